@@ -0,0 +1,44 @@
+/*
+ * Helpers shared by the benchmarks: a clock, and machine-readable results.
+ *
+ * Every benchmark prints its results for people to read, and also reports each number
+ * with bench_result(). If the BENCH_RESULTS environment variable names a file, every
+ * result is appended to it as a JSON object on a line of its own:
+ *   {"bench":"spawn","case":"posix_spawn","value":3373.2,"unit":"spawns/s"}
+ * "make results" runs the whole suite like that, and compare.sh compares two result
+ * files, such as a baseline and a run after a change. lib.sh does the same for the
+ * benchmarks that are shell scripts.
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Record a result in $BENCH_RESULTS, if it is set.
+ * @param bench Name of the benchmark.
+ * @param name Name of the case.
+ * @param value The result.
+ * @param unit Its unit. Rates ("/s") are better when higher, anything else when lower.
+ */
+static void bench_result(const char *bench, const char *name, double value, const char *unit) {
+    const char *path = getenv("BENCH_RESULTS");
+    FILE *out;
+
+    if (path == NULL || *path == '\0' || (out = fopen(path, "a")) == NULL) {
+        return;
+    }
+    fprintf(out, "{\"bench\":\"%s\",\"case\":\"%s\",\"value\":%.6g,\"unit\":\"%s\"}\n", bench, name, value, unit);
+    fclose(out);
+}
+
+#endif
@@ -0,0 +1,44 @@
+#!/bin/sh
+#
+# Long block benchmark
+#
+# Runs scripts made of a single compound command ("if true; then ... fi") of 2000 to
+# 16000 lines through each shell given on the command line, and reports lines per
+# second. The shell can't run any of it before it has read the "fi", so this measures
+# collecting and parsing a command that goes on over many lines; the rate should stay
+# the same as the block grows. Other shells found on the system are measured too, for
+# comparison.
+#
+# Usage: ./block.sh shell...
+
+shells="$*"
+for other in dash bash; do
+    if command -v "$other" > /dev/null 2>&1; then
+        shells="$shells $(command -v "$other")"
+    fi
+done
+
+. "$(dirname "$0")/lib.sh"
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+for lines in 2000 4000 8000 16000; do
+    {
+        echo 'if true; then'
+        awk -v n="$lines" 'BEGIN { for (i = 0; i < n; i++) print "    x=" i "; while false; do :; done" }'
+        echo 'fi'
+    } > "$dir/$lines"
+done
+
+for sh in $shells; do
+    for lines in 2000 4000 8000 16000; do
+        start=$(now)
+        "$sh" "$dir/$lines"
+        end=$(now)
+        rate=$((lines * 1000000000 / (end - start)))
+        printf '%-24s %6d lines  %8d ms  %10d lines/s\n' "$sh" "$lines" \
+            $(((end - start) / 1000000)) "$rate"
+        result block "$(basename "$sh") $lines" "$rate" "lines/s"
+    done
+done
@@ -0,0 +1,36 @@
+#!/bin/sh
+#
+# Compares two result files written by the benchmarks (see bench.h), such as a
+# baseline and a run after a change, and prints the change of every result. Rates
+# ("/s") are better when they go up; times and sizes are better when they go down.
+#
+# Usage: ./compare.sh baseline.jsonl results.jsonl
+
+if [ $# -ne 2 ]; then
+    echo "usage: $0 baseline.jsonl results.jsonl" >&2
+    exit 2
+fi
+
+awk '
+function field(line, name,    rest) {
+    rest = substr(line, index(line, "\"" name "\":") + length(name) + 3)
+    if (substr(rest, 1, 1) == "\"") {
+        rest = substr(rest, 2)
+        return substr(rest, 1, index(rest, "\"") - 1)
+    }
+    match(rest, /^[-0-9.e+]+/)
+    return substr(rest, 1, RLENGTH)
+}
+{
+    key = field($0, "bench") ": " field($0, "case")
+    if (FNR == NR) {
+        base[key] = field($0, "value")
+    } else if (key in base) {
+        unit = field($0, "unit")
+        value = field($0, "value")
+        change = base[key] != 0 ? (value - base[key]) / base[key] * 100 : 0
+        better = unit ~ /\/s$/ ? change > 0 : change < 0
+        printf "%-36s %12.4g -> %-12.4g %-9s %+7.1f%%%s\n", key, base[key], value, unit, change,
+               (change > 5 || change < -5) ? (better ? "  better" : "  WORSE") : ""
+    }
+}' "$1" "$2"
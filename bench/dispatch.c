@@ -0,0 +1,80 @@
+/*
+ * Builtin dispatch benchmark
+ *
+ * Looks up every builtin name (and a name that isn't a builtin, like "ls") N times with
+ * the perfect hash behind sh_builtin_lookup(), and with a linear strcmp() scan of
+ * "sh_builtins[]" like the shell started out with. Then it runs "cd ." through
+ * sh_execute() N times, which is the whole path of a builtin command.
+ *
+ * Usage: ./dispatch [-n count]
+ */
+
+#define SH_NO_MAIN
+#include "../src/main.c"
+#include "bench.h"
+
+/*
+ * The lookup the shell started out with.
+ */
+static const struct sh_builtin *linear_lookup(const char *name) {
+    int i;
+
+    for (i = 0; i < SH_NUM_BUILTINS; i++) {
+        if (strcmp(name, sh_builtins[i].name) == 0) {
+            return &sh_builtins[i];
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    const char *names[SH_NUM_BUILTINS + 1];
+    char *args[] = {"cd", ".", NULL};
+    long count = 10000000, i, found;
+    double start, elapsed;
+    int opt, n = 0;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        if (opt == 'n') {
+            count = atol(optarg);
+        } else {
+            fprintf(stderr, "usage: %s [-n count]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    for (n = 0; n < SH_NUM_BUILTINS; n++) {
+        names[n] = sh_builtins[n].name;
+    }
+    names[n++] = "ls";
+
+    found = 0;
+    start = now();
+    for (i = 0; i < count; i++) {
+        found += sh_builtin_lookup(names[i % n]) != NULL;
+    }
+    elapsed = now() - start;
+    printf("%-14s %10ld lookups  %8.3f s  %8.1f ns/lookup  (%ld found)\n",
+           "perfect hash", count, elapsed, elapsed / count * 1e9, found);
+    bench_result("dispatch", "perfect hash", elapsed / count * 1e9, "ns");
+
+    found = 0;
+    start = now();
+    for (i = 0; i < count; i++) {
+        found += linear_lookup(names[i % n]) != NULL;
+    }
+    elapsed = now() - start;
+    printf("%-14s %10ld lookups  %8.3f s  %8.1f ns/lookup  (%ld found)\n",
+           "linear scan", count, elapsed, elapsed / count * 1e9, found);
+    bench_result("dispatch", "linear scan", elapsed / count * 1e9, "ns");
+
+    count /= 10;
+    start = now();
+    for (i = 0; i < count; i++) {
+        sh_execute(args);
+    }
+    elapsed = now() - start;
+    printf("%-14s %10ld commands %8.3f s  %8.1f ns/command\n", "sh_execute", count, elapsed, elapsed / count * 1e9);
+    bench_result("dispatch", "sh_execute", elapsed / count * 1e9, "ns");
+
+    return EXIT_SUCCESS;
+}
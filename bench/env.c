@@ -0,0 +1,87 @@
+/*
+ * Environment benchmark
+ *
+ * Exports N variables, then measures what the shell does with them: looking a variable
+ * up, getting the environment for a program when nothing changed (the shared snapshot),
+ * getting it right after an export (a new snapshot), and the whole environment cost of a
+ * command with an assignment in front of it, "X=1 cmd". The last one builds a snapshot
+ * for the command, and should find the old one again afterwards.
+ *
+ * Usage: ./env [-n count] [-v variables]
+ */
+
+#define SH_NO_MAIN
+#include "../src/main.c"
+#include "bench.h"
+
+static void report(const char *name, long count, double elapsed, const char *what) {
+    printf("%-14s %10ld %-8s %8.3f s  %8.1f ns/%s\n", name, count, what, elapsed, elapsed / count * 1e9, what);
+    bench_result("env", name, elapsed / count * 1e9, "ns");
+}
+
+int main(int argc, char **argv) {
+    struct sh_word word = {"X=1", 3, 0};
+    struct sh_node node = {0};
+    struct sh_var_saved saved;
+    struct sh_env_mark mark;
+    long count = 1000000, i, found = 0;
+    int opt, vars = 1000;
+    double start;
+    char name[32], **envp;
+
+    while ((opt = getopt(argc, argv, "n:v:")) != -1) {
+        if (opt == 'n') {
+            count = atol(optarg);
+        } else if (opt == 'v') {
+            vars = atoi(optarg);
+        } else {
+            fprintf(stderr, "usage: %s [-n count] [-v variables]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    for (i = 0; i < vars; i++) {
+        snprintf(name, sizeof(name), "BENCH_VAR_%ld", i);
+        sh_var_set(name, strlen(name), "some value of a reasonable length", SH_VAR_EXPORT);
+    }
+    printf("%d exported variables\n", vars);
+
+    start = now();
+    for (i = 0; i < count; i++) {
+        snprintf(name, sizeof(name), "BENCH_VAR_%ld", i % vars);
+        found += sh_var_get(name) != NULL;
+    }
+    report("lookup", count, now() - start, "lookup");
+
+    envp = sh_env();
+    start = now();
+    for (i = 0; i < count; i++) {
+        found += sh_env() == envp;
+    }
+    report("shared envp", count, now() - start, "spawn");
+
+    count /= 100;
+    start = now();
+    for (i = 0; i < count; i++) {
+        sh_var_set("BENCH_VAR_0", 11, i & 1 ? "odd" : "even", SH_VAR_EXPORT);
+        envp = sh_env();
+    }
+    report("export", count, now() - start, "export");
+
+    node.type = SH_NODE_COMMAND;
+    node.command.argc = 1;
+    node.command.words = &word;
+    start = now();
+    for (i = 0; i < count; i++) {
+        sh_exec_assign(&node, 1, &saved, &mark);
+        sh_env();
+        sh_exec_unassign(&saved, 1, &mark);
+        found += sh_env() == envp;
+    }
+    report("X=1 cmd", count, now() - start, "command");
+    if (found != 2 * count * 100 + count) {
+        fprintf(stderr, "env: the environment was not shared\n");
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
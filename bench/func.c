@@ -0,0 +1,94 @@
+/*
+ * Function benchmark
+ *
+ * Defines a few functions whose bodies only run builtins (loops, "case", "if",
+ * assignments, "local"), then calls each of them N times: once through the compiled
+ * bytecode with sh_func_call(), the way the shell runs them, and once by walking the
+ * same body tree with sh_exec_node(), which is what running the function would cost
+ * without compiling it.
+ *
+ * Usage: ./func [-n calls]
+ */
+
+#define SH_NO_MAIN
+#include "../src/main.c"
+#include "bench.h"
+
+int main(int argc, char **argv) {
+    static const struct {
+        const char *name, *definition;
+    } cases[] = {
+            {"straight", "f() { a=1; b=$a; : $b; true; x=$1; }"},
+            {"loop",     "f() { for i in a b c d e f g h; do x=$i; done; }"},
+            {"case",     "f() { for i in a b c d; do case $i in a|b) x=1 ;; c) : ;; *) y=2 ;; esac; done; }"},
+            {"if",       "f() { for i in 1 2 3 4; do if false; then :; elif false; then :; else x=$i; fi; done; }"},
+            {"local",    "f() { local x=$1 y; y=$x; while false; do :; done; }"},
+    };
+    char *args[] = {"f", "arg", NULL};
+    struct sh_lexer lexer = {0};
+    struct sh_parser parser = {0};
+    struct sh_arena arena = {0};
+    struct sh_node *tree;
+    struct sh_func *func;
+    struct sh_frame frame = {NULL, 0, 0};
+    long count = 200000, i;
+    double start, vm, walk;
+    char name[64];
+    size_t c;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        if (opt == 'n') {
+            count = atol(optarg);
+        } else {
+            fprintf(stderr, "usage: %s [-n calls]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    sh_argc = 2;
+    sh_argv = args;
+
+    for (c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+        if (sh_lex(&lexer, cases[c].definition, strlen(cases[c].definition)) != SH_LEX_OK
+            || sh_parse(&parser, &lexer, &arena, &tree) != SH_PARSE_OK) {
+            fprintf(stderr, "func: %s: parse error\n", cases[c].name);
+            return EXIT_FAILURE;
+        }
+        sh_exec_node(tree);
+        func = sh_func_find("f");
+        while (tree->type == SH_NODE_LIST || tree->type == SH_NODE_PIPELINE) {
+            tree = tree->list.first;
+        }
+
+        start = now();
+        for (i = 0; i < count; i++) {
+            sh_func_call(func, args);
+        }
+        vm = now() - start;
+
+        // The tree walker, with a frame for "local" like a call would have.
+        sh_frame = &frame;
+        start = now();
+        for (i = 0; i < count; i++) {
+            sh_exec_node(tree->func.body);
+            while (frame.count > 0) {
+                sh_var_restore(&frame.saved[--frame.count]);
+            }
+        }
+        walk = now() - start;
+        sh_frame = NULL;
+
+        printf("%-10s %8ld calls  bytecode %8.0f ns/call  tree walk %8.0f ns/call  (%.2fx)\n",
+               cases[c].name, count, vm / count * 1e9, walk / count * 1e9, walk / vm);
+        bench_result("func", cases[c].name, vm / count * 1e9, "ns");
+        snprintf(name, sizeof(name), "%s (tree walk)", cases[c].name);
+        bench_result("func", name, walk / count * 1e9, "ns");
+        sh_arena_reset(&arena);
+    }
+
+    free(frame.saved);
+    sh_arena_free(&arena);
+    free(parser.words);
+    free(lexer.tokens);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,91 @@
+#!/bin/sh
+#
+# Pathname expansion benchmark
+#
+# Creates a directory of files (100000 by default, a tenth of them "*.txt", the rest
+# "*.log") and has each shell given on the command line expand patterns in it: "*",
+# which matches everything, "*.txt", which is a suffix check, and two that need the
+# matcher. Reports how long each expansion takes, and how many directory entries per
+# second that is. Other shells found on the system are measured too, for comparison.
+#
+# Then it creates a tree of files (500000 by default, 50 to a directory, four levels
+# deep, a fifth of them "*.json") and expands "**/*.json" in it, with 1, 2, 4, ... up to
+# one thread per CPU ($SH_GLOB_THREADS), and with bash, if there is one.
+#
+# Usage: ./glob.sh [-n files] [-t tree-files] shell...
+
+n=100000
+tree=500000
+while [ $# -gt 1 ]; do
+    case $1 in
+        -n) n=$2 ;;
+        -t) tree=$2 ;;
+        *) break ;;
+    esac
+    shift 2
+done
+
+shells="$*"
+for other in dash bash; do
+    if command -v "$other" > /dev/null 2>&1; then
+        shells="$shells $(command -v "$other")"
+    fi
+done
+
+. "$(dirname "$0")/lib.sh"
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+awk -v n="$n" -v dir="$dir" 'BEGIN {
+    for (i = 0; i < n; i++) {
+        printf "%s/%s%07d.%s\n", dir, i % 10 ? "f" : "g", i, i % 10 ? "log" : "txt"
+    }
+}' | xargs touch
+
+for sh in $shells; do
+    for pattern in '*' '*.txt' 'f00*5.log' 'g?????0[0-4].txt'; do
+        start=$(now)
+        "$sh" -c "cd '$dir' && echo $pattern > /dev/null"
+        end=$(now)
+        rate=$((n * 1000000000 / (end - start)))
+        printf '%-24s %-18s %8d ms  %10d entries/s\n' "$sh" "$pattern" $(((end - start) / 1000000)) "$rate"
+        result glob "$(basename "$sh") $pattern" "$rate" entries/s
+    done
+done
+
+mkdir "$dir/tree"
+awk -v n="$tree" -v dir="$dir/tree" 'BEGIN {
+    for (i = 0; i < n; i += 50) {
+        d = int(i / 50)
+        path = sprintf("%s/d%d/e%d/f%d/g%d", dir, d % 10, int(d / 10) % 10, int(d / 100) % 10, int(d / 1000))
+        print "mkdir -p " path
+        for (j = 0; j < 50 && i + j < n; j++) {
+            printf "> %s/%s%d.%s\n", path, "file", j, j % 5 ? "log" : "json"
+        }
+    }
+}' | sh
+
+cpus=$(getconf _NPROCESSORS_ONLN 2> /dev/null || echo 1)
+for sh in "$@"; do
+    threads=1
+    while :; do
+        start=$(now)
+        SH_GLOB_THREADS=$threads "$sh" -c "cd '$dir/tree' && echo **/*.json > /dev/null"
+        end=$(now)
+        rate=$((tree * 1000000000 / (end - start)))
+        printf '%-24s %-18s %8d ms  %10d entries/s\n' "$sh" "tree, $threads threads" $(((end - start) / 1000000)) "$rate"
+        result glob "$(basename "$sh") tree $threads" "$rate" entries/s
+        [ "$threads" -ge "$cpus" ] && break
+        threads=$((threads * 2))
+        [ "$threads" -gt "$cpus" ] && threads=$cpus
+    done
+done
+if command -v bash > /dev/null 2>&1; then
+    start=$(now)
+    bash -O globstar -c "cd '$dir/tree' && echo **/*.json > /dev/null"
+    end=$(now)
+    rate=$((tree * 1000000000 / (end - start)))
+    printf '%-24s %-18s %8d ms  %10d entries/s\n' "$(command -v bash)" "tree" $(((end - start) / 1000000)) "$rate"
+    result glob "bash tree" "$rate" entries/s
+fi
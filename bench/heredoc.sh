@@ -0,0 +1,65 @@
+#!/bin/sh
+#
+# Here-document benchmark
+#
+# Runs loops that feed a here-document to a command through each shell given on the
+# command line, and reports here-documents per second: a short one to a program ("wc")
+# and to a builtin ("cat"), and a large one (1 MiB, more than a pipe holds) to a
+# program. Then it runs a script made of a single 100000-line here-document, which
+# measures reading and lexing the body. Other shells found on the system are measured
+# too, for comparison.
+#
+# Usage: ./heredoc.sh [-n iterations] shell...
+
+n=2000
+if [ "$1" = "-n" ]; then
+    n=$2
+    shift 2
+fi
+
+shells="$*"
+for other in dash bash; do
+    if command -v "$other" > /dev/null 2>&1; then
+        shells="$shells $(command -v "$other")"
+    fi
+done
+
+. "$(dirname "$0")/lib.sh"
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+# generate NAME COUNT COMMAND LINES: write a script that feeds COMMAND a here-document
+# of LINES lines COUNT times, with $i set to the iteration.
+generate() {
+    {
+        printf 'for i in'
+        awk -v n="$2" 'BEGIN { for (i = 0; i < n; i++) printf " %d", i }'
+        printf '; do\n%s <<EOF\n' "$3"
+        awk -v n="$4" 'BEGIN { for (i = 0; i < n; i++) print "line " i " of here-document $i, padded out to 64 bytes" }'
+        printf 'EOF\ndone\n'
+    } > "$dir/$1"
+}
+
+generate program "$n" 'wc -c > /dev/null' 4
+generate builtin "$n" 'cat > /dev/null' 4
+generate large $((n / 20)) 'wc -c > /dev/null' 16384
+generate script 1 'wc -c > /dev/null' 100000
+
+for sh in $shells; do
+    for kind in program builtin large script; do
+        count=$n
+        unit=here-documents
+        case $kind in
+            large) count=$((n / 20)) ;;
+            script) count=100000 unit=lines ;;
+        esac
+        start=$(now)
+        "$sh" "$dir/$kind"
+        end=$(now)
+        rate=$((count * 1000000000 / (end - start)))
+        printf '%-24s %-8s %8d %-14s  %8d ms  %10d %s/s\n' "$sh" "$kind" "$count" "$unit" \
+            $(((end - start) / 1000000)) "$rate" "$unit"
+        result heredoc "$(basename "$sh") $kind" "$rate" "$unit/s"
+    done
+done
@@ -0,0 +1,46 @@
+#!/bin/sh
+#
+# Background job stress test
+#
+# Has the shell start N background jobs ("/bin/true &", one per line) and then "wait"
+# for all of them, for N = 1000 and N = 10000 (or the counts given with -n). Finished
+# jobs are reaped as their SIGCHLD arrives, so the time per job should stay flat as N
+# grows; the test fails if it grows by more than a factor of 3.
+#
+# Usage: ./jobs.sh [-n "count..."] shell
+
+counts="1000 10000"
+if [ "$1" = "-n" ]; then
+    counts=$2
+    shift 2
+fi
+sh=${1:-./shell}
+
+script=$(mktemp)
+trap 'rm -f "$script"' EXIT
+
+. "$(dirname "$0")/lib.sh"
+
+first=
+for n in $counts; do
+    i=0
+    while [ "$i" -lt "$n" ]; do
+        echo "/bin/true &"
+        i=$((i + 1))
+    done > "$script"
+    echo "wait" >> "$script"
+
+    start=$(now)
+    "$sh" "$script" || exit 1
+    end=$(now)
+    per_job=$(((end - start) / n))
+    printf '%-24s %6d jobs  %8d ms  %8d ns/job\n' "$sh" "$n" $(((end - start) / 1000000)) "$per_job"
+    result jobs "$n jobs" "$per_job" ns
+
+    if [ -z "$first" ]; then
+        first=$per_job
+    elif [ "$per_job" -gt $((first * 3)) ]; then
+        echo "jobs: time per job grew from $first ns to $per_job ns" >&2
+        exit 1
+    fi
+done
@@ -0,0 +1,174 @@
+/*
+ * Lexer benchmark
+ *
+ * Lexes (and expands the words of) pathological long lines: lots of short words, one
+ * huge quoted word, nothing but operators, and so on. For plain words, the original
+ * strtok() splitter is measured too. Then it lexes and parses a mix of ordinary
+ * script lines over and over, which is what the shell does for every line it runs.
+ * Last, it expands the words of a parsed command into arguments, for a command of plain
+ * words (which should cost no copies) and for one with quotes and parameters, and
+ * reports how much of the execution arena each one takes.
+ *
+ * Usage: ./lex [-m megabytes] [-n lines]
+ */
+
+#define SH_NO_MAIN
+#include "../src/main.c"
+#include "bench.h"
+
+static char *repeat(const char *prefix, const char *unit, const char *suffix, size_t size) {
+    size_t unit_len = strlen(unit), len = strlen(prefix);
+    char *line = malloc(size + strlen(prefix) + strlen(suffix) + unit_len + 1);
+
+    if (!line) {
+        fprintf(stderr, "lex: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    strcpy(line, prefix);
+    while (len < size) {
+        memcpy(line + len, unit, unit_len);
+        len += unit_len;
+    }
+    strcpy(line + len, suffix);
+    return line;
+}
+
+/*
+ * The splitter the shell started out with.
+ */
+static size_t legacy_split_line(char *line) {
+    size_t n = 0;
+    char *token = strtok(line, " \t\r\n\a");
+
+    while (token != NULL) {
+        n++;
+        token = strtok(NULL, " \t\r\n\a");
+    }
+    return n;
+}
+
+int main(int argc, char **argv) {
+    static const struct {
+        const char *name, *prefix, *unit, *suffix;
+    } cases[] = {
+            {"short words",   "",  "ab cd ef ",     ""},
+            {"quoted word",   "'", "abcdefgh",      "'"},
+            {"operators",     "",  "a;b|c&&d||e ",  ""},
+            {"backslashes",   "",  "a\\ b\\;c\\| ", ""},
+            {"double quotes", "",  "\"a $1 b\" ",   ""},
+            {"redirections",  "",  "2>a <b >>c ",   ""},
+    };
+    static const struct {
+        const char *name, *line;
+    } commands[] = {
+            {"plain words",    "ls -l --color=auto /usr/share/doc /usr/share/man /tmp"},
+            {"expanded words", "printf '%s\\n' \"$HOME\" \"a b\" c\\ d \"$1\" x$?y"},
+    };
+    static const char *script[] = {
+            "echo hello world",
+            "ls -l /usr/share/doc | grep -v README > /dev/null",
+            "cd /tmp && make -j4 all 2>&1 | tee build.log || echo \"build failed\" >&2",
+            "( cd src; cat *.c ) | wc -l; printf '%s\\n' \"$1\" >> out.txt &",
+    };
+    struct sh_lexer lexer = {0};
+    struct sh_parser parser = {0};
+    struct sh_arena arena = {0};
+    struct sh_strbuf buf = {0};
+    struct sh_node *tree;
+    size_t size = 16 << 20, len, i, words, lines = 1000000;
+    double start, elapsed;
+    char *line;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "m:n:")) != -1) {
+        if (opt == 'm') {
+            size = (size_t) atol(optarg) << 20;
+        } else if (opt == 'n') {
+            lines = (size_t) atol(optarg);
+        } else {
+            fprintf(stderr, "usage: %s [-m megabytes] [-n lines]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        line = repeat(cases[i].prefix, cases[i].unit, cases[i].suffix, size);
+        len = strlen(line);
+
+        start = now();
+        if (sh_lex(&lexer, line, len) != SH_LEX_OK) {
+            fprintf(stderr, "lex: %s: lexer error\n", cases[i].name);
+            return EXIT_FAILURE;
+        }
+        words = 0;
+        for (size_t t = 0; t < lexer.num_tokens; t++) {
+            struct sh_word word = {lexer.tokens[t].text, lexer.tokens[t].len, lexer.tokens[t].flags};
+            if (lexer.tokens[t].type == SH_TOKEN_WORD && sh_expand_word(&arena, &word, &buf) != NULL) {
+                words++;
+            }
+        }
+        elapsed = now() - start;
+        sh_arena_reset(&arena);
+        printf("%-14s %10zu tokens %10zu words  %8.3f s  %8.1f MB/s\n",
+               cases[i].name, lexer.num_tokens, words, elapsed, len / elapsed / (1 << 20));
+        bench_result("lex", cases[i].name, len / elapsed / (1 << 20), "MB/s");
+
+        if (i == 0) {
+            start = now();
+            words = legacy_split_line(line);
+            elapsed = now() - start;
+            printf("%-14s %10s %10zu words  %8.3f s  %8.1f MB/s\n",
+                   "  (strtok)", "", words, elapsed, len / elapsed / (1 << 20));
+            bench_result("lex", "strtok", len / elapsed / (1 << 20), "MB/s");
+        }
+        free(line);
+    }
+
+    start = now();
+    for (i = 0; i < lines; i++) {
+        line = (char *) script[i % 4];
+        if (sh_lex(&lexer, line, strlen(line)) != SH_LEX_OK
+            || sh_parse(&parser, &lexer, &arena, &tree) != SH_PARSE_OK) {
+            fprintf(stderr, "lex: parse error\n");
+            return EXIT_FAILURE;
+        }
+        sh_arena_reset(&arena);
+    }
+    elapsed = now() - start;
+    printf("%-14s %10zu lines  %8.3f s  %8.0f ns/line\n", "parse", lines, elapsed, elapsed / lines * 1e9);
+    bench_result("lex", "parse", elapsed / lines * 1e9, "ns");
+
+    for (i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+        struct sh_arena_mark mark;
+        size_t used = 0;
+
+        line = (char *) commands[i].line;
+        if (sh_lex(&lexer, line, strlen(line)) != SH_LEX_OK
+            || sh_parse(&parser, &lexer, &arena, &tree) != SH_PARSE_OK) {
+            fprintf(stderr, "lex: parse error\n");
+            return EXIT_FAILURE;
+        }
+        tree = tree->list.first->list.first;
+
+        start = now();
+        for (size_t n = 0; n < lines; n++) {
+            mark = sh_arena_get_mark(&sh_exec_arena);
+            sh_expand_args(tree, 0);
+            if (n == 0) {
+                used = sh_exec_arena.head->used - mark.used;
+            }
+            sh_arena_release(&sh_exec_arena, mark);
+        }
+        elapsed = now() - start;
+        printf("%-14s %10zu words  %8.3f s  %8.0f ns/command  %4zu bytes/command\n",
+               commands[i].name, (size_t) tree->command.argc, elapsed, elapsed / lines * 1e9, used);
+        bench_result("lex", commands[i].name, elapsed / lines * 1e9, "ns");
+        sh_arena_reset(&arena);
+    }
+
+    sh_arena_free(&arena);
+    free(parser.words);
+    free(lexer.tokens);
+    free(buf.data);
+    return EXIT_SUCCESS;
+}
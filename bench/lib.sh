@@ -0,0 +1,12 @@
+# Helpers shared by the benchmarks that are shell scripts (see bench.h).
+
+now() {
+    date +%s%N
+}
+
+# result BENCH CASE VALUE UNIT: record a result in $BENCH_RESULTS, if it is set.
+result() {
+    if [ -n "$BENCH_RESULTS" ]; then
+        printf '{"bench":"%s","case":"%s","value":%s,"unit":"%s"}\n' "$1" "$2" "$3" "$4" >> "$BENCH_RESULTS"
+    fi
+}
@@ -0,0 +1,65 @@
+#!/bin/sh
+#
+# Loop benchmark
+#
+# Runs loops whose bodies are builtins only ("for", "case", "if", assignments, calls to a
+# function that runs builtins) through
+# each shell given on the command line, and reports iterations per second. Nothing is
+# started, so this measures how fast a shell walks the same commands over and over.
+# Other shells found on the system are measured too, for comparison.
+#
+# Usage: ./loop.sh [-n thousands] shell...
+
+outer=100
+if [ "$1" = "-n" ]; then
+    outer=$2
+    shift 2
+fi
+
+shells="$*"
+for other in dash bash; do
+    if command -v "$other" > /dev/null 2>&1; then
+        shells="$shells $(command -v "$other")"
+    fi
+done
+
+. "$(dirname "$0")/lib.sh"
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+# words COUNT: print COUNT words on one line.
+words() {
+    i=0
+    while [ "$i" -lt "$1" ]; do
+        printf 'w%d ' "$i"
+        i=$((i + 1))
+    done
+}
+
+# generate NAME BODY: write a script that runs BODY for $outer thousand values of $b.
+outer_words=$(words "$outer")
+inner_words=$(words 1000)
+generate() {
+    printf 'f() { local v=$1; x=$v; }\nfor a in %s; do\nfor b in %s; do\n%s\ndone\ndone\n' \
+        "$outer_words" "$inner_words" "$2" > "$dir/$1"
+}
+
+generate for ":"
+generate case 'case $b in w1*) : ;; w2*|w3*) : ;; *) : ;; esac'
+generate if 'if false; then :; elif false; then :; else :; fi'
+generate assign 'x=$b; y=$x'
+generate call 'f $b'
+
+n=$((outer * 1000))
+for sh in $shells; do
+    for kind in for case if assign call; do
+        start=$(now)
+        "$sh" "$dir/$kind"
+        end=$(now)
+        rate=$((n * 1000000000 / (end - start)))
+        printf '%-24s %-8s %8d iterations  %8d ms  %10d iterations/s\n' "$sh" "$kind" "$n" \
+            $(((end - start) / 1000000)) "$rate"
+        result loop "$(basename "$sh") $kind" "$rate" iterations/s
+    done
+done
@@ -0,0 +1,40 @@
+#!/bin/sh
+#
+# Parallel builtin benchmark
+#
+# Runs "/bin/echo" over N inputs (the lines of "seq N"), J at a time, with the shell's
+# "parallel" builtin (unordered and with -k) and with "xargs -P", and reports the mean
+# time per command. GNU parallel is measured too if it is installed.
+#
+# Usage: ./parallel.sh [-n inputs] [-j jobs] shell
+
+inputs=5000
+jobs=8
+while [ $# -gt 1 ]; do
+    case $1 in
+        -n) inputs=$2; shift 2 ;;
+        -j) jobs=$2; shift 2 ;;
+        *) break ;;
+    esac
+done
+sh=${1:-./shell}
+
+. "$(dirname "$0")/lib.sh"
+
+measure() {
+    name=$1
+    shift
+    start=$(now)
+    seq "$inputs" | "$@" > /dev/null
+    end=$(now)
+    printf '%-24s %6d inputs  -j %-3d %8d ms  %8d us/command\n' "$name" "$inputs" "$jobs" \
+        $(((end - start) / 1000000)) $(((end - start) / inputs / 1000))
+    result parallel "$name" $(((end - start) / inputs / 1000)) us
+}
+
+measure "parallel" "$sh" -c "parallel -j $jobs /bin/echo"
+measure "parallel -k" "$sh" -c "parallel -k -j $jobs /bin/echo"
+measure "xargs -P" xargs -P "$jobs" -n 1 /bin/echo
+if command -v parallel > /dev/null 2>&1; then
+    measure "GNU parallel" parallel -j "$jobs" /bin/echo
+fi
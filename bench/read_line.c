@@ -0,0 +1,167 @@
+/*
+ * Line reader benchmark
+ *
+ * Reads a script line by line with the original getchar() based reader, with the block
+ * reader behind sh_read_line(), and with the mmap() reader used for script files, and
+ * reports throughput for each. Without a
+ * file argument, a script of "-m" megabytes (100 by default) is generated first.
+ *
+ * Usage: ./read_line [-m megabytes] [file]
+ */
+
+#define SH_NO_MAIN
+#include "../src/main.c"
+#include "bench.h"
+
+#include <fcntl.h>
+
+#define LEGACY_BUFFER_SIZE 1024
+
+/*
+ * The reader the shell started out with: one getchar() per byte, and a buffer that
+ * grows by 1024 bytes at a time.
+ */
+static char *legacy_read_line(FILE *in) {
+    int buffer_size = LEGACY_BUFFER_SIZE;
+    int position = 0;
+    char *buffer = malloc(sizeof(char) * buffer_size);
+    int c;
+
+    if (!buffer) {
+        fprintf(stderr, "read_line: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+
+    while (1) {
+        c = getc(in);
+        if (c == EOF || c == '\n') {
+            buffer[position] = '\0';
+            if (c == EOF && position == 0) {
+                free(buffer);
+                return NULL;
+            }
+            return buffer;
+        }
+        buffer[position++] = c;
+        if (position >= buffer_size) {
+            buffer_size += LEGACY_BUFFER_SIZE;
+            buffer = realloc(buffer, buffer_size);
+            if (!buffer) {
+                fprintf(stderr, "read_line: reallocation error\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+}
+
+static void generate(const char *path, long megabytes) {
+    static const char *lines[] = {
+            "echo hello world\n",
+            "ls -l /usr/share/doc | grep -v README > /dev/null\n",
+            "cd /tmp\n",
+            "printf '%s\\n' one two three four five six seven eight nine ten\n",
+    };
+    FILE *out = fopen(path, "w");
+    long written = 0, limit = megabytes << 20;
+    int i = 0;
+
+    if (!out) {
+        perror("read_line");
+        exit(EXIT_FAILURE);
+    }
+    while (written < limit) {
+        fputs(lines[i], out);
+        written += strlen(lines[i]);
+        i = (i + 1) % 4;
+    }
+    fclose(out);
+}
+
+int main(int argc, char **argv) {
+    char tmp[] = "/tmp/sh-read-line-XXXXXX";
+    const char *path;
+    struct sh_reader reader;
+    long megabytes = 100, lines, bytes;
+    double start, elapsed;
+    const char *line;
+    size_t len;
+    FILE *in;
+    int opt, fd;
+
+    while ((opt = getopt(argc, argv, "m:")) != -1) {
+        if (opt == 'm') {
+            megabytes = atol(optarg);
+        } else {
+            fprintf(stderr, "usage: %s [-m megabytes] [file]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (optind < argc) {
+        path = argv[optind];
+    } else {
+        fd = mkstemp(tmp);
+        if (fd < 0) {
+            perror("read_line");
+            return EXIT_FAILURE;
+        }
+        close(fd);
+        generate(tmp, megabytes);
+        path = tmp;
+    }
+
+    in = fopen(path, "r");
+    if (!in) {
+        perror("read_line");
+        return EXIT_FAILURE;
+    }
+    lines = bytes = 0;
+    start = now();
+    while ((line = legacy_read_line(in)) != NULL) {
+        bytes += strlen(line) + 1;
+        lines++;
+        free((char *) line);
+    }
+    elapsed = now() - start;
+    fclose(in);
+    printf("getchar      %9ld lines  %8.3f s  %8.1f MB/s\n", lines, elapsed, bytes / elapsed / (1 << 20));
+    bench_result("read_line", "getchar", bytes / elapsed / (1 << 20), "MB/s");
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror("read_line");
+        return EXIT_FAILURE;
+    }
+    sh_reader_init(&reader, fd);
+    lines = bytes = 0;
+    start = now();
+    while ((line = sh_reader_next(&reader, &len)) != NULL) {
+        bytes += len + 1;
+        lines++;
+    }
+    elapsed = now() - start;
+    sh_reader_free(&reader);
+    close(fd);
+    printf("sh_reader    %9ld lines  %8.3f s  %8.1f MB/s\n", lines, elapsed, bytes / elapsed / (1 << 20));
+    bench_result("read_line", "sh_reader", bytes / elapsed / (1 << 20), "MB/s");
+
+    lines = bytes = 0;
+    start = now();
+    if (sh_reader_map(&reader, path) != 0) {
+        perror("read_line");
+        return EXIT_FAILURE;
+    }
+    while ((line = sh_reader_next(&reader, &len)) != NULL) {
+        bytes += len + 1;
+        lines++;
+    }
+    sh_reader_free(&reader);
+    elapsed = now() - start;
+    printf("mmap         %9ld lines  %8.3f s  %8.1f MB/s\n", lines, elapsed, bytes / elapsed / (1 << 20));
+    bench_result("read_line", "mmap", bytes / elapsed / (1 << 20), "MB/s");
+
+    if (path == tmp) {
+        unlink(tmp);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,55 @@
+#!/bin/sh
+#
+# Script throughput benchmark
+#
+# Runs scripts of N lines of one kind each (builtins, external commands, two-stage
+# pipelines, redirections) through each shell given on the command line, and reports
+# lines per second. Other shells found on the system are measured too, for comparison.
+#
+# Usage: ./script.sh [-n lines] shell...
+
+lines=2000
+if [ "$1" = "-n" ]; then
+    lines=$2
+    shift 2
+fi
+
+shells="$*"
+for other in dash bash; do
+    if command -v "$other" > /dev/null 2>&1; then
+        shells="$shells $(command -v "$other")"
+    fi
+done
+
+. "$(dirname "$0")/lib.sh"
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+# generate NAME COUNT LINE: write a script of COUNT copies of LINE.
+generate() {
+    i=0
+    while [ "$i" -lt "$2" ]; do
+        echo "$3"
+        i=$((i + 1))
+    done > "$dir/$1"
+}
+
+# Builtins are run many more times, or the script would take no time at all.
+generate builtin $((lines * 50)) "cd ."
+generate external "$lines" "/bin/true"
+generate pipeline "$lines" "/bin/true | /bin/true"
+generate redirect "$lines" "/bin/true > $dir/out 2>&1 < /dev/null"
+
+for sh in $shells; do
+    for kind in builtin external pipeline redirect; do
+        n=$(wc -l < "$dir/$kind")
+        start=$(now)
+        "$sh" "$dir/$kind"
+        end=$(now)
+        rate=$((n * 1000000000 / (end - start)))
+        printf '%-24s %-10s %8d lines  %8d ms  %10d lines/s\n' "$sh" "$kind" "$n" \
+            $(((end - start) / 1000000)) "$rate"
+        result script "$(basename "$sh") $kind" "$rate" lines/s
+    done
+done
@@ -0,0 +1,75 @@
+/*
+ * Spawn benchmark
+ *
+ * Launches "/bin/true" N times with each of the shell's launch engines and reports
+ * spawns per second. Pass "-b MB" to grow the heap first: fork() gets slower as the
+ * shell's memory grows, while vfork() and posix_spawn() should stay flat. Then it runs
+ * "/bin/true" N times through sh_launch(), which adds the job table and the wait, and
+ * reports the latency of a whole command.
+ *
+ * Usage: ./spawn [-n count] [-b heap_mb]
+ */
+
+#define SH_NO_MAIN
+#include "../src/main.c"
+#include "bench.h"
+
+int main(int argc, char **argv) {
+    static const char *names[] = {"posix_spawn", "vfork", "fork"};
+    char *args[] = {"/bin/true", NULL};
+    long count = 1000, heap_mb = 0;
+    char *heap = NULL;
+    double start, elapsed;
+    int opt, b;
+    long i;
+
+    while ((opt = getopt(argc, argv, "n:b:")) != -1) {
+        switch (opt) {
+            case 'n':
+                count = atol(optarg);
+                break;
+            case 'b':
+                heap_mb = atol(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-n count] [-b heap_mb]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (heap_mb > 0) {
+        // Touch every page so the mappings really exist.
+        heap = malloc(heap_mb << 20);
+        if (!heap) {
+            fprintf(stderr, "spawn: allocation error\n");
+            return EXIT_FAILURE;
+        }
+        memset(heap, 1, heap_mb << 20);
+    }
+
+    for (b = SH_SPAWN_POSIX; b <= SH_SPAWN_FORK; b++) {
+        start = now();
+
+        for (i = 0; i < count; i++) {
+            pid_t pid = sh_spawn(args, b, NULL);
+            if (pid > 0) {
+                sh_wait_pid(pid);
+            }
+        }
+        elapsed = now() - start;
+        printf("%-12s %8ld spawns  %8.3f s  %10.0f spawns/sec  (heap %ld MB)\n",
+               names[b], count, elapsed, count / elapsed, heap_mb);
+        bench_result("spawn", names[b], count / elapsed, "spawns/s");
+    }
+
+    start = now();
+    for (i = 0; i < count; i++) {
+        sh_launch(args);
+    }
+    elapsed = now() - start;
+    printf("%-12s %8ld commands  %6.3f s  %10.1f us/command\n", "sh_launch", count, elapsed, elapsed / count * 1e6);
+    bench_result("spawn", "sh_launch", elapsed / count * 1e6, "us");
+
+    free(heap);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,44 @@
+#!/bin/sh
+#
+# Startup latency benchmark
+#
+# Runs "SHELL -c true" (and a command that ends in an external program) N times for
+# each shell given on the command line, hyperfine style, and reports the mean time
+# per run. Other shells found on the system are measured too, for comparison.
+#
+# Usage: ./startup.sh [-n runs] shell...
+
+runs=1000
+if [ "$1" = "-n" ]; then
+    runs=$2
+    shift 2
+fi
+
+shells="$*"
+for other in dash bash; do
+    if command -v "$other" > /dev/null 2>&1; then
+        shells="$shells $(command -v "$other")"
+    fi
+done
+
+. "$(dirname "$0")/lib.sh"
+
+measure() {
+    sh=$1
+    cmd=$2
+    i=0
+    start=$(now)
+    while [ "$i" -lt "$runs" ]; do
+        "$sh" -c "$cmd"
+        i=$((i + 1))
+    done
+    end=$(now)
+    printf '%-24s %-12s %6d runs  %8d us/run\n' "$sh" "$cmd" "$runs" \
+        $(((end - start) / runs / 1000))
+    result startup "$(basename "$sh") $cmd" $(((end - start) / runs / 1000)) us
+}
+
+for sh in $shells; do
+    measure "$sh" "exit"
+    measure "$sh" "/bin/true"
+done
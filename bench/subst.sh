@@ -0,0 +1,58 @@
+#!/bin/sh
+#
+# Command substitution benchmark
+#
+# Runs loops that capture the output of a command with "$(...)" through each shell given
+# on the command line, and reports substitutions per second: "echo", a function, a
+# builtin and a function in a pipeline-free list, a program ("basename"), and something
+# that has to run in a subshell (it changes directory). Other shells found on the system
+# are measured too, for comparison.
+#
+# Usage: ./subst.sh [-n iterations] shell...
+
+n=2000
+if [ "$1" = "-n" ]; then
+    n=$2
+    shift 2
+fi
+
+shells="$*"
+for other in dash bash; do
+    if command -v "$other" > /dev/null 2>&1; then
+        shells="$shells $(command -v "$other")"
+    fi
+done
+
+. "$(dirname "$0")/lib.sh"
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+# generate NAME BODY: write a script that runs BODY $n times, with $b set to a path.
+i=0
+paths=
+while [ "$i" -lt "$n" ]; do
+    paths="$paths /usr/lib/w$i.so"
+    i=$((i + 1))
+done
+generate() {
+    printf 'f() { echo "$1"; }\nfor b in %s; do\n%s\ndone\n' "$paths" "$2" > "$dir/$1"
+}
+
+generate echo 'x=$(echo "$b")'
+generate function 'x=$(f "$b")'
+generate list 'x=$(true; f "$b")'
+generate program 'x=$(basename "$b" .so)'
+generate subshell 'x=$(cd /; echo "$b")'
+
+for sh in $shells; do
+    for kind in echo function list program subshell; do
+        start=$(now)
+        "$sh" "$dir/$kind"
+        end=$(now)
+        rate=$((n * 1000000000 / (end - start)))
+        printf '%-24s %-8s %8d substitutions  %8d ms  %10d substitutions/s\n' "$sh" "$kind" "$n" \
+            $(((end - start) / 1000000)) "$rate"
+        result subst "$(basename "$sh") $kind" "$rate" substitutions/s
+    done
+done
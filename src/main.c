@@ -1,8 +1,84 @@
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <locale.h>
+#include <poll.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <spawn.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#endif
+
+extern char **environ;
+
+/*
+ * Exit status of the last command. It also becomes the shell's own exit status.
+ */
+int sh_last_status = 0;
+
+/*
+ * Exit status of the last command substitution of the command being expanded, or -1 if
+ * it had none. A command with no name ("x=$(cmd)") takes it as its own.
+ */
+int sh_subst_status = -1;
+
+/*
+ * Set when a word of the command being expanded can't be ("${x y}", "$((1/0))"): the
+ * command doesn't run, and a shell that isn't interactive exits.
+ */
+int sh_expand_failed = 0;
+int sh_interactive = 0;
+
+/*
+ * A jump out of the commands being run, waiting to happen: "break N" or "continue N" out
+ * of loops, "return" out of a function, or an interrupt (^C) that abandons everything up
+ * to the next prompt. Lists and loops stop running commands while one is pending.
+ */
+#define SH_JUMP_NONE      0
+#define SH_JUMP_BREAK     1
+#define SH_JUMP_CONTINUE  2
+#define SH_JUMP_INTERRUPT 3
+#define SH_JUMP_RETURN    4
+
+int sh_jump = SH_JUMP_NONE;
+int sh_jump_levels = 0;
+
+/*
+ * How many loops the commands being run are nested in ("break 5" inside two loops
+ * leaves both of them).
+ */
+int sh_loop_depth = 0;
+
+/*
+ * The descriptors the shell keeps open for itself (epoll, signalfd, inotify) are moved
+ * to 10 and up, out of the way of the ones scripts redirect (see "Redirections").
+ */
+int sh_redirect_move_fd(int fd, int above);
+
 
 /*
  * Shell Builtins
@@ -33,6 +109,19 @@
  *   - cd: sh_cd
  *   - help: sh_help
  *   - exit: sh_exit
+ *   - hash: sh_hash
+ *   - cat: sh_cat
+ *   - jobs: sh_jobs
+ *   - fg: sh_fg
+ *   - bg: sh_bg
+ *   - wait: sh_wait
+ *   - parallel: sh_parallel
+ *   - export: sh_export
+ *   - unset: sh_unset
+ *   - true, false, ":": sh_true, sh_false
+ *   - echo: sh_echo
+ *   - break, continue: sh_break, sh_continue
+ *   - local, return: sh_local, sh_return
  */
 
 int sh_cd(char **args);
@@ -41,25 +130,170 @@ int sh_help(char **args);
 
 int sh_exit(char **args);
 
+int sh_hash(char **args);
+
+int sh_cat(char **args);
+
+int sh_jobs(char **args);
+
+int sh_fg(char **args);
+
+int sh_bg(char **args);
+
+int sh_wait(char **args);
+
+int sh_parallel(char **args);
+
+int sh_export(char **args);
+
+int sh_unset(char **args);
+
+int sh_true(char **args);
+
+int sh_false(char **args);
+
+int sh_echo(char **args);
+
+int sh_break(char **args);
+
+int sh_continue(char **args);
+
+int sh_local(char **args);
+
+int sh_return(char **args);
+
 
 /*
- * List of builtin commands, followed by their corresponding functions.
+ * The builtin registry
+ *
+ * Every builtin has an entry in "sh_builtins[]" (kept in alphabetical order, which is
+ * the order "help" lists them in) with its function, some flags, and a line of help:
+ *   - SH_BUILTIN_SPECIAL: a POSIX "special" builtin, whose errors are fatal in scripts
+ *     and whose assignments persist.
+ *   - SH_BUILTIN_SUBSHELL: the builtin has no lasting effect on the shell itself (it only
+ *     produces output), so running it in a subshell gives the same result as running it
+ *     in the shell. Builtins like "cd" and "exit" don't have this flag.
+ *   - SH_BUILTIN_STATUS: the builtin looks at the exit status of the command before it
+ *     ("exit" and "return" without an argument use it), so it isn't reset to 0 first.
+ *
+ * Finding a builtin by name happens for every command the shell runs, so instead of
+ * comparing the name with each entry in turn, we use a perfect hash in the style of
+ * gperf: the hash is the name's length plus a value for its first, second and last
+ * characters (the second one tells "exit" from "true"), and the character values are
+ * chosen so that no two builtins land on the same slot.
+ * A lookup is then one hash, one table load and one "strcmp()". The tables below come
+ * from tools/builtin_hash.c: whenever a builtin is added or renamed, run "make -C tools"
+ * and paste its output over them. tests/builtins.c checks that every name is found.
  */
 
-char *builtin_str[] = {
-        "cd",
-        "help",
-        "exit",
+#define SH_BUILTIN_SPECIAL  0x1
+#define SH_BUILTIN_SUBSHELL 0x2
+#define SH_BUILTIN_STATUS   0x4
+
+struct sh_builtin {
+    const char *name;
+    int (*func)(char **);
+    int flags;
+    const char *help;
+};
+
+const struct sh_builtin sh_builtins[] = {
+        {":",        &sh_true,     SH_BUILTIN_SPECIAL,  ": [ARG...]: do nothing, successfully"},
+        {"bg",       &sh_bg,       0,                   "bg [%JOB]: continue a stopped job in the background"},
+        {"break",    &sh_break,    SH_BUILTIN_SPECIAL,  "break [N]: leave the innermost N loops"},
+        {"cat",      &sh_cat,      SH_BUILTIN_SUBSHELL, "cat [FILE...]: copy files to standard output"},
+        {"cd",       &sh_cd,       0,                   "cd DIR: change the current directory"},
+        {"continue", &sh_continue, SH_BUILTIN_SPECIAL,  "continue [N]: go on with the next iteration of the Nth loop"},
+        {"echo",     &sh_echo,     SH_BUILTIN_SUBSHELL, "echo [-neE] [ARG...]: print the arguments"},
+        {"exit",     &sh_exit,     SH_BUILTIN_SPECIAL | SH_BUILTIN_STATUS, "exit [N]: exit the shell with status N"},
+        {"export",   &sh_export,   SH_BUILTIN_SPECIAL,  "export [-p] [NAME[=VALUE]...]: give variables to the commands the shell runs"},
+        {"false",    &sh_false,    SH_BUILTIN_SUBSHELL, "false: fail"},
+        {"fg",       &sh_fg,       0,                   "fg [%JOB]: continue a job in the foreground"},
+        {"hash",     &sh_hash,     0,                   "hash [-r | -s | NAME...]: remember or report command locations"},
+        {"help",     &sh_help,     SH_BUILTIN_SUBSHELL, "help: print this help"},
+        {"jobs",     &sh_jobs,     0,                   "jobs [-p]: list jobs"},
+        {"local",    &sh_local,    0,                   "local NAME[=VALUE]...: give the running function variables of its own"},
+        {"parallel", &sh_parallel, SH_BUILTIN_SUBSHELL, "parallel [-j N] [-k] [-t SECONDS] COMMAND [ARG...] [::: INPUT...]: run COMMAND over inputs, N at a time"},
+        {"return",   &sh_return,   SH_BUILTIN_SPECIAL | SH_BUILTIN_STATUS, "return [N]: return from a function with status N"},
+        {"true",     &sh_true,     SH_BUILTIN_SUBSHELL, "true: succeed"},
+        {"unset",    &sh_unset,    SH_BUILTIN_SPECIAL,  "unset [-v | -f] NAME...: forget variables or functions"},
+        {"wait",     &sh_wait,     0,                   "wait [%JOB | PID...]: wait for background jobs"},
+};
+
+#define SH_NUM_BUILTINS ((int) (sizeof(sh_builtins) / sizeof(sh_builtins[0])))
+
+#define SH_BUILTIN_MAX_HASH 30
+
+const unsigned char sh_builtin_asso[256] = {
+        [':'] = 0,
+        ['a'] = 11,
+        ['b'] = 8,
+        ['c'] = 1,
+        ['d'] = 3,
+        ['e'] = 2,
+        ['f'] = 9,
+        ['g'] = 5,
+        ['h'] = 1,
+        ['j'] = 11,
+        ['k'] = 6,
+        ['l'] = 6,
+        ['n'] = 7,
+        ['o'] = 7,
+        ['p'] = 5,
+        ['r'] = 0,
+        ['s'] = 6,
+        ['t'] = 1,
+        ['u'] = 0,
+        ['w'] = 9,
+        ['x'] = 1,
 };
 
-int (*builtin_func[])(char **) = {
-        &sh_cd,
-        &sh_help,
-        &sh_exit,
+const struct sh_builtin *sh_builtin_slots[SH_BUILTIN_MAX_HASH + 1] = {
+        [1] = &sh_builtins[0], // :
+        [7] = &sh_builtins[17], // true
+        [8] = &sh_builtins[7], // exit
+        [9] = &sh_builtins[4], // cd
+        [10] = &sh_builtins[8], // export
+        [12] = &sh_builtins[12], // help
+        [13] = &sh_builtins[18], // unset
+        [14] = &sh_builtins[6], // echo
+        [15] = &sh_builtins[16], // return
+        [16] = &sh_builtins[3], // cat
+        [17] = &sh_builtins[11], // hash
+        [18] = &sh_builtins[5], // continue
+        [19] = &sh_builtins[2], // break
+        [20] = &sh_builtins[1], // bg
+        [21] = &sh_builtins[10], // fg
+        [24] = &sh_builtins[14], // local
+        [25] = &sh_builtins[19], // wait
+        [27] = &sh_builtins[9], // false
+        [28] = &sh_builtins[13], // jobs
+        [30] = &sh_builtins[15], // parallel
 };
 
-int sh_num_builtins() {
-    return sizeof(builtin_str) / sizeof(char *);
+/**
+ * @brief Find a builtin by name.
+ * @param name The command name.
+ * @return The registry entry, or NULL if the name is not a builtin.
+ */
+const struct sh_builtin *sh_builtin_lookup(const char *name) {
+    const struct sh_builtin *builtin;
+    size_t len = strlen(name);
+    unsigned int h;
+
+    if (len == 0) {
+        return NULL;
+    }
+    h = len + sh_builtin_asso[(unsigned char) name[0]] + sh_builtin_asso[(unsigned char) name[1]]
+        + sh_builtin_asso[(unsigned char) name[len - 1]];
+    if (h > SH_BUILTIN_MAX_HASH) {
+        return NULL;
+    }
+    builtin = sh_builtin_slots[h];
+    if (builtin == NULL || strcmp(builtin->name, name) != 0) {
+        return NULL;
+    }
+    return builtin;
 }
 
 
@@ -75,9 +309,11 @@ int sh_num_builtins() {
 int sh_cd(char **args) {
     if (args[1] == NULL) {
         fprintf(stderr, "sh: expected argument to \"cd\"\n");
+        sh_last_status = 1;
     } else {
         if (chdir(args[1]) != 0) {
             perror("sh");
+            sh_last_status = 1;
         }
     }
     return 1;
@@ -94,8 +330,8 @@ int sh_help(char **args) {
     printf("Type program names and arguments, and hit enter.\n");
     printf("The following are built in:\n");
 
-    for (i = 0; i < sh_num_builtins(); i++) {
-        printf("  %s\n", builtin_str[i]);
+    for (i = 0; i < SH_NUM_BUILTINS; i++) {
+        printf("  %s\n", sh_builtins[i].help);
     }
 
     printf("Use the man command for information on other programs.\n");
@@ -104,270 +340,10111 @@ int sh_help(char **args) {
 
 /**
  * @brief Builtin command: exit.
- * @param args List of args. Not examined.
+ * @param args List of args. args[0] is "exit". args[1], if given, is the exit status.
  * @return Always returns 0, to terminate execution.
  */
 int sh_exit(char **args) {
+    if (args[1] != NULL) {
+        sh_last_status = atoi(args[1]) & 0xff;
+    }
     return 0;
 }
 
+/**
+ * @brief Builtin command: true, and ":".
+ * @param args List of args. Not examined.
+ * @return Always returns 1, to continue executing.
+ */
+int sh_true(char **args) {
+    (void) args;
+    sh_last_status = 0;
+    return 1;
+}
 
-/*
- * How shells start processes
- *
- * Staring processes is the main function of shells. So writing a shell means that
- * you need to know exactly what's going on with processes and how they start.
- *
- * There are only two ways of starting processes on Unix. The first one (which almost
- * doesn't count) is by being "Init". When a Unix computer boots, its kernel is loaded.
- * Once it is loaded and initialized, the kernel starts only one process, which is called "Init".
- * This process runs for the entire length of time that the computer is on, and it manages
- * loading up the rest of the processes that you need for your computer to be useful.
- *
- * Since most programs aren't "Init", that leaves only one practical way for processes to
- * get started: the "fork()" system call. When this function is called, the operating system
- * makes a duplicate of the process and starts them both running. The original process is
- * called the "parent", and the new one is called the "child". "fork()" returns 0 to the child
- * process, and it returns to the parent the process ID number (PID) of its child. In essence,
- * this means that the only way for new processes is to start is by an existing one duplicating
- * itself.
- *
- * This might sound like a problem. Typically, when you want to run a new process, you don't
- * just want another copy of the same program - you want to run a different program. THat's
- * what the "exec()" system call is all about. It replaces the current running program with
- * an entirely new one. This means that when you call "exec()", the operating system stops
- * your process, loads up the new program, and starts that one in its place. A process never
- * returns from an "exec()" call (unless there's an error).
- *
- * With these two system calls, we have the building blocks for how most programs are run on Unix.
- * First, an existing process forks itself into two separate ones. Then, the child uses "exec()" to
- * replace itself with a new program. The parent process can continue doing other things, and it can
- * even keep tabs on its children, using the system call "wait()".
+/**
+ * @brief Builtin command: false.
+ * @param args List of args. Not examined.
+ * @return Always returns 1, to continue executing.
  */
+int sh_false(char **args) {
+    (void) args;
+    sh_last_status = 1;
+    return 1;
+}
 
 /**
- * @brief Launch a program and wait for it to terminate.
- * @param args Null terminated list of arguments (including program).
- * @return Always returns 1, to continue execution.
+ * @brief Leave loops, for "break" and "continue".
+ * @param args List of args. args[1], if given, is the number of loops.
+ * @param jump SH_JUMP_BREAK or SH_JUMP_CONTINUE.
+ * @return Always returns 1, to continue executing.
  */
-int sh_launch(char **args) {
-    pid_t pid, wpid;
-    int status;
+int sh_jump_loops(char **args, int jump) {
+    int levels = 1;
 
-    pid = fork();
-    if (pid == 0) {
-        // Child process
-        if (execvp(args[0], args) == -1) {
-            perror("sh");
+    if (args[1] != NULL) {
+        levels = atoi(args[1]);
+        if (levels < 1) {
+            fprintf(stderr, "sh: %s: %s: loop count out of range\n", args[0], args[1]);
+            sh_last_status = 1;
+            return 1;
         }
-        exit(EXIT_FAILURE);
-    } else if (pid < 0) {
-        // Error forking
-        perror("sh");
-    } else {
-        // Parent process
-        do {
-            wpid = waitpid(pid, &status, WUNTRACED);
-        } while (!WIFEXITED(status) && !WIFSIGNALED(status));
     }
-
+    sh_last_status = 0;
+    if (sh_loop_depth == 0) {
+        // Outside of a loop, there is nothing to leave.
+        return 1;
+    }
+    sh_jump = jump;
+    sh_jump_levels = levels < sh_loop_depth ? levels : sh_loop_depth;
     return 1;
 }
 
+/**
+ * @brief Builtin command: break.
+ * @param args List of args. args[1], if given, is the number of loops to leave.
+ * @return Always returns 1, to continue executing.
+ */
+int sh_break(char **args) {
+    return sh_jump_loops(args, SH_JUMP_BREAK);
+}
+
+/**
+ * @brief Builtin command: continue.
+ * @param args List of args. args[1], if given, is the loop to go on with.
+ * @return Always returns 1, to continue executing.
+ */
+int sh_continue(char **args) {
+    return sh_jump_loops(args, SH_JUMP_CONTINUE);
+}
+
 
 /*
- * Shell execution
+ * Remembering where commands live
  *
- * The last step is to implement "sh_execute()", the function that will either launch
- * a builtin, or a process.
+ * When you type "ls", something has to find "/bin/ls". "execvp()" does it by trying
+ * "execve()" in every directory of "$PATH" until one works, which is one failing system
+ * call per directory, for every single command. Scripts run the same handful of commands
+ * over and over, so like bash we keep a hash table from command names to absolute paths.
+ *
+ * The table is only correct while the directories it was built from stay the same. It is
+ * thrown away when "$PATH" changes, and when a directory in "$PATH" gains or loses files.
+ * On Linux we ask the kernel to tell us about that with inotify, which costs a single
+ * non-blocking "read()" per lookup. Elsewhere we compare the directories' mtimes.
  */
 
+#define SH_HASH_INITIAL_SIZE 64
+
+struct sh_hash_entry {
+    char *name;
+    char *path;
+    long hits;
+};
+
+struct sh_hash_table {
+    struct sh_hash_entry *entries;
+    int size;
+    int count;
+    char *path_var;
+    time_t *dir_mtimes;
+    int num_dirs;
+    int notify_fd;
+    long hits;
+    long misses;
+};
+
+struct sh_hash_table sh_hash_table = {.notify_fd = -1};
+
 /**
- * @brief Execute shell built-in or launch program.
- * @param args Null terminated list of arguments.
- * @return 1 if the shell should continue running, 0 if it should terminate.
+ * @brief FNV-1a hash of a command name.
+ * @param name The name.
+ * @return The hash value.
  */
-int sh_execute(char **args) {
-    int i;
-
-    if (args[0] == NULL) {
-        // An empty command was entered.
-        return 1;
-    }
+unsigned long sh_hash_string(const char *name) {
+    unsigned long h = 14695981039346656037UL;
 
-    for (i = 0; i < sh_num_builtins(); i++) {
-        if (strcmp(args[0], builtin_str[i]) == 0) {
-            return (*builtin_func[i])(args);
-        }
+    while (*name) {
+        h ^= (unsigned char) *name++;
+        h *= 1099511628211UL;
     }
-
-    return sh_launch(args);
+    return h;
 }
 
-
-/*
- * Parsing the line
- *
- * We are going to parse that line into a list of arguments.
- * We won't allow quoting or backslash escaping in our command line arguments.
- * Instead, we will simply use whitespace to separate arguments from each other.
- * So the command echo "this message" would not call echo with a single argument this message,
- * but rather it would call echo with two arguments: "this" and "message"
- *
- * With those simplifications, all we need to do is "tokenize" the string using whitespace as delimiters.
- * That means we can break out the classic library function "strtok" to do some of the dirty work for us.
+/**
+ * @brief Forget every remembered command location.
  */
+void sh_hash_clear(void) {
+    struct sh_hash_table *t = &sh_hash_table;
+    int i;
 
-#define SH_TOK_BUFFER_SIZE 64
-#define SH_TOK_DELIMITER " \t\r\n\a"
+    for (i = 0; i < t->size; i++) {
+        free(t->entries[i].name);
+        free(t->entries[i].path);
+    }
+    free(t->entries);
+    t->entries = NULL;
+    t->size = 0;
+    t->count = 0;
+}
 
 /**
- * @brief Split a line into tokens.
- * @param line The line.
- * @return Null-terminated array of tokens.
+ * @brief Find the slot for a name (open addressing with linear probing).
+ * @param name The command name.
+ * @return The slot holding the name, or the empty slot where it belongs.
  */
-char **sh_split_line(char *line) {
-    int buffer_size = SH_TOK_BUFFER_SIZE, position = 0;
-    char **tokens = malloc(buffer_size * sizeof(char *));
-    char *token;
+struct sh_hash_entry *sh_hash_slot(const char *name) {
+    struct sh_hash_table *t = &sh_hash_table;
+    unsigned long i = sh_hash_string(name) & (t->size - 1);
 
-    if (!tokens) {
-        fprintf(stderr, "sh: allocation error\n");
-        exit(EXIT_FAILURE);
+    while (t->entries[i].name != NULL && strcmp(t->entries[i].name, name) != 0) {
+        i = (i + 1) & (t->size - 1);
     }
+    return &t->entries[i];
+}
 
-    token = strtok(line, SH_TOK_DELIMITER);
-    while (token != NULL) {
-        tokens[position] = token;
-        position++;
+/**
+ * @brief Remember the location of a command, growing the table when it gets full.
+ * @param name The command name.
+ * @param path The absolute path of the command.
+ * @return The table entry.
+ */
+struct sh_hash_entry *sh_hash_insert(const char *name, const char *path) {
+    struct sh_hash_table *t = &sh_hash_table;
+    struct sh_hash_entry *entry;
+    int i;
 
-        if (position >= buffer_size) {
-            buffer_size += SH_TOK_BUFFER_SIZE;
-            tokens = realloc(tokens, buffer_size * sizeof(char *));
+    if ((t->count + 1) * 4 > t->size * 3) {
+        struct sh_hash_entry *old = t->entries;
+        int old_size = t->size;
 
-            if (!tokens) {
-                fprintf(stderr, "sh: allocation error\n");
-                exit(EXIT_FAILURE);
+        t->size = old_size ? old_size * 2 : SH_HASH_INITIAL_SIZE;
+        t->entries = calloc(t->size, sizeof(struct sh_hash_entry));
+        if (!t->entries) {
+            fprintf(stderr, "sh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        for (i = 0; i < old_size; i++) {
+            if (old[i].name != NULL) {
+                *sh_hash_slot(old[i].name) = old[i];
             }
         }
+        free(old);
+    }
 
-        token = strtok(NULL, SH_TOK_DELIMITER);
+    entry = sh_hash_slot(name);
+    if (entry->name == NULL) {
+        entry->name = strdup(name);
+        t->count++;
+    } else {
+        free(entry->path);
     }
-    tokens[position] = NULL;
-    return tokens;
+    entry->path = strdup(path);
+    entry->hits = 0;
+    if (!entry->name || !entry->path) {
+        fprintf(stderr, "sh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    return entry;
 }
 
-
-/*
- * Reading a line
- *
- * Reading a line stdin sounds so simple, but in C it can be a hassle.
- * The sad thing is that you don't know ahead of time how much text a user
- * will enter into their shell. You can't simply allocate a block and hope
- * they don't exceed it. Instead, you need to start with a block, and if they
- * do exceed it, reallocate with more space. This is common strategy in C.
+/**
+ * @brief Forget the location of a single command.
+ * @param name The command name.
  */
+void sh_hash_remove(const char *name) {
+    struct sh_hash_table *t = &sh_hash_table;
+    struct sh_hash_entry *entry, moved;
+    unsigned long i, j;
+
+    if (t->size == 0) {
+        return;
+    }
+    entry = sh_hash_slot(name);
+    if (entry->name == NULL) {
+        return;
+    }
+    free(entry->name);
+    free(entry->path);
+    entry->name = NULL;
+    entry->path = NULL;
+    t->count--;
 
-#define SH_READ_LINE_BUFFER_SIZE 1024
+    // Re-insert the rest of the probe run so lookups don't stop at the hole.
+    i = entry - t->entries;
+    for (j = (i + 1) & (t->size - 1); t->entries[j].name != NULL; j = (j + 1) & (t->size - 1)) {
+        moved = t->entries[j];
+        t->entries[j].name = NULL;
+        *sh_hash_slot(moved.name) = moved;
+    }
+}
 
 /**
- * @brief Read a line of input from stdin.
- * @return The line from stdin.
+ * @brief Call a function for every directory in a PATH string.
+ * @param path_var The PATH value.
+ * @param fn Called with each directory (empty entries mean ".") and its index.
+ * @param data Passed through to fn.
+ * @return The number of directories.
  */
-char *sh_read_line(void) {
-    int buffer_size = SH_READ_LINE_BUFFER_SIZE;
-    int position = 0;
-    char *buffer = malloc(sizeof(char) * buffer_size);
-    int c;
-
-    if (!buffer) {
-        fprintf(stderr, "sh: allocation error\n");
-        exit(EXIT_FAILURE);
-    }
+int sh_path_foreach(const char *path_var, int (*fn)(const char *, int, void *), void *data) {
+    char dir[PATH_MAX];
+    const char *p = path_var, *end;
+    size_t len;
+    int n = 0;
 
     while (1) {
-        // Read a character
-        c = getchar();
-
-        // If we hit EOF, replace it with a null character and return.
-        if (c == EOF || c == '\n') {
-            buffer[position] = '\0';
-            return buffer;
+        end = strchr(p, ':');
+        len = end ? (size_t) (end - p) : strlen(p);
+        if (len == 0) {
+            strcpy(dir, ".");
+        } else if (len < sizeof(dir)) {
+            memcpy(dir, p, len);
+            dir[len] = '\0';
         } else {
-            buffer[position] = c;
+            dir[0] = '\0';
         }
-        position++;
-
-        // If we have exceeded the buffer. reallocate.
-        if (position >= buffer_size) {
-            buffer_size += SH_READ_LINE_BUFFER_SIZE;
-            buffer = realloc(buffer, buffer_size);
-            if (!buffer) {
-                fprintf(stderr, "sh: reallocation error\n");
-                exit(EXIT_FAILURE);
-            }
+        if (dir[0] != '\0' && fn(dir, n, data)) {
+            return n + 1;
+        }
+        n++;
+        if (!end) {
+            return n;
         }
+        p = end + 1;
     }
 }
 
+/**
+ * @brief Record a PATH directory's modification time (and its inotify watch).
+ */
+int sh_hash_watch_dir(const char *dir, int index, void *data) {
+    struct sh_hash_table *t = &sh_hash_table;
+    struct stat st;
 
-/*
- * Basic loop of a shell
- *
- * Shell does the following during its loop:
- *   1. Read: Read the command from standard input.
- *   2. Parse: Separate the command string into a program and arguments.
- *   3. Execute: Run the parsed command.
+    (void) data;
+    t->dir_mtimes[index] = stat(dir, &st) == 0 ? st.st_mtime : 0;
+#ifdef __linux__
+    if (t->notify_fd >= 0) {
+        inotify_add_watch(t->notify_fd, dir, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                                             IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF);
+    }
+#endif
+    return 0;
+}
+
+/**
+ * @brief Check whether a PATH directory's modification time changed.
  */
+int sh_hash_dir_changed(const char *dir, int index, void *data) {
+    struct sh_hash_table *t = &sh_hash_table;
+    struct stat st;
+    int *changed = data;
+
+    *changed = index >= t->num_dirs || (stat(dir, &st) == 0 ? st.st_mtime : 0) != t->dir_mtimes[index];
+    return *changed;
+}
 
 /**
- * @brief Loop getting input and executing it.
+ * @brief Count the directories of a PATH string.
  */
-void sh_loop(void) {
-    char *line;
-    char **args;
-    int status;
+int sh_path_count(const char *dir, int index, void *data) {
+    (void) dir;
+    (void) index;
+    (void) data;
+    return 0;
+}
 
-    do {
-        printf("> ");
+const char *sh_var_get(const char *name);
 
-        // Read
-        line = sh_read_line();
+/**
+ * @brief Throw the table away if PATH or any of its directories changed.
+ */
+void sh_hash_validate(void) {
+    struct sh_hash_table *t = &sh_hash_table;
+    const char *path_var = sh_var_get("PATH");
+    int changed = 0;
 
-        // Parse
-        args = sh_split_line(line);
+    if (path_var == NULL) {
+        path_var = "/usr/local/bin:/usr/bin:/bin";
+    }
 
-        // Execute
-        status = sh_execute(args);
+    if (t->path_var == NULL || strcmp(t->path_var, path_var) != 0) {
+        free(t->path_var);
+        free(t->dir_mtimes);
+        t->path_var = strdup(path_var);
+        t->num_dirs = sh_path_foreach(path_var, sh_path_count, NULL);
+        t->dir_mtimes = calloc(t->num_dirs, sizeof(time_t));
+        if (!t->path_var || !t->dir_mtimes) {
+            fprintf(stderr, "sh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+#ifdef __linux__
+        if (t->notify_fd >= 0) {
+            close(t->notify_fd);
+        }
+        t->notify_fd = sh_redirect_move_fd(inotify_init1(IN_NONBLOCK | IN_CLOEXEC), -1);
+#endif
+        sh_path_foreach(path_var, sh_hash_watch_dir, NULL);
+        sh_hash_clear();
+        return;
+    }
 
-        free(line);
-        free(args);
-    } while (status);
-}
+    if (t->count == 0) {
+        return;
+    }
 
+#ifdef __linux__
+    if (t->notify_fd >= 0) {
+        char events[4096];
 
-/*
- * A shell does three main things in its lifetime.
- *   1. Initialize: In this step, a typical shell would read and execute its configuration files.
- *      These change aspects of the shell's behavior.
- *   2. Interpret: Next, the shell reads commands from stdin (which could be interactive, or a file)
- *      and executes them.
- *   3. Terminate: After its commands are executed, the shell executes any shutdown commands,
- *      frees up any memory, and terminates.
- */
+        while (read(t->notify_fd, events, sizeof(events)) > 0) {
+            changed = 1;
+        }
+        if (changed) {
+            sh_hash_clear();
+        }
+        return;
+    }
+#endif
+
+    sh_path_foreach(path_var, sh_hash_dir_changed, &changed);
+    if (changed) {
+        sh_path_foreach(path_var, sh_hash_watch_dir, NULL);
+        sh_hash_clear();
+    }
+}
+
+struct sh_path_search {
+    const char *name;
+    char path[PATH_MAX];
+    int found;
+    int relative;
+};
 
 /**
- * @brief Main entry point.
- * @param argc Argument count.
- * @param argv Argument vector.
- * @return status code.
+ * @brief Look for an executable in one PATH directory.
  */
-int main(int argc, char **argv) {
-    // Load config files, if any.
-
-    // Run command loop.
-    sh_loop();
+int sh_path_try_dir(const char *dir, int index, void *data) {
+    struct sh_path_search *search = data;
+    struct stat st;
+
+    (void) index;
+    if (snprintf(search->path, sizeof(search->path), "%s/%s", dir, search->name) >= (int) sizeof(search->path)) {
+        return 0;
+    }
+    if (stat(search->path, &st) == 0 && S_ISREG(st.st_mode) && access(search->path, X_OK) == 0) {
+        search->found = 1;
+        search->relative = dir[0] != '/';
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Find the absolute path of a command, using the hash table when possible.
+ * @param name The command name. Names containing a slash are returned unchanged.
+ * @param path Buffer of PATH_MAX bytes that receives the path.
+ * @return 1 if the command was found, 0 if not.
+ */
+int sh_hash_lookup(const char *name, char *path) {
+    struct sh_hash_table *t = &sh_hash_table;
+    struct sh_path_search search;
+    struct sh_hash_entry *entry;
+
+    if (strchr(name, '/') != NULL) {
+        snprintf(path, PATH_MAX, "%s", name);
+        return 1;
+    }
+
+    sh_hash_validate();
+    if (t->size > 0) {
+        entry = sh_hash_slot(name);
+        if (entry->name != NULL) {
+            entry->hits++;
+            t->hits++;
+            strcpy(path, entry->path);
+            return 1;
+        }
+    }
+    t->misses++;
+
+    search.name = name;
+    search.found = 0;
+    sh_path_foreach(t->path_var, sh_path_try_dir, &search);
+    if (!search.found) {
+        return 0;
+    }
+
+    // Relative PATH entries like "." depend on the current directory, so don't remember them.
+    if (!search.relative) {
+        sh_hash_insert(name, search.path)->hits = 1;
+    }
+    strcpy(path, search.path);
+    return 1;
+}
+
+/**
+ * @brief Builtin command: remember or report command locations.
+ * @param args List of args. "hash" lists the table, "hash -r" empties it, "hash -s" prints
+ *             the hit/miss counters, and "hash name..." looks up and remembers each name.
+ * @return Always returns 1, to continue executing.
+ */
+int sh_hash(char **args) {
+    struct sh_hash_table *t = &sh_hash_table;
+    char path[PATH_MAX];
+    int i;
+
+    if (args[1] == NULL) {
+        sh_hash_validate();
+        if (t->count == 0) {
+            printf("hash: hash table empty\n");
+            return 1;
+        }
+        printf("hits\tcommand\n");
+        for (i = 0; i < t->size; i++) {
+            if (t->entries[i].name != NULL) {
+                printf("%4ld\t%s\n", t->entries[i].hits, t->entries[i].path);
+            }
+        }
+    } else if (strcmp(args[1], "-r") == 0) {
+        sh_hash_clear();
+    } else if (strcmp(args[1], "-s") == 0) {
+        printf("hits: %ld\nmisses: %ld\n", t->hits, t->misses);
+    } else {
+        for (i = 1; args[i] != NULL; i++) {
+            sh_hash_remove(args[i]);
+            if (!sh_hash_lookup(args[i], path)) {
+                fprintf(stderr, "sh: hash: %s: not found\n", args[i]);
+                sh_last_status = 1;
+            }
+        }
+    }
+    return 1;
+}
+
+
+/*
+ * Timing and tracing
+ *
+ * "time pipeline" reports how long a pipeline took (wall clock, and CPU time in user
+ * and kernel mode), how much memory it used at most and how often it was switched out.
+ * Children are reaped with "wait4()", which hands back each child's resource usage
+ * along with its status, and the usage of a job's processes is added up in the job
+ * (see the "Jobs" section). Builtins run in the shell, so the shell's own usage
+ * ("getrusage(RUSAGE_SELF)") is counted too.
+ *
+ * Setting SH_TRACE to a file name when the shell starts turns on the execution trace:
+ * a JSON object per line for every line parsed and every command run, with how long
+ * parsing, starting and waiting took, in microseconds. When SH_TRACE isn't set, all
+ * the trace costs is a test of "sh_trace_fd" per command.
+ */
+
+int sh_trace_fd = -1;
+
+// Resource usage of the foreground jobs of the "time" being measured, or NULL.
+struct rusage *sh_time_usage = NULL;
+
+/**
+ * @brief Read the monotonic clock.
+ * @return The time in nanoseconds.
+ */
+long long sh_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * @brief Add one resource usage to another. The maximum resident set size is the larger
+ *        of the two, everything else is summed.
+ * @param total The usage to add to.
+ * @param usage The usage to add.
+ */
+void sh_rusage_add(struct rusage *total, const struct rusage *usage) {
+    timeradd(&total->ru_utime, &usage->ru_utime, &total->ru_utime);
+    timeradd(&total->ru_stime, &usage->ru_stime, &total->ru_stime);
+    if (usage->ru_maxrss > total->ru_maxrss) {
+        total->ru_maxrss = usage->ru_maxrss;
+    }
+    total->ru_nvcsw += usage->ru_nvcsw;
+    total->ru_nivcsw += usage->ru_nivcsw;
+}
+
+/**
+ * @brief Write all of a buffer to a file descriptor.
+ * @param fd The file descriptor.
+ * @param data The data.
+ * @param len Its length.
+ */
+void sh_write_all(int fd, const char *data, size_t len) {
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+/**
+ * @brief Open the trace file named by $SH_TRACE, if it is set.
+ */
+void sh_trace_init(void) {
+    const char *path = getenv("SH_TRACE");
+    int fd;
+
+    if (path == NULL || *path == '\0') {
+        return;
+    }
+    fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "sh: SH_TRACE: %s: %s\n", path, strerror(errno));
+        return;
+    }
+    // Out of the way of the file descriptors scripts use (see "Redirections").
+    sh_trace_fd = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+    close(fd);
+}
+
+/**
+ * @brief Append a JSON string to a trace record.
+ * @param out Where to write it.
+ * @param end End of the space for the record.
+ * @param s The string, or NULL.
+ * @param len Length of the string.
+ * @return Where the record continues.
+ */
+char *sh_trace_string(char *out, char *end, const char *s, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    size_t i;
+
+    *out++ = '"';
+    for (i = 0; i < len && out + 8 < end; i++) {
+        unsigned char c = s[i];
+        if (c == '"' || c == '\\') {
+            *out++ = '\\';
+            *out++ = c;
+        } else if (c < 0x20) {
+            out += sprintf(out, "\\u00%c%c", hex[c >> 4], hex[c & 0xf]);
+        } else {
+            *out++ = c;
+        }
+    }
+    *out++ = '"';
+    return out;
+}
+
+/**
+ * @brief Write a trace record for a line that was parsed.
+ * @param line The line.
+ * @param len Length of the line.
+ * @param parse_ns How long lexing and parsing took.
+ */
+void sh_trace_parse(const char *line, size_t len, long long parse_ns) {
+    char record[4096], *out = record, *end = record + sizeof(record) - 64;
+
+    out += sprintf(out, "{\"event\":\"parse\",\"line\":");
+    out = sh_trace_string(out, end, line, len);
+    out += sprintf(out, ",\"bytes\":%zu,\"parse_us\":%.3f}\n", len, parse_ns / 1e3);
+    sh_write_all(sh_trace_fd, record, out - record);
+}
+
+/**
+ * @brief Write a trace record for a command that was run.
+ * @param kind "builtin", "command", "pipeline", or "exec" for a command that replaced the shell.
+ * @param args The command's arguments, or NULL.
+ * @param text The command as text, if args is NULL.
+ * @param pid PID of its (last) process, or 0 if it could not be started.
+ * @param spawn_ns How long starting it took.
+ * @param wait_ns How long it ran after it was started.
+ */
+void sh_trace_command(const char *kind, char **args, const char *text, pid_t pid, long long spawn_ns, long long wait_ns) {
+    char record[4096], *out = record, *end = record + sizeof(record) - 128;
+    int i;
+
+    out += sprintf(out, "{\"event\":\"%s\",", kind);
+    if (args == NULL) {
+        out += sprintf(out, "\"text\":");
+        out = sh_trace_string(out, end, text, strlen(text));
+    } else {
+        out += sprintf(out, "\"argv\":[");
+        for (i = 0; args[i] != NULL && out < end; i++) {
+            if (i > 0) {
+                *out++ = ',';
+            }
+            out = sh_trace_string(out, end, args[i], strlen(args[i]));
+        }
+        *out++ = ']';
+    }
+    out += sprintf(out, ",\"pid\":%d,\"spawn_us\":%.3f,\"wait_us\":%.3f,\"status\":%d}\n",
+                   (int) pid, spawn_ns / 1e3, wait_ns / 1e3, sh_last_status);
+    sh_write_all(sh_trace_fd, record, out - record);
+}
+
+
+/*
+ * How shells start processes
+ *
+ * Staring processes is the main function of shells. So writing a shell means that
+ * you need to know exactly what's going on with processes and how they start.
+ *
+ * There are only two ways of starting processes on Unix. The first one (which almost
+ * doesn't count) is by being "Init". When a Unix computer boots, its kernel is loaded.
+ * Once it is loaded and initialized, the kernel starts only one process, which is called "Init".
+ * This process runs for the entire length of time that the computer is on, and it manages
+ * loading up the rest of the processes that you need for your computer to be useful.
+ *
+ * Since most programs aren't "Init", that leaves only one practical way for processes to
+ * get started: the "fork()" system call. When this function is called, the operating system
+ * makes a duplicate of the process and starts them both running. The original process is
+ * called the "parent", and the new one is called the "child". "fork()" returns 0 to the child
+ * process, and it returns to the parent the process ID number (PID) of its child. In essence,
+ * this means that the only way for new processes is to start is by an existing one duplicating
+ * itself.
+ *
+ * This might sound like a problem. Typically, when you want to run a new process, you don't
+ * just want another copy of the same program - you want to run a different program. THat's
+ * what the "exec()" system call is all about. It replaces the current running program with
+ * an entirely new one. This means that when you call "exec()", the operating system stops
+ * your process, loads up the new program, and starts that one in its place. A process never
+ * returns from an "exec()" call (unless there's an error).
+ *
+ * With these two system calls, we have the building blocks for how most programs are run on Unix.
+ * First, an existing process forks itself into two separate ones. Then, the child uses "exec()" to
+ * replace itself with a new program. The parent process can continue doing other things, and it can
+ * even keep tabs on its children, using the system call "wait()".
+ */
+
+/*
+ * Cheaper ways to start processes
+ *
+ * "fork()" has one big cost: the kernel has to copy the parent's page tables (the memory
+ * itself is shared copy-on-write, but the mappings are not). For a tiny shell that's
+ * nothing, but as the shell's heap grows the fork gets slower, and all of that work is
+ * thrown away a moment later when the child calls "exec()".
+ *
+ * "vfork()" avoids the copy altogether: the child borrows the parent's memory and the
+ * parent is suspended until the child calls "exec()" or "_exit()". The child must not
+ * do anything else, so it is only good for the fork-then-exec pattern, which is exactly
+ * what a shell needs. "posix_spawn()" wraps the same idea in a safe, standard API (glibc
+ * implements it with "clone(CLONE_VM|CLONE_VFORK)"), and also reports exec failures back
+ * to the parent as a return value.
+ *
+ * So the shell launches programs with "posix_spawn()" by default, can use a hand-rolled
+ * "vfork()" path, and keeps the classic "fork()" path as a fallback for when the others
+ * are unavailable.
+ */
+
+enum sh_spawn_backend {
+    SH_SPAWN_POSIX,
+    SH_SPAWN_VFORK,
+    SH_SPAWN_FORK,
+};
+
+enum sh_spawn_backend sh_spawn_backend = SH_SPAWN_POSIX;
+
+
+/*
+ * Process groups and the terminal
+ *
+ * An interactive shell runs each pipeline in a process group of its own, and hands the
+ * terminal to that group while it runs. Then the keys that send signals (Ctrl-C, Ctrl-\,
+ * Ctrl-Z) reach every process of the pipeline, and not the shell, which ignores them.
+ * Children have to get the default signal handling back before they run anything.
+ *
+ * A non-interactive shell (a script, or "sh -c") leaves its children in its own process
+ * group, so that a Ctrl-C aimed at the script reaches them too.
+ */
+
+int sh_job_control = 0;
+pid_t sh_shell_pgid;
+struct termios sh_shell_tmodes;
+
+const int sh_job_signals[] = {SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU};
+
+// The signal mask programs should start with: the shell's own, without SIGCHLD blocked.
+sigset_t sh_child_sigmask;
+
+#define SH_NUM_JOB_SIGNALS ((int) (sizeof(sh_job_signals) / sizeof(sh_job_signals[0])))
+
+/*
+ * A file descriptor action: make "fd" a copy of "src" (with dup2()), or close "fd" if
+ * "src" is negative. Redirections boil down to a list of these (see sh_redirect_prepare()).
+ */
+struct sh_fd_action {
+    int fd;
+    int src;
+};
+
+/*
+ * How to set up a child: where its stdin and stdout come from, its redirections, and its
+ * process group. The pipeline's stdin and stdout are connected first, then the
+ * redirections are applied, so "cmd > file | next" writes to the file.
+ */
+struct sh_launch {
+    int fd_in;     // becomes stdin, or -1 to inherit ours
+    int fd_out;    // becomes stdout, or -1 to inherit ours
+    int fd_peer;   // read end of fd_out's pipe, closed by a forked child, or -1
+    pid_t pgid;    // process group to join: 0 for a new one, -1 to stay in the shell's
+    const struct sh_fd_action *actions;
+    int num_actions;
+};
+
+/**
+ * @brief Check whether a launch's redirections replace one of its file descriptors
+ *        before anything uses it, which makes connecting it to a pipe pointless.
+ * @param launch The launch.
+ * @param fd The file descriptor.
+ * @return 1 if the redirections replace fd, 0 if not.
+ */
+int sh_launch_overrides(const struct sh_launch *launch, int fd) {
+    int i;
+
+    for (i = 0; i < launch->num_actions; i++) {
+        if (launch->actions[i].src == fd) {
+            return 0;
+        }
+        if (launch->actions[i].fd == fd) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Apply a list of file descriptor actions to the current process.
+ * @param actions The actions.
+ * @param n Number of actions.
+ */
+void sh_apply_fd_actions(const struct sh_fd_action *actions, int n) {
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (actions[i].src < 0) {
+            close(actions[i].fd);
+        } else {
+            dup2(actions[i].src, actions[i].fd);
+        }
+    }
+}
+
+/**
+ * @brief Take control of the terminal, if the shell is interactive.
+ */
+void sh_init_job_control(void) {
+    int i;
+
+    if (!isatty(STDIN_FILENO)) {
+        return;
+    }
+
+    // Wait until we are in the foreground before taking over.
+    while (tcgetpgrp(STDIN_FILENO) != (sh_shell_pgid = getpgrp())) {
+        kill(-sh_shell_pgid, SIGTTIN);
+    }
+    for (i = 0; i < SH_NUM_JOB_SIGNALS; i++) {
+        signal(sh_job_signals[i], SIG_IGN);
+    }
+
+    sh_shell_pgid = getpid();
+    if (setpgid(sh_shell_pgid, sh_shell_pgid) < 0 && errno != EPERM) {
+        perror("sh");
+        return;
+    }
+    tcsetpgrp(STDIN_FILENO, sh_shell_pgid);
+    tcgetattr(STDIN_FILENO, &sh_shell_tmodes);
+    sh_job_control = 1;
+}
+
+/**
+ * @brief Hand the terminal to a process group.
+ * @param pgid The process group, or the shell's own to take the terminal back.
+ */
+void sh_give_terminal(pid_t pgid) {
+    if (sh_job_control && pgid > 0) {
+        tcsetpgrp(STDIN_FILENO, pgid);
+    }
+}
+
+/**
+ * @brief Set up a new child process before it runs anything.
+ * @param launch How to set up the child, or NULL to leave it as it is.
+ */
+void sh_child_setup(const struct sh_launch *launch) {
+    int i;
+
+    sigprocmask(SIG_SETMASK, &sh_child_sigmask, NULL);
+    if (launch == NULL) {
+        return;
+    }
+    if (launch->pgid >= 0) {
+        setpgid(0, launch->pgid);
+    }
+    if (sh_job_control) {
+        for (i = 0; i < SH_NUM_JOB_SIGNALS; i++) {
+            signal(sh_job_signals[i], SIG_DFL);
+        }
+    }
+    if (launch->fd_in >= 0 && !sh_launch_overrides(launch, STDIN_FILENO)) {
+        dup2(launch->fd_in, STDIN_FILENO);
+    }
+    if (launch->fd_out >= 0 && !sh_launch_overrides(launch, STDOUT_FILENO)) {
+        dup2(launch->fd_out, STDOUT_FILENO);
+    }
+    // A fork that never execs keeps its O_CLOEXEC descriptors, and a stage holding the
+    // read end of its own output pipe would never get SIGPIPE.
+    if (launch->fd_peer >= 0) {
+        close(launch->fd_peer);
+    }
+    sh_apply_fd_actions(launch->actions, launch->num_actions);
+}
+
+void sh_jobs_forget(void);
+void sh_subst_forget(void);
+
+/**
+ * @brief Fork a child that runs shell code rather than a program.
+ * @param launch How to set up the child, or NULL.
+ * @return As fork(): 0 in the child, the child's PID in the parent, -1 on error.
+ */
+pid_t sh_fork(const struct sh_launch *launch) {
+    pid_t pid;
+
+    fflush(stdout);
+    pid = fork();
+    if (pid == 0) {
+        sh_child_setup(launch);
+        sh_jobs_forget();
+        sh_subst_forget();
+    } else if (pid < 0) {
+        perror("sh");
+        sh_last_status = 1;
+    } else if (launch != NULL && launch->pgid >= 0) {
+        // Also set the group from the parent, so it exists before anyone uses it.
+        setpgid(pid, launch->pgid ? launch->pgid : pid);
+    }
+    return pid;
+}
+
+/*
+ * The shell for files that can be executed but aren't programs: scripts without a "#!"
+ * line. The kernel refuses them with ENOEXEC, and, like execvp(), we hand them to it.
+ */
+#define SH_SCRIPT_SHELL "/bin/sh"
+
+/**
+ * @brief Build the arguments that run a script without a "#!" line.
+ * @param path Path of the script.
+ * @param args Null terminated list of arguments (including program).
+ * @return Null terminated list (to free()): the shell, the script, and the arguments.
+ */
+char **sh_script_args(const char *path, char **args) {
+    char **script;
+    int n;
+
+    for (n = 0; args[n] != NULL; n++);
+    script = malloc((n + 2) * sizeof(char *));
+    if (!script) {
+        fprintf(stderr, "sh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    script[0] = SH_SCRIPT_SHELL;
+    script[1] = (char *) path;
+    memcpy(script + 2, args + 1, n * sizeof(char *));
+    return script;
+}
+
+/**
+ * @brief Start a program with posix_spawn().
+ * @param path Path of the program.
+ * @param args Null terminated list of arguments (including program).
+ * @param launch How to set up the child, or NULL.
+ * @param err Set to the spawn error, or 0 on success.
+ * @return PID of the child, or -1 on error.
+ */
+pid_t sh_spawn_posix(const char *path, char **args, const struct sh_launch *launch, int *err) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t signals;
+    short flags = 0;
+    pid_t pid;
+    int i;
+
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &sh_child_sigmask);
+    flags |= POSIX_SPAWN_SETSIGMASK;
+    if (launch == NULL) {
+        posix_spawnattr_setflags(&attr, flags);
+        *err = posix_spawn(&pid, path, NULL, &attr, args, environ);
+        posix_spawnattr_destroy(&attr);
+        return *err == 0 ? pid : -1;
+    }
+
+    posix_spawn_file_actions_init(&actions);
+    if (launch->fd_in >= 0 && !sh_launch_overrides(launch, STDIN_FILENO)) {
+        posix_spawn_file_actions_adddup2(&actions, launch->fd_in, STDIN_FILENO);
+    }
+    if (launch->fd_out >= 0 && !sh_launch_overrides(launch, STDOUT_FILENO)) {
+        posix_spawn_file_actions_adddup2(&actions, launch->fd_out, STDOUT_FILENO);
+    }
+    for (i = 0; i < launch->num_actions; i++) {
+        if (launch->actions[i].src < 0) {
+            posix_spawn_file_actions_addclose(&actions, launch->actions[i].fd);
+        } else {
+            posix_spawn_file_actions_adddup2(&actions, launch->actions[i].src, launch->actions[i].fd);
+        }
+    }
+    if (launch->pgid >= 0) {
+        posix_spawnattr_setpgroup(&attr, launch->pgid);
+        flags |= POSIX_SPAWN_SETPGROUP;
+    }
+    if (sh_job_control) {
+        sigemptyset(&signals);
+        for (i = 0; i < SH_NUM_JOB_SIGNALS; i++) {
+            sigaddset(&signals, sh_job_signals[i]);
+        }
+        posix_spawnattr_setsigdefault(&attr, &signals);
+        flags |= POSIX_SPAWN_SETSIGDEF;
+    }
+    posix_spawnattr_setflags(&attr, flags);
+
+    *err = posix_spawn(&pid, path, &actions, &attr, args, environ);
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    return *err == 0 ? pid : -1;
+}
+
+/**
+ * @brief Start a program with vfork() and execv().
+ * @param path Path of the program.
+ * @param args Null terminated list of arguments (including program).
+ * @param launch How to set up the child, or NULL.
+ * @param err Set to the exec error, or 0 on success.
+ * @return PID of the child, or -1 on error.
+ */
+pid_t sh_spawn_vfork(const char *path, char **args, const struct sh_launch *launch, int *err) {
+    // The child shares our memory until it execs, so it can hand errno back through here.
+    volatile int exec_errno = 0;
+    pid_t pid;
+
+    pid = vfork();
+    if (pid == 0) {
+        // Child process
+        sh_child_setup(launch);
+        execv(path, args);
+        exec_errno = errno;
+        _exit(127);
+    } else if (pid < 0) {
+        *err = errno;
+        return -1;
+    }
+
+    // Parent process: the child has either exec'd or exited by now.
+    *err = exec_errno;
+    if (*err != 0) {
+        waitpid(pid, NULL, 0);
+        return -1;
+    }
+    return pid;
+}
+
+/**
+ * @brief Start a program with fork() and execv().
+ * @param path Path of the program.
+ * @param args Null terminated list of arguments (including program).
+ * @param launch How to set up the child, or NULL.
+ * @param err Set to the fork error, or 0 on success.
+ * @return PID of the child, or -1 on error.
+ */
+pid_t sh_spawn_fork(const char *path, char **args, const struct sh_launch *launch, int *err) {
+    pid_t pid;
+
+    *err = 0;
+    pid = fork();
+    if (pid == 0) {
+        // Child process
+        sh_child_setup(launch);
+        execv(path, args);
+        if (errno == ENOEXEC) {
+            execv(SH_SCRIPT_SHELL, sh_script_args(path, args));
+        }
+        // Not exit(): the atexit handlers and stdio buffers are the parent's.
+        fprintf(stderr, "sh: %s: %s\n", args[0], strerror(errno));
+        _exit(errno == ENOENT ? 127 : 126);
+    } else if (pid < 0) {
+        // Error forking
+        *err = errno;
+    }
+    return pid;
+}
+
+char **sh_env(void);
+
+/**
+ * @brief Start a program using the given backend, falling back to fork().
+ * @param args Null terminated list of arguments (including program).
+ * @param backend Which launch engine to try first.
+ * @param launch How to set up the child, or NULL to let it inherit everything.
+ * @return PID of the child, or -1 if it could not be started (error already reported).
+ */
+pid_t sh_spawn(char **args, enum sh_spawn_backend backend, const struct sh_launch *launch) {
+    char path[PATH_MAX], **argv = args, **script = NULL;
+    const char *file = path;
+    pid_t pid = -1;
+    int err = ENOSYS, retried = 0;
+
+    if (!sh_hash_lookup(args[0], path)) {
+        fprintf(stderr, "sh: %s: command not found\n", args[0]);
+        sh_last_status = 127;
+        return -1;
+    }
+
+    // Anything we printed ourselves has to come out before the child's output.
+    fflush(stdout);
+    // Every backend gives the program "environ"; make it the exported variables.
+    environ = sh_env();
+
+    while (1) {
+        switch (backend) {
+            case SH_SPAWN_POSIX:
+                pid = sh_spawn_posix(file, argv, launch, &err);
+                break;
+            case SH_SPAWN_VFORK:
+                pid = sh_spawn_vfork(file, argv, launch, &err);
+                break;
+            case SH_SPAWN_FORK:
+                break;
+        }
+
+        // Resource problems and missing support are worth a retry with plain fork().
+        if (pid < 0 && (err == ENOSYS || err == ENOMEM || err == EAGAIN)) {
+            pid = sh_spawn_fork(file, argv, launch, &err);
+        }
+
+        // A remembered location may have gone stale; look it up again, once.
+        if (pid < 0 && err == ENOENT && !retried && script == NULL && strchr(args[0], '/') == NULL) {
+            retried = 1;
+            sh_hash_remove(args[0]);
+            if (sh_hash_lookup(args[0], path)) {
+                continue;
+            }
+        }
+
+        // An executable file that isn't a program is a script without "#!".
+        if (pid < 0 && err == ENOEXEC && script == NULL) {
+            script = sh_script_args(path, args);
+            file = script[0];
+            argv = script;
+            continue;
+        }
+        break;
+    }
+    free(script);
+
+    if (pid < 0) {
+        fprintf(stderr, "sh: %s: %s\n", args[0], strerror(err));
+        sh_last_status = err == ENOENT ? 127 : 126;
+    } else if (launch != NULL && launch->pgid >= 0) {
+        // Also set the group from the parent, so it exists before anyone uses it.
+        setpgid(pid, launch->pgid ? launch->pgid : pid);
+    }
+    return pid;
+}
+
+/**
+ * @brief Wait for a child process to terminate.
+ * @param pid PID of the child.
+ * @return The wait status of the child.
+ */
+int sh_wait_pid(pid_t pid) {
+    int status = 0;
+
+    do {
+        if (waitpid(pid, &status, WUNTRACED) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("sh");
+            break;
+        }
+    } while (!WIFEXITED(status) && !WIFSIGNALED(status));
+
+    return status;
+}
+
+/**
+ * @brief Turn a wait status into a shell exit status.
+ * @param status The status from waitpid().
+ * @return The exit code, or 128 plus the signal number if the child was killed or stopped.
+ */
+int sh_exit_status(int status) {
+    if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    if (WIFSTOPPED(status)) {
+        return 128 + WSTOPSIG(status);
+    }
+    return WEXITSTATUS(status);
+}
+
+
+/*
+ * The event loop
+ *
+ * A shell often has to wait for several things at once: the user's next line, children
+ * changing state, output from commands it collects, and timeouts. Blocking in "read()"
+ * or "waitpid()" on one of them means ignoring the others until it is done. Instead
+ * the shell waits for all of them at once, in one place, the reactor: each thing it
+ * waits for is an event source, a file descriptor plus a function to call when that
+ * file descriptor becomes readable.
+ *
+ * On Linux the reactor is an epoll instance, so a wait costs the same no matter how
+ * many sources there are. Children are a source like any other: SIGCHLD is blocked and
+ * read from a signalfd (see the "Jobs" section), and timers are timerfds. Elsewhere the
+ * reactor keeps a list of its sources and waits with "poll()".
+ */
+
+struct sh_event_source {
+    int fd;
+    void (*fn)(struct sh_event_source *source);
+    void *data;
+};
+
+#define SH_REACTOR_MAX_EVENTS 64
+
+int sh_reactor_fd = -1;
+
+// The sources, for the poll() fallback.
+struct sh_event_source **sh_reactor_sources = NULL;
+int sh_reactor_num_sources = 0, sh_reactor_capacity = 0;
+
+/**
+ * @brief Set up the reactor, or start over with an empty one (in a forked subshell).
+ */
+void sh_reactor_init(void) {
+    if (sh_reactor_fd >= 0) {
+        close(sh_reactor_fd);
+    }
+    sh_reactor_fd = -1;
+    sh_reactor_num_sources = 0;
+#ifdef __linux__
+    sh_reactor_fd = sh_redirect_move_fd(epoll_create1(EPOLL_CLOEXEC), -1);
+#endif
+}
+
+/**
+ * @brief Start watching an event source.
+ * @param source The source. It must stay where it is until it is removed.
+ * @return 0 on success, -1 on error (with errno set). Regular files can't be watched
+ *         (EPERM): they are always readable.
+ */
+int sh_reactor_add(struct sh_event_source *source) {
+#ifdef __linux__
+    struct epoll_event event;
+
+    if (sh_reactor_fd >= 0) {
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.ptr = source;
+        return epoll_ctl(sh_reactor_fd, EPOLL_CTL_ADD, source->fd, &event);
+    }
+#endif
+    if (sh_reactor_num_sources == sh_reactor_capacity) {
+        sh_reactor_capacity = sh_reactor_capacity ? sh_reactor_capacity * 2 : 16;
+        sh_reactor_sources = realloc(sh_reactor_sources, sh_reactor_capacity * sizeof(struct sh_event_source *));
+        if (!sh_reactor_sources) {
+            fprintf(stderr, "sh: reallocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    sh_reactor_sources[sh_reactor_num_sources++] = source;
+    return 0;
+}
+
+/**
+ * @brief Stop watching an event source.
+ * @param source The source.
+ */
+void sh_reactor_remove(struct sh_event_source *source) {
+    int i;
+
+#ifdef __linux__
+    if (sh_reactor_fd >= 0) {
+        epoll_ctl(sh_reactor_fd, EPOLL_CTL_DEL, source->fd, NULL);
+        return;
+    }
+#endif
+    for (i = 0; i < sh_reactor_num_sources; i++) {
+        if (sh_reactor_sources[i] == source) {
+            sh_reactor_sources[i] = sh_reactor_sources[--sh_reactor_num_sources];
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Start a one-shot timer, as an event source that becomes readable when it expires.
+ * @param source The source. Its fd is set to the timer.
+ * @param ms How long until the timer expires, in milliseconds.
+ * @return 0 on success, -1 on error (with errno set; ENOSYS where there are no timerfds).
+ */
+int sh_reactor_add_timer(struct sh_event_source *source, long ms) {
+#ifdef __linux__
+    struct itimerspec when = {{0, 0}, {ms / 1000, (ms % 1000) * 1000000}};
+
+    source->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (source->fd < 0) {
+        return -1;
+    }
+    if (timerfd_settime(source->fd, 0, &when, NULL) < 0 || sh_reactor_add(source) < 0) {
+        close(source->fd);
+        source->fd = -1;
+        return -1;
+    }
+    return 0;
+#else
+    (void) source;
+    (void) ms;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/**
+ * @brief Stop a timer and close it.
+ * @param source The timer's source.
+ */
+void sh_reactor_remove_timer(struct sh_event_source *source) {
+    if (source->fd >= 0) {
+        sh_reactor_remove(source);
+        close(source->fd);
+        source->fd = -1;
+    }
+}
+
+/**
+ * @brief Wait for sources to become ready.
+ * @param ready Set to the sources that are ready (room for SH_REACTOR_MAX_EVENTS).
+ * @param timeout How long to wait at most, in milliseconds, or -1 for no limit.
+ * @return The number of sources that are ready, or -1 on error (with errno set).
+ */
+int sh_reactor_collect(struct sh_event_source **ready, int timeout) {
+    struct pollfd fds[SH_REACTOR_MAX_EVENTS];
+    int i, n = 0, count;
+
+#ifdef __linux__
+    struct epoll_event events[SH_REACTOR_MAX_EVENTS];
+
+    if (sh_reactor_fd >= 0) {
+        count = epoll_wait(sh_reactor_fd, events, SH_REACTOR_MAX_EVENTS, timeout);
+        for (i = 0; i < count; i++) {
+            ready[i] = events[i].data.ptr;
+        }
+        return count;
+    }
+#endif
+    count = sh_reactor_num_sources < SH_REACTOR_MAX_EVENTS ? sh_reactor_num_sources : SH_REACTOR_MAX_EVENTS;
+    for (i = 0; i < count; i++) {
+        fds[i].fd = sh_reactor_sources[i]->fd;
+        fds[i].events = POLLIN;
+    }
+    if (poll(fds, count, timeout) < 0) {
+        return -1;
+    }
+    for (i = 0; i < count; i++) {
+        if (fds[i].revents != 0) {
+            ready[n++] = sh_reactor_sources[i];
+        }
+    }
+    return n;
+}
+
+/**
+ * @brief Wait for events, and call the functions of the sources that are ready.
+ *
+ * A function may remove its own source, but not others: their events may be next.
+ *
+ * @param timeout How long to wait at most, in milliseconds, or -1 to wait until something happens.
+ * @return The number of sources that were ready, or -1 on error.
+ */
+int sh_reactor_wait(int timeout) {
+    struct sh_event_source *ready[SH_REACTOR_MAX_EVENTS];
+    int i, n;
+
+    n = sh_reactor_collect(ready, timeout);
+    if (n < 0) {
+        return errno == EINTR ? 0 : -1;
+    }
+    for (i = 0; i < n; i++) {
+        ready[i]->fn(ready[i]);
+    }
+    return n;
+}
+
+
+/*
+ * Jobs
+ *
+ * Every pipeline the shell starts is a job: a group of processes that are started,
+ * stopped and waited for together. "cmd &" starts a job in the background and goes on
+ * to the next command at once; "jobs" lists the jobs, "fg" and "bg" move them to the
+ * foreground or background, and "wait" waits for them.
+ *
+ * Children tell us about themselves with SIGCHLD. The shell keeps SIGCHLD blocked and
+ * reads it from a signalfd, an event source of the reactor (see "The event loop"), so a
+ * child changing state just wakes up whatever the shell is waiting for. Where there are
+ * no signalfds, a signal handler writes a byte to a pipe instead (the "self-pipe
+ * trick"). Either way, "waitpid(-1, ..., WNOHANG)" then collects every event that is
+ * waiting, and a hash table from PID to process finds the job for each one. Reaping
+ * costs O(1) per event, no matter how many jobs are running, and nothing polls.
+ *
+ * When the shell waits for a foreground job, it waits in the reactor too: background
+ * jobs that finish in the meantime are reaped along the way.
+ */
+
+#define SH_JOB_RUNNING 0
+#define SH_JOB_STOPPED 1
+#define SH_JOB_DONE    2
+
+struct sh_job;
+
+struct sh_proc {
+    pid_t pid;
+    int status;
+    int state;
+    struct sh_job *job;
+};
+
+struct sh_job {
+    int id;
+    pid_t pgid;
+    char *text;
+    int num_procs;
+    int num_live;             // processes that haven't finished
+    int num_stopped;          // processes that are stopped
+    int background;
+    int notified;
+    struct termios tmodes;    // terminal modes to restore when the job is continued
+    int has_tmodes;
+    struct sh_node *node;     // the command, while it runs in the foreground
+    char **args;
+    struct rusage usage;      // of the processes that have finished
+    struct sh_job *prev;
+    struct sh_job *next;
+    struct sh_proc procs[];
+};
+
+struct sh_job *sh_jobs_first = NULL, *sh_jobs_last = NULL;
+int sh_num_jobs = 0;
+pid_t sh_last_bg_pid = 0;
+
+void sh_jobs_reap(void);
+
+/**
+ * @brief Event source function for SIGCHLD.
+ */
+void sh_sigchld_ready(struct sh_event_source *source) {
+    (void) source;
+    sh_jobs_reap();
+}
+
+struct sh_event_source sh_sigchld_source = {-1, sh_sigchld_ready, NULL};
+int sh_sigchld_pipe = -1;     // write end of the self-pipe, if there is no signalfd
+
+// PID -> process, with open addressing.
+struct sh_proc **sh_pid_map = NULL;
+int sh_pid_map_size = 0, sh_pid_map_count = 0;
+
+char *sh_job_describe(struct sh_node *node, char **args);
+
+/**
+ * @brief SIGCHLD handler, where there is no signalfd: wake up the shell.
+ */
+void sh_sigchld_handler(int sig) {
+    int saved_errno = errno;
+
+    (void) sig;
+    if (write(sh_sigchld_pipe, "", 1) < 0) {
+        // The pipe is full, so the shell will wake up anyway.
+    }
+    errno = saved_errno;
+}
+
+/**
+ * @brief Set up the reactor, and SIGCHLD as an event source.
+ */
+void sh_init_jobs(void) {
+    struct sigaction sa;
+    sigset_t mask;
+    int fds[2];
+
+    sh_reactor_init();
+    sigprocmask(SIG_BLOCK, NULL, &sh_child_sigmask);
+    sigdelset(&sh_child_sigmask, SIGCHLD);
+
+#ifdef __linux__
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    sh_sigchld_source.fd = sh_redirect_move_fd(signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC), -1);
+    if (sh_sigchld_source.fd >= 0) {
+        sh_reactor_add(&sh_sigchld_source);
+        return;
+    }
+    sigprocmask(SIG_UNBLOCK, &mask, NULL);
+#endif
+
+    if (pipe2(fds, O_CLOEXEC | O_NONBLOCK) < 0) {
+        return;
+    }
+    sh_sigchld_source.fd = sh_redirect_move_fd(fds[0], -1);
+    sh_sigchld_pipe = sh_redirect_move_fd(fds[1], -1);
+    sh_reactor_add(&sh_sigchld_source);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sh_sigchld_handler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGCHLD, &sa, NULL);
+    (void) mask;
+}
+
+/**
+ * @brief Find the slot of a PID in the PID map.
+ */
+struct sh_proc **sh_pid_map_slot(pid_t pid) {
+    unsigned int i = ((unsigned int) pid * 2654435761u) & (sh_pid_map_size - 1);
+
+    while (sh_pid_map[i] != NULL && sh_pid_map[i]->pid != pid) {
+        i = (i + 1) & (sh_pid_map_size - 1);
+    }
+    return &sh_pid_map[i];
+}
+
+/**
+ * @brief Add a process to the PID map.
+ */
+void sh_pid_map_add(struct sh_proc *proc) {
+    struct sh_proc **old = sh_pid_map;
+    int i, old_size = sh_pid_map_size;
+
+    if ((sh_pid_map_count + 1) * 2 > sh_pid_map_size) {
+        sh_pid_map_size = old_size ? old_size * 2 : 64;
+        sh_pid_map = calloc(sh_pid_map_size, sizeof(struct sh_proc *));
+        if (!sh_pid_map) {
+            fprintf(stderr, "sh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        for (i = 0; i < old_size; i++) {
+            if (old[i] != NULL) {
+                *sh_pid_map_slot(old[i]->pid) = old[i];
+            }
+        }
+        free(old);
+    }
+    *sh_pid_map_slot(proc->pid) = proc;
+    sh_pid_map_count++;
+}
+
+/**
+ * @brief Remove a PID from the PID map.
+ */
+void sh_pid_map_remove(pid_t pid) {
+    struct sh_proc **slot, *moved;
+    int i, j;
+
+    if (sh_pid_map_size == 0 || *(slot = sh_pid_map_slot(pid)) == NULL) {
+        return;
+    }
+    *slot = NULL;
+    sh_pid_map_count--;
+
+    // Re-insert the rest of the probe run so lookups don't stop at the hole.
+    i = slot - sh_pid_map;
+    for (j = (i + 1) & (sh_pid_map_size - 1); sh_pid_map[j] != NULL; j = (j + 1) & (sh_pid_map_size - 1)) {
+        moved = sh_pid_map[j];
+        sh_pid_map[j] = NULL;
+        *sh_pid_map_slot(moved->pid) = moved;
+    }
+}
+
+/**
+ * @brief Fill in one process of a job, once it has been started.
+ * @param job The job.
+ * @param i Which process it is.
+ * @param pid Its PID, or -1 if it could not be started.
+ */
+void sh_job_set_proc(struct sh_job *job, int i, pid_t pid) {
+    job->procs[i].pid = pid;
+    job->procs[i].job = job;
+    if (pid > 0) {
+        job->procs[i].state = SH_JOB_RUNNING;
+        job->procs[i].status = 0;
+        job->num_live++;
+        sh_pid_map_add(&job->procs[i]);
+    } else {
+        // It never started; its status is whatever the launch failure left behind.
+        job->procs[i].state = SH_JOB_DONE;
+        job->procs[i].status = (sh_last_status ? sh_last_status : 1) << 8;
+    }
+}
+
+/**
+ * @brief Register the processes of a pipeline as a job.
+ * @param pids PIDs of the processes. Failed launches are -1. NULL to fill them in with
+ *             sh_job_set_proc() as they start, so that one that finishes before the last
+ *             has started (while a later stage's "$(...)" runs) isn't reaped unseen.
+ * @param n Number of processes.
+ * @param pgid The job's process group, or -1 if it has none.
+ * @return The job.
+ */
+struct sh_job *sh_job_add(const pid_t *pids, int n, pid_t pgid) {
+    struct sh_job *job = malloc(sizeof(struct sh_job) + n * sizeof(struct sh_proc));
+    int i;
+
+    if (!job) {
+        fprintf(stderr, "sh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(job, 0, sizeof(struct sh_job));
+    job->id = sh_jobs_last ? sh_jobs_last->id + 1 : 1;
+    job->pgid = pgid;
+    job->num_procs = n;
+
+    for (i = 0; i < n; i++) {
+        if (pids != NULL) {
+            sh_job_set_proc(job, i, pids[i]);
+        } else {
+            job->procs[i].pid = -1;
+            job->procs[i].job = job;
+            job->procs[i].state = SH_JOB_DONE;
+            job->procs[i].status = 0;
+        }
+    }
+
+    job->prev = sh_jobs_last;
+    if (sh_jobs_last) {
+        sh_jobs_last->next = job;
+    } else {
+        sh_jobs_first = job;
+    }
+    sh_jobs_last = job;
+    sh_num_jobs++;
+    return job;
+}
+
+/**
+ * @brief Remove a job from the job table and free it.
+ * @param job The job.
+ */
+void sh_job_remove(struct sh_job *job) {
+    int i;
+
+    for (i = 0; i < job->num_procs; i++) {
+        if (job->procs[i].state != SH_JOB_DONE) {
+            sh_pid_map_remove(job->procs[i].pid);
+        }
+    }
+    if (job->prev) {
+        job->prev->next = job->next;
+    } else {
+        sh_jobs_first = job->next;
+    }
+    if (job->next) {
+        job->next->prev = job->prev;
+    } else {
+        sh_jobs_last = job->prev;
+    }
+    sh_num_jobs--;
+    if (sh_time_usage != NULL && job->num_live == 0) {
+        sh_rusage_add(sh_time_usage, &job->usage);
+    }
+    free(job->text);
+    free(job);
+}
+
+/**
+ * @brief Forget every job without waiting for it, in a newly forked subshell.
+ *
+ * The subshell's children are its own, and so is its reactor: the epoll instance and
+ * the self-pipe are shared with the parent across fork().
+ */
+void sh_jobs_forget(void) {
+    while (sh_jobs_first != NULL) {
+        sh_job_remove(sh_jobs_first);
+    }
+    if (sh_sigchld_source.fd >= 0) {
+        close(sh_sigchld_source.fd);
+        sh_sigchld_source.fd = -1;
+    }
+    if (sh_sigchld_pipe >= 0) {
+        close(sh_sigchld_pipe);
+        sh_sigchld_pipe = -1;
+    }
+    sh_init_jobs();
+}
+
+/**
+ * @brief Get the state of a job.
+ */
+int sh_job_state(const struct sh_job *job) {
+    if (job->num_live == 0) {
+        return SH_JOB_DONE;
+    }
+    return job->num_live == job->num_stopped ? SH_JOB_STOPPED : SH_JOB_RUNNING;
+}
+
+/**
+ * @brief Get the exit status of a job: that of its last process.
+ */
+int sh_job_status(const struct sh_job *job) {
+    return sh_exit_status(job->procs[job->num_procs - 1].status);
+}
+
+/**
+ * @brief Record an event from wait4().
+ * @param pid The PID wait4() returned.
+ * @param status The wait status.
+ * @param usage The resource usage of the process, if it finished.
+ */
+void sh_job_update(pid_t pid, int status, const struct rusage *usage) {
+    struct sh_proc *proc;
+    struct sh_job *job;
+
+    if (sh_pid_map_size == 0 || (proc = *sh_pid_map_slot(pid)) == NULL) {
+        return;
+    }
+    job = proc->job;
+
+    if (WIFSTOPPED(status)) {
+        if (proc->state != SH_JOB_STOPPED) {
+            proc->state = SH_JOB_STOPPED;
+            job->num_stopped++;
+        }
+        proc->status = status;
+        job->notified = 0;
+    } else if (WIFCONTINUED(status)) {
+        if (proc->state == SH_JOB_STOPPED) {
+            proc->state = SH_JOB_RUNNING;
+            job->num_stopped--;
+        }
+    } else {
+        if (proc->state == SH_JOB_STOPPED) {
+            job->num_stopped--;
+        }
+        proc->state = SH_JOB_DONE;
+        proc->status = status;
+        sh_rusage_add(&job->usage, usage);
+        job->num_live--;
+        sh_pid_map_remove(pid);
+        job->notified = 0;
+    }
+}
+
+/**
+ * @brief Collect every child event that is waiting, without blocking.
+ */
+void sh_jobs_reap(void) {
+    char drain[512];          // room for a few signalfd_siginfo records
+    struct rusage usage;
+    pid_t pid;
+    int status;
+
+    if (sh_sigchld_source.fd >= 0) {
+        while (read(sh_sigchld_source.fd, drain, sizeof(drain)) > 0);
+    }
+    while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &usage)) > 0) {
+        sh_job_update(pid, status, &usage);
+    }
+}
+
+/**
+ * @brief Event source function for input: note that it is readable.
+ */
+void sh_input_ready(struct sh_event_source *source) {
+    *(int *) source->data = 1;
+}
+
+/**
+ * @brief Wait until a file descriptor is readable, reaping children in the meantime.
+ *
+ * This is how a shell waiting for its next command notices background jobs finishing:
+ * it sleeps in the reactor, where its input is just one more event source.
+ *
+ * @param fd The file descriptor.
+ */
+void sh_wait_input(int fd) {
+    int ready = 0;
+    struct sh_event_source input = {fd, sh_input_ready, &ready};
+
+    if (sh_reactor_add(&input) < 0) {
+        // A regular file is always readable.
+        return;
+    }
+    while (!ready && sh_reactor_wait(-1) >= 0);
+    sh_reactor_remove(&input);
+}
+
+/**
+ * @brief Print a line about a job, like "[1]+  Running    sleep 10 &".
+ * @param out Where to print it.
+ * @param job The job.
+ */
+void sh_job_print(FILE *out, const struct sh_job *job) {
+    char state[32];
+    int status;
+
+    switch (sh_job_state(job)) {
+        case SH_JOB_RUNNING:
+            strcpy(state, "Running");
+            break;
+        case SH_JOB_STOPPED:
+            strcpy(state, "Stopped");
+            break;
+        default:
+            status = sh_job_status(job);
+            if (status == 0) {
+                strcpy(state, "Done");
+            } else {
+                snprintf(state, sizeof(state), "Exit %d", status);
+            }
+            break;
+    }
+    fprintf(out, "[%d]%c  %-22s %s%s\n", job->id, job == sh_jobs_last ? '+' : ' ', state,
+            job->text ? job->text : "", sh_job_state(job) == SH_JOB_RUNNING ? " &" : "");
+}
+
+/**
+ * @brief Tell the user about background jobs that finished, and forget them.
+ *
+ * Only interactive shells do this. Elsewhere finished jobs stay in the table until
+ * "wait" collects their status.
+ */
+void sh_jobs_notify(void) {
+    struct sh_job *job, *next;
+
+    if (sh_num_jobs > 0) {
+        sh_jobs_reap();
+    }
+    if (!sh_job_control) {
+        return;
+    }
+    for (job = sh_jobs_first; job != NULL; job = next) {
+        next = job->next;
+        if (sh_job_state(job) == SH_JOB_DONE) {
+            if (job->background) {
+                sh_job_print(stderr, job);
+            }
+            sh_job_remove(job);
+        } else if (sh_job_state(job) == SH_JOB_STOPPED && !job->notified) {
+            sh_job_print(stderr, job);
+            job->notified = 1;
+        }
+    }
+}
+
+/**
+ * @brief Wait for a job to finish or stop.
+ * @param job The job.
+ * @param foreground Whether to hand the job the terminal while waiting.
+ * @return The job's exit status (128 plus the signal number if it stopped).
+ *         A job that finished is removed from the table; a stopped one is kept.
+ */
+int sh_job_wait(struct sh_job *job, int foreground) {
+    struct sh_proc *last = &job->procs[job->num_procs - 1];
+    struct rusage usage;
+    pid_t pid;
+    int i, status = 0;
+
+    if (foreground && sh_job_control && job->pgid > 0) {
+        sh_give_terminal(job->pgid);
+        if (job->has_tmodes) {
+            tcsetattr(STDIN_FILENO, TCSADRAIN, &job->tmodes);
+        }
+    }
+
+    while (sh_job_state(job) == SH_JOB_RUNNING) {
+        if (sh_sigchld_source.fd >= 0 && sh_reactor_wait(-1) >= 0) {
+            continue;
+        }
+        pid = wait4(-1, &status, WUNTRACED, &usage);
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        sh_job_update(pid, status, &usage);
+    }
+
+    if (foreground && sh_job_control && job->pgid > 0) {
+        sh_give_terminal(sh_shell_pgid);
+        job->has_tmodes = tcgetattr(STDIN_FILENO, &job->tmodes) == 0;
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &sh_shell_tmodes);
+    }
+
+    if (sh_job_state(job) == SH_JOB_STOPPED) {
+        for (i = 0; i < job->num_procs; i++) {
+            if (job->procs[i].state == SH_JOB_STOPPED) {
+                status = sh_exit_status(job->procs[i].status);
+            }
+        }
+        if (job->text == NULL) {
+            job->text = sh_job_describe(job->node, job->args);
+        }
+        job->background = 1;
+        job->notified = 1;
+        job->node = NULL;
+        job->args = NULL;
+        fprintf(stderr, "\n");
+        sh_job_print(stderr, job);
+        return status;
+    }
+
+    status = sh_job_status(job);
+    if (foreground && sh_job_control && WIFSIGNALED(last->status)
+        && WTERMSIG(last->status) != SIGINT && WTERMSIG(last->status) != SIGPIPE) {
+        fprintf(stderr, "%s\n", strsignal(WTERMSIG(last->status)));
+    }
+    if (foreground && sh_job_control && WIFSIGNALED(last->status) && WTERMSIG(last->status) == SIGINT) {
+        // ^C stops a loop at the prompt too, not just the command that was running.
+        sh_jump = SH_JUMP_INTERRUPT;
+    }
+    sh_job_remove(job);
+    return status;
+}
+
+/**
+ * @brief Wait for a foreground job that is already registered (see sh_wait_foreground()).
+ * @param job The job.
+ * @param node The command, to describe the job if it stops (or NULL).
+ * @param args The command's arguments, used instead when node is NULL.
+ * @return Exit status of the last process.
+ */
+int sh_wait_foreground_job(struct sh_job *job, struct sh_node *node, char **args) {
+    job->node = node;
+    job->args = args;
+    return sh_job_wait(job, 1);
+}
+
+/**
+ * @brief Wait for the processes of a foreground pipeline, with the terminal handed to them.
+ * @param pids PIDs of the processes, in pipeline order. Failed launches are -1.
+ * @param n Number of processes.
+ * @param pgid The pipeline's process group, or -1 if it has none.
+ * @param node The command, to describe the job if it stops (or NULL).
+ * @param args The command's arguments, used instead when node is NULL.
+ * @return Exit status of the last process.
+ */
+int sh_wait_foreground(const pid_t *pids, int n, pid_t pgid, struct sh_node *node, char **args) {
+    return sh_wait_foreground_job(sh_job_add(pids, n, pgid), node, args);
+}
+
+/**
+ * @brief Register a job that was started in the background (see sh_start_background()).
+ * @param job The job.
+ * @param text Description of the job (taken over by the job).
+ */
+void sh_start_background_job(struct sh_job *job, char *text) {
+    job->text = text;
+    job->background = 1;
+    sh_last_bg_pid = job->procs[job->num_procs - 1].pid;
+    if (sh_job_control) {
+        fprintf(stderr, "[%d] %d\n", job->id, (int) sh_last_bg_pid);
+    }
+    sh_last_status = 0;
+}
+
+/**
+ * @brief Register a pipeline that was started in the background.
+ * @param pids PIDs of the processes, in pipeline order. Failed launches are -1.
+ * @param n Number of processes.
+ * @param pgid The pipeline's process group, or -1 if it has none.
+ * @param text Description of the job (taken over by the job).
+ */
+void sh_start_background(const pid_t *pids, int n, pid_t pgid, char *text) {
+    sh_start_background_job(sh_job_add(pids, n, pgid), text);
+}
+
+/**
+ * @brief Find a job from a "%N" (or "%%", "%+") specification, or the current job.
+ * @param spec The specification, or NULL for the current job.
+ * @param name Name of the builtin, for error messages.
+ * @return The job, or NULL (after printing a message).
+ */
+struct sh_job *sh_job_find(const char *spec, const char *name) {
+    struct sh_job *job;
+    char *end;
+    long id;
+
+    if (spec == NULL || strcmp(spec, "%%") == 0 || strcmp(spec, "%+") == 0) {
+        if (sh_jobs_last == NULL) {
+            fprintf(stderr, "sh: %s: no current job\n", name);
+        }
+        return sh_jobs_last;
+    }
+    if (spec[0] == '%') {
+        id = strtol(spec + 1, &end, 10);
+        for (job = sh_jobs_first; job != NULL && *end == '\0'; job = job->next) {
+            if (job->id == id) {
+                return job;
+            }
+        }
+    } else {
+        id = strtol(spec, &end, 10);
+        if (*end == '\0' && sh_pid_map_size > 0 && *sh_pid_map_slot(id) != NULL) {
+            return (*sh_pid_map_slot(id))->job;
+        }
+        for (job = sh_jobs_first; job != NULL && *end == '\0'; job = job->next) {
+            if (job->procs[job->num_procs - 1].pid == id) {
+                return job;
+            }
+        }
+    }
+    fprintf(stderr, "sh: %s: %s: no such job\n", name, spec);
+    return NULL;
+}
+
+/**
+ * @brief Continue a stopped job.
+ * @param job The job.
+ */
+void sh_job_continue(struct sh_job *job) {
+    int i;
+
+    for (i = 0; i < job->num_procs; i++) {
+        if (job->procs[i].state == SH_JOB_STOPPED) {
+            job->procs[i].state = SH_JOB_RUNNING;
+            job->num_stopped--;
+        }
+    }
+    if (job->pgid > 0) {
+        kill(-job->pgid, SIGCONT);
+    } else {
+        for (i = 0; i < job->num_procs; i++) {
+            if (job->procs[i].state != SH_JOB_DONE) {
+                kill(job->procs[i].pid, SIGCONT);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Builtin command: list jobs.
+ * @param args List of args. "jobs -p" prints only process group leaders' PIDs.
+ * @return Always returns 1, to continue executing.
+ */
+int sh_jobs(char **args) {
+    struct sh_job *job;
+    int pids_only = args[1] != NULL && strcmp(args[1], "-p") == 0;
+
+    sh_jobs_reap();
+    for (job = sh_jobs_first; job != NULL; job = job->next) {
+        if (pids_only) {
+            printf("%d\n", (int) (job->pgid > 0 ? job->pgid : job->procs[0].pid));
+        } else {
+            sh_job_print(stdout, job);
+            job->notified = 1;
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Builtin command: continue a job in the foreground.
+ * @param args List of args. args[1], if given, is the job ("%N").
+ * @return Always returns 1, to continue executing.
+ */
+int sh_fg(char **args) {
+    struct sh_job *job = sh_job_find(args[1], "fg");
+
+    if (job == NULL) {
+        sh_last_status = 1;
+        return 1;
+    }
+    printf("%s\n", job->text);
+    fflush(stdout);
+    job->background = 0;
+    sh_job_continue(job);
+    sh_last_status = sh_job_wait(job, 1);
+    return 1;
+}
+
+/**
+ * @brief Builtin command: continue a stopped job in the background.
+ * @param args List of args. args[1], if given, is the job ("%N").
+ * @return Always returns 1, to continue executing.
+ */
+int sh_bg(char **args) {
+    struct sh_job *job = sh_job_find(args[1], "bg");
+
+    if (job == NULL) {
+        sh_last_status = 1;
+        return 1;
+    }
+    job->background = 1;
+    sh_job_continue(job);
+    sh_job_print(stderr, job);
+    return 1;
+}
+
+/**
+ * @brief Builtin command: wait for background jobs.
+ * @param args List of args. With no arguments, waits for every job. Otherwise each
+ *             argument is a job ("%N") or a PID, and the status is that of the last one.
+ * @return Always returns 1, to continue executing.
+ */
+int sh_wait(char **args) {
+    struct sh_job *job, *next;
+    int i;
+
+    if (args[1] == NULL) {
+        for (job = sh_jobs_first; job != NULL; job = next) {
+            next = job->next;
+            if (sh_job_state(job) != SH_JOB_STOPPED) {
+                sh_job_wait(job, 0);
+            }
+        }
+        sh_last_status = 0;
+        return 1;
+    }
+
+    for (i = 1; args[i] != NULL; i++) {
+        job = sh_job_find(args[i], "wait");
+        sh_last_status = job != NULL ? sh_job_wait(job, 0) : 127;
+    }
+    return 1;
+}
+
+/**
+ * @brief Launch a program with redirections and wait for it to terminate.
+ * @param args Null terminated list of arguments (including program).
+ * @param actions The redirections, as file descriptor actions.
+ * @param num_actions Number of actions.
+ * @return Always returns 1, to continue execution.
+ */
+int sh_launch_redirected(char **args, const struct sh_fd_action *actions, int num_actions) {
+    struct sh_launch launch = {-1, -1, -1, sh_job_control ? 0 : -1, actions, num_actions};
+    long long start = sh_trace_fd >= 0 ? sh_now() : 0, spawned = 0;
+    pid_t pid;
+
+    pid = sh_spawn(args, sh_spawn_backend, &launch);
+    if (sh_trace_fd >= 0) {
+        spawned = sh_now();
+    }
+    if (pid > 0) {
+        sh_last_status = sh_wait_foreground(&pid, 1, launch.pgid < 0 ? -1 : pid, NULL, args);
+    }
+    if (sh_trace_fd >= 0) {
+        sh_trace_command("command", args, NULL, pid > 0 ? pid : 0, spawned - start, sh_now() - spawned);
+    }
+
+    return 1;
+}
+
+/**
+ * @brief Launch a program and wait for it to terminate.
+ * @param args Null terminated list of arguments (including program).
+ * @return Always returns 1, to continue execution.
+ */
+int sh_launch(char **args) {
+    return sh_launch_redirected(args, NULL, 0);
+}
+
+/**
+ * @brief Replace the shell with a program, for the last command of "sh -c".
+ *
+ * When there is nothing left to do after a command, there is no point in forking a
+ * child and waiting for it: the shell can simply become the command.
+ *
+ * @param args Null terminated list of arguments (including program).
+ * @return Never returns; exits with status 126 or 127 if the program can't be run.
+ */
+void sh_exec_tail(char **args) {
+    char path[PATH_MAX];
+
+    if (!sh_hash_lookup(args[0], path)) {
+        fprintf(stderr, "sh: %s: command not found\n", args[0]);
+        exit(127);
+    }
+    fflush(stdout);
+    if (sh_trace_fd >= 0) {
+        sh_trace_command("exec", args, NULL, getpid(), 0, 0);
+    }
+    sigprocmask(SIG_SETMASK, &sh_child_sigmask, NULL);
+    execve(path, args, sh_env());
+    if (errno == ENOEXEC) {
+        execve(SH_SCRIPT_SHELL, sh_script_args(path, args), sh_env());
+    }
+    fprintf(stderr, "sh: %s: %s\n", args[0], strerror(errno));
+    exit(errno == ENOENT ? 127 : 126);
+}
+
+
+/*
+ * Moving data without copying it
+ *
+ * A lot of what shell scripts do is move bytes around: "cat file | cmd", "cmd < file".
+ * Done the obvious way, with "read()" and "write()", every byte is copied from the
+ * kernel into our buffer and straight back again. Linux can move the data for us:
+ *   - "copy_file_range()" copies between two files (and may not copy at all, on file
+ *     systems that can share the blocks).
+ *   - "splice()" moves data between a pipe and anything else, passing page references
+ *     instead of bytes.
+ *   - "sendfile()" sends a file to any other file descriptor.
+ * sh_copy_fd() tries whichever of those fits the two file descriptors, and falls back to
+ * the plain loop when the kernel says no.
+ */
+
+#define SH_COPY_CHUNK (1 << 20)
+
+/**
+ * @brief Copy everything from one file descriptor to another.
+ * @param in File descriptor to read from.
+ * @param out File descriptor to write to.
+ * @return 0 on success, -1 on error (with errno set).
+ */
+int sh_copy_fd(int in, int out) {
+    struct stat in_st, out_st;
+    char buffer[65536];
+    ssize_t n, written, w;
+    int in_file, out_file, in_pipe, out_pipe;
+
+    if (fstat(in, &in_st) < 0 || fstat(out, &out_st) < 0) {
+        return -1;
+    }
+    in_file = S_ISREG(in_st.st_mode);
+    out_file = S_ISREG(out_st.st_mode);
+    in_pipe = S_ISFIFO(in_st.st_mode);
+    out_pipe = S_ISFIFO(out_st.st_mode);
+
+    // If a method fails, the file offsets still say how far we got, so the next one
+    // simply carries on. Real I/O errors will show up again in the last one.
+    if (in_file && out_file) {
+        while ((n = copy_file_range(in, NULL, out, NULL, SH_COPY_CHUNK, 0)) > 0);
+        if (n == 0) {
+            return 0;
+        }
+    }
+
+    if (in_pipe || out_pipe) {
+        while ((n = splice(in, NULL, out, NULL, SH_COPY_CHUNK, SPLICE_F_MORE | SPLICE_F_MOVE)) > 0);
+        if (n == 0) {
+            return 0;
+        }
+    }
+
+    if (in_file) {
+        while ((n = sendfile(out, in, NULL, SH_COPY_CHUNK)) > 0);
+        if (n == 0) {
+            return 0;
+        }
+    }
+
+    // The kernel couldn't do it for us: copy through user space.
+    while ((n = read(in, buffer, sizeof(buffer))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        for (written = 0; written < n; written += w) {
+            w = write(out, buffer + written, n - written);
+            if (w < 0) {
+                if (errno == EINTR) {
+                    w = 0;
+                    continue;
+                }
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Builtin command: copy files (or stdin) to stdout.
+ *
+ * As a builtin, "cat file | cmd" moves the file into the pipe with sh_copy_fd() instead
+ * of starting a program that copies it through its own buffers. Options aren't handled
+ * here; with any option, the real cat is run instead.
+ *
+ * @param args List of args. args[0] is "cat". The rest are files, "-" meaning stdin.
+ * @return Always returns 1, to continue executing.
+ */
+int sh_cat(char **args) {
+    int i, fd;
+
+    for (i = 1; args[i] != NULL; i++) {
+        if (args[i][0] == '-' && args[i][1] != '\0') {
+            return sh_launch(args);
+        }
+    }
+
+    // Our own buffered output must come first.
+    fflush(stdout);
+
+    if (args[1] == NULL) {
+        if (sh_copy_fd(STDIN_FILENO, STDOUT_FILENO) < 0) {
+            perror("sh: cat");
+            sh_last_status = 1;
+        }
+        return 1;
+    }
+
+    for (i = 1; args[i] != NULL; i++) {
+        if (strcmp(args[i], "-") == 0) {
+            fd = STDIN_FILENO;
+        } else if ((fd = open(args[i], O_RDONLY | O_CLOEXEC)) < 0) {
+            fprintf(stderr, "sh: cat: %s: %s\n", args[i], strerror(errno));
+            sh_last_status = 1;
+            continue;
+        }
+        if (sh_copy_fd(fd, STDOUT_FILENO) < 0) {
+            fprintf(stderr, "sh: cat: %s: %s\n", args[i], strerror(errno));
+            sh_last_status = 1;
+        }
+        if (fd != STDIN_FILENO) {
+            close(fd);
+        }
+    }
+    return 1;
+}
+
+
+/*
+ * Shell execution
+ *
+ * The last step is to implement "sh_execute()", the function that will either launch
+ * a builtin, or a process.
+ */
+
+/**
+ * @brief Execute shell built-in or launch program.
+ * @param args Null terminated list of arguments.
+ * @return 1 if the shell should continue running, 0 if it should terminate.
+ */
+int sh_execute(char **args) {
+    const struct sh_builtin *builtin;
+    long long start;
+    int status;
+
+    if (args[0] == NULL) {
+        // An empty command was entered.
+        return 1;
+    }
+
+    builtin = sh_builtin_lookup(args[0]);
+    if (builtin != NULL) {
+        if (!(builtin->flags & SH_BUILTIN_STATUS)) {
+            sh_last_status = 0;
+        }
+        if (sh_trace_fd >= 0) {
+            start = sh_now();
+            status = builtin->func(args);
+            sh_trace_command("builtin", args, NULL, getpid(), 0, sh_now() - start);
+            return status;
+        }
+        return builtin->func(args);
+    }
+
+    return sh_launch(args);
+}
+
+
+/*
+ * Memory arenas
+ *
+ * Parsing a line makes lots of small allocations (words, argument arrays, ...) that all
+ * die together once the line has been executed. Rather than calling "malloc()" and
+ * "free()" for each of them, we hand them out from an arena: a big block of memory with
+ * a pointer that is bumped forward on every allocation. Freeing everything at once is
+ * just resetting the pointer. When a block runs out, a new one twice the size is chained
+ * in front, and a reset keeps only that biggest block, so a shell that has seen a long
+ * line once doesn't keep asking for memory afterwards.
+ */
+
+#define SH_ARENA_BLOCK_SIZE 65536
+
+struct sh_arena_block {
+    struct sh_arena_block *next;
+    size_t size;
+    size_t used;
+    char data[];
+};
+
+struct sh_arena {
+    struct sh_arena_block *head;
+};
+
+/**
+ * @brief Allocate memory from an arena.
+ * @param arena The arena.
+ * @param size Number of bytes.
+ * @return The memory, aligned for any pointer or integer type.
+ */
+void *sh_arena_alloc(struct sh_arena *arena, size_t size) {
+    struct sh_arena_block *block = arena->head;
+    size_t block_size;
+    void *p;
+
+    size = (size + 7) & ~(size_t) 7;
+    if (block == NULL || block->size - block->used < size) {
+        block_size = block ? block->size * 2 : SH_ARENA_BLOCK_SIZE;
+        while (block_size < size) {
+            block_size *= 2;
+        }
+        block = malloc(sizeof(struct sh_arena_block) + block_size);
+        if (!block) {
+            fprintf(stderr, "sh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        block->next = arena->head;
+        block->size = block_size;
+        block->used = 0;
+        arena->head = block;
+    }
+
+    p = block->data + block->used;
+    block->used += size;
+    return p;
+}
+
+/**
+ * @brief Copy a string into an arena.
+ * @param arena The arena.
+ * @param s The string.
+ * @param len Length of the string.
+ * @return The null terminated copy.
+ */
+char *sh_arena_strndup(struct sh_arena *arena, const char *s, size_t len) {
+    char *copy = sh_arena_alloc(arena, len + 1);
+
+    memcpy(copy, s, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+/**
+ * @brief Free everything allocated from an arena, keeping its biggest block for reuse.
+ * @param arena The arena.
+ */
+void sh_arena_reset(struct sh_arena *arena) {
+    struct sh_arena_block *block, *next;
+
+    if (arena->head == NULL) {
+        return;
+    }
+    for (block = arena->head->next; block != NULL; block = next) {
+        next = block->next;
+        free(block);
+    }
+    arena->head->next = NULL;
+    arena->head->used = 0;
+}
+
+struct sh_arena_mark {
+    struct sh_arena_block *block;
+    size_t used;
+};
+
+/**
+ * @brief Remember how much of an arena is in use.
+ * @param arena The arena.
+ * @return A mark to pass to sh_arena_release().
+ */
+struct sh_arena_mark sh_arena_get_mark(struct sh_arena *arena) {
+    struct sh_arena_mark mark;
+
+    mark.block = arena->head;
+    mark.used = arena->head ? arena->head->used : 0;
+    return mark;
+}
+
+/**
+ * @brief Free everything allocated from an arena since a mark was taken.
+ * @param arena The arena.
+ * @param mark The mark.
+ */
+void sh_arena_release(struct sh_arena *arena, struct sh_arena_mark mark) {
+    struct sh_arena_block *block;
+
+    if (mark.block == NULL) {
+        sh_arena_reset(arena);
+        return;
+    }
+    while (arena->head != mark.block) {
+        block = arena->head;
+        arena->head = block->next;
+        free(block);
+    }
+    arena->head->used = mark.used;
+}
+
+/**
+ * @brief Move the blocks of one arena into another, so what was allocated from the first
+ *        lives as long as what is allocated from the second.
+ * @param arena The arena that takes the blocks.
+ * @param from The arena that gives them up. It is left empty.
+ */
+void sh_arena_adopt(struct sh_arena *arena, struct sh_arena *from) {
+    struct sh_arena_block *last;
+
+    if (from->head == NULL) {
+        return;
+    }
+    for (last = from->head; last->next != NULL; last = last->next);
+    last->next = arena->head;
+    arena->head = from->head;
+    from->head = NULL;
+}
+
+/**
+ * @brief Free an arena and all of its blocks.
+ * @param arena The arena.
+ */
+void sh_arena_free(struct sh_arena *arena) {
+    sh_arena_reset(arena);
+    free(arena->head);
+    arena->head = NULL;
+}
+
+
+/*
+ * Growable strings
+ *
+ * Building a word of unknown length (for example while removing quotes) needs a buffer
+ * that can grow. "struct sh_strbuf" is that buffer. It is usually kept around and
+ * reused, so after warming up it doesn't allocate at all.
+ */
+
+struct sh_strbuf {
+    char *data;
+    size_t len;
+    size_t size;
+};
+
+/**
+ * @brief Make sure a string buffer has room for more bytes.
+ * @param buf The buffer.
+ * @param extra Number of bytes that will be appended.
+ */
+void sh_strbuf_reserve(struct sh_strbuf *buf, size_t extra) {
+    if (buf->len + extra + 1 <= buf->size) {
+        return;
+    }
+    if (buf->size == 0) {
+        buf->size = 256;
+    }
+    while (buf->len + extra + 1 > buf->size) {
+        buf->size *= 2;
+    }
+    buf->data = realloc(buf->data, buf->size);
+    if (!buf->data) {
+        fprintf(stderr, "sh: reallocation error\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * @brief Append bytes to a string buffer.
+ * @param buf The buffer.
+ * @param s The bytes.
+ * @param len Number of bytes.
+ */
+void sh_strbuf_append(struct sh_strbuf *buf, const char *s, size_t len) {
+    sh_strbuf_reserve(buf, len);
+    memcpy(buf->data + buf->len, s, len);
+    buf->len += len;
+    buf->data[buf->len] = '\0';
+}
+
+/**
+ * @brief Append one character to a string buffer.
+ * @param buf The buffer.
+ * @param c The character.
+ */
+void sh_strbuf_putc(struct sh_strbuf *buf, char c) {
+    sh_strbuf_reserve(buf, 1);
+    buf->data[buf->len++] = c;
+    buf->data[buf->len] = '\0';
+}
+
+// What "echo -e" turns a backslash and a letter into.
+const char sh_echo_escapes[256] = {
+        ['\\'] = '\\',
+        ['a'] = '\a',
+        ['b'] = '\b',
+        ['e'] = '\033',
+        ['f'] = '\f',
+        ['n'] = '\n',
+        ['r'] = '\r',
+        ['t'] = '\t',
+        ['v'] = '\v',
+};
+
+/**
+ * @brief Format the arguments of "echo", the way GNU echo does: "-n" leaves out the
+ *        newline, "-e" turns backslash escapes on and "-E" turns them off again.
+ * @param buf Where to append the text.
+ * @param args List of args. args[0] is "echo".
+ */
+void sh_echo_append(struct sh_strbuf *buf, char **args) {
+    const char *p;
+    int newline = 1, escape = 0, i, n, digits;
+    unsigned char c;
+
+    for (i = 1; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+        if (args[i][strspn(args[i] + 1, "neE") + 1] != '\0') {
+            break;
+        }
+        for (p = args[i] + 1; *p != '\0'; p++) {
+            if (*p == 'n') {
+                newline = 0;
+            } else {
+                escape = *p == 'e';
+            }
+        }
+    }
+
+    for (; args[i] != NULL; i++) {
+        if (!escape || strchr(args[i], '\\') == NULL) {
+            sh_strbuf_append(buf, args[i], strlen(args[i]));
+        } else {
+            for (p = args[i]; *p != '\0'; p++) {
+                if (*p != '\\' || p[1] == '\0') {
+                    sh_strbuf_putc(buf, *p);
+                    continue;
+                }
+                c = (unsigned char) *++p;
+                if (c == 'c') {
+                    return;
+                } else if (c == '0') {
+                    // "\0NNN": up to three octal digits.
+                    for (n = 0, digits = 0; digits < 3 && p[1] >= '0' && p[1] <= '7'; digits++) {
+                        n = n * 8 + *++p - '0';
+                    }
+                    sh_strbuf_putc(buf, (char) n);
+                } else if (sh_echo_escapes[c] != 0) {
+                    sh_strbuf_putc(buf, sh_echo_escapes[c]);
+                } else {
+                    sh_strbuf_putc(buf, '\\');
+                    sh_strbuf_putc(buf, (char) c);
+                }
+            }
+        }
+        if (args[i + 1] != NULL) {
+            sh_strbuf_putc(buf, ' ');
+        }
+    }
+    if (newline) {
+        sh_strbuf_putc(buf, '\n');
+    }
+}
+
+/**
+ * @brief Builtin command: echo.
+ * @param args List of args. args[0] is "echo".
+ * @return Always returns 1, to continue executing.
+ */
+int sh_echo(char **args) {
+    static struct sh_strbuf buf;
+
+    buf.len = 0;
+    sh_echo_append(&buf, args);
+    fwrite(buf.data, 1, buf.len, stdout);
+    sh_last_status = 0;
+    return 1;
+}
+
+
+/*
+ * Lexing the line
+ *
+ * The first version of this shell split lines on whitespace with "strtok()", so the
+ * command echo "this message" called echo with two arguments: "\"this" and "message\"".
+ * Real shells let you quote things, and they also have operators like "|", "&&" and ">"
+ * that separate commands from each other. So the first step of parsing is a lexer that
+ * turns a line into a list of tokens:
+ *   - Words. Quotes and backslashes protect spaces and operator characters inside a word:
+ *     'single quotes' protect everything, "double quotes" protect everything but "$",
+ *     "`" and "\", and a backslash protects the next character. A command substitution,
+ *     $(...) or `...`, is part of the word it is in, whatever it contains.
+ *   - Operators: | || & && ; ;; < > >> >| <> <& >& << <<- <<< ( )
+ *   - Newlines, which separate commands like ";" does. A command that goes on for several
+ *     lines (like a loop) is lexed again as a whole, with the lines joined by newlines.
+ *   - IO numbers: a word made of digits right before "<" or ">", as in "2>file".
+ * Everything after a "#" at the start of a word is a comment, up to the end of the line.
+ * A backslash at the end of a line joins it with the next one.
+ *
+ * The body of a here-document ("cat <<EOF") starts on the line after the "<<", and goes
+ * on up to a line that is just the delimiter word (without its quotes). It isn't made of
+ * tokens: when the lexer gets to the end of a line with here-documents on it, it skips
+ * over their bodies, and notes where each one is in a list of its own, in the order of
+ * the "<<" operators, which is the order the parser meets them in.
+ *
+ * The lexer makes a single pass over the line and never looks back. A word token is
+ * just a slice of the line; quote removal happens later, during word expansion, since
+ * what a "$" means depends on whether it was quoted. The token array is kept and reused
+ * from line to line.
+ */
+
+enum sh_token_type {
+    SH_TOKEN_WORD,
+    SH_TOKEN_IO_NUMBER,
+    SH_TOKEN_PIPE,       // |
+    SH_TOKEN_OR_IF,      // ||
+    SH_TOKEN_AMP,        // &
+    SH_TOKEN_AND_IF,     // &&
+    SH_TOKEN_SEMI,       // ;
+    SH_TOKEN_DSEMI,      // ;;
+    SH_TOKEN_LESS,       // <
+    SH_TOKEN_GREAT,      // >
+    SH_TOKEN_DGREAT,     // >>
+    SH_TOKEN_CLOBBER,    // >|
+    SH_TOKEN_LESSGREAT,  // <>
+    SH_TOKEN_LESSAND,    // <&
+    SH_TOKEN_GREATAND,   // >&
+    SH_TOKEN_DLESS,      // <<
+    SH_TOKEN_DLESSDASH,  // <<-
+    SH_TOKEN_TLESS,      // <<<
+    SH_TOKEN_LPAREN,     // (
+    SH_TOKEN_RPAREN,     // )
+    SH_TOKEN_NEWLINE,
+};
+
+// Flags of a word token, so that expansion can skip work the word doesn't need.
+#define SH_WORD_QUOTED  0x1
+#define SH_WORD_DOLLAR  0x2
+#define SH_WORD_HEREDOC 0x4   // the body of a here-document, where quotes are just characters
+#define SH_WORD_GLOB    0x8   // an unquoted "*", "?" or "[": may be a pathname pattern
+#define SH_WORD_TILDE   0x10  // an unquoted "~" at the start, or after "=" or ":": may be a home directory
+
+struct sh_token {
+    enum sh_token_type type;
+    int flags;
+    const char *text;
+    size_t len;
+};
+
+struct sh_heredoc {
+    size_t token;              // the delimiter word
+    int strip;                 // "<<-": tabs at the start of its lines are removed
+    const char *body;          // NULL until the lexer gets to the end of the line
+    size_t len;
+};
+
+struct sh_lexer {
+    struct sh_token *tokens;
+    size_t num_tokens;
+    size_t capacity;
+    struct sh_heredoc *heredocs;
+    size_t num_heredocs;
+    size_t heredocs_capacity;
+    const struct sh_heredoc *unfinished;   // the here-document the input ended in, if any
+};
+
+#define SH_LEX_OK          0
+#define SH_LEX_INCOMPLETE  1
+#define SH_LEX_ERROR      -1
+
+// Character classes for the lexer's inner loops.
+#define SH_CHAR_BLANK    0x1
+#define SH_CHAR_OPERATOR 0x2
+#define SH_CHAR_SPECIAL  0x4
+#define SH_CHAR_GLOB     0x8
+#define SH_CHAR_TILDE    0x10
+
+const unsigned char sh_char_class[256] = {
+        [' '] = SH_CHAR_BLANK,
+        ['\t'] = SH_CHAR_BLANK,
+        ['\r'] = SH_CHAR_BLANK,
+        ['\n'] = SH_CHAR_OPERATOR,
+        ['\a'] = SH_CHAR_BLANK,
+        ['|'] = SH_CHAR_OPERATOR,
+        ['&'] = SH_CHAR_OPERATOR,
+        [';'] = SH_CHAR_OPERATOR,
+        ['<'] = SH_CHAR_OPERATOR,
+        ['>'] = SH_CHAR_OPERATOR,
+        ['('] = SH_CHAR_OPERATOR,
+        [')'] = SH_CHAR_OPERATOR,
+        ['\\'] = SH_CHAR_SPECIAL,
+        ['\''] = SH_CHAR_SPECIAL,
+        ['"'] = SH_CHAR_SPECIAL,
+        ['$'] = SH_CHAR_SPECIAL,
+        ['`'] = SH_CHAR_SPECIAL,
+        ['*'] = SH_CHAR_GLOB,
+        ['?'] = SH_CHAR_GLOB,
+        ['['] = SH_CHAR_GLOB,
+        ['~'] = SH_CHAR_TILDE,
+};
+
+/**
+ * @brief Append a token to the lexer's token list.
+ * @param lexer The lexer.
+ * @param type Type of the token.
+ * @param text Start of the token in the line.
+ * @param len Length of the token.
+ * @param flags Word flags.
+ */
+void sh_lex_push(struct sh_lexer *lexer, enum sh_token_type type, const char *text, size_t len, int flags) {
+    struct sh_token *token;
+
+    if (lexer->num_tokens >= lexer->capacity) {
+        lexer->capacity = lexer->capacity ? lexer->capacity * 2 : 64;
+        lexer->tokens = realloc(lexer->tokens, lexer->capacity * sizeof(struct sh_token));
+        if (!lexer->tokens) {
+            fprintf(stderr, "sh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    token = &lexer->tokens[lexer->num_tokens++];
+    token->type = type;
+    token->flags = flags;
+    token->text = text;
+    token->len = len;
+}
+
+/**
+ * @brief Lex an operator.
+ * @param p Start of the operator.
+ * @param end End of the line.
+ * @param len Set to the length of the operator.
+ * @return The operator's token type.
+ */
+enum sh_token_type sh_lex_operator(const char *p, const char *end, size_t *len) {
+    char next = p + 1 < end ? p[1] : '\0';
+
+    *len = 2;
+    switch (*p) {
+        case '|':
+            if (next == '|') return SH_TOKEN_OR_IF;
+            *len = 1;
+            return SH_TOKEN_PIPE;
+        case '&':
+            if (next == '&') return SH_TOKEN_AND_IF;
+            *len = 1;
+            return SH_TOKEN_AMP;
+        case ';':
+            if (next == ';') return SH_TOKEN_DSEMI;
+            *len = 1;
+            return SH_TOKEN_SEMI;
+        case '>':
+            if (next == '>') return SH_TOKEN_DGREAT;
+            if (next == '|') return SH_TOKEN_CLOBBER;
+            if (next == '&') return SH_TOKEN_GREATAND;
+            *len = 1;
+            return SH_TOKEN_GREAT;
+        case '<':
+            if (next == '<') {
+                if (p + 2 < end && p[2] == '-') {
+                    *len = 3;
+                    return SH_TOKEN_DLESSDASH;
+                }
+                if (p + 2 < end && p[2] == '<') {
+                    *len = 3;
+                    return SH_TOKEN_TLESS;
+                }
+                return SH_TOKEN_DLESS;
+            }
+            if (next == '>') return SH_TOKEN_LESSGREAT;
+            if (next == '&') return SH_TOKEN_LESSAND;
+            *len = 1;
+            return SH_TOKEN_LESS;
+        case '(':
+            *len = 1;
+            return SH_TOKEN_LPAREN;
+        case '\n':
+            *len = 1;
+            return SH_TOKEN_NEWLINE;
+        default:
+            *len = 1;
+            return SH_TOKEN_RPAREN;
+    }
+}
+
+/**
+ * @brief Find the brace that ends a "${...}" parameter expansion.
+ * @param p The opening brace.
+ * @param end End of the line.
+ * @param in_double Whether the expansion is inside double quotes (where single quotes
+ *                  are just characters).
+ * @return The closing brace, or NULL if the line ends first.
+ */
+const char *sh_lex_brace_end(const char *p, const char *end, int in_double) {
+    const char *q;
+    int depth = 1;
+
+    for (p++; p < end; p++) {
+        switch (*p) {
+            case '}':
+                if (--depth == 0) {
+                    return p;
+                }
+                break;
+            case '{':
+                if (p[-1] == '$') {
+                    depth++;
+                }
+                break;
+            case '\\':
+                p++;
+                break;
+            case '\'':
+                if (!in_double) {
+                    if ((q = memchr(p + 1, '\'', end - p - 1)) == NULL) {
+                        return NULL;
+                    }
+                    p = q;
+                }
+                break;
+            case '"':
+                for (p++; p < end && *p != '"'; p++) {
+                    if (*p == '\\') {
+                        p++;
+                    }
+                }
+                if (p >= end) {
+                    return NULL;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Find the end of a "$(...)" command substitution.
+ *
+ * Parentheses nest, and the ones in quotes don't count. (A "case" pattern with an
+ * unmatched ")" inside a substitution needs its optional "(" in front.)
+ *
+ * @param p The opening parenthesis.
+ * @param end End of the line.
+ * @return The closing parenthesis, or NULL if the line ends first.
+ */
+const char *sh_lex_paren_end(const char *p, const char *end) {
+    const char *q;
+    int depth = 1;
+
+    for (p++; p < end; p++) {
+        switch (*p) {
+            case '(':
+                depth++;
+                break;
+            case ')':
+                if (--depth == 0) {
+                    return p;
+                }
+                break;
+            case '\\':
+                p++;
+                break;
+            case '\'':
+                if ((q = memchr(p + 1, '\'', end - p - 1)) == NULL) {
+                    return NULL;
+                }
+                p = q;
+                break;
+            case '"':
+            case '`':
+                for (q = p++; p < end && *p != *q; p++) {
+                    if (*p == '\\') {
+                        p++;
+                    }
+                }
+                if (p >= end) {
+                    return NULL;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Find the end of a "$((...))" arithmetic expansion.
+ * @param p The first of the opening parentheses.
+ * @param end End of the line.
+ * @return The last of the closing parentheses, or NULL if this isn't one after all but a
+ *         command substitution that starts with a subshell, like "$((cmd) | cmd)".
+ */
+const char *sh_lex_arith_end(const char *p, const char *end) {
+    const char *q = sh_lex_paren_end(p + 1, end);
+
+    return q != NULL && q + 1 < end && q[1] == ')' ? q + 1 : NULL;
+}
+
+/**
+ * @brief Find the end of a "`...`" command substitution.
+ * @param p The opening backquote.
+ * @param end End of the line.
+ * @return The closing backquote, or NULL if the line ends first.
+ */
+const char *sh_lex_backquote_end(const char *p, const char *end) {
+    for (p++; p < end; p++) {
+        if (*p == '\\') {
+            p++;
+        } else if (*p == '`') {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Note that the word just lexed is the delimiter of a here-document.
+ * @param lexer The lexer.
+ * @param strip Whether it is "<<-".
+ */
+void sh_lex_heredoc(struct sh_lexer *lexer, int strip) {
+    struct sh_heredoc *heredoc;
+
+    if (lexer->num_heredocs >= lexer->heredocs_capacity) {
+        lexer->heredocs_capacity = lexer->heredocs_capacity ? lexer->heredocs_capacity * 2 : 4;
+        lexer->heredocs = realloc(lexer->heredocs, lexer->heredocs_capacity * sizeof(struct sh_heredoc));
+        if (!lexer->heredocs) {
+            fprintf(stderr, "sh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    heredoc = &lexer->heredocs[lexer->num_heredocs++];
+    heredoc->token = lexer->num_tokens - 1;
+    heredoc->strip = strip;
+    heredoc->body = NULL;
+    heredoc->len = 0;
+}
+
+/**
+ * @brief Check whether a line is the delimiter of a here-document: the delimiter word,
+ *        with its quotes removed.
+ * @param delim The delimiter word.
+ * @param line The line, without its newline.
+ * @param len Length of the line.
+ * @return 1 if it is, 0 if not.
+ */
+int sh_lex_heredoc_end(const struct sh_token *delim, const char *line, size_t len) {
+    const char *p = delim->text, *end = delim->text + delim->len;
+    size_t i = 0;
+    char quote = 0;
+
+    for (; p < end; p++) {
+        if (quote == 0 && (*p == '\'' || *p == '"')) {
+            quote = *p;
+            continue;
+        }
+        if (*p == quote) {
+            quote = 0;
+            continue;
+        }
+        if (*p == '\\' && quote != '\'' && p + 1 < end && (quote == 0 || strchr("$`\"\\", p[1]) != NULL)) {
+            p++;
+        }
+        if (i >= len || line[i] != *p) {
+            return 0;
+        }
+        i++;
+    }
+    return i == len;
+}
+
+/**
+ * @brief Find the bodies of the here-documents whose "<<" is on the line that just ended.
+ * @param lexer The lexer.
+ * @param first The first of those here-documents.
+ * @param p Start of the next line.
+ * @param end End of the input.
+ * @return Where the line after the last body starts, or NULL if the input ends first.
+ */
+const char *sh_lex_heredoc_bodies(struct sh_lexer *lexer, size_t first, const char *p, const char *end) {
+    struct sh_heredoc *heredoc;
+    const char *line, *newline, *text;
+
+    for (heredoc = &lexer->heredocs[first]; heredoc < lexer->heredocs + lexer->num_heredocs; heredoc++) {
+        heredoc->body = p;
+        for (;;) {
+            line = p;
+            newline = memchr(p, '\n', end - p);
+            p = newline != NULL ? newline : end;
+            for (text = line; heredoc->strip && text < p && *text == '\t'; text++);
+            if (sh_lex_heredoc_end(&lexer->tokens[heredoc->token], text, p - text)) {
+                heredoc->len = line - heredoc->body;
+                break;
+            }
+            if (newline == NULL) {
+                lexer->unfinished = heredoc;
+                return NULL;
+            }
+            p++;
+        }
+        if (newline != NULL) {
+            p++;
+        }
+    }
+    return p;
+}
+
+/**
+ * @brief Split a line into tokens.
+ * @param lexer The lexer. Its token list and here-documents are replaced.
+ * @param line The line.
+ * @param len Length of the line.
+ * @return SH_LEX_OK, or SH_LEX_INCOMPLETE if a quote or backslash is left open, or a
+ *         here-document isn't finished.
+ */
+int sh_lex(struct sh_lexer *lexer, const char *line, size_t len) {
+    const char *p = line, *end = line + len, *start, *q;
+    size_t op_len, pending = 0;
+    int flags, digits;
+
+    lexer->num_tokens = 0;
+    lexer->num_heredocs = 0;
+    lexer->unfinished = NULL;
+
+    while (p < end) {
+        unsigned char cls = sh_char_class[(unsigned char) *p];
+
+        if (cls & SH_CHAR_BLANK) {
+            p++;
+            continue;
+        }
+        if (*p == '\\' && p + 1 < end && p[1] == '\n') {
+            p += 2;
+            continue;
+        }
+        if (*p == '#') {
+            if ((p = memchr(p, '\n', end - p)) == NULL) {
+                break;
+            }
+            continue;
+        }
+        if (cls & SH_CHAR_OPERATOR) {
+            enum sh_token_type type = sh_lex_operator(p, end, &op_len);
+            sh_lex_push(lexer, type, p, op_len, 0);
+            p += op_len;
+            if (type == SH_TOKEN_NEWLINE && pending < lexer->num_heredocs) {
+                if ((p = sh_lex_heredoc_bodies(lexer, pending, p, end)) == NULL) {
+                    return SH_LEX_INCOMPLETE;
+                }
+                pending = lexer->num_heredocs;
+            }
+            continue;
+        }
+
+        // A word: runs until an unquoted blank or operator character.
+        start = p;
+        flags = 0;
+        digits = 1;
+        while (p < end) {
+            cls = sh_char_class[(unsigned char) *p];
+            if (cls == 0) {
+                if (*p < '0' || *p > '9') {
+                    digits = 0;
+                }
+                p++;
+                continue;
+            }
+            if (cls & (SH_CHAR_BLANK | SH_CHAR_OPERATOR)) {
+                break;
+            }
+            digits = 0;
+            if (cls & SH_CHAR_GLOB) {
+                flags |= SH_WORD_GLOB;
+                p++;
+                continue;
+            }
+            if (cls & SH_CHAR_TILDE) {
+                // Whether it really starts a tilde prefix is up to the expansion.
+                if (p == start || p[-1] == '=' || p[-1] == ':') {
+                    flags |= SH_WORD_TILDE;
+                }
+                p++;
+                continue;
+            }
+            switch (*p) {
+                case '\\':
+                    flags |= SH_WORD_QUOTED;
+                    if (p + 1 >= end) {
+                        return SH_LEX_INCOMPLETE;
+                    }
+                    p += 2;
+                    break;
+                case '\'':
+                    flags |= SH_WORD_QUOTED;
+                    q = memchr(p + 1, '\'', end - p - 1);
+                    if (q == NULL) {
+                        return SH_LEX_INCOMPLETE;
+                    }
+                    p = q + 1;
+                    break;
+                case '"':
+                    flags |= SH_WORD_QUOTED;
+                    for (p++; p < end && *p != '"'; p++) {
+                        if (*p == '\\' && p + 1 < end) {
+                            p++;
+                        } else if (*p == '$') {
+                            flags |= SH_WORD_DOLLAR;
+                            if (p + 1 < end && p[1] == '{') {
+                                if ((q = sh_lex_brace_end(p + 1, end, 1)) == NULL) {
+                                    return SH_LEX_INCOMPLETE;
+                                }
+                                p = q;
+                            } else if (p + 1 < end && p[1] == '(') {
+                                if ((q = sh_lex_paren_end(p + 1, end)) == NULL) {
+                                    return SH_LEX_INCOMPLETE;
+                                }
+                                p = q;
+                            }
+                        } else if (*p == '`') {
+                            flags |= SH_WORD_DOLLAR;
+                            if ((q = sh_lex_backquote_end(p, end)) == NULL) {
+                                return SH_LEX_INCOMPLETE;
+                            }
+                            p = q;
+                        }
+                    }
+                    if (p >= end) {
+                        return SH_LEX_INCOMPLETE;
+                    }
+                    p++;
+                    break;
+                case '`':
+                    flags |= SH_WORD_DOLLAR;
+                    if ((q = sh_lex_backquote_end(p, end)) == NULL) {
+                        return SH_LEX_INCOMPLETE;
+                    }
+                    p = q + 1;
+                    break;
+                default:
+                    flags |= SH_WORD_DOLLAR;
+                    p++;
+                    // "${NAME:-some words}" and "$(cmd | cmd)" are one word, blanks and all.
+                    if (p < end && *p == '{') {
+                        if ((q = sh_lex_brace_end(p, end, 0)) == NULL) {
+                            return SH_LEX_INCOMPLETE;
+                        }
+                        p = q + 1;
+                    } else if (p < end && *p == '(') {
+                        if ((q = sh_lex_paren_end(p, end)) == NULL) {
+                            return SH_LEX_INCOMPLETE;
+                        }
+                        p = q + 1;
+                    }
+                    break;
+            }
+        }
+
+        if (digits && p < end && (*p == '<' || *p == '>')) {
+            sh_lex_push(lexer, SH_TOKEN_IO_NUMBER, start, p - start, 0);
+        } else {
+            sh_lex_push(lexer, SH_TOKEN_WORD, start, p - start, flags);
+            if (lexer->num_tokens >= 2 && (lexer->tokens[lexer->num_tokens - 2].type == SH_TOKEN_DLESS ||
+                                           lexer->tokens[lexer->num_tokens - 2].type == SH_TOKEN_DLESSDASH)) {
+                sh_lex_heredoc(lexer, lexer->tokens[lexer->num_tokens - 2].type == SH_TOKEN_DLESSDASH);
+            }
+        }
+    }
+
+    // The bodies of here-documents are still to come.
+    return pending < lexer->num_heredocs ? SH_LEX_INCOMPLETE : SH_LEX_OK;
+}
+
+
+/*
+ * How many compound commands are still open in a command that goes on over several lines.
+ * sh_loop() only parses the lines again once the count says the command may be complete,
+ * so it has to err on the low side: every unquoted "fi", "done", "esac" and "}" closes
+ * one, but only a word where a command starts ("if", "while", "until", "for", "case" or
+ * "{", and not a "case" pattern like "if)") opens one. Parentheses are counted apart,
+ * and a ")" with no "(" open (the end of a "case" pattern) doesn't count.
+ */
+struct sh_lex_depth {
+    int open;
+    int parens;
+    int command;               // the next word is where a command starts
+};
+
+/**
+ * @brief Check whether a word token is one of a list of unquoted words.
+ */
+int sh_lex_word_in(const struct sh_token *token, const char *const *words) {
+    if (token->type != SH_TOKEN_WORD || token->flags != 0) {
+        return 0;
+    }
+    for (; *words != NULL; words++) {
+        if (strlen(*words) == token->len && memcmp(*words, token->text, token->len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Count the compound commands that tokens open and close.
+ * @param depth The count so far, to add to. A line starts with depth->command set.
+ * @param tokens The tokens.
+ * @param n Number of tokens.
+ */
+void sh_lex_count_depth(struct sh_lex_depth *depth, const struct sh_token *tokens, size_t n) {
+    static const char *const openers[] = {"if", "while", "until", "for", "case", "{", NULL};
+    static const char *const closers[] = {"fi", "done", "esac", "}", NULL};
+    // Words after which another command starts.
+    static const char *const leaders[] = {"then", "do", "else", "elif", "if", "while", "until", "{", "!", NULL};
+    const struct sh_token *token;
+    size_t i;
+    int command;
+
+    for (i = 0; i < n; i++) {
+        token = &tokens[i];
+        command = depth->command;
+        depth->command = 0;
+        switch (token->type) {
+            case SH_TOKEN_WORD:
+                if (sh_lex_word_in(token, closers)) {
+                    depth->open--;
+                } else if (command && sh_lex_word_in(token, openers)
+                           && !(i + 1 < n && (tokens[i + 1].type == SH_TOKEN_RPAREN || tokens[i + 1].type == SH_TOKEN_PIPE))) {
+                    depth->open++;
+                }
+                depth->command = command && sh_lex_word_in(token, leaders);
+                break;
+            case SH_TOKEN_LPAREN:
+                depth->parens++;
+                depth->command = 1;
+                break;
+            case SH_TOKEN_RPAREN:
+                if (depth->parens > 0) {
+                    depth->parens--;
+                }
+                depth->command = 1;
+                break;
+            case SH_TOKEN_NEWLINE:
+            case SH_TOKEN_SEMI:
+            case SH_TOKEN_AMP:
+            case SH_TOKEN_PIPE:
+            case SH_TOKEN_AND_IF:
+            case SH_TOKEN_OR_IF:
+                depth->command = 1;
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+/*
+ * Positional parameters
+ *
+ * When the shell runs a script, "$0" is the name of the script and "$1", "$2", ... are
+ * the arguments that followed it.
+ */
+
+int sh_argc = 0;
+char **sh_argv = NULL;
+
+
+/*
+ * Variables
+ *
+ * Shell variables live in an open-addressing hash table, like the command locations do.
+ * An entry is small (the name, its hash, some flags and one pointer), so a probe run is
+ * a few neighbouring entries in one or two cache lines, and the stored hash means that a
+ * name is only compared when it is almost certainly the right one. The names are
+ * interned: each one is copied once into an arena, and keeps its slot for the life of
+ * the shell, even after "unset". So the table never has tombstones, and a name pointer
+ * stays valid for anyone who holds on to it.
+ *
+ * A value is stored as the string "NAME=value", because that is exactly what a child's
+ * environment is made of. The environment ("envp") is then just an array of pointers to
+ * the entries of the exported variables. These arrays are immutable, versioned snapshots:
+ * every change to an exported variable makes a new version, and a snapshot is only built
+ * when a program is about to be started and the last one is out of date. Otherwise every
+ * program gets the same array, so starting one costs nothing extra however large the
+ * environment is. Until something changes, the shell simply passes on the environment it
+ * was started with.
+ *
+ * Snapshots are reference counted, so that "VAR=value cmd" can hold on to the one from
+ * before its assignment. If the command changed nothing else, that snapshot is current
+ * again once the assignment is undone, and the next command reuses it instead of paying
+ * for another one. A subshell is a forked copy of the shell: it shares the snapshot and
+ * its strings with its parent through the kernel's copy-on-write pages, and only builds
+ * one of its own if it exports something.
+ */
+
+#define SH_VAR_INITIAL_SIZE 128
+
+#define SH_VAR_EXPORT 0x1
+
+struct sh_var {
+    const char *name;
+    unsigned int hash;
+    unsigned int name_len;
+    int flags;
+    char *entry;
+};
+
+struct sh_env {
+    int refs;
+    unsigned long version;
+    char *envp[];
+};
+
+struct sh_var_table {
+    struct sh_var *entries;
+    int size;
+    int count;
+    struct sh_arena names;
+    struct sh_env *env;
+    char **initial;            // "environ" as the shell started, for version 0
+    unsigned long version;
+    unsigned long last_version;
+};
+
+struct sh_var_table sh_vars;
+
+/**
+ * @brief Note that an exported variable changed, making a new version of the environment.
+ */
+void sh_env_changed(void) {
+    sh_vars.version = ++sh_vars.last_version;
+}
+
+/*
+ * The shell's own PID, for "$$". A subshell is a forked copy of the shell, and keeps it.
+ */
+pid_t sh_shell_pid;
+
+/**
+ * @brief Length of the variable name at the start of a string.
+ * @param s The string.
+ * @param len Length of the string.
+ * @return The number of characters that make up a name (0 if it doesn't start with one).
+ */
+size_t sh_var_name_len(const char *s, size_t len) {
+    size_t i = 0;
+
+    if (len == 0 || !(*s == '_' || (*s >= 'a' && *s <= 'z') || (*s >= 'A' && *s <= 'Z'))) {
+        return 0;
+    }
+    for (i = 1; i < len; i++) {
+        if (!(s[i] == '_' || (s[i] >= 'a' && s[i] <= 'z') || (s[i] >= 'A' && s[i] <= 'Z') ||
+              (s[i] >= '0' && s[i] <= '9'))) {
+            break;
+        }
+    }
+    return i;
+}
+
+/**
+ * @brief FNV-1a hash of a variable name.
+ * @param name The name (not necessarily null terminated).
+ * @param len Length of the name.
+ * @return The hash value.
+ */
+unsigned int sh_var_hash(const char *name, size_t len) {
+    unsigned long h = 14695981039346656037UL;
+
+    while (len-- > 0) {
+        h ^= (unsigned char) *name++;
+        h *= 1099511628211UL;
+    }
+    return (unsigned int) h;
+}
+
+/**
+ * @brief Find the slot for a name (open addressing with linear probing).
+ * @param name The name (not necessarily null terminated).
+ * @param len Length of the name.
+ * @param hash Hash of the name.
+ * @return The slot holding the name, or the empty slot where it belongs.
+ */
+struct sh_var *sh_var_slot(const char *name, size_t len, unsigned int hash) {
+    struct sh_var_table *t = &sh_vars;
+    unsigned int i = hash & (t->size - 1);
+    struct sh_var *var;
+
+    for (var = &t->entries[i]; var->name != NULL; var = &t->entries[i]) {
+        if (var->hash == hash && var->name_len == len && memcmp(var->name, name, len) == 0) {
+            break;
+        }
+        i = (i + 1) & (t->size - 1);
+    }
+    return var;
+}
+
+void sh_var_set(const char *name, size_t len, const char *value, int flags);
+
+/**
+ * @brief Create the table, and import the environment the shell was started with.
+ */
+void sh_var_init(void) {
+    struct sh_var_table *t = &sh_vars;
+    const char *eq;
+    char **env;
+
+    t->size = SH_VAR_INITIAL_SIZE;
+    t->entries = calloc(t->size, sizeof(struct sh_var));
+    if (!t->entries) {
+        fprintf(stderr, "sh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    sh_shell_pid = getpid();
+    t->initial = environ;
+
+    for (env = environ; *env != NULL; env++) {
+        eq = strchr(*env, '=');
+        if (eq != NULL && eq > *env) {
+            sh_var_set(*env, eq - *env, eq + 1, SH_VAR_EXPORT);
+        }
+    }
+    // "environ" says the same thing, so there's no need to build a snapshot yet.
+    t->version = 0;
+}
+
+/**
+ * @brief Find a variable's table entry, adding the name if it is new.
+ * @param name The name (not necessarily null terminated).
+ * @param len Length of the name.
+ * @return The entry. It stays where it is until the next call.
+ */
+struct sh_var *sh_var_intern(const char *name, size_t len) {
+    struct sh_var_table *t = &sh_vars;
+    unsigned int hash = sh_var_hash(name, len);
+    struct sh_var *var, *old;
+    int i, old_size;
+
+    if (t->entries == NULL) {
+        sh_var_init();
+    }
+
+    if ((t->count + 1) * 4 > t->size * 3) {
+        old = t->entries;
+        old_size = t->size;
+        t->size *= 2;
+        t->entries = calloc(t->size, sizeof(struct sh_var));
+        if (!t->entries) {
+            fprintf(stderr, "sh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        for (i = 0; i < old_size; i++) {
+            if (old[i].name != NULL) {
+                *sh_var_slot(old[i].name, old[i].name_len, old[i].hash) = old[i];
+            }
+        }
+        free(old);
+    }
+
+    var = sh_var_slot(name, len, hash);
+    if (var->name == NULL) {
+        var->name = sh_arena_strndup(&t->names, name, len);
+        var->hash = hash;
+        var->name_len = len;
+        t->count++;
+    }
+    return var;
+}
+
+/**
+ * @brief Look up a variable.
+ * @param name The name (not necessarily null terminated).
+ * @param len Length of the name.
+ * @return The value, or NULL if the variable is not set.
+ */
+const char *sh_var_lookup(const char *name, size_t len) {
+    struct sh_var *var;
+
+    if (sh_vars.entries == NULL) {
+        sh_var_init();
+    }
+    var = sh_var_slot(name, len, sh_var_hash(name, len));
+    return var->entry != NULL ? var->entry + len + 1 : NULL;
+}
+
+/**
+ * @brief Look up a variable by its null terminated name.
+ * @param name The name.
+ * @return The value, or NULL if the variable is not set.
+ */
+const char *sh_var_get(const char *name) {
+    return sh_var_lookup(name, strlen(name));
+}
+
+/**
+ * @brief Set a variable.
+ * @param name The name (not necessarily null terminated).
+ * @param len Length of the name.
+ * @param value The new value.
+ * @param flags Flags to add to the variable (SH_VAR_EXPORT).
+ */
+void sh_var_set(const char *name, size_t len, const char *value, int flags) {
+    struct sh_var *var = sh_var_intern(name, len);
+    size_t value_len = strlen(value);
+    char *entry = malloc(len + value_len + 2);
+
+    if (!entry) {
+        fprintf(stderr, "sh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(entry, var->name, len);
+    entry[len] = '=';
+    memcpy(entry + len + 1, value, value_len + 1);
+
+    // The old value may be what we are copying from, so it goes last.
+    free(var->entry);
+    var->entry = entry;
+    var->flags |= flags;
+    if (var->flags & SH_VAR_EXPORT) {
+        sh_env_changed();
+    }
+}
+
+/**
+ * @brief Mark a variable for export, whether or not it is set.
+ * @param name The name (not necessarily null terminated).
+ * @param len Length of the name.
+ */
+void sh_var_export(const char *name, size_t len) {
+    struct sh_var *var = sh_var_intern(name, len);
+
+    if (!(var->flags & SH_VAR_EXPORT) && var->entry != NULL) {
+        sh_env_changed();
+    }
+    var->flags |= SH_VAR_EXPORT;
+}
+
+/**
+ * @brief Unset a variable. Its name stays in the table.
+ * @param name The name (not necessarily null terminated).
+ * @param len Length of the name.
+ */
+void sh_var_unset(const char *name, size_t len) {
+    struct sh_var *var = sh_var_intern(name, len);
+
+    if ((var->flags & SH_VAR_EXPORT) && var->entry != NULL) {
+        sh_env_changed();
+    }
+    free(var->entry);
+    var->entry = NULL;
+    var->flags = 0;
+}
+
+/*
+ * A variable's value and flags, put aside while an assignment in front of a command
+ * ("VAR=value cmd") is in effect.
+ */
+struct sh_var_saved {
+    const char *name;
+    size_t len;
+    char *entry;
+    int flags;
+};
+
+/**
+ * @brief Put a variable's value aside, leaving it unset.
+ * @param name The name (not necessarily null terminated).
+ * @param len Length of the name.
+ * @param saved Where to keep the value.
+ */
+void sh_var_save(const char *name, size_t len, struct sh_var_saved *saved) {
+    struct sh_var *var = sh_var_intern(name, len);
+
+    if ((var->flags & SH_VAR_EXPORT) && var->entry != NULL) {
+        sh_env_changed();
+    }
+    saved->name = var->name;
+    saved->len = len;
+    saved->entry = var->entry;
+    saved->flags = var->flags;
+    var->entry = NULL;
+    var->flags = 0;
+}
+
+/**
+ * @brief Bring back a value put aside by sh_var_save().
+ * @param saved The saved value.
+ */
+void sh_var_restore(struct sh_var_saved *saved) {
+    struct sh_var *var = sh_var_intern(saved->name, saved->len);
+
+    if (((var->flags & SH_VAR_EXPORT) && var->entry != NULL) || (saved->flags & SH_VAR_EXPORT)) {
+        sh_env_changed();
+    }
+    free(var->entry);
+    var->entry = saved->entry;
+    var->flags = saved->flags;
+}
+
+/**
+ * @brief Drop a reference to an environment snapshot.
+ * @param env The snapshot, or NULL.
+ */
+void sh_env_release(struct sh_env *env) {
+    if (env != NULL && --env->refs == 0) {
+        free(env);
+    }
+}
+
+/**
+ * @brief Get the environment for a program the shell starts.
+ * @return A null terminated "NAME=value" array, valid until an exported variable changes.
+ */
+char **sh_env(void) {
+    struct sh_var_table *t = &sh_vars;
+    struct sh_env *env;
+    int i, n = 0;
+
+    if (t->entries == NULL) {
+        sh_var_init();
+    }
+    if (t->version == 0) {
+        // Not "environ" itself: spawning a program points that at the latest snapshot.
+        return t->initial;
+    }
+    if (t->env != NULL && t->env->version == t->version) {
+        return t->env->envp;
+    }
+
+    for (i = 0; i < t->size; i++) {
+        if ((t->entries[i].flags & SH_VAR_EXPORT) && t->entries[i].entry != NULL) {
+            n++;
+        }
+    }
+    env = malloc(sizeof(struct sh_env) + (n + 1) * sizeof(char *));
+    if (!env) {
+        fprintf(stderr, "sh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    env->refs = 1;
+    env->version = t->version;
+    n = 0;
+    for (i = 0; i < t->size; i++) {
+        if ((t->entries[i].flags & SH_VAR_EXPORT) && t->entries[i].entry != NULL) {
+            env->envp[n++] = t->entries[i].entry;
+        }
+    }
+    env->envp[n] = NULL;
+
+    sh_env_release(t->env);
+    t->env = env;
+    return env->envp;
+}
+
+/*
+ * The environment before the assignments in front of a command, and the last version
+ * the assignments themselves made (anything after that was the command's own doing).
+ */
+struct sh_env_mark {
+    struct sh_env *env;
+    unsigned long version;
+    unsigned long assigned;
+};
+
+/**
+ * @brief Remember the environment before assignments that only last for one command.
+ * @param mark Where to remember it.
+ */
+void sh_env_mark(struct sh_env_mark *mark) {
+    struct sh_var_table *t = &sh_vars;
+
+    mark->version = t->version;
+    mark->env = t->env != NULL && t->env->version == t->version ? t->env : NULL;
+    if (mark->env != NULL) {
+        mark->env->refs++;
+    }
+}
+
+/**
+ * @brief Go back to the environment of a mark, once the assignments have been undone.
+ * @param mark The mark.
+ * @param unchanged Whether nothing but the assignments changed the exported variables.
+ */
+void sh_env_return(struct sh_env_mark *mark, int unchanged) {
+    struct sh_var_table *t = &sh_vars;
+
+    if (unchanged) {
+        t->version = mark->version;
+        if (mark->env != NULL && t->env != mark->env) {
+            sh_env_release(t->env);
+            t->env = mark->env;
+            t->env->refs++;
+        }
+    }
+    sh_env_release(mark->env);
+}
+
+/**
+ * @brief Compare two variables by name, for qsort().
+ */
+int sh_var_compare(const void *a, const void *b) {
+    return strcmp((*(struct sh_var *const *) a)->name, (*(struct sh_var *const *) b)->name);
+}
+
+/**
+ * @brief Builtin command: export variables.
+ * @param args List of args. args[0] is "export". The rest are "NAME" or "NAME=value";
+ *             with none (or just "-p"), the exported variables are listed.
+ * @return Always returns 1, to continue executing.
+ */
+int sh_export(char **args) {
+    struct sh_var_table *t = &sh_vars;
+    struct sh_var **vars;
+    const char *eq, *p;
+    size_t len;
+    int i, n = 0;
+
+    if (t->entries == NULL) {
+        sh_var_init();
+    }
+    sh_last_status = 0;
+    i = args[1] != NULL && strcmp(args[1], "-p") == 0 ? 2 : 1;
+
+    if (args[i] == NULL) {
+        vars = malloc((t->count + 1) * sizeof(struct sh_var *));
+        if (!vars) {
+            fprintf(stderr, "sh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        for (i = 0; i < t->size; i++) {
+            if (t->entries[i].flags & SH_VAR_EXPORT) {
+                vars[n++] = &t->entries[i];
+            }
+        }
+        qsort(vars, n, sizeof(struct sh_var *), sh_var_compare);
+        for (i = 0; i < n; i++) {
+            printf("export %s", vars[i]->name);
+            if (vars[i]->entry != NULL) {
+                // Quote the value so that the output can be read back in.
+                putchar('=');
+                putchar('\'');
+                for (p = vars[i]->entry + vars[i]->name_len + 1; *p; p++) {
+                    if (*p == '\'') {
+                        fputs("'\\''", stdout);
+                    } else {
+                        putchar(*p);
+                    }
+                }
+                putchar('\'');
+            }
+            putchar('\n');
+        }
+        free(vars);
+        return 1;
+    }
+
+    for (; args[i] != NULL; i++) {
+        eq = strchr(args[i], '=');
+        len = eq != NULL ? (size_t) (eq - args[i]) : strlen(args[i]);
+        if (len == 0 || sh_var_name_len(args[i], len) != len) {
+            fprintf(stderr, "sh: export: %s: not a valid identifier\n", args[i]);
+            sh_last_status = 1;
+        } else if (eq != NULL) {
+            sh_var_set(args[i], len, eq + 1, SH_VAR_EXPORT);
+        } else {
+            sh_var_export(args[i], len);
+        }
+    }
+    return 1;
+}
+
+void sh_func_unset(const char *name, size_t len);
+
+/**
+ * @brief Builtin command: unset variables, or functions with "-f".
+ * @param args List of args. args[0] is "unset". The rest are names, after an optional
+ *             "-v" or "-f".
+ * @return Always returns 1, to continue executing.
+ */
+int sh_unset(char **args) {
+    int i = 1, functions = 0;
+    size_t len;
+
+    if (args[1] != NULL && (strcmp(args[1], "-v") == 0 || strcmp(args[1], "-f") == 0)) {
+        functions = args[1][1] == 'f';
+        i++;
+    }
+    sh_last_status = 0;
+    for (; args[i] != NULL; i++) {
+        len = strlen(args[i]);
+        if (len == 0 || sh_var_name_len(args[i], len) != len) {
+            fprintf(stderr, "sh: unset: %s: not a valid identifier\n", args[i]);
+            sh_last_status = 1;
+        } else if (functions) {
+            sh_func_unset(args[i], len);
+        } else {
+            sh_var_unset(args[i], len);
+        }
+    }
+    return 1;
+}
+
+
+/*
+ * Word expansion
+ *
+ * Before a word becomes an argument, its quotes are removed and the parameters in it
+ * (outside single quotes) are replaced with their values: "$1", "$NAME", "${NAME}",
+ * "${NAME:-default}" and friends, and the special parameters "$?", "$#", "$@", "$*", "$$"
+ * and "$!". An unquoted word that expands to nothing disappears altogether, as in other
+ * shells.
+ *
+ * The value of an unquoted parameter is split into fields on the characters of "$IFS"
+ * (blanks, by default), and "$@" in double quotes gives one field per positional
+ * parameter, so a word can turn into any number of arguments. That only happens to the
+ * words of a command: a redirection target or an assignment is always one word.
+ */
+
+struct sh_word {
+    const char *text;          // not necessarily null terminated, but text[len] is readable
+    size_t len;
+    int flags;
+};
+
+/*
+ * The fields a command's words expanded to.
+ */
+struct sh_fields {
+    char **words;
+    int count;
+    int size;
+};
+
+/*
+ * The state of one word's expansion. "started" says that the current field exists even
+ * if it is still empty, because it had quotes in it. A word that is used as a pattern
+ * (as in "case") keeps a backslash in front of each pattern character that was quoted,
+ * since only the unquoted ones match anything but themselves. So do the fields of a
+ * command that may be pathname patterns: "magic" says the current field has an unquoted
+ * "*", "?" or "[", and "escaped" that a backslash was added to it.
+ */
+struct sh_expansion {
+    struct sh_arena *arena;
+    struct sh_strbuf *buf;
+    struct sh_fields *fields;
+    const char *ifs;
+    int started;
+    int pattern;
+    int glob;                  // fields with pattern characters become pathnames
+    int magic;
+    int escaped;
+    int assignment;            // the value of an assignment: a "~" after ":" expands too
+};
+
+char *sh_expand_word(struct sh_arena *arena, const struct sh_word *token, struct sh_strbuf *buf);
+int sh_glob(struct sh_arena *arena, const char *pattern, size_t len, struct sh_fields *fields);
+
+/**
+ * @brief Add a field to a list.
+ * @param fields The list.
+ * @param word The field.
+ */
+void sh_fields_push(struct sh_fields *fields, char *word) {
+    if (fields->count == fields->size) {
+        fields->size = fields->size ? fields->size * 2 : 16;
+        fields->words = realloc(fields->words, fields->size * sizeof(char *));
+        if (!fields->words) {
+            fprintf(stderr, "sh: reallocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    fields->words[fields->count++] = word;
+}
+
+/**
+ * @brief Finish the current field and start a new one.
+ * @param e The expansion.
+ */
+void sh_expand_field_end(struct sh_expansion *e) {
+    char *word, *from, *to;
+
+    if (!e->magic || sh_glob(e->arena, e->buf->data, e->buf->len, e->fields) == 0) {
+        // Not a pattern, or one that matches nothing: the field stays, without escapes.
+        word = sh_arena_strndup(e->arena, e->buf->data, e->buf->len);
+        if (e->escaped) {
+            for (from = to = word; *from != '\0'; from++) {
+                if (*from == '\\' && from[1] != '\0') {
+                    from++;
+                }
+                *to++ = *from;
+            }
+            *to = '\0';
+        }
+        sh_fields_push(e->fields, word);
+    }
+    e->buf->len = 0;
+    e->started = 0;
+    e->magic = 0;
+    e->escaped = 0;
+}
+
+/**
+ * @brief Add quoted characters to the word.
+ * @param e The expansion.
+ * @param s The characters.
+ * @param len Number of characters.
+ */
+void sh_expand_quoted(struct sh_expansion *e, const char *s, size_t len) {
+    const char *end = s + len, *run;
+
+    if (!e->pattern) {
+        sh_strbuf_append(e->buf, s, len);
+        return;
+    }
+    while (s < end) {
+        for (run = s; s < end && *s != '*' && *s != '?' && *s != '[' && *s != ']' && *s != '\\'; s++);
+        sh_strbuf_append(e->buf, run, s - run);
+        if (s < end) {
+            sh_strbuf_putc(e->buf, '\\');
+            sh_strbuf_putc(e->buf, *s++);
+            e->escaped = 1;
+        }
+    }
+}
+
+/**
+ * @brief Add a parameter's value to the word, splitting it into fields unless quoted.
+ * @param e The expansion.
+ * @param value The value.
+ * @param len Length of the value.
+ * @param quoted Whether the parameter was in double quotes.
+ */
+void sh_expand_value(struct sh_expansion *e, const char *value, size_t len, int quoted) {
+    const char *end = value + len;
+    int blank_ended = 0;       // the last field ended at a blank
+
+    if (quoted) {
+        sh_expand_quoted(e, value, len);
+        return;
+    }
+    if (e->fields == NULL) {
+        sh_strbuf_append(e->buf, value, len);
+        return;
+    }
+    if (e->ifs == NULL) {
+        e->ifs = sh_var_get("IFS");
+        if (e->ifs == NULL) {
+            e->ifs = " \t\n";
+        }
+    }
+
+    sh_strbuf_reserve(e->buf, len);
+    for (; value < end; value++) {
+        if (*value == '\0' || strchr(e->ifs, *value) == NULL) {
+            if (e->glob && (*value == '*' || *value == '?' || *value == '[')) {
+                e->magic = 1;
+            } else if (e->glob && *value == '\\') {
+                // A backslash that came from a value is just a character.
+                sh_strbuf_putc(e->buf, '\\');
+                e->escaped = 1;
+            }
+            sh_strbuf_putc(e->buf, *value);
+            blank_ended = 0;
+        } else if (*value != ' ' && *value != '\t' && *value != '\n') {
+            // Other separators delimit a field each, even an empty one: "a::b" is 3 fields.
+            // Blanks around one are part of it: "a : b" is 2.
+            if (!blank_ended) {
+                sh_expand_field_end(e);
+            }
+            blank_ended = 0;
+        } else if (e->buf->len > 0 || e->started) {
+            sh_expand_field_end(e);
+            blank_ended = 1;
+        }
+    }
+}
+
+/**
+ * @brief Expand "$@" or "$*".
+ * @param e The expansion.
+ * @param star Whether it is "$*".
+ * @param quoted Whether it is in double quotes.
+ */
+void sh_expand_positional(struct sh_expansion *e, int star, int quoted) {
+    const char *ifs;
+    int i;
+
+    for (i = 1; i < sh_argc; i++) {
+        if (i > 1) {
+            if (quoted && !star && e->fields != NULL) {
+                // "$@" keeps each parameter a separate field, even an empty one.
+                sh_expand_field_end(e);
+                e->started = 1;
+            } else if (quoted || e->fields == NULL) {
+                ifs = sh_var_get("IFS");
+                if (ifs == NULL) {
+                    sh_strbuf_putc(e->buf, ' ');
+                } else if (*ifs != '\0') {
+                    sh_strbuf_putc(e->buf, *ifs);
+                }
+            } else if (e->buf->len > 0 || e->started) {
+                sh_expand_field_end(e);
+            }
+        }
+        sh_expand_value(e, sh_argv[i], strlen(sh_argv[i]), quoted);
+    }
+}
+
+/**
+ * @brief Get the value of a parameter other than "$@" and "$*".
+ * @param name The name: a variable name, a number, or one of "?", "#", "$", "!".
+ * @param len Length of the name.
+ * @param num Room to format a numeric value in.
+ * @return The value, or NULL if the parameter is not set.
+ */
+const char *sh_param_value(const char *name, size_t len, char num[32]) {
+    long n;
+
+    if (*name >= '0' && *name <= '9') {
+        n = strtol(name, NULL, 10);
+        return n < sh_argc ? sh_argv[n] : NULL;
+    }
+    if (len > 1 || sh_var_name_len(name, len) == 1) {
+        return sh_var_lookup(name, len);
+    }
+    switch (*name) {
+        case '?':
+            n = sh_last_status;
+            break;
+        case '#':
+            n = sh_argc > 0 ? sh_argc - 1 : 0;
+            break;
+        case '$':
+            n = sh_shell_pid ? sh_shell_pid : getpid();
+            break;
+        case '!':
+            if (sh_last_bg_pid == 0) {
+                return NULL;
+            }
+            n = sh_last_bg_pid;
+            break;
+        default:
+            return NULL;
+    }
+    snprintf(num, 32, "%ld", n);
+    return num;
+}
+
+/**
+ * @brief Expand one parameter: "$NAME", "$1", "$?", "${NAME:-word}", and so on.
+ * @param e The expansion.
+ * @param p Just after the dollar sign.
+ * @param end End of the word.
+ * @param quoted Whether the parameter is in double quotes.
+ * @return Where the parameter ends.
+ */
+const char *sh_expand_param(struct sh_expansion *e, const char *p, const char *end, int quoted) {
+    const char *name = p, *inner, *close, *value, *word_text = NULL;
+    struct sh_strbuf word_buf = {0};
+    size_t len, word_len = 0;
+    int colon = 0, length = 0, unset;
+    char num[32], op = 0;
+
+    if (p < end && *p != '{') {
+        len = sh_var_name_len(p, end - p);
+        if (len == 0 && (*p == '@' || *p == '*')) {
+            sh_expand_positional(e, *p == '*', quoted);
+            return p + 1;
+        }
+        if (len == 0 && ((*p >= '0' && *p <= '9') || strchr("?#$!", *p) != NULL)) {
+            len = 1;
+        }
+        if (len == 0) {
+            // Not a parameter, just a dollar sign.
+            sh_strbuf_putc(e->buf, '$');
+            return p;
+        }
+        value = sh_param_value(p, len, num);
+        if (value != NULL) {
+            sh_expand_value(e, value, strlen(value), quoted);
+        }
+        return p + len;
+    }
+    if (p >= end) {
+        sh_strbuf_putc(e->buf, '$');
+        return p;
+    }
+
+    // "${...}": the lexer made sure the closing brace is there.
+    close = sh_lex_brace_end(p, end, quoted);
+    inner = name = ++p;
+    if (*name == '#' && name + 1 < close) {
+        length = 1;
+        name++;
+    }
+    len = sh_var_name_len(name, close - name);
+    if (len == 0 && name < close) {
+        if (*name >= '0' && *name <= '9') {
+            for (len = 1; name + len < close && name[len] >= '0' && name[len] <= '9'; len++) {}
+        } else if (strchr("?#$!@*", *name) != NULL) {
+            len = 1;
+        }
+    }
+    p = name + len;
+    if (p < close && *p == ':') {
+        colon = 1;
+        p++;
+    }
+    if (p < close && strchr("-=+", *p) != NULL) {
+        op = *p++;
+        word_text = p;
+        word_len = close - p;
+    }
+    if (len == 0 || (op == 0 && p != close) || (length && op != 0) ||
+        (op == '=' && sh_var_name_len(name, len) != len)) {
+        fprintf(stderr, "sh: ${%.*s}: bad substitution\n", (int) (close - inner), inner);
+        sh_expand_failed = 1;
+        return close + 1;
+    }
+
+    if (!length && op == 0 && (*name == '@' || *name == '*')) {
+        sh_expand_positional(e, *name == '*', quoted);
+        return close + 1;
+    }
+    value = *name == '@' || *name == '*' ? (sh_argc > 1 ? sh_argv[1] : NULL) : sh_param_value(name, len, num);
+    if (length) {
+        snprintf(num, sizeof(num), "%zu", value != NULL ? strlen(value) : 0);
+        sh_expand_value(e, num, strlen(num), quoted);
+        return close + 1;
+    }
+
+    unset = value == NULL || (colon && *value == '\0');
+    if ((op == '-' || op == '=') && unset) {
+        struct sh_word word = {word_text, word_len, SH_WORD_QUOTED | SH_WORD_DOLLAR};
+        value = sh_expand_word(e->arena, &word, &word_buf);
+        if (value == NULL) {
+            value = "";
+        }
+        if (op == '=') {
+            sh_var_set(name, len, value, 0);
+        }
+    } else if (op == '+') {
+        struct sh_word word = {word_text, word_len, SH_WORD_QUOTED | SH_WORD_DOLLAR};
+        value = unset ? NULL : sh_expand_word(e->arena, &word, &word_buf);
+    }
+    free(word_buf.data);
+    if (value != NULL) {
+        sh_expand_value(e, value, strlen(value), quoted);
+    }
+    return close + 1;
+}
+
+const char *sh_command_subst(const char *text, size_t len, size_t *out_len);
+
+/**
+ * @brief Expand a "$(...)" command substitution: the output of the command, without the
+ *        newlines at its end.
+ * @param e The expansion.
+ * @param p The opening parenthesis.
+ * @param end End of the word.
+ * @param quoted Whether it is inside double quotes.
+ * @return Where the word goes on after it.
+ */
+const char *sh_expand_command(struct sh_expansion *e, const char *p, const char *end, int quoted) {
+    const char *close = sh_lex_paren_end(p, end), *out;
+    size_t len;
+
+    if (close == NULL) {
+        close = end;
+    }
+    out = sh_command_subst(p + 1, close - p - 1, &len);
+    while (len > 0 && out[len - 1] == '\n') {
+        len--;
+    }
+    sh_expand_value(e, out, len, quoted);
+    return close < end ? close + 1 : end;
+}
+
+/**
+ * @brief Expand a "`...`" command substitution, the old form of "$(...)". In there, a
+ *        backslash only escapes "$", "`", another backslash, and '"' in double quotes.
+ * @param e The expansion.
+ * @param p The opening backquote.
+ * @param end End of the word.
+ * @param quoted Whether it is inside double quotes.
+ * @return Where the word goes on after it.
+ */
+const char *sh_expand_backquote(struct sh_expansion *e, const char *p, const char *end, int quoted) {
+    const char *close = sh_lex_backquote_end(p, end), *out;
+    char *text;
+    size_t len = 0;
+
+    if (close == NULL) {
+        close = end;
+    }
+    text = sh_arena_alloc(e->arena, close - p);
+    for (p++; p < close; p++) {
+        if (*p == '\\' && p + 1 < close && (strchr("$`\\", p[1]) != NULL || (quoted && p[1] == '"'))) {
+            p++;
+        }
+        text[len++] = *p;
+    }
+    out = sh_command_subst(text, len, &len);
+    while (len > 0 && out[len - 1] == '\n') {
+        len--;
+    }
+    sh_expand_value(e, out, len, quoted);
+    return close < end ? close + 1 : end;
+}
+
+/*
+ * Arithmetic expansion: "$((expression))" is the value of an integer expression in C's
+ * syntax, less "++", "--" and ",": constants (decimal, octal "017" or hex "0x1f"),
+ * variables by name (unset or empty is 0), parentheses, the unary, binary and "?:"
+ * operators, and assignments ("=", "+=", ...). The expression is expanded first, like
+ * a word in double quotes, so "$x" and "$(cmd)" work in there as well. Then it is
+ * evaluated straight from the text, by recursive descent.
+ */
+struct sh_arith {
+    const char *p;
+    const char *end;
+    const char *error;         // what went wrong, or NULL
+    int skip;                  // inside the side of "&&", "||" or "?:" that isn't taken
+};
+
+long sh_arith_assign(struct sh_arith *a);
+
+/**
+ * @brief Find the operator the expression goes on with, after any blanks.
+ * @param a The evaluation. Skips the blanks, but not the operator.
+ * @return The operator (the longest that matches), or NULL if something else is next.
+ */
+const char *sh_arith_op(struct sh_arith *a) {
+    static const char *const ops[] = {
+            "<<=", ">>=", "<<", ">>", "<=", ">=", "==", "!=", "&&", "||", "*=", "/=", "%=", "+=",
+            "-=", "&=", "^=", "|=", "*", "/", "%", "+", "-", "<", ">", "&", "^", "|", "!", "~",
+            "?", ":", "=", "(", ")", NULL,
+    };
+    const char *const *op;
+    size_t len;
+
+    while (a->p < a->end && isspace((unsigned char) *a->p)) {
+        a->p++;
+    }
+    for (op = ops; *op != NULL; op++) {
+        len = strlen(*op);
+        if ((size_t) (a->end - a->p) >= len && memcmp(a->p, *op, len) == 0) {
+            return *op;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Take an operator if it is the one that comes next.
+ * @param a The evaluation.
+ * @param op The operator.
+ * @return Whether it was there.
+ */
+int sh_arith_accept(struct sh_arith *a, const char *op) {
+    const char *next = sh_arith_op(a);
+
+    if (next == NULL || strcmp(next, op) != 0) {
+        return 0;
+    }
+    a->p += strlen(op);
+    return 1;
+}
+
+/**
+ * @brief Report an error, unless there already is one (the first one is the one to show).
+ */
+void sh_arith_error(struct sh_arith *a, const char *error) {
+    if (a->error == NULL) {
+        a->error = error;
+    }
+}
+
+/**
+ * @brief Convert a constant, or a variable's value, to a number.
+ * @param a The evaluation, to report an error to.
+ * @param s The text, which ends at "end" or at a null character before it.
+ * @param end End of the text.
+ * @return The number.
+ */
+long sh_arith_number(struct sh_arith *a, const char *s, const char *end) {
+    char *q;
+    long n;
+
+    while (s < end && isspace((unsigned char) *s)) {
+        s++;
+    }
+    if (s == end || *s == '\0') {
+        return 0;
+    }
+    n = strtol(s, &q, 0);
+    while (q < end && isspace((unsigned char) *q)) {
+        q++;
+    }
+    if (q == s || (q < end && *q != '\0')) {
+        sh_arith_error(a, "bad number");
+        return 0;
+    }
+    return n;
+}
+
+/**
+ * @brief Apply a binary operator. Signed overflow wraps around, as it does in most shells.
+ * @param a The evaluation.
+ * @param op The operator, without the "=" of an assignment like "+=".
+ * @param l The left operand.
+ * @param r The right operand.
+ * @return The result.
+ */
+long sh_arith_apply(struct sh_arith *a, const char *op, long l, long r) {
+    switch (op[0]) {
+        case '*':
+            return (long) ((unsigned long) l * (unsigned long) r);
+        case '/':
+        case '%':
+            if (r == 0) {
+                if (!a->skip) {
+                    sh_arith_error(a, "division by zero");
+                }
+                return 0;
+            }
+            if (r == -1) {
+                return op[0] == '/' ? (long) (0 - (unsigned long) l) : 0;
+            }
+            return op[0] == '/' ? l / r : l % r;
+        case '+':
+            return (long) ((unsigned long) l + (unsigned long) r);
+        case '-':
+            return (long) ((unsigned long) l - (unsigned long) r);
+        case '<':
+            if (op[1] == '<') {
+                return (long) ((unsigned long) l << (r & 63));
+            }
+            return op[1] == '=' ? l <= r : l < r;
+        case '>':
+            if (op[1] == '>') {
+                return l >> (r & 63);
+            }
+            return op[1] == '=' ? l >= r : l > r;
+        case '=':
+            return l == r;
+        case '!':
+            return l != r;
+        case '&':
+            return op[1] == '&' ? l && r : l & r;
+        case '^':
+            return l ^ r;
+        case '|':
+            return op[1] == '|' ? l || r : l | r;
+        default:
+            return 0;
+    }
+}
+
+/**
+ * @brief How tightly a binary operator binds.
+ * @param op The operator, or NULL.
+ * @return Its precedence, higher for tighter, or 0 if it isn't a binary operator.
+ */
+int sh_arith_precedence(const char *op) {
+    static const struct {
+        const char *op;
+        int precedence;
+    } binary[] = {
+            {"||", 1}, {"&&", 2}, {"|", 3}, {"^", 4}, {"&", 5}, {"==", 6}, {"!=", 6}, {"<", 7},
+            {"<=", 7}, {">", 7}, {">=", 7}, {"<<", 8}, {">>", 8}, {"+", 9}, {"-", 9}, {"*", 10},
+            {"/", 10}, {"%", 10}, {NULL, 0},
+    };
+    int i;
+
+    for (i = 0; op != NULL && binary[i].op != NULL; i++) {
+        if (strcmp(binary[i].op, op) == 0) {
+            return binary[i].precedence;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Evaluate a unary expression: a constant, a variable, a parenthesized
+ *        expression, or one of those after "+", "-", "!" or "~".
+ */
+long sh_arith_unary(struct sh_arith *a) {
+    const char *op = sh_arith_op(a), *start = a->p;
+    size_t len;
+    long n;
+
+    if (op != NULL && strchr("+-!~", op[0]) != NULL && op[1] == '\0') {
+        a->p++;
+        n = sh_arith_unary(a);
+        switch (op[0]) {
+            case '-':
+                return (long) (0 - (unsigned long) n);
+            case '!':
+                return !n;
+            case '~':
+                return ~n;
+            default:
+                return n;
+        }
+    }
+    if (op != NULL && op[0] == '(') {
+        a->p++;
+        n = sh_arith_assign(a);
+        if (!sh_arith_accept(a, ")")) {
+            sh_arith_error(a, "missing \")\"");
+        }
+        return n;
+    }
+    if (a->p < a->end && *a->p >= '0' && *a->p <= '9') {
+        while (a->p < a->end && (isalnum((unsigned char) *a->p) || *a->p == '_')) {
+            a->p++;
+        }
+        return sh_arith_number(a, start, a->p);
+    }
+    len = sh_var_name_len(a->p, a->end - a->p);
+    if (len == 0) {
+        sh_arith_error(a, "syntax error");
+        return 0;
+    }
+    a->p += len;
+    op = sh_var_lookup(start, len);
+    return op != NULL ? sh_arith_number(a, op, op + strlen(op)) : 0;
+}
+
+/**
+ * @brief Evaluate the binary operators that bind at least as tightly as a precedence.
+ * @param a The evaluation.
+ * @param precedence The precedence (see sh_arith_precedence()).
+ * @return The value.
+ */
+long sh_arith_binary(struct sh_arith *a, int precedence) {
+    long left = sh_arith_unary(a), right;
+    const char *op;
+    int level, skip;
+
+    while (a->error == NULL && (level = sh_arith_precedence(op = sh_arith_op(a))) >= precedence) {
+        a->p += strlen(op);
+        if (level <= 2) {
+            // "&&" and "||" don't evaluate the right side if the left one decides.
+            skip = op[0] == '&' ? !left : left != 0;
+            a->skip += skip;
+            right = sh_arith_binary(a, level + 1);
+            a->skip -= skip;
+        } else {
+            right = sh_arith_binary(a, level + 1);
+        }
+        left = sh_arith_apply(a, op, left, right);
+    }
+    return left;
+}
+
+/**
+ * @brief Evaluate a conditional expression, "condition ? then : else", or just the
+ *        condition if there is no "?".
+ */
+long sh_arith_conditional(struct sh_arith *a) {
+    long condition = sh_arith_binary(a, 1), then, otherwise;
+
+    if (!sh_arith_accept(a, "?")) {
+        return condition;
+    }
+    a->skip += condition == 0;
+    then = sh_arith_assign(a);
+    a->skip -= condition == 0;
+    if (!sh_arith_accept(a, ":")) {
+        sh_arith_error(a, "missing \":\"");
+        return 0;
+    }
+    a->skip += condition != 0;
+    otherwise = sh_arith_conditional(a);
+    a->skip -= condition != 0;
+    return condition ? then : otherwise;
+}
+
+/**
+ * @brief Evaluate an assignment to a variable ("x = 1", "x += 2", ...), or a conditional
+ *        expression if it isn't one.
+ * @param a The evaluation.
+ * @return The value.
+ */
+long sh_arith_assign(struct sh_arith *a) {
+    const char *start, *op, *value;
+    char assign[4], num[32];
+    size_t len;
+    long n;
+
+    sh_arith_op(a);
+    start = a->p;
+    len = sh_var_name_len(start, a->end - start);
+    if (len == 0) {
+        return sh_arith_conditional(a);
+    }
+    a->p += len;
+    op = sh_arith_op(a);
+    if (op == NULL || op[strlen(op) - 1] != '=' || strcmp(op, "==") == 0 || strcmp(op, "!=") == 0 ||
+        strcmp(op, "<=") == 0 || strcmp(op, ">=") == 0) {
+        a->p = start;
+        return sh_arith_conditional(a);
+    }
+    a->p += strlen(op);
+    n = sh_arith_assign(a);
+    if (op[1] != '\0') {
+        // "x op= n" is "x = x op n".
+        snprintf(assign, sizeof(assign), "%.*s", (int) strlen(op) - 1, op);
+        value = sh_var_lookup(start, len);
+        n = sh_arith_apply(a, assign, value != NULL ? sh_arith_number(a, value, value + strlen(value)) : 0, n);
+    }
+    if (!a->skip && a->error == NULL) {
+        snprintf(num, sizeof(num), "%ld", n);
+        sh_var_set(start, len, num, 0);
+    }
+    return n;
+}
+
+/**
+ * @brief Expand a "$((...))" arithmetic expansion.
+ * @param e The expansion.
+ * @param p The first of the opening parentheses.
+ * @param close The last of the closing ones (see sh_lex_arith_end()).
+ * @param quoted Whether it is inside double quotes.
+ * @return Where the word goes on after it.
+ */
+const char *sh_expand_arith(struct sh_expansion *e, const char *p, const char *close, int quoted) {
+    struct sh_word word = {p + 2, close - p - 3, SH_WORD_QUOTED | SH_WORD_DOLLAR};
+    struct sh_strbuf word_buf = {0};
+    struct sh_arith a = {NULL, NULL, NULL, 0};
+    const char *text;
+    char num[32];
+    long n;
+
+    text = sh_expand_word(e->arena, &word, &word_buf);
+    free(word_buf.data);
+    if (text == NULL) {
+        text = "";
+    }
+    a.p = text;
+    a.end = text + strlen(text);
+    sh_arith_op(&a);
+    n = a.p < a.end ? sh_arith_assign(&a) : 0;
+    sh_arith_op(&a);
+    if (a.p < a.end) {
+        sh_arith_error(&a, "syntax error");
+    }
+    if (a.error != NULL) {
+        fprintf(stderr, "sh: $((%s)): %s\n", text, a.error);
+        sh_expand_failed = 1;
+        return close + 1;
+    }
+    snprintf(num, sizeof(num), "%ld", n);
+    sh_expand_value(e, num, strlen(num), quoted);
+    return close + 1;
+}
+
+/**
+ * @brief Expand a tilde prefix: "~" is $HOME, and "~NAME" the home directory of user NAME.
+ *        The prefix runs up to the first "/" (or ":", in an assignment). One with quotes or
+ *        expansions in it, or that names no user, stays as it is.
+ * @param e The expansion.
+ * @param p The "~".
+ * @param end End of the word.
+ * @return Where the word goes on after the prefix.
+ */
+const char *sh_expand_tilde(struct sh_expansion *e, const char *p, const char *end) {
+    const char *q, *dir = NULL;
+    struct passwd *pw;
+    char name[256];
+
+    for (q = p + 1; q < end && *q != '/' && !(e->assignment && *q == ':'); q++) {
+        if (strchr("\\'\"$`", *q) != NULL) {
+            break;
+        }
+    }
+    if ((q < end && *q != '/' && *q != ':') || (size_t) (q - p) > sizeof(name)) {
+        sh_strbuf_putc(e->buf, '~');
+        return p + 1;
+    }
+    if (q == p + 1) {
+        dir = sh_var_get("HOME");
+        if (dir == NULL && (pw = getpwuid(getuid())) != NULL) {
+            dir = pw->pw_dir;
+        }
+    } else {
+        snprintf(name, sizeof(name), "%.*s", (int) (q - p - 1), p + 1);
+        if ((pw = getpwnam(name)) != NULL) {
+            dir = pw->pw_dir;
+        }
+    }
+    if (dir == NULL) {
+        sh_strbuf_putc(e->buf, '~');
+        return p + 1;
+    }
+    // The directory is as good as quoted: it isn't split into fields, or a pattern.
+    sh_expand_quoted(e, dir, strlen(dir));
+    e->started = 1;
+    return q;
+}
+
+/**
+ * @brief Expand a word, into one word or a list of fields.
+ *
+ * All the expansions happen in one pass over the word, from its text into the buffer,
+ * and a field is only copied out of the buffer once it is finished. A word that has
+ * nothing to expand (no quotes, "$", "`" or pattern characters, which the lexer flags)
+ * never touches the buffer, and comes back as the word's own text if it is null
+ * terminated, so it costs no copy at all.
+ *
+ * @param e The expansion, with its arena, buffer, and fields (NULL for a single word).
+ * @param token The word.
+ * @return The expanded word (NULL if it expanded to no word at all, or if split into fields).
+ */
+char *sh_expand(struct sh_expansion *e, const struct sh_word *token) {
+    const char *p = token->text, *end = token->text + token->len, *close;
+    struct sh_strbuf *buf = e->buf;
+    int heredoc = token->flags & SH_WORD_HEREDOC, in_double = heredoc;
+    char *word;
+
+    // Most words have nothing to expand. One that is a string of its own, like the words
+    // of a tree, is used as it is; only a slice of a longer string gets copied.
+    if (token->flags == 0) {
+        word = token->text[token->len] == '\0' ? (char *) token->text
+                                                : sh_arena_strndup(e->arena, token->text, token->len);
+        if (e->fields != NULL) {
+            sh_fields_push(e->fields, word);
+        }
+        return word;
+    }
+
+    buf->len = 0;
+    sh_strbuf_reserve(buf, token->len);
+    while (p < end) {
+        switch (*p) {
+            case '\'':
+                if (in_double) {
+                    sh_expand_quoted(e, p++, 1);
+                } else {
+                    const char *q = memchr(p + 1, '\'', end - p - 1);
+                    sh_expand_quoted(e, p + 1, q - p - 1);
+                    p = q + 1;
+                    e->started = 1;
+                }
+                break;
+            case '"':
+                if (heredoc) {
+                    sh_expand_quoted(e, p++, 1);
+                    break;
+                }
+                // With no positional parameters, "$@" is no field at all, quotes or not.
+                if (!in_double && end - p >= 4 && memcmp(p, "\"$@\"", 4) == 0 && sh_argc <= 1) {
+                    p += 4;
+                    break;
+                }
+                in_double = !in_double;
+                e->started = 1;
+                p++;
+                break;
+            case '\\':
+                // A backslash at the end of a line joins the lines. Inside double quotes, a
+                // backslash only escapes a few characters.
+                if (p[1] == '\n') {
+                    p += 2;
+                } else if (in_double && strchr(heredoc ? "$`\\" : "$`\"\\", p[1]) == NULL) {
+                    sh_expand_quoted(e, p++, 1);
+                } else {
+                    sh_expand_quoted(e, p + 1, 1);
+                    p += 2;
+                    e->started = 1;
+                }
+                break;
+            case '$':
+                if (p + 2 < end && p[1] == '(' && p[2] == '(' && (close = sh_lex_arith_end(p + 1, end)) != NULL) {
+                    p = sh_expand_arith(e, p + 1, close, in_double);
+                } else if (p + 1 < end && p[1] == '(') {
+                    p = sh_expand_command(e, p + 1, end, in_double);
+                } else {
+                    p = sh_expand_param(e, p + 1, end, in_double);
+                }
+                break;
+            case '`':
+                p = sh_expand_backquote(e, p, end, in_double);
+                break;
+            case '*':
+            case '?':
+            case '[':
+                if (!in_double) {
+                    e->magic = e->glob;
+                }
+                // fall through
+            case '~':
+                if (*p == '~' && !in_double && (token->flags & SH_WORD_TILDE)
+                    && (p == token->text || (e->assignment && p[-1] == ':'))) {
+                    p = sh_expand_tilde(e, p, end);
+                    break;
+                }
+                // fall through
+            default:
+                if (in_double) {
+                    // Copy the whole run up to the next character that means something, which
+                    // for a here-document body can be most of it.
+                    const char *q = p + 1;
+                    while (q < end && *q != '"' && *q != '\\' && *q != '$' && *q != '`') {
+                        q++;
+                    }
+                    sh_expand_quoted(e, p, q - p);
+                    p = q;
+                } else {
+                    sh_strbuf_putc(buf, *p++);
+                }
+                break;
+        }
+    }
+
+    if (e->fields != NULL) {
+        if (buf->len > 0 || e->started) {
+            sh_expand_field_end(e);
+        }
+        return NULL;
+    }
+    if (buf->len == 0 && !e->started) {
+        return NULL;
+    }
+    return sh_arena_strndup(e->arena, buf->data, buf->len);
+}
+
+/**
+ * @brief Expand a word into a single word.
+ * @param arena Where to put the result.
+ * @param token The word.
+ * @param buf Scratch buffer.
+ * @return The expanded word, or NULL if it expanded to no word at all.
+ */
+char *sh_expand_word(struct sh_arena *arena, const struct sh_word *token, struct sh_strbuf *buf) {
+    struct sh_expansion e = {arena, buf, NULL, NULL, 0, 0, 0, 0, 0, 0};
+
+    return sh_expand(&e, token);
+}
+
+/**
+ * @brief Expand the value of an assignment, where a "~" after a ":" expands too (as in
+ *        "PATH=~/bin:~/sbin").
+ * @param arena Where to put the result.
+ * @param token The value.
+ * @param buf Scratch buffer.
+ * @return The expanded value, or NULL if it expanded to nothing.
+ */
+char *sh_expand_assignment(struct sh_arena *arena, const struct sh_word *token, struct sh_strbuf *buf) {
+    struct sh_expansion e = {arena, buf, NULL, NULL, 0, 0, 0, 0, 0, 1};
+
+    return sh_expand(&e, token);
+}
+
+/**
+ * @brief Expand a word into fields.
+ * @param arena Where to put the fields.
+ * @param token The word.
+ * @param buf Scratch buffer.
+ * @param fields Where to add the fields.
+ */
+void sh_expand_fields(struct sh_arena *arena, const struct sh_word *token, struct sh_strbuf *buf,
+                      struct sh_fields *fields) {
+    struct sh_expansion e = {arena, buf, fields, NULL, 0, 0, 0, 0, 0, 0};
+
+    // Only an unquoted pattern character or expansion can make a field a pattern.
+    if (token->flags & (SH_WORD_GLOB | SH_WORD_DOLLAR)) {
+        e.pattern = 1;
+        e.glob = 1;
+    }
+
+    sh_expand(&e, token);
+}
+
+/**
+ * @brief Expand a word that is used as a pattern, for fnmatch().
+ * @param arena Where to put the result.
+ * @param token The word.
+ * @param buf Scratch buffer.
+ * @return The pattern, with the characters that were quoted escaped.
+ */
+char *sh_expand_pattern(struct sh_arena *arena, const struct sh_word *token, struct sh_strbuf *buf) {
+    struct sh_expansion e = {arena, buf, NULL, NULL, 0, 1, 0, 0, 0, 0};
+    char *pattern = sh_expand(&e, token);
+
+    return pattern != NULL ? pattern : "";
+}
+
+
+/*
+ * Pathname expansion
+ *
+ * An unquoted "*", "?" or "[...]" makes a field of a command a pattern, and the field is
+ * replaced with the pathnames that match it, sorted. If none do, it stays as it is. A
+ * "**" that makes up a whole component matches any number of directories (but not
+ * hidden ones, and it doesn't follow symbolic links), so with "**" between "src" and
+ * "*.c" the pattern finds the C files anywhere under "src". Names that start with "."
+ * only match a pattern that does too, and "." and ".." never match.
+ *
+ * A pattern is compiled once per expansion: it is split into its components at the
+ * slashes, and each component with pattern characters gets the literal text a name must
+ * start and end with, and how short it can be. Most names in a directory don't match,
+ * and those checks turn them down without running the matcher; for "*.log" they are the
+ * whole match. A component without pattern characters is just a name, so the directory
+ * it is in never needs to be read.
+ *
+ * Directories are read with getdents64() into a big buffer, a few system calls for even
+ * a huge directory, and the type in each entry says which ones are directories without
+ * a stat() (unless the file system doesn't fill it in). A name is only copied when it
+ * matches. The matches are sorted with a radix quicksort on their bytes, which is the
+ * collation of the C locale. Another LC_COLLATE (or LC_ALL, or LANG) sorts them with
+ * strcoll() in that locale.
+ *
+ * A pattern with "**" can have a whole tree to go through, so its directories are read
+ * by a pool of threads: $SH_GLOB_THREADS of them, or one per CPU. Each thread keeps the
+ * directories it comes across in a deque of its own, and goes on with the newest one,
+ * depth first. A thread that runs out takes the oldest one of another thread, which is
+ * likely to be the top of a big subtree. A directory is opened with openat() relative to
+ * the one it is in, which stays open until all of its subdirectories have been opened,
+ * so no path is looked up more than once. Each thread sorts its own matches, and they
+ * are merged, so the order doesn't depend on which thread found what.
+ */
+
+#define SH_GLOB_BUFFER_SIZE (256 << 10)
+#define SH_GLOB_MAX_THREADS 64
+
+enum sh_glob_kind {
+    SH_GLOB_LITERAL,           // a name
+    SH_GLOB_MATCH,             // a pattern
+    SH_GLOB_ANY,               // "**"
+};
+
+struct sh_glob_part {
+    enum sh_glob_kind kind;
+    const char *text;          // the pattern, or the name without its backslashes
+    size_t len;
+    const char *prefix;        // literal text a name has to start with
+    size_t prefix_len;
+    const char *suffix;        // and end with
+    size_t suffix_len;
+    size_t min_len;            // how short a name can be
+    int fixed;                 // no "*": a name has exactly min_len characters
+    int simple;                // prefix, "*", suffix: the checks above are the whole match
+    int hidden;                // starts with ".", so it matches hidden names
+};
+
+/*
+ * A pattern being expanded, and the workers expanding it. "pending" counts the
+ * directories that were found and aren't done yet, and "queued" the ones among them that
+ * no worker has taken.
+ */
+struct sh_glob {
+    struct sh_glob_part *parts;
+    int num_parts;
+    int dirs_only;             // the pattern ends with "/"
+    int any;                   // it has a "**"
+    int bytewise;              // the matches are sorted by their bytes, not with strcoll()
+    struct sh_glob_worker *workers;
+    int num_workers;
+    long pending;
+    long queued;
+    int idle;                  // workers waiting for a directory
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+};
+
+/*
+ * A directory that is open. The tasks for the directories in it share it, and the last
+ * one done with it closes it.
+ */
+struct sh_glob_dir {
+    int fd;
+    int refs;
+    const char *path;          // relative to where the pattern starts, with a "/" at the end
+    size_t path_len;
+};
+
+// A directory to read: a name in its parent, and the part of the pattern for its entries.
+struct sh_glob_task {
+    struct sh_glob_dir *parent;
+    int part;
+    char name[];
+};
+
+struct sh_glob_worker {
+    struct sh_glob *g;
+    struct sh_arena arena;     // the matches, handed over to the expansion's arena at the end
+    struct sh_fields matches;
+    char *buf;                 // for getdents64()
+    pthread_t thread;
+    pthread_mutex_t lock;      // for the deque
+    struct sh_glob_task **tasks;
+    size_t head;
+    size_t tail;
+    size_t size;
+};
+
+// The entries getdents64() fills its buffer with.
+struct sh_dirent64 {
+    unsigned long long ino;
+    long long off;
+    unsigned short reclen;
+    unsigned char type;
+    char name[];
+};
+
+struct sh_glob_reader {
+#ifdef __linux__
+    int fd;
+    long len;
+    long pos;
+#else
+    DIR *dir;
+#endif
+};
+
+char *sh_glob_buf;
+
+const struct {
+    const char *name;
+    int (*test)(int);
+} sh_glob_classes[] = {
+        {"alnum", isalnum}, {"alpha", isalpha}, {"blank", isblank}, {"cntrl", iscntrl},
+        {"digit", isdigit}, {"graph", isgraph}, {"lower", islower}, {"print", isprint},
+        {"punct", ispunct}, {"space", isspace}, {"upper", isupper}, {"xdigit", isxdigit},
+};
+
+/**
+ * @brief Match a character against a bracket expression, like "[a-z]" or "[![:digit:]_]".
+ * @param p The "[".
+ * @param end End of the pattern.
+ * @param c The character.
+ * @param match Set to whether the character matches.
+ * @return Just past the "]", or NULL if there is none (and the "[" is just a character).
+ */
+const char *sh_glob_bracket(const char *p, const char *end, unsigned char c, int *match) {
+    const char *start, *close;
+    unsigned char lo, hi;
+    int negate = 0, found = 0;
+    size_t i, len;
+
+    p++;
+    if (p < end && (*p == '!' || *p == '^')) {
+        negate = 1;
+        p++;
+    }
+    for (start = p; p < end && (*p != ']' || p == start);) {
+        if (*p == '[' && p + 1 < end && p[1] == ':') {
+            for (close = p + 2; close + 1 < end && (close[0] != ':' || close[1] != ']'); close++);
+            if (close + 1 < end) {
+                len = close - p - 2;
+                for (i = 0; i < sizeof(sh_glob_classes) / sizeof(sh_glob_classes[0]); i++) {
+                    if (strlen(sh_glob_classes[i].name) == len && memcmp(sh_glob_classes[i].name, p + 2, len) == 0) {
+                        found |= sh_glob_classes[i].test(c) != 0;
+                        break;
+                    }
+                }
+                p = close + 2;
+                continue;
+            }
+        }
+        if (*p == '\\' && p + 1 < end) {
+            p++;
+        }
+        lo = hi = *p++;
+        if (p + 1 < end && *p == '-' && p[1] != ']') {
+            p++;
+            if (*p == '\\' && p + 1 < end) {
+                p++;
+            }
+            hi = *p++;
+        }
+        found |= lo <= c && c <= hi;
+    }
+    if (p >= end) {
+        return NULL;
+    }
+    *match = found != negate;
+    return p + 1;
+}
+
+/**
+ * @brief Match a name against a pattern.
+ *
+ * When the name doesn't match after a "*", the "*" takes one more character and the rest
+ * is tried again. Only the last "*" ever needs to do that, which keeps it linear for
+ * the usual patterns.
+ *
+ * @param p The pattern.
+ * @param pend End of the pattern.
+ * @param s The name.
+ * @param send End of the name.
+ * @return 1 if it matches, 0 if not.
+ */
+int sh_glob_match(const char *p, const char *pend, const char *s, const char *send) {
+    const char *star = NULL, *star_s = NULL, *next;
+    int match;
+
+    while (s < send) {
+        if (p < pend && *p == '*') {
+            star = ++p;
+            star_s = s;
+            continue;
+        }
+        if (p < pend) {
+            if (*p == '?') {
+                next = p + 1;
+                match = 1;
+            } else if (*p != '[' || (next = sh_glob_bracket(p, pend, *s, &match)) == NULL) {
+                if (*p == '\\' && p + 1 < pend) {
+                    p++;
+                }
+                next = p + 1;
+                match = *p == *s;
+            }
+            if (match) {
+                p = next;
+                s++;
+                continue;
+            }
+        }
+        if (star == NULL) {
+            return 0;
+        }
+        p = star;
+        s = ++star_s;
+    }
+    while (p < pend && *p == '*') {
+        p++;
+    }
+    return p == pend;
+}
+
+/**
+ * @brief Compile a component of a pattern.
+ * @param arena Where to put the literal text it needs.
+ * @param part The part to fill in.
+ * @param text The component.
+ * @param len Length of the component.
+ * @return 1 if it has pattern characters, 0 if it is just a name.
+ */
+int sh_glob_compile_part(struct sh_arena *arena, struct sh_glob_part *part, const char *text, size_t len) {
+    const char *p = text, *end = text + len, *next;
+    char *literal = sh_arena_alloc(arena, len + 1);
+    size_t n = 0, run = 0;
+    int stars = 0, others = 0, match;
+
+    memset(part, 0, sizeof(*part));
+    part->hidden = len > 0 && (*p == '.' || (*p == '\\' && len > 1 && p[1] == '.'));
+    if (len == 2 && memcmp(text, "**", 2) == 0) {
+        part->kind = SH_GLOB_ANY;
+        return 1;
+    }
+
+    while (p < end) {
+        next = p + 1;
+        if (*p == '*') {
+            stars++;
+        } else if (*p == '?' || (*p == '[' && (next = sh_glob_bracket(p, end, 0, &match)) != NULL)) {
+            others++;
+            part->min_len++;
+        } else {
+            if (*p == '\\' && p + 1 < end) {
+                p++;
+            }
+            if (stars + others == 0) {
+                part->prefix_len++;
+            }
+            literal[n++] = *p;
+            part->min_len++;
+            p++;
+            continue;
+        }
+        run = n;
+        p = next;
+    }
+    literal[n] = '\0';
+
+    if (stars + others == 0) {
+        part->kind = SH_GLOB_LITERAL;
+        part->text = literal;
+        part->len = n;
+        return 0;
+    }
+    part->kind = SH_GLOB_MATCH;
+    part->text = text;
+    part->len = len;
+    part->prefix = literal;
+    part->suffix = literal + run;
+    part->suffix_len = n - run;
+    part->fixed = stars == 0;
+    part->simple = stars == 1 && others == 0;
+    return 1;
+}
+
+/**
+ * @brief Compile a pattern.
+ * @param g The pattern's expansion.
+ * @param arena Where to put the compiled pattern.
+ * @param pattern The pattern, null terminated.
+ * @param len Length of the pattern.
+ * @return 1 if it has pattern characters, 0 if it is just a pathname.
+ */
+int sh_glob_compile(struct sh_glob *g, struct sh_arena *arena, const char *pattern, size_t len) {
+    const char *p = pattern, *end = pattern + len, *slash;
+    struct sh_glob_part *part;
+    int magic = 0, count = 2;
+
+    for (slash = p; (slash = memchr(slash, '/', end - slash)) != NULL; slash++) {
+        count++;
+    }
+    g->parts = sh_arena_alloc(arena, count * sizeof(struct sh_glob_part));
+    g->num_parts = 0;
+    g->dirs_only = len > 0 && pattern[len - 1] == '/';
+
+    while (p < end) {
+        if ((slash = memchr(p, '/', end - p)) == NULL) {
+            slash = end;
+        }
+        if (slash > p) {
+            part = &g->parts[g->num_parts];
+            magic |= sh_glob_compile_part(arena, part, p, slash - p);
+            // "**/**" is just "**".
+            if (part->kind != SH_GLOB_ANY || g->num_parts == 0 || part[-1].kind != SH_GLOB_ANY) {
+                g->num_parts++;
+            }
+            g->any |= part->kind == SH_GLOB_ANY;
+        }
+        p = slash + 1;
+    }
+    if (g->num_parts > 0 && g->parts[g->num_parts - 1].kind == SH_GLOB_ANY) {
+        // A "**" at the end matches everything below, like "**/*".
+        sh_glob_compile_part(arena, &g->parts[g->num_parts++], "*", 1);
+    }
+    return magic;
+}
+
+/**
+ * @brief Check whether a name matches a part of a pattern.
+ * @param part The part.
+ * @param name The name.
+ * @param len Length of the name.
+ * @return 1 if it matches, 0 if not.
+ */
+int sh_glob_part_match(const struct sh_glob_part *part, const char *name, size_t len) {
+    if (name[0] == '.' && !part->hidden) {
+        return 0;
+    }
+    if (part->fixed ? len != part->min_len : len < part->min_len) {
+        return 0;
+    }
+    if (memcmp(name, part->prefix, part->prefix_len) != 0 ||
+        memcmp(name + len - part->suffix_len, part->suffix, part->suffix_len) != 0) {
+        return 0;
+    }
+    return part->simple || sh_glob_match(part->text, part->text + part->len, name, name + len);
+}
+
+/**
+ * @brief Start reading a directory.
+ * @param r The reader.
+ * @param fd The directory, which stays open.
+ * @return 0 on success, -1 on error.
+ */
+int sh_glob_open(struct sh_glob_reader *r, int fd) {
+#ifdef __linux__
+    r->fd = fd;
+    r->len = 0;
+    r->pos = 0;
+    return 0;
+#else
+    r->dir = fdopendir(fcntl(fd, F_DUPFD_CLOEXEC, 0));
+    return r->dir != NULL ? 0 : -1;
+#endif
+}
+
+/**
+ * @brief Get the next entry of a directory.
+ * @param r The reader.
+ * @param buf Buffer of SH_GLOB_BUFFER_SIZE bytes for the entries.
+ * @param type Set to the type of the entry (DT_DIR, ...), which may be DT_UNKNOWN.
+ * @return Name of the entry, or NULL at the end of the directory (or on an error).
+ */
+const char *sh_glob_next(struct sh_glob_reader *r, char *buf, unsigned char *type) {
+#ifdef __linux__
+    struct sh_dirent64 *entry;
+
+    if (r->pos >= r->len) {
+        r->len = syscall(SYS_getdents64, r->fd, buf, SH_GLOB_BUFFER_SIZE);
+        r->pos = 0;
+        if (r->len <= 0) {
+            return NULL;
+        }
+    }
+    entry = (struct sh_dirent64 *) (buf + r->pos);
+    r->pos += entry->reclen;
+    *type = entry->type;
+    return entry->name;
+#else
+    struct dirent *entry = readdir(r->dir);
+
+    (void) buf;
+    if (entry == NULL) {
+        return NULL;
+    }
+    *type = entry->d_type;
+    return entry->d_name;
+#endif
+}
+
+/**
+ * @brief Stop reading a directory.
+ * @param r The reader.
+ */
+void sh_glob_close(struct sh_glob_reader *r) {
+#ifndef __linux__
+    closedir(r->dir);
+#else
+    (void) r;
+#endif
+}
+
+/**
+ * @brief Check whether a directory entry is a directory.
+ * @param fd The directory it is in.
+ * @param name Its name.
+ * @param type Its type, from the directory entry.
+ * @param follow Whether a symbolic link to a directory counts.
+ * @return 1 if it is, 0 if not.
+ */
+int sh_glob_is_dir(int fd, const char *name, unsigned char type, int follow) {
+    struct stat st;
+
+    if (type == DT_DIR) {
+        return 1;
+    }
+    if (type != DT_UNKNOWN && (type != DT_LNK || !follow)) {
+        return 0;
+    }
+    return fstatat(fd, name, &st, follow ? 0 : AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+}
+
+/**
+ * @brief Add a pathname that matches.
+ * @param w The worker that found it.
+ * @param dir The directory it is in.
+ * @param name Its name.
+ * @param len Length of the name.
+ */
+void sh_glob_add(struct sh_glob_worker *w, const struct sh_glob_dir *dir, const char *name, size_t len) {
+    char *match = sh_arena_alloc(&w->arena, dir->path_len + len + 2);
+
+    memcpy(match, dir->path, dir->path_len);
+    memcpy(match + dir->path_len, name, len);
+    len += dir->path_len;
+    if (w->g->dirs_only) {
+        match[len++] = '/';
+    }
+    match[len] = '\0';
+    sh_fields_push(&w->matches, match);
+}
+
+/**
+ * @brief Open a directory in another one.
+ * @param w The worker.
+ * @param parent The directory it is in.
+ * @param name Its name.
+ * @param len Length of the name.
+ * @return The directory, or NULL if it can't be opened.
+ */
+struct sh_glob_dir *sh_glob_enter(struct sh_glob_worker *w, const struct sh_glob_dir *parent, const char *name,
+                                  size_t len) {
+    struct sh_glob_dir *dir;
+    char *path;
+    int fd = openat(parent->fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (fd < 0) {
+        return NULL;
+    }
+    dir = sh_arena_alloc(&w->arena, sizeof(struct sh_glob_dir) + parent->path_len + len + 2);
+    path = (char *) (dir + 1);
+    memcpy(path, parent->path, parent->path_len);
+    memcpy(path + parent->path_len, name, len);
+    path[parent->path_len + len] = '/';
+    path[parent->path_len + len + 1] = '\0';
+    dir->fd = fd;
+    dir->refs = 1;
+    dir->path = path;
+    dir->path_len = parent->path_len + len + 1;
+    return dir;
+}
+
+/**
+ * @brief Be done with a directory, closing it if nothing else needs it.
+ * @param dir The directory.
+ */
+void sh_glob_leave(struct sh_glob_dir *dir) {
+    if (__atomic_sub_fetch(&dir->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        close(dir->fd);
+    }
+}
+
+/**
+ * @brief Be done with a directory that was pending, and wake up the workers that are
+ *        waiting if it was the last one.
+ * @param g The pattern.
+ */
+void sh_glob_done(struct sh_glob *g) {
+    if (__atomic_sub_fetch(&g->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+        pthread_mutex_lock(&g->lock);
+        pthread_cond_broadcast(&g->wake);
+        pthread_mutex_unlock(&g->lock);
+    }
+}
+
+/**
+ * @brief Add a directory to read to a worker's deque.
+ * @param w The worker.
+ * @param parent The directory it is in.
+ * @param name Its name.
+ * @param len Length of the name.
+ * @param part The part of the pattern for its entries.
+ */
+void sh_glob_push(struct sh_glob_worker *w, struct sh_glob_dir *parent, const char *name, size_t len, int part) {
+    struct sh_glob *g = w->g;
+    struct sh_glob_task *task = sh_arena_alloc(&w->arena, sizeof(struct sh_glob_task) + len + 1);
+
+    task->parent = parent;
+    task->part = part;
+    memcpy(task->name, name, len + 1);
+    __atomic_add_fetch(&parent->refs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&g->pending, 1, __ATOMIC_SEQ_CST);
+
+    pthread_mutex_lock(&w->lock);
+    if (w->tail == w->size) {
+        if (w->head > 0) {
+            memmove(w->tasks, w->tasks + w->head, (w->tail - w->head) * sizeof(struct sh_glob_task *));
+            w->tail -= w->head;
+            w->head = 0;
+        } else {
+            w->size = w->size ? w->size * 2 : 64;
+            w->tasks = realloc(w->tasks, w->size * sizeof(struct sh_glob_task *));
+            if (!w->tasks) {
+                fprintf(stderr, "sh: reallocation error\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    w->tasks[w->tail++] = task;
+    pthread_mutex_unlock(&w->lock);
+
+    __atomic_add_fetch(&g->queued, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&g->idle, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&g->lock);
+        pthread_cond_signal(&g->wake);
+        pthread_mutex_unlock(&g->lock);
+    }
+}
+
+/**
+ * @brief Take a directory to read: the newest one in the worker's own deque, or else the
+ *        oldest one in another worker's.
+ * @param w The worker.
+ * @return The directory, or NULL if every deque is empty.
+ */
+struct sh_glob_task *sh_glob_take(struct sh_glob_worker *w) {
+    struct sh_glob *g = w->g;
+    struct sh_glob_worker *other;
+    struct sh_glob_task *task = NULL;
+    int i;
+
+    pthread_mutex_lock(&w->lock);
+    if (w->tail > w->head) {
+        task = w->tasks[--w->tail];
+    }
+    pthread_mutex_unlock(&w->lock);
+    for (i = 1; task == NULL && i < g->num_workers; i++) {
+        other = &g->workers[(w - g->workers + i) % g->num_workers];
+        pthread_mutex_lock(&other->lock);
+        if (other->tail > other->head) {
+            task = other->tasks[other->head++];
+        }
+        pthread_mutex_unlock(&other->lock);
+    }
+    if (task != NULL) {
+        __atomic_sub_fetch(&g->queued, 1, __ATOMIC_SEQ_CST);
+    }
+    return task;
+}
+
+void sh_glob_walk(struct sh_glob_worker *w, int i, struct sh_glob_dir *dir);
+
+/**
+ * @brief Match the entries of a directory against a part of a pattern that isn't a
+ *        name. The directories to go on in are left in the worker's deque.
+ * @param w The worker.
+ * @param i The part.
+ * @param dir The directory.
+ */
+void sh_glob_read(struct sh_glob_worker *w, int i, struct sh_glob_dir *dir) {
+    struct sh_glob *g = w->g;
+    const struct sh_glob_part *part = &g->parts[i], *target = part;
+    struct sh_glob_reader r;
+    const char *name;
+    unsigned char type;
+    size_t len;
+    int t = i;
+
+    if (part->kind == SH_GLOB_ANY) {
+        // "**" can also match no directory at all.
+        target = &g->parts[++t];
+        if (target->kind == SH_GLOB_LITERAL) {
+            sh_glob_walk(w, t, dir);
+            target = NULL;
+        }
+    }
+
+    if (sh_glob_open(&r, dir->fd) < 0) {
+        return;
+    }
+    while ((name = sh_glob_next(&r, w->buf, &type)) != NULL) {
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+            continue;
+        }
+        len = strlen(name);
+        if (target != NULL && sh_glob_part_match(target, name, len)) {
+            if (t < g->num_parts - 1) {
+                if (sh_glob_is_dir(dir->fd, name, type, 1)) {
+                    sh_glob_push(w, dir, name, len, t + 1);
+                }
+            } else if (!g->dirs_only || sh_glob_is_dir(dir->fd, name, type, 1)) {
+                sh_glob_add(w, dir, name, len);
+            }
+        }
+        if (part->kind == SH_GLOB_ANY && name[0] != '.' && sh_glob_is_dir(dir->fd, name, type, 0)) {
+            sh_glob_push(w, dir, name, len, i);
+        }
+    }
+    sh_glob_close(&r);
+}
+
+/**
+ * @brief Expand the rest of a pattern in a directory.
+ * @param w The worker.
+ * @param i The first part that is left.
+ * @param dir The directory.
+ */
+void sh_glob_walk(struct sh_glob_worker *w, int i, struct sh_glob_dir *dir) {
+    struct sh_glob *g = w->g;
+    const struct sh_glob_part *part = &g->parts[i];
+    struct sh_glob_dir *sub;
+    struct stat st;
+
+    if (part->kind != SH_GLOB_LITERAL) {
+        sh_glob_read(w, i, dir);
+        return;
+    }
+    if (i == g->num_parts - 1) {
+        if (fstatat(dir->fd, part->text, &st, g->dirs_only ? 0 : AT_SYMLINK_NOFOLLOW) == 0 &&
+            (!g->dirs_only || S_ISDIR(st.st_mode))) {
+            sh_glob_add(w, dir, part->text, part->len);
+        }
+        return;
+    }
+    if ((sub = sh_glob_enter(w, dir, part->text, part->len)) != NULL) {
+        sh_glob_walk(w, i + 1, sub);
+        sh_glob_leave(sub);
+    }
+}
+
+/**
+ * @brief Sort strings by their bytes, with a multikey quicksort: the strings are split
+ *        three ways on one byte, and only the ones with the same byte go on to compare
+ *        the next one.
+ * @param a The strings.
+ * @param n Number of strings.
+ * @param depth Number of bytes at the start that all of them have in common.
+ */
+void sh_glob_sort_bytes(char **a, size_t n, size_t depth) {
+    size_t lt, gt, i, j;
+    int pivot, c;
+    char *t;
+
+    while (n > 1) {
+        if (n < 12) {
+            for (i = 1; i < n; i++) {
+                for (j = i; j > 0 && strcmp(a[j - 1] + depth, a[j] + depth) > 0; j--) {
+                    t = a[j];
+                    a[j] = a[j - 1];
+                    a[j - 1] = t;
+                }
+            }
+            return;
+        }
+        t = a[0];
+        a[0] = a[n / 2];
+        a[n / 2] = t;
+        pivot = (unsigned char) a[0][depth];
+        for (lt = 0, i = 1, gt = n; i < gt;) {
+            c = (unsigned char) a[i][depth];
+            if (c < pivot) {
+                t = a[lt];
+                a[lt++] = a[i];
+                a[i++] = t;
+            } else if (c > pivot) {
+                t = a[--gt];
+                a[gt] = a[i];
+                a[i] = t;
+            } else {
+                i++;
+            }
+        }
+        sh_glob_sort_bytes(a, lt, depth);
+        if (pivot != 0) {
+            sh_glob_sort_bytes(a + lt, gt - lt, depth + 1);
+        }
+        a += gt;
+        n -= gt;
+    }
+}
+
+int sh_glob_collate(const void *a, const void *b) {
+    return strcoll(*(char *const *) a, *(char *const *) b);
+}
+
+/**
+ * @brief Find out how to sort pathnames: in the collation LC_ALL, LC_COLLATE or LANG says.
+ * @return 1 for the C locale's, which is by bytes, or 0 for strcoll(), which is then set
+ *         up for it.
+ */
+int sh_glob_bytewise(void) {
+    static const char *vars[] = {"LC_ALL", "LC_COLLATE", "LANG"};
+    static char current[64] = "C";
+    const char *name = NULL;
+    size_t i;
+
+    for (i = 0; i < 3 && (name == NULL || *name == '\0'); i++) {
+        name = sh_var_get(vars[i]);
+    }
+    if (name == NULL || *name == '\0' || strcmp(name, "C") == 0 || strncmp(name, "C.", 2) == 0 ||
+        strcmp(name, "POSIX") == 0) {
+        return 1;
+    }
+    if (strcmp(name, current) != 0) {
+        if (strlen(name) >= sizeof(current) || setlocale(LC_COLLATE, name) == NULL) {
+            return 1;
+        }
+        strcpy(current, name);
+    }
+    return 0;
+}
+
+/**
+ * @brief Sort pathnames.
+ * @param words The pathnames.
+ * @param n Number of pathnames.
+ * @param bytewise Whether to sort them by their bytes, rather than with strcoll().
+ */
+void sh_glob_sort(char **words, size_t n, int bytewise) {
+    if (bytewise) {
+        sh_glob_sort_bytes(words, n, 0);
+    } else {
+        qsort(words, n, sizeof(char *), sh_glob_collate);
+    }
+}
+
+/**
+ * @brief Read directories until there are none left, then sort what matched.
+ * @param arg The worker.
+ * @return NULL.
+ */
+void *sh_glob_work(void *arg) {
+    struct sh_glob_worker *w = arg;
+    struct sh_glob *g = w->g;
+    struct sh_glob_task *task;
+    struct sh_glob_dir *dir;
+    int done;
+
+    for (;;) {
+        if ((task = sh_glob_take(w)) != NULL) {
+            if ((dir = sh_glob_enter(w, task->parent, task->name, strlen(task->name))) != NULL) {
+                sh_glob_walk(w, task->part, dir);
+                sh_glob_leave(dir);
+            }
+            sh_glob_leave(task->parent);
+            sh_glob_done(g);
+            continue;
+        }
+        pthread_mutex_lock(&g->lock);
+        __atomic_add_fetch(&g->idle, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&g->queued, __ATOMIC_SEQ_CST) == 0 && __atomic_load_n(&g->pending, __ATOMIC_SEQ_CST) > 0) {
+            pthread_cond_wait(&g->wake, &g->lock);
+        }
+        __atomic_sub_fetch(&g->idle, 1, __ATOMIC_SEQ_CST);
+        done = __atomic_load_n(&g->pending, __ATOMIC_SEQ_CST) == 0;
+        pthread_mutex_unlock(&g->lock);
+        if (done) {
+            break;
+        }
+    }
+    sh_glob_sort(w->matches.words, w->matches.count, g->bytewise);
+    return NULL;
+}
+
+/**
+ * @brief Get the number of threads for a pattern with "**": $SH_GLOB_THREADS, or one per CPU.
+ * @return The number of threads.
+ */
+int sh_glob_threads(void) {
+    const char *value = sh_var_get("SH_GLOB_THREADS");
+    long n = value != NULL && *value != '\0' ? atol(value) : sysconf(_SC_NPROCESSORS_ONLN);
+
+    return n < 1 ? 1 : n > SH_GLOB_MAX_THREADS ? SH_GLOB_MAX_THREADS : (int) n;
+}
+
+/**
+ * @brief Merge the sorted matches of the workers.
+ * @param g The pattern.
+ * @param fields Where to add the matches, in order.
+ */
+void sh_glob_merge(struct sh_glob *g, struct sh_fields *fields) {
+    int next[SH_GLOB_MAX_THREADS] = {0};
+    struct sh_glob_worker *w;
+    char *min;
+    int i, from;
+
+    for (;;) {
+        min = NULL;
+        from = 0;
+        for (i = 0; i < g->num_workers; i++) {
+            w = &g->workers[i];
+            if (next[i] < w->matches.count && (min == NULL || (g->bytewise ? strcmp(w->matches.words[next[i]], min)
+                                                                          : strcoll(w->matches.words[next[i]], min)) < 0)) {
+                min = w->matches.words[next[i]];
+                from = i;
+            }
+        }
+        if (min == NULL) {
+            return;
+        }
+        sh_fields_push(fields, min);
+        next[from]++;
+    }
+}
+
+/**
+ * @brief Expand a field that is a pattern into the pathnames that match it.
+ * @param arena Where to put the pathnames.
+ * @param pattern The pattern, with the characters that were quoted escaped.
+ * @param len Length of the pattern.
+ * @param fields Where to add the pathnames, sorted.
+ * @return Number of pathnames added: 0 if none match, or if it isn't a pattern after all.
+ */
+int sh_glob(struct sh_arena *arena, const char *pattern, size_t len, struct sh_fields *fields) {
+    struct sh_glob g = {0};
+    struct sh_glob_worker *w;
+    struct sh_glob_dir *root;
+    sigset_t all, old;
+    int first = fields->count, started, i, fd;
+
+    pattern = sh_arena_strndup(arena, pattern, len);
+    if (!sh_glob_compile(&g, arena, pattern, len)) {
+        return 0;
+    }
+    if ((fd = open(*pattern == '/' ? "/" : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        return 0;
+    }
+    if (sh_glob_buf == NULL && (sh_glob_buf = malloc(SH_GLOB_BUFFER_SIZE)) == NULL) {
+        fprintf(stderr, "sh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+
+    g.bytewise = sh_glob_bytewise();
+    g.num_workers = g.any ? sh_glob_threads() : 1;
+    g.workers = calloc(g.num_workers, sizeof(struct sh_glob_worker));
+    if (!g.workers) {
+        fprintf(stderr, "sh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_init(&g.lock, NULL);
+    pthread_cond_init(&g.wake, NULL);
+    for (i = 0; i < g.num_workers; i++) {
+        w = &g.workers[i];
+        w->g = &g;
+        w->buf = i == 0 ? sh_glob_buf : malloc(SH_GLOB_BUFFER_SIZE);
+        if (!w->buf) {
+            fprintf(stderr, "sh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        pthread_mutex_init(&w->lock, NULL);
+    }
+
+    // The shell reads the top directory itself. The other workers leave signals to it.
+    g.pending = 1;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    for (started = 1; started < g.num_workers; started++) {
+        if (pthread_create(&g.workers[started].thread, NULL, sh_glob_work, &g.workers[started]) != 0) {
+            break;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    root = sh_arena_alloc(&g.workers[0].arena, sizeof(struct sh_glob_dir));
+    root->fd = fd;
+    root->refs = 1;
+    root->path = *pattern == '/' ? "/" : "";
+    root->path_len = *pattern == '/';
+    sh_glob_walk(&g.workers[0], 0, root);
+    sh_glob_leave(root);
+    sh_glob_done(&g);
+    sh_glob_work(&g.workers[0]);
+    for (i = 1; i < started; i++) {
+        pthread_join(g.workers[i].thread, NULL);
+    }
+
+    sh_glob_merge(&g, fields);
+    for (i = 0; i < g.num_workers; i++) {
+        w = &g.workers[i];
+        sh_arena_adopt(arena, &w->arena);
+        free(w->matches.words);
+        free(w->tasks);
+        if (i > 0) {
+            free(w->buf);
+        }
+        pthread_mutex_destroy(&w->lock);
+    }
+    free(g.workers);
+    pthread_cond_destroy(&g.wake);
+    pthread_mutex_destroy(&g.lock);
+    return fields->count - first;
+}
+
+
+/*
+ * Parsing
+ *
+ * The tokens of a line are turned into a tree that says how the commands relate to each
+ * other. The grammar is a subset of the POSIX one:
+ *
+ *   list     : and_or (separator and_or)* [separator]
+ *   and_or   : pipeline (("&&" | "||") pipeline)*
+ *   pipeline : ["!"] command ("|" command)*
+ *   command  : simple | compound redirect* | function
+ *   compound : "(" list ")" | "{" list "}" | if | while | for | case
+ *   function : name "(" ")" compound redirect*
+ *   if       : "if" list "then" list ("elif" list "then" list)* ["else" list] "fi"
+ *   while    : ("while" | "until") list "do" list "done"
+ *   for      : "for" name ["in" word* separator] "do" list "done"
+ *   case     : "case" word "in" (["("] word ("|" word)* ")" [list] ";;")* "esac"
+ *   simple   : (word | redirect)+
+ *   redirect : [io_number] ("<" | ">" | ">>" | ">|" | "<>" | "<&" | ">&" | "<<" | "<<-" | "<<<") word
+ *
+ * A separator is ";", "&" or a newline, and newlines may also follow "&&", "||", "|",
+ * and the keywords. Keywords like "if" and "done" are only keywords where a command
+ * starts (and when they are not quoted); anywhere else they are ordinary words. The
+ * last ";;" of a "case" may be left out. A function definition is also a command: it is
+ * recognized by the "(" ")" after the name.
+ *
+ * The parser is a plain recursive-descent parser, with one function per rule. All the
+ * nodes (and copies of the words they contain) are allocated from an arena, so a tree
+ * is a compact block of memory that doesn't depend on the line it came from. That lets
+ * the shell parse something once and run it as many times as it likes: a loop body is
+ * parsed once, and each trip around the loop is a walk over the same nodes.
+ */
+
+enum sh_node_type {
+    SH_NODE_COMMAND,
+    SH_NODE_PIPELINE,
+    SH_NODE_AND,
+    SH_NODE_OR,
+    SH_NODE_LIST,
+    SH_NODE_SUBSHELL,
+    SH_NODE_IF,
+    SH_NODE_WHILE,
+    SH_NODE_UNTIL,
+    SH_NODE_FOR,
+    SH_NODE_CASE,
+    SH_NODE_GROUP,
+    SH_NODE_FUNCTION,
+};
+
+// Node flags.
+#define SH_NODE_ASYNC      0x1   // list item ended with "&"
+#define SH_NODE_NEGATE     0x2   // pipeline started with "!"
+#define SH_NODE_TAIL       0x4   // nothing runs after this command (see sh_exec_tail())
+#define SH_NODE_TIME       0x8   // pipeline started with "time" (see sh_exec_timed())
+#define SH_NODE_TIME_POSIX 0x10  // "time -p": report in the POSIX format
+
+struct sh_redir {
+    struct sh_redir *next;
+    enum sh_token_type op;
+    int fd;
+    struct sh_word target;     // for a here-document, its delimiter
+    struct sh_word body;       // here-documents only
+};
+
+struct sh_case_item {
+    struct sh_case_item *next;
+    int num_patterns;
+    struct sh_word *patterns;
+    struct sh_node *body;      // NULL if empty
+};
+
+struct sh_node {
+    enum sh_node_type type;
+    int flags;
+    struct sh_node *next;      // next stage of a pipeline, or next item of a list
+    struct sh_redir *redirs;
+    union {
+        struct {
+            int argc;
+            struct sh_word *words;
+        } command;
+        struct {
+            struct sh_node *first;
+        } list;                // SH_NODE_PIPELINE, SH_NODE_LIST, SH_NODE_SUBSHELL and SH_NODE_GROUP
+        struct {
+            struct sh_node *left;
+            struct sh_node *right;
+        } binary;              // SH_NODE_AND and SH_NODE_OR
+        struct {
+            struct sh_node *cond;
+            struct sh_node *body;
+            struct sh_node *orelse;  // "elif" (another SH_NODE_IF) or "else", or NULL
+        } cond;                // SH_NODE_IF, SH_NODE_WHILE and SH_NODE_UNTIL
+        struct {
+            struct sh_word name;
+            int argc;          // -1 without "in": loop over "$@"
+            struct sh_word *words;
+            struct sh_node *body;
+        } loop;                // SH_NODE_FOR
+        struct {
+            struct sh_word word;
+            struct sh_case_item *items;
+        } cases;               // SH_NODE_CASE
+        struct {
+            struct sh_word name;
+            struct sh_node *body;
+        } func;                // SH_NODE_FUNCTION
+    };
+};
+
+struct sh_parser {
+    struct sh_token *tokens;
+    size_t num_tokens;
+    size_t pos;
+    struct sh_arena *arena;
+    struct sh_word *words;     // scratch space for the words of a simple command
+    size_t words_capacity;
+    struct sh_heredoc *heredocs;
+    size_t heredoc;            // the next one to be met
+    int incomplete;
+    const struct sh_token *error;
+};
+
+#define SH_PARSE_OK          0
+#define SH_PARSE_INCOMPLETE  1
+#define SH_PARSE_ERROR      -1
+
+struct sh_node *sh_parse_list(struct sh_parser *parser, enum sh_token_type terminator);
+struct sh_node *sh_parse_command(struct sh_parser *parser);
+
+/**
+ * @brief Look at the current token without consuming it.
+ * @param parser The parser.
+ * @return The token, or NULL at the end of the input.
+ */
+struct sh_token *sh_parse_peek(struct sh_parser *parser) {
+    return parser->pos < parser->num_tokens ? &parser->tokens[parser->pos] : NULL;
+}
+
+/**
+ * @brief Check whether the current token is an operator of the given type.
+ */
+int sh_parse_at(struct sh_parser *parser, enum sh_token_type type) {
+    struct sh_token *token = sh_parse_peek(parser);
+    return token != NULL && token->type == type;
+}
+
+/**
+ * @brief Check whether the current token is a given unquoted word, like a keyword.
+ * @param parser The parser.
+ * @param word The word.
+ * @return 1 if it is, 0 if not.
+ */
+int sh_parse_at_word(struct sh_parser *parser, const char *word) {
+    struct sh_token *token = sh_parse_peek(parser);
+
+    return token != NULL && token->type == SH_TOKEN_WORD && token->flags == 0
+           && token->len == strlen(word) && memcmp(token->text, word, token->len) == 0;
+}
+
+/**
+ * @brief Check whether the current token is a keyword that ends a list, like "fi".
+ */
+int sh_parse_at_list_end(struct sh_parser *parser) {
+    static const char *const words[] = {"then", "elif", "else", "fi", "do", "done", "esac", "}"};
+    size_t i;
+
+    for (i = 0; i < sizeof(words) / sizeof(words[0]); i++) {
+        if (sh_parse_at_word(parser, words[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Skip any newlines.
+ */
+void sh_parse_newlines(struct sh_parser *parser) {
+    while (sh_parse_at(parser, SH_TOKEN_NEWLINE)) {
+        parser->pos++;
+    }
+}
+
+/**
+ * @brief Record a syntax error at the current token.
+ * @param parser The parser.
+ * @return NULL, for convenience.
+ */
+struct sh_node *sh_parse_fail(struct sh_parser *parser) {
+    if (parser->error == NULL && !parser->incomplete) {
+        if (parser->pos >= parser->num_tokens) {
+            parser->incomplete = 1;
+        } else {
+            parser->error = &parser->tokens[parser->pos];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Allocate a node.
+ */
+struct sh_node *sh_parse_node(struct sh_parser *parser, enum sh_node_type type) {
+    struct sh_node *node = sh_arena_alloc(parser->arena, sizeof(struct sh_node));
+
+    memset(node, 0, sizeof(struct sh_node));
+    node->type = type;
+    return node;
+}
+
+/**
+ * @brief Copy a word token into the tree.
+ */
+void sh_parse_word(struct sh_parser *parser, const struct sh_token *token, struct sh_word *word) {
+    word->text = sh_arena_strndup(parser->arena, token->text, token->len);
+    word->len = token->len;
+    word->flags = token->flags;
+}
+
+/**
+ * @brief Check whether a token starts a redirection.
+ */
+int sh_token_is_redirect(const struct sh_token *token) {
+    return token->type == SH_TOKEN_IO_NUMBER || (token->type >= SH_TOKEN_LESS && token->type <= SH_TOKEN_TLESS);
+}
+
+/**
+ * @brief Copy the body of a here-document into the tree.
+ *
+ * With "<<-", the tabs at the start of each line go. If any part of the delimiter was
+ * quoted, the body is taken as it is; if not, "$", "`" and "\" work in it like they do
+ * in double quotes.
+ *
+ * @param parser The parser.
+ * @param heredoc The here-document, as the lexer found it.
+ * @param redir Its redirection.
+ */
+void sh_parse_heredoc(struct sh_parser *parser, const struct sh_heredoc *heredoc, struct sh_redir *redir) {
+    const char *p = heredoc->body, *end = heredoc->body + heredoc->len;
+    char *body;
+    size_t len = 0;
+
+    if (!heredoc->strip) {
+        body = sh_arena_strndup(parser->arena, p, heredoc->len);
+        len = heredoc->len;
+    } else {
+        body = sh_arena_alloc(parser->arena, heredoc->len + 1);
+        while (p < end) {
+            for (; p < end && *p == '\t'; p++);
+            for (; p < end && *p != '\n'; p++) {
+                body[len++] = *p;
+            }
+            if (p < end) {
+                body[len++] = *p++;
+            }
+        }
+        body[len] = '\0';
+    }
+
+    redir->body.text = body;
+    redir->body.len = len;
+    redir->body.flags = 0;
+    if (!(redir->target.flags & SH_WORD_QUOTED) && (memchr(body, '$', len) != NULL || memchr(body, '`', len) != NULL ||
+                                                   memchr(body, '\\', len) != NULL)) {
+        redir->body.flags = SH_WORD_HEREDOC | SH_WORD_DOLLAR;
+    }
+}
+
+/**
+ * @brief Parse a redirection and append it to a list.
+ * @param parser The parser. The current token starts a redirection.
+ * @param tail Where to link the redirection.
+ * @return The new end of the list, or NULL on error.
+ */
+struct sh_redir **sh_parse_redirect(struct sh_parser *parser, struct sh_redir **tail) {
+    struct sh_token *token = sh_parse_peek(parser);
+    struct sh_redir *redir = sh_arena_alloc(parser->arena, sizeof(struct sh_redir));
+
+    redir->next = NULL;
+    redir->fd = -1;
+    if (token->type == SH_TOKEN_IO_NUMBER) {
+        redir->fd = atoi(token->text);
+        parser->pos++;
+        token = sh_parse_peek(parser);
+    }
+    redir->op = token->type;
+    if (redir->fd < 0) {
+        redir->fd = (redir->op == SH_TOKEN_LESS || redir->op == SH_TOKEN_LESSGREAT || redir->op == SH_TOKEN_LESSAND ||
+                     redir->op >= SH_TOKEN_DLESS) ? 0 : 1;
+    }
+    parser->pos++;
+
+    token = sh_parse_peek(parser);
+    if (token == NULL || token->type != SH_TOKEN_WORD) {
+        sh_parse_fail(parser);
+        return NULL;
+    }
+    sh_parse_word(parser, token, &redir->target);
+    parser->pos++;
+    if (redir->op == SH_TOKEN_DLESS || redir->op == SH_TOKEN_DLESSDASH) {
+        sh_parse_heredoc(parser, &parser->heredocs[parser->heredoc++], redir);
+    }
+
+    *tail = redir;
+    return &redir->next;
+}
+
+/**
+ * @brief Copy the current word token into the parser's scratch space, and move on.
+ * @param parser The parser.
+ * @param n Number of words already in the scratch space.
+ */
+void sh_parse_scratch_word(struct sh_parser *parser, size_t n) {
+    if (n >= parser->words_capacity) {
+        parser->words_capacity = parser->words_capacity ? parser->words_capacity * 2 : 32;
+        parser->words = realloc(parser->words, parser->words_capacity * sizeof(struct sh_word));
+        if (!parser->words) {
+            fprintf(stderr, "sh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    sh_parse_word(parser, sh_parse_peek(parser), &parser->words[n]);
+    parser->pos++;
+}
+
+/**
+ * @brief Copy words out of the scratch space, so they sit next to each other in the arena.
+ */
+struct sh_word *sh_parse_scratch_copy(struct sh_parser *parser, size_t n) {
+    struct sh_word *words = sh_arena_alloc(parser->arena, n * sizeof(struct sh_word));
+
+    memcpy(words, parser->words, n * sizeof(struct sh_word));
+    return words;
+}
+
+/**
+ * @brief simple : (word | redirect)+
+ */
+struct sh_node *sh_parse_simple(struct sh_parser *parser) {
+    struct sh_node *node = sh_parse_node(parser, SH_NODE_COMMAND);
+    struct sh_redir **redir_tail = &node->redirs;
+    struct sh_token *token;
+    size_t argc = 0;
+
+    while ((token = sh_parse_peek(parser)) != NULL) {
+        if (token->type == SH_TOKEN_WORD) {
+            sh_parse_scratch_word(parser, argc++);
+        } else if (sh_token_is_redirect(token)) {
+            redir_tail = sh_parse_redirect(parser, redir_tail);
+            if (redir_tail == NULL) {
+                return NULL;
+            }
+        } else {
+            break;
+        }
+    }
+
+    if (argc == 0 && node->redirs == NULL) {
+        return sh_parse_fail(parser);
+    }
+
+    node->command.argc = argc;
+    node->command.words = sh_parse_scratch_copy(parser, argc);
+    return node;
+}
+
+/**
+ * @brief Expect a keyword, and skip the newlines after it.
+ * @param parser The parser.
+ * @param word The keyword.
+ * @return 1 if it was there, 0 if not (after recording a syntax error).
+ */
+int sh_parse_keyword(struct sh_parser *parser, const char *word) {
+    if (!sh_parse_at_word(parser, word)) {
+        sh_parse_fail(parser);
+        return 0;
+    }
+    parser->pos++;
+    sh_parse_newlines(parser);
+    return 1;
+}
+
+/**
+ * @brief if : "if" list "then" list ("elif" list "then" list)* ["else" list] "fi"
+ */
+struct sh_node *sh_parse_if(struct sh_parser *parser) {
+    struct sh_node *node = sh_parse_node(parser, SH_NODE_IF);
+
+    // Called at "if" or "elif".
+    parser->pos++;
+    if ((node->cond.cond = sh_parse_list(parser, SH_TOKEN_RPAREN)) == NULL || !sh_parse_keyword(parser, "then")
+        || (node->cond.body = sh_parse_list(parser, SH_TOKEN_RPAREN)) == NULL) {
+        return NULL;
+    }
+    if (sh_parse_at_word(parser, "elif")) {
+        node->cond.orelse = sh_parse_if(parser);
+        return node->cond.orelse != NULL ? node : NULL;
+    }
+    if (sh_parse_at_word(parser, "else")) {
+        parser->pos++;
+        if ((node->cond.orelse = sh_parse_list(parser, SH_TOKEN_RPAREN)) == NULL) {
+            return NULL;
+        }
+    }
+    if (!sh_parse_at_word(parser, "fi")) {
+        return sh_parse_fail(parser);
+    }
+    parser->pos++;
+    return node;
+}
+
+/**
+ * @brief Parse a loop body: "do" list "done".
+ */
+struct sh_node *sh_parse_do(struct sh_parser *parser) {
+    struct sh_node *body;
+
+    if (!sh_parse_keyword(parser, "do") || (body = sh_parse_list(parser, SH_TOKEN_RPAREN)) == NULL) {
+        return NULL;
+    }
+    if (!sh_parse_at_word(parser, "done")) {
+        return sh_parse_fail(parser);
+    }
+    parser->pos++;
+    return body;
+}
+
+/**
+ * @brief while : ("while" | "until") list "do" list "done"
+ */
+struct sh_node *sh_parse_while(struct sh_parser *parser) {
+    struct sh_node *node = sh_parse_node(parser, sh_parse_at_word(parser, "while") ? SH_NODE_WHILE : SH_NODE_UNTIL);
+
+    parser->pos++;
+    if ((node->cond.cond = sh_parse_list(parser, SH_TOKEN_RPAREN)) == NULL
+        || (node->cond.body = sh_parse_do(parser)) == NULL) {
+        return NULL;
+    }
+    return node;
+}
+
+/**
+ * @brief for : "for" name ["in" word* separator] "do" list "done"
+ */
+struct sh_node *sh_parse_for(struct sh_parser *parser) {
+    struct sh_node *node = sh_parse_node(parser, SH_NODE_FOR);
+    struct sh_token *token;
+    size_t n = 0;
+
+    parser->pos++;
+    token = sh_parse_peek(parser);
+    if (token == NULL || token->type != SH_TOKEN_WORD || sh_var_name_len(token->text, token->len) != token->len) {
+        return sh_parse_fail(parser);
+    }
+    sh_parse_word(parser, token, &node->loop.name);
+    parser->pos++;
+    sh_parse_newlines(parser);
+
+    node->loop.argc = -1;
+    if (sh_parse_at_word(parser, "in")) {
+        parser->pos++;
+        while ((token = sh_parse_peek(parser)) != NULL && token->type == SH_TOKEN_WORD) {
+            sh_parse_scratch_word(parser, n++);
+        }
+        node->loop.argc = n;
+        node->loop.words = sh_parse_scratch_copy(parser, n);
+        if (!sh_parse_at(parser, SH_TOKEN_SEMI) && !sh_parse_at(parser, SH_TOKEN_NEWLINE)) {
+            return sh_parse_fail(parser);
+        }
+        parser->pos++;
+    } else if (sh_parse_at(parser, SH_TOKEN_SEMI)) {
+        parser->pos++;
+    }
+    sh_parse_newlines(parser);
+
+    node->loop.body = sh_parse_do(parser);
+    return node->loop.body != NULL ? node : NULL;
+}
+
+/**
+ * @brief case : "case" word "in" (["("] word ("|" word)* ")" [list] ";;")* "esac"
+ */
+struct sh_node *sh_parse_case(struct sh_parser *parser) {
+    struct sh_node *node = sh_parse_node(parser, SH_NODE_CASE);
+    struct sh_case_item *item, **tail = &node->cases.items;
+    struct sh_token *token;
+    size_t n;
+
+    parser->pos++;
+    token = sh_parse_peek(parser);
+    if (token == NULL || token->type != SH_TOKEN_WORD) {
+        return sh_parse_fail(parser);
+    }
+    sh_parse_word(parser, token, &node->cases.word);
+    parser->pos++;
+    sh_parse_newlines(parser);
+    if (!sh_parse_keyword(parser, "in")) {
+        return NULL;
+    }
+
+    while (!sh_parse_at_word(parser, "esac")) {
+        item = sh_arena_alloc(parser->arena, sizeof(struct sh_case_item));
+        item->next = NULL;
+        item->body = NULL;
+
+        if (sh_parse_at(parser, SH_TOKEN_LPAREN)) {
+            parser->pos++;
+        }
+        n = 0;
+        while (1) {
+            token = sh_parse_peek(parser);
+            if (token == NULL || token->type != SH_TOKEN_WORD) {
+                return sh_parse_fail(parser);
+            }
+            sh_parse_scratch_word(parser, n++);
+            if (!sh_parse_at(parser, SH_TOKEN_PIPE)) {
+                break;
+            }
+            parser->pos++;
+        }
+        if (!sh_parse_at(parser, SH_TOKEN_RPAREN)) {
+            return sh_parse_fail(parser);
+        }
+        parser->pos++;
+        item->num_patterns = n;
+        item->patterns = sh_parse_scratch_copy(parser, n);
+        sh_parse_newlines(parser);
+
+        if (!sh_parse_at(parser, SH_TOKEN_DSEMI) && !sh_parse_at_word(parser, "esac")) {
+            if ((item->body = sh_parse_list(parser, SH_TOKEN_DSEMI)) == NULL) {
+                return NULL;
+            }
+        }
+        *tail = item;
+        tail = &item->next;
+
+        if (sh_parse_at(parser, SH_TOKEN_DSEMI)) {
+            parser->pos++;
+            sh_parse_newlines(parser);
+        } else if (!sh_parse_at_word(parser, "esac")) {
+            return sh_parse_fail(parser);
+        }
+    }
+    parser->pos++;
+    return node;
+}
+
+/**
+ * @brief function : name "(" ")" compound redirect*
+ */
+struct sh_node *sh_parse_function(struct sh_parser *parser) {
+    struct sh_node *node = sh_parse_node(parser, SH_NODE_FUNCTION);
+
+    sh_parse_word(parser, &parser->tokens[parser->pos], &node->func.name);
+    parser->pos += 3;
+    sh_parse_newlines(parser);
+    // The body must be a compound command.
+    if (!sh_parse_at(parser, SH_TOKEN_LPAREN) && !sh_parse_at_word(parser, "{") && !sh_parse_at_word(parser, "if")
+        && !sh_parse_at_word(parser, "while") && !sh_parse_at_word(parser, "until")
+        && !sh_parse_at_word(parser, "for") && !sh_parse_at_word(parser, "case")) {
+        return sh_parse_fail(parser);
+    }
+    node->func.body = sh_parse_command(parser);
+    return node->func.body != NULL ? node : NULL;
+}
+
+/**
+ * @brief command : simple | compound redirect* | function
+ */
+struct sh_node *sh_parse_command(struct sh_parser *parser) {
+    struct sh_node *node;
+    struct sh_redir **redir_tail;
+    struct sh_token *token;
+
+    token = sh_parse_peek(parser);
+    if (token != NULL && token->type == SH_TOKEN_WORD && parser->pos + 2 < parser->num_tokens
+        && parser->tokens[parser->pos + 1].type == SH_TOKEN_LPAREN
+        && parser->tokens[parser->pos + 2].type == SH_TOKEN_RPAREN
+        && sh_var_name_len(token->text, token->len) == token->len) {
+        return sh_parse_function(parser);
+    }
+
+    if (sh_parse_at(parser, SH_TOKEN_LPAREN)) {
+        parser->pos++;
+        node = sh_parse_node(parser, SH_NODE_SUBSHELL);
+        node->list.first = sh_parse_list(parser, SH_TOKEN_RPAREN);
+        if (node->list.first == NULL) {
+            return NULL;
+        }
+        if (!sh_parse_at(parser, SH_TOKEN_RPAREN)) {
+            return sh_parse_fail(parser);
+        }
+        parser->pos++;
+    } else if (sh_parse_at_word(parser, "{")) {
+        parser->pos++;
+        node = sh_parse_node(parser, SH_NODE_GROUP);
+        node->list.first = sh_parse_list(parser, SH_TOKEN_RPAREN);
+        if (node->list.first == NULL) {
+            return NULL;
+        }
+        if (!sh_parse_at_word(parser, "}")) {
+            return sh_parse_fail(parser);
+        }
+        parser->pos++;
+    } else if (sh_parse_at_word(parser, "if")) {
+        node = sh_parse_if(parser);
+    } else if (sh_parse_at_word(parser, "while") || sh_parse_at_word(parser, "until")) {
+        node = sh_parse_while(parser);
+    } else if (sh_parse_at_word(parser, "for")) {
+        node = sh_parse_for(parser);
+    } else if (sh_parse_at_word(parser, "case")) {
+        node = sh_parse_case(parser);
+    } else if (sh_parse_at_list_end(parser)) {
+        return sh_parse_fail(parser);
+    } else {
+        return sh_parse_simple(parser);
+    }
+    if (node == NULL) {
+        return NULL;
+    }
+
+    redir_tail = &node->redirs;
+    while ((token = sh_parse_peek(parser)) != NULL && sh_token_is_redirect(token)) {
+        redir_tail = sh_parse_redirect(parser, redir_tail);
+        if (redir_tail == NULL) {
+            return NULL;
+        }
+    }
+    return node;
+}
+
+/**
+ * @brief pipeline : ["time" ["-p"]] ["!"] command ("|" command)*
+ */
+struct sh_node *sh_parse_pipeline(struct sh_parser *parser) {
+    struct sh_node *node = sh_parse_node(parser, SH_NODE_PIPELINE), **tail = &node->list.first;
+
+    if (sh_parse_at_word(parser, "time")) {
+        node->flags |= SH_NODE_TIME;
+        parser->pos++;
+        if (sh_parse_at_word(parser, "-p")) {
+            node->flags |= SH_NODE_TIME_POSIX;
+            parser->pos++;
+        }
+    }
+    if (sh_parse_at_word(parser, "!")) {
+        node->flags |= SH_NODE_NEGATE;
+        parser->pos++;
+    }
+
+    while (1) {
+        *tail = sh_parse_command(parser);
+        if (*tail == NULL) {
+            return NULL;
+        }
+        tail = &(*tail)->next;
+        if (!sh_parse_at(parser, SH_TOKEN_PIPE)) {
+            return node;
+        }
+        parser->pos++;
+        sh_parse_newlines(parser);
+    }
+}
+
+/**
+ * @brief and_or : pipeline (("&&" | "||") pipeline)*
+ */
+struct sh_node *sh_parse_and_or(struct sh_parser *parser) {
+    struct sh_node *node, *left;
+
+    left = sh_parse_pipeline(parser);
+    while (left != NULL && (sh_parse_at(parser, SH_TOKEN_AND_IF) || sh_parse_at(parser, SH_TOKEN_OR_IF))) {
+        node = sh_parse_node(parser, sh_parse_at(parser, SH_TOKEN_AND_IF) ? SH_NODE_AND : SH_NODE_OR);
+        parser->pos++;
+        sh_parse_newlines(parser);
+        node->binary.left = left;
+        node->binary.right = sh_parse_pipeline(parser);
+        if (node->binary.right == NULL) {
+            return NULL;
+        }
+        left = node;
+    }
+    return left;
+}
+
+/**
+ * @brief list : and_or (separator and_or)* [separator]
+ * @param parser The parser.
+ * @param terminator Token type that ends the list (besides the end of the input and the
+ *                   keywords that end lists, like "fi").
+ * @return The list, or NULL on error.
+ */
+struct sh_node *sh_parse_list(struct sh_parser *parser, enum sh_token_type terminator) {
+    struct sh_node *node = sh_parse_node(parser, SH_NODE_LIST), **tail = &node->list.first;
+    struct sh_token *token;
+
+    sh_parse_newlines(parser);
+    while (1) {
+        *tail = sh_parse_and_or(parser);
+        if (*tail == NULL) {
+            return NULL;
+        }
+
+        token = sh_parse_peek(parser);
+        if (token != NULL && (token->type == SH_TOKEN_SEMI || token->type == SH_TOKEN_AMP ||
+                              token->type == SH_TOKEN_NEWLINE)) {
+            if (token->type == SH_TOKEN_AMP) {
+                (*tail)->flags |= SH_NODE_ASYNC;
+            }
+            parser->pos++;
+            sh_parse_newlines(parser);
+            token = sh_parse_peek(parser);
+        } else if (token != NULL && token->type != terminator && !sh_parse_at_list_end(parser)) {
+            return sh_parse_fail(parser);
+        }
+        tail = &(*tail)->next;
+
+        if (token == NULL || token->type == terminator || sh_parse_at_list_end(parser)) {
+            return node;
+        }
+    }
+}
+
+/**
+ * @brief Parse a lexed line into a tree.
+ * @param parser The parser. Its scratch space is reused between calls.
+ * @param lexer The lexed line.
+ * @param arena Where to allocate the tree.
+ * @param tree Set to the tree, or NULL if the line is empty.
+ * @return SH_PARSE_OK, SH_PARSE_INCOMPLETE if the line ends in the middle of a command,
+ *         or SH_PARSE_ERROR (after printing a message).
+ */
+int sh_parse(struct sh_parser *parser, struct sh_lexer *lexer, struct sh_arena *arena, struct sh_node **tree) {
+    parser->tokens = lexer->tokens;
+    parser->num_tokens = lexer->num_tokens;
+    parser->heredocs = lexer->heredocs;
+    parser->heredoc = 0;
+    parser->pos = 0;
+    parser->arena = arena;
+    parser->incomplete = 0;
+    parser->error = NULL;
+
+    *tree = NULL;
+    if (lexer->num_tokens == 0) {
+        return SH_PARSE_OK;
+    }
+
+    *tree = sh_parse_list(parser, SH_TOKEN_RPAREN);
+    if (*tree != NULL && parser->pos < parser->num_tokens) {
+        sh_parse_fail(parser);
+        *tree = NULL;
+    }
+    if (*tree != NULL) {
+        return SH_PARSE_OK;
+    }
+    if (parser->incomplete) {
+        return SH_PARSE_INCOMPLETE;
+    }
+    fprintf(stderr, "sh: syntax error near unexpected token `%.*s'\n",
+            (int) parser->error->len, parser->error->text);
+    return SH_PARSE_ERROR;
+}
+
+
+/*
+ * Redirections
+ *
+ * "cmd > file" means: open the file, and run cmd with it as its stdout. The shell opens
+ * the files itself, up front. That way an error like a missing file is reported once,
+ * with the file's name, before anything is started. The files are opened with O_CLOEXEC
+ * and moved above the file descriptors scripts normally use, so that the only thing
+ * left to do in the child is one dup2() per redirection ("2>&1" is a dup2() too, and
+ * "2>&-" a close()). No close() is needed afterwards, since exec closes the originals.
+ *
+ * The resulting list of file descriptor actions is used in three ways:
+ *   - For programs, it becomes posix_spawn() file actions (or is applied by hand after
+ *     vfork() or fork()).
+ *   - For forked subshells and pipeline stages, the child applies it.
+ *   - For builtins, which run inside the shell, the shell saves the file descriptors it
+ *     is about to replace, applies the list, runs the builtin and puts them back.
+ *
+ * An action that is overwritten before anything reads it (like the first one in
+ * "cmd > a > b") is dropped from the list, although its file is still created.
+ *
+ * A here-document ("<<EOF") or here-string ("<<< word") is expanded by the shell and
+ * handed over as a file descriptor to read it from, like any other file: see
+ * sh_redirect_string().
+ */
+
+#define SH_REDIRECT_FD_BASE 10
+
+// Words are expanded into this arena while commands run (see "Executing the tree").
+struct sh_arena sh_exec_arena;
+struct sh_strbuf sh_expand_buf;
+struct sh_fields sh_expand_list;
+
+struct sh_redirs {
+    struct sh_fd_action *actions;
+    int num_actions;
+    int *opened;
+    int num_opened;
+};
+
+/**
+ * @brief Move a file descriptor we opened out of the way of the ones scripts use.
+ * @param fd The file descriptor, which is closed.
+ * @param above Also keep the result above this file descriptor.
+ * @return The new file descriptor (with O_CLOEXEC), or -1 on error.
+ */
+int sh_redirect_move_fd(int fd, int above) {
+    int moved;
+
+    if (fd >= SH_REDIRECT_FD_BASE && fd > above) {
+        return fd;
+    }
+    moved = fcntl(fd, F_DUPFD_CLOEXEC, above >= SH_REDIRECT_FD_BASE ? above + 1 : SH_REDIRECT_FD_BASE);
+    close(fd);
+    return moved;
+}
+
+#ifdef __linux__
+/**
+ * @brief Make a sealed in-memory file that holds a string.
+ * @param text The string.
+ * @param len Length of the string.
+ * @return The file, open for reading from the start, or -1 on error (with errno set).
+ */
+int sh_redirect_memfd(const char *text, size_t len) {
+    int fd = memfd_create("sh-heredoc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    size_t done;
+    ssize_t n;
+
+    if (fd < 0) {
+        return -1;
+    }
+    for (done = 0; done < len; done += n) {
+        n = write(fd, text + done, len - done);
+        if (n < 0 && errno != EINTR) {
+            close(fd);
+            return -1;
+        }
+        n = n < 0 ? 0 : n;
+    }
+    // The command gets it read-only, for good: nothing can change it behind its back.
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0 ||
+        lseek(fd, 0, SEEK_SET) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+#endif
+
+/**
+ * @brief Make a file descriptor that reads back a string, for "<<< word" and
+ *        here-documents.
+ *
+ * The string has to be in there before the command starts, since nobody reads it until
+ * we're done writing. A string that fits in a pipe goes into one. A bigger one goes into
+ * a sealed memfd, which holds any size without a temporary file on a disk or in /tmp
+ * (and without a name to clean up, or race with).
+ *
+ * @param text The string.
+ * @param len Length of the string.
+ * @return The file descriptor, or -1 on error (with errno set).
+ */
+int sh_redirect_string(const char *text, size_t len) {
+    int fds[2], size;
+
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        return -1;
+    }
+    size = fcntl(fds[1], F_GETPIPE_SZ);
+    if (size >= 0 && len > (size_t) size) {
+        close(fds[0]);
+        close(fds[1]);
+#ifdef __linux__
+        return sh_redirect_memfd(text, len);
+#else
+        errno = EFBIG;
+        return -1;
+#endif
+    }
+    if (write(fds[1], text, len) != (ssize_t) len) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    close(fds[1]);
+    return fds[0];
+}
+
+/**
+ * @brief Drop actions that are overwritten before anything reads them.
+ * @param redirs The redirections.
+ */
+void sh_redirect_optimize(struct sh_redirs *redirs) {
+    struct sh_fd_action *actions = redirs->actions;
+    int i, j, n = 0, dead;
+
+    for (i = 0; i < redirs->num_actions; i++) {
+        dead = 0;
+        for (j = i + 1; j < redirs->num_actions; j++) {
+            if (actions[j].src == actions[i].fd) {
+                break;
+            }
+            if (actions[j].fd == actions[i].fd) {
+                dead = 1;
+                break;
+            }
+        }
+        if (!dead) {
+            actions[n++] = actions[i];
+        }
+    }
+    redirs->num_actions = n;
+}
+
+/**
+ * @brief Close the files opened for a list of redirections.
+ * @param redirs The redirections.
+ */
+void sh_redirect_close(struct sh_redirs *redirs) {
+    int i;
+
+    for (i = 0; i < redirs->num_opened; i++) {
+        close(redirs->opened[i]);
+    }
+    redirs->num_opened = 0;
+}
+
+/**
+ * @brief Open the files of a list of redirections and work out the actions they need.
+ * @param list The redirections of a command.
+ * @param redirs Filled in, with memory from the execution arena.
+ * @return 0 on success, -1 on error (after printing a message and closing everything).
+ */
+int sh_redirect_prepare(struct sh_redir *list, struct sh_redirs *redirs) {
+    struct sh_fd_action *action;
+    struct sh_redir *redir;
+    const char *target, *body;
+    int count = 0, flags, fd, i, heredoc;
+
+    for (redir = list; redir != NULL; redir = redir->next) {
+        count++;
+    }
+    redirs->actions = sh_arena_alloc(&sh_exec_arena, count * sizeof(struct sh_fd_action));
+    redirs->opened = sh_arena_alloc(&sh_exec_arena, count * sizeof(int));
+    redirs->num_actions = 0;
+    redirs->num_opened = 0;
+
+    for (redir = list; redir != NULL; redir = redir->next) {
+        action = &redirs->actions[redirs->num_actions++];
+        action->fd = redir->fd;
+
+        // The delimiter of a here-document is only there to end it.
+        heredoc = redir->op == SH_TOKEN_DLESS || redir->op == SH_TOKEN_DLESSDASH;
+        target = heredoc ? "here-document" : sh_expand_word(&sh_exec_arena, &redir->target, &sh_expand_buf);
+        if (target == NULL) {
+            fprintf(stderr, "sh: %s: ambiguous redirect\n", redir->target.text);
+            goto fail;
+        }
+
+        switch (redir->op) {
+            case SH_TOKEN_LESSAND:
+            case SH_TOKEN_GREATAND:
+                if (strcmp(target, "-") == 0) {
+                    action->src = -1;
+                    continue;
+                }
+                for (i = 0; target[i] >= '0' && target[i] <= '9'; i++);
+                if (i == 0 || target[i] != '\0') {
+                    fprintf(stderr, "sh: %s: bad file descriptor\n", target);
+                    goto fail;
+                }
+                action->src = atoi(target);
+                // The source has to be open, by a redirection before this one or in the shell.
+                // The shell's own descriptors (all close-on-exec) don't count.
+                for (i = redirs->num_actions - 2; i >= 0 && redirs->actions[i].fd != action->src; i--);
+                flags = i >= 0 ? (redirs->actions[i].src < 0 ? -1 : 0) : fcntl(action->src, F_GETFD);
+                if (flags < 0 || (flags & FD_CLOEXEC)) {
+                    fprintf(stderr, "sh: %s: %s\n", target, strerror(EBADF));
+                    goto fail;
+                }
+                continue;
+            case SH_TOKEN_TLESS:
+                sh_strbuf_reserve(&sh_expand_buf, 0);
+                sh_expand_buf.len = 0;
+                sh_strbuf_append(&sh_expand_buf, target, strlen(target));
+                sh_strbuf_putc(&sh_expand_buf, '\n');
+                fd = sh_redirect_string(sh_expand_buf.data, sh_expand_buf.len);
+                break;
+            case SH_TOKEN_DLESS:
+            case SH_TOKEN_DLESSDASH:
+                // The body is one word, expanded without splitting (or taken as it is).
+                body = redir->body.flags != 0 ? sh_expand_word(&sh_exec_arena, &redir->body, &sh_expand_buf)
+                                              : redir->body.text;
+                if (body == NULL) {
+                    body = "";
+                }
+                fd = sh_redirect_string(body, strlen(body));
+                break;
+            default:
+                switch (redir->op) {
+                    case SH_TOKEN_LESS:
+                        flags = O_RDONLY;
+                        break;
+                    case SH_TOKEN_DGREAT:
+                        flags = O_WRONLY | O_CREAT | O_APPEND;
+                        break;
+                    case SH_TOKEN_LESSGREAT:
+                        flags = O_RDWR | O_CREAT;
+                        break;
+                    default:
+                        flags = O_WRONLY | O_CREAT | O_TRUNC;
+                        break;
+                }
+                fd = open(target, flags | O_CLOEXEC, 0666);
+                break;
+        }
+
+        if (fd >= 0) {
+            fd = sh_redirect_move_fd(fd, redir->fd);
+        }
+        if (fd < 0) {
+            fprintf(stderr, "sh: %s: %s\n", target, strerror(errno));
+            goto fail;
+        }
+        redirs->opened[redirs->num_opened++] = fd;
+        action->src = fd;
+    }
+
+    sh_redirect_optimize(redirs);
+    return 0;
+
+fail:
+    sh_redirect_close(redirs);
+    sh_last_status = 1;
+    return -1;
+}
+
+/*
+ * A file descriptor saved while a builtin runs with redirections.
+ */
+struct sh_saved_fd {
+    int fd;
+    int saved;    // copy of the original, or -1 if fd was closed
+};
+
+/**
+ * @brief Apply redirections to the shell itself, saving what they replace.
+ * @param redirs The redirections.
+ * @param saved Filled in with the saved file descriptors (one slot per action).
+ * @return Number of saved file descriptors.
+ */
+int sh_redirect_apply_saved(const struct sh_redirs *redirs, struct sh_saved_fd *saved) {
+    int i, j, n = 0;
+
+    fflush(stdout);
+    for (i = 0; i < redirs->num_actions; i++) {
+        for (j = 0; j < n && saved[j].fd != redirs->actions[i].fd; j++);
+        if (j == n) {
+            saved[n].fd = redirs->actions[i].fd;
+            saved[n].saved = fcntl(saved[n].fd, F_DUPFD_CLOEXEC, SH_REDIRECT_FD_BASE);
+            n++;
+        }
+    }
+    sh_apply_fd_actions(redirs->actions, redirs->num_actions);
+    return n;
+}
+
+/**
+ * @brief Put back the file descriptors saved by sh_redirect_apply_saved().
+ * @param saved The saved file descriptors.
+ * @param n Number of saved file descriptors.
+ */
+void sh_redirect_restore(struct sh_saved_fd *saved, int n) {
+    fflush(stdout);
+    while (n-- > 0) {
+        if (saved[n].saved >= 0) {
+            dup2(saved[n].saved, saved[n].fd);
+            close(saved[n].saved);
+        } else {
+            close(saved[n].fd);
+        }
+    }
+}
+
+
+/*
+ * Executing the tree
+ *
+ * Running a tree is a walk over its nodes. Words are expanded just before a command
+ * runs, into an arena that is rolled back as soon as the command is done, so the same
+ * tree can be run again and again without the shell's memory growing.
+ */
+
+int sh_exec_node(struct sh_node *node);
+int sh_exec_body(struct sh_node *node);
+struct sh_func *sh_func_find(const char *name);
+int sh_func_call(struct sh_func *func, char **args);
+void sh_func_define(struct sh_node *node);
+
+/**
+ * @brief Mark the commands after which the shell has nothing left to do.
+ * @param node The tree.
+ */
+void sh_mark_tail(struct sh_node *node) {
+    struct sh_case_item *item;
+    struct sh_node *last;
+
+    switch (node->type) {
+        case SH_NODE_COMMAND:
+        case SH_NODE_SUBSHELL:
+            node->flags |= SH_NODE_TAIL;
+            break;
+        case SH_NODE_PIPELINE:
+            if (node->list.first->next == NULL && !(node->flags & (SH_NODE_NEGATE | SH_NODE_TIME))) {
+                sh_mark_tail(node->list.first);
+            }
+            break;
+        case SH_NODE_AND:
+        case SH_NODE_OR:
+            sh_mark_tail(node->binary.right);
+            break;
+        case SH_NODE_LIST:
+            for (last = node->list.first; last->next != NULL; last = last->next);
+            if (!(last->flags & SH_NODE_ASYNC)) {
+                sh_mark_tail(last);
+            }
+            break;
+        case SH_NODE_IF:
+            // Whichever branch runs is the last thing that does. Loops run theirs again.
+            if (node->redirs == NULL) {
+                sh_mark_tail(node->cond.body);
+                if (node->cond.orelse != NULL) {
+                    sh_mark_tail(node->cond.orelse);
+                }
+            }
+            break;
+        case SH_NODE_CASE:
+            for (item = node->cases.items; node->redirs == NULL && item != NULL; item = item->next) {
+                if (item->body != NULL) {
+                    sh_mark_tail(item->body);
+                }
+            }
+            break;
+        case SH_NODE_GROUP:
+            if (node->redirs == NULL) {
+                sh_mark_tail(node->list.first);
+            }
+            break;
+        case SH_NODE_WHILE:
+        case SH_NODE_UNTIL:
+        case SH_NODE_FOR:
+        case SH_NODE_FUNCTION:
+            break;
+    }
+}
+
+// Redirection operators, from SH_TOKEN_LESS on.
+const char *const sh_redirect_ops[] = {"<", ">", ">>", ">|", "<>", "<&", ">&", "<<", "<<-", "<<<"};
+
+/**
+ * @brief Write a tree back out as text, the way "jobs" shows it.
+ * @param node The tree.
+ * @param buf Where to append the text.
+ */
+void sh_node_text(const struct sh_node *node, struct sh_strbuf *buf) {
+    const struct sh_case_item *case_item;
+    const struct sh_node *item;
+    const struct sh_redir *redir;
+    char fd[16];
+    int i;
+
+    switch (node->type) {
+        case SH_NODE_COMMAND:
+            for (i = 0; i < node->command.argc; i++) {
+                if (i > 0) {
+                    sh_strbuf_putc(buf, ' ');
+                }
+                sh_strbuf_append(buf, node->command.words[i].text, node->command.words[i].len);
+            }
+            break;
+        case SH_NODE_SUBSHELL:
+            sh_strbuf_putc(buf, '(');
+            sh_node_text(node->list.first, buf);
+            sh_strbuf_putc(buf, ')');
+            break;
+        case SH_NODE_PIPELINE:
+            if (node->flags & SH_NODE_TIME) {
+                sh_strbuf_append(buf, node->flags & SH_NODE_TIME_POSIX ? "time -p " : "time ",
+                                 node->flags & SH_NODE_TIME_POSIX ? 8 : 5);
+            }
+            if (node->flags & SH_NODE_NEGATE) {
+                sh_strbuf_append(buf, "! ", 2);
+            }
+            for (item = node->list.first; item != NULL; item = item->next) {
+                sh_node_text(item, buf);
+                if (item->next != NULL) {
+                    sh_strbuf_append(buf, " | ", 3);
+                }
+            }
+            break;
+        case SH_NODE_AND:
+        case SH_NODE_OR:
+            sh_node_text(node->binary.left, buf);
+            sh_strbuf_append(buf, node->type == SH_NODE_AND ? " && " : " || ", 4);
+            sh_node_text(node->binary.right, buf);
+            break;
+        case SH_NODE_LIST:
+            for (item = node->list.first; item != NULL; item = item->next) {
+                sh_node_text(item, buf);
+                if (item->next != NULL) {
+                    sh_strbuf_append(buf, item->flags & SH_NODE_ASYNC ? " & " : "; ", item->flags & SH_NODE_ASYNC ? 3 : 2);
+                }
+            }
+            break;
+        case SH_NODE_IF:
+            sh_strbuf_append(buf, "if ", 3);
+            for (item = node; item != NULL; item = item->cond.orelse) {
+                sh_node_text(item->cond.cond, buf);
+                sh_strbuf_append(buf, "; then ", 7);
+                sh_node_text(item->cond.body, buf);
+                if (item->cond.orelse != NULL && item->cond.orelse->type == SH_NODE_IF) {
+                    sh_strbuf_append(buf, "; elif ", 7);
+                } else {
+                    if (item->cond.orelse != NULL) {
+                        sh_strbuf_append(buf, "; else ", 7);
+                        sh_node_text(item->cond.orelse, buf);
+                    }
+                    break;
+                }
+            }
+            sh_strbuf_append(buf, "; fi", 4);
+            break;
+        case SH_NODE_WHILE:
+        case SH_NODE_UNTIL:
+            sh_strbuf_append(buf, node->type == SH_NODE_WHILE ? "while " : "until ", 6);
+            sh_node_text(node->cond.cond, buf);
+            sh_strbuf_append(buf, "; do ", 5);
+            sh_node_text(node->cond.body, buf);
+            sh_strbuf_append(buf, "; done", 6);
+            break;
+        case SH_NODE_FOR:
+            sh_strbuf_append(buf, "for ", 4);
+            sh_strbuf_append(buf, node->loop.name.text, node->loop.name.len);
+            if (node->loop.argc >= 0) {
+                sh_strbuf_append(buf, " in", 3);
+                for (i = 0; i < node->loop.argc; i++) {
+                    sh_strbuf_putc(buf, ' ');
+                    sh_strbuf_append(buf, node->loop.words[i].text, node->loop.words[i].len);
+                }
+            }
+            sh_strbuf_append(buf, "; do ", 5);
+            sh_node_text(node->loop.body, buf);
+            sh_strbuf_append(buf, "; done", 6);
+            break;
+        case SH_NODE_CASE:
+            sh_strbuf_append(buf, "case ", 5);
+            sh_strbuf_append(buf, node->cases.word.text, node->cases.word.len);
+            sh_strbuf_append(buf, " in", 3);
+            for (case_item = node->cases.items; case_item != NULL; case_item = case_item->next) {
+                for (i = 0; i < case_item->num_patterns; i++) {
+                    sh_strbuf_putc(buf, i == 0 ? ' ' : '|');
+                    sh_strbuf_append(buf, case_item->patterns[i].text, case_item->patterns[i].len);
+                }
+                sh_strbuf_append(buf, ") ", 2);
+                if (case_item->body != NULL) {
+                    sh_node_text(case_item->body, buf);
+                }
+                sh_strbuf_append(buf, ";;", 2);
+            }
+            sh_strbuf_append(buf, " esac", 5);
+            break;
+        case SH_NODE_GROUP:
+            sh_strbuf_append(buf, "{ ", 2);
+            sh_node_text(node->list.first, buf);
+            sh_strbuf_append(buf, "; }", 3);
+            break;
+        case SH_NODE_FUNCTION:
+            sh_strbuf_append(buf, node->func.name.text, node->func.name.len);
+            sh_strbuf_append(buf, "() ", 3);
+            sh_node_text(node->func.body, buf);
+            break;
+    }
+
+    for (redir = node->redirs; redir != NULL; redir = redir->next) {
+        sh_strbuf_putc(buf, ' ');
+        if (redir->fd != (sh_redirect_ops[redir->op - SH_TOKEN_LESS][0] == '<' ? 0 : 1)) {
+            snprintf(fd, sizeof(fd), "%d", redir->fd);
+            sh_strbuf_append(buf, fd, strlen(fd));
+        }
+        sh_strbuf_append(buf, sh_redirect_ops[redir->op - SH_TOKEN_LESS], strlen(sh_redirect_ops[redir->op - SH_TOKEN_LESS]));
+        sh_strbuf_append(buf, redir->target.text, redir->target.len);
+    }
+}
+
+/**
+ * @brief Describe a job for "jobs".
+ * @param node The job's command, or NULL.
+ * @param args Its arguments, if node is NULL.
+ * @return The description (to be freed with free()).
+ */
+char *sh_job_describe(struct sh_node *node, char **args) {
+    struct sh_strbuf buf = {0};
+    int i;
+
+    if (node != NULL) {
+        sh_node_text(node, &buf);
+    }
+    for (i = 0; node == NULL && args != NULL && args[i] != NULL; i++) {
+        if (i > 0) {
+            sh_strbuf_putc(&buf, ' ');
+        }
+        sh_strbuf_append(&buf, args[i], strlen(args[i]));
+    }
+    sh_strbuf_append(&buf, "", 0);
+    return buf.data;
+}
+
+/**
+ * @brief Count the assignments ("NAME=value" words) in front of a simple command.
+ * @param node The command.
+ * @return The number of leading words that are assignments.
+ */
+int sh_count_assignments(struct sh_node *node) {
+    const struct sh_word *word;
+    size_t len;
+    int i;
+
+    for (i = 0; i < node->command.argc; i++) {
+        word = &node->command.words[i];
+        len = sh_var_name_len(word->text, word->len);
+        if (len == 0 || len == word->len || word->text[len] != '=') {
+            break;
+        }
+    }
+    return i;
+}
+
+/**
+ * @brief Give up on a command because one of its words failed to expand.
+ * @return 1 to go on with the next command, or 0 if the shell should terminate, which a
+ *         shell that isn't interactive does.
+ */
+int sh_expand_abort(void) {
+    sh_last_status = 2;
+    return sh_interactive;
+}
+
+/**
+ * @brief Perform the assignments in front of a simple command.
+ * @param node The command.
+ * @param num Number of assignments.
+ * @param saved Where to put the old values aside, if the assignments only last as long as
+ *              the command (which then gets them in its environment), or NULL.
+ * @param mark Where to remember the environment from before, along with saved.
+ * @return 0, or -1 if a value failed to expand (the variables are all set anyway, so
+ *         that saved can undo them the same as ever).
+ */
+int sh_exec_assign(struct sh_node *node, int num, struct sh_var_saved *saved, struct sh_env_mark *mark) {
+    const struct sh_word *word;
+    struct sh_word value;
+    const char *text;
+    size_t len;
+    int i;
+
+    sh_expand_failed = 0;
+    if (saved != NULL) {
+        sh_env_mark(mark);
+    }
+    for (i = 0; i < num; i++) {
+        word = &node->command.words[i];
+        len = sh_var_name_len(word->text, word->len);
+        value.text = word->text + len + 1;
+        value.len = word->len - len - 1;
+        value.flags = word->flags;
+        text = sh_expand_assignment(&sh_exec_arena, &value, &sh_expand_buf);
+        if (saved != NULL) {
+            sh_var_save(word->text, len, &saved[i]);
+        }
+        sh_var_set(word->text, len, text != NULL ? text : "", saved != NULL ? SH_VAR_EXPORT : 0);
+    }
+    if (saved != NULL) {
+        mark->assigned = sh_vars.last_version;
+    }
+    return sh_expand_failed ? -1 : 0;
+}
+
+/**
+ * @brief Undo temporary assignments, last one first.
+ * @param saved The old values.
+ * @param num Number of assignments.
+ * @param mark The environment from before the assignments.
+ */
+void sh_exec_unassign(struct sh_var_saved *saved, int num, struct sh_env_mark *mark) {
+    int unchanged = sh_vars.last_version == mark->assigned;
+
+    while (num-- > 0) {
+        sh_var_restore(&saved[num]);
+    }
+    sh_env_return(mark, unchanged);
+}
+
+/**
+ * @brief Expand the words of a simple command into arguments.
+ * @param node The command.
+ * @param first The first word to expand (the ones before it are assignments).
+ * @return Null terminated list of arguments, in the execution arena, or NULL if a word
+ *         failed to expand (see sh_expand_abort()).
+ */
+char **sh_expand_args(struct sh_node *node, int first) {
+    struct sh_fields *fields = &sh_expand_list;
+    char **args;
+    int i;
+
+    fields->count = 0;
+    sh_expand_failed = 0;
+    for (i = first; i < node->command.argc; i++) {
+        sh_expand_fields(&sh_exec_arena, &node->command.words[i], &sh_expand_buf, fields);
+    }
+    if (sh_expand_failed) {
+        return NULL;
+    }
+    args = sh_arena_alloc(&sh_exec_arena, (fields->count + 1) * sizeof(char *));
+    if (fields->count > 0) {
+        memcpy(args, fields->words, fields->count * sizeof(char *));
+    }
+    args[fields->count] = NULL;
+    return args;
+}
+
+/**
+ * @brief Run a simple command.
+ *
+ * Assignments in front of a command only last as long as it does, except for special
+ * builtins like "export". Without a command, they set shell variables. A function runs
+ * in the shell, like a builtin.
+ *
+ * @param node The command.
+ * @return 1 if the shell should continue running, 0 if it should terminate.
+ */
+int sh_exec_command(struct sh_node *node) {
+    struct sh_arena_mark mark = sh_arena_get_mark(&sh_exec_arena);
+    struct sh_redirs redirs = {0};
+    struct sh_var_saved *vars = NULL;
+    struct sh_env_mark env_mark;
+    const struct sh_builtin *builtin;
+    struct sh_func *func = NULL;
+    struct sh_saved_fd *saved;
+    char **args;
+    int status = 1, num_saved, num_assigns;
+
+    sh_subst_status = -1;
+    num_assigns = sh_count_assignments(node);
+    args = sh_expand_args(node, num_assigns);
+    if (args == NULL) {
+        sh_arena_release(&sh_exec_arena, mark);
+        return sh_expand_abort();
+    }
+    if (node->redirs != NULL && sh_redirect_prepare(node->redirs, &redirs) < 0) {
+        sh_arena_release(&sh_exec_arena, mark);
+        return 1;
+    }
+
+    builtin = args[0] != NULL ? sh_builtin_lookup(args[0]) : NULL;
+    if (args[0] != NULL && (builtin == NULL || !(builtin->flags & SH_BUILTIN_SPECIAL))) {
+        // Functions come before regular builtins, but not before special ones.
+        func = sh_func_find(args[0]);
+    }
+    if (num_assigns > 0 && args[0] != NULL && (builtin == NULL || !(builtin->flags & SH_BUILTIN_SPECIAL))) {
+        vars = sh_arena_alloc(&sh_exec_arena, num_assigns * sizeof(struct sh_var_saved));
+    }
+    if (sh_exec_assign(node, num_assigns, vars, &env_mark) < 0) {
+        status = sh_expand_abort();
+    } else if (args[0] == NULL) {
+        // Only assignments and redirections: the variables are set and the files created.
+        // The status is that of the last command substitution, if there was one.
+        sh_last_status = sh_subst_status >= 0 ? sh_subst_status : 0;
+    } else if ((func != NULL || builtin != NULL) && redirs.num_actions == 0) {
+        status = func != NULL ? sh_func_call(func, args) : sh_execute(args);
+    } else if (func != NULL || builtin != NULL) {
+        saved = sh_arena_alloc(&sh_exec_arena, redirs.num_actions * sizeof(struct sh_saved_fd));
+        num_saved = sh_redirect_apply_saved(&redirs, saved);
+        status = func != NULL ? sh_func_call(func, args) : sh_execute(args);
+        sh_redirect_restore(saved, num_saved);
+    } else if (node->flags & SH_NODE_TAIL) {
+        sh_apply_fd_actions(redirs.actions, redirs.num_actions);
+        sh_exec_tail(args);
+    } else if (redirs.num_actions > 0) {
+        status = sh_launch_redirected(args, redirs.actions, redirs.num_actions);
+    } else {
+        status = sh_execute(args);
+    }
+
+    if (vars != NULL) {
+        sh_exec_unassign(vars, num_assigns, &env_mark);
+    }
+    sh_redirect_close(&redirs);
+    sh_arena_release(&sh_exec_arena, mark);
+    return status;
+}
+
+/**
+ * @brief Run a list in a child process.
+ * @param node The subshell.
+ * @return 1, to continue executing.
+ */
+int sh_exec_subshell(struct sh_node *node) {
+    struct sh_arena_mark mark = sh_arena_get_mark(&sh_exec_arena);
+    struct sh_launch launch = {-1, -1, -1, sh_job_control ? 0 : -1, NULL, 0};
+    struct sh_redirs redirs = {0};
+    pid_t pid;
+
+    if (node->redirs != NULL) {
+        if (sh_redirect_prepare(node->redirs, &redirs) < 0) {
+            sh_arena_release(&sh_exec_arena, mark);
+            return 1;
+        }
+        launch.actions = redirs.actions;
+        launch.num_actions = redirs.num_actions;
+    }
+
+    // There is nothing to protect the shell from if it is about to exit anyway.
+    sh_mark_tail(node->list.first);
+    if (node->flags & SH_NODE_TAIL) {
+        fflush(stdout);
+        sh_apply_fd_actions(redirs.actions, redirs.num_actions);
+        sh_exec_node(node->list.first);
+        sh_arena_release(&sh_exec_arena, mark);
+        return 1;
+    }
+
+    pid = sh_fork(&launch);
+    if (pid == 0) {
+        // Child process
+        sh_job_control = 0;
+        sh_exec_node(node->list.first);
+        fflush(stdout);
+        exit(sh_last_status);
+    } else if (pid > 0) {
+        sh_last_status = sh_wait_foreground(&pid, 1, launch.pgid < 0 ? -1 : pid, node, NULL);
+    }
+
+    sh_redirect_close(&redirs);
+    sh_arena_release(&sh_exec_arena, mark);
+    return 1;
+}
+
+/**
+ * @brief Start one stage of a pipeline.
+ *
+ * Programs are started with sh_spawn(). Builtins, functions and subshells need the shell
+ * itself, so for them the shell forks a copy of itself that runs the stage and exits.
+ *
+ * @param node The stage.
+ * @param launch How to connect the stage.
+ * @return PID of the stage, or -1 if it could not be started.
+ */
+pid_t sh_launch_stage(struct sh_node *node, const struct sh_launch *launch) {
+    struct sh_arena_mark mark = sh_arena_get_mark(&sh_exec_arena);
+    struct sh_launch stage = *launch;
+    struct sh_redirs redirs = {0};
+    struct sh_var_saved *vars = NULL;
+    struct sh_env_mark env_mark;
+    struct sh_func *func;
+    char **args = NULL;
+    int num_assigns = 0;
+    pid_t pid;
+
+    if (node->type == SH_NODE_COMMAND) {
+        num_assigns = sh_count_assignments(node);
+        if ((args = sh_expand_args(node, num_assigns)) == NULL) {
+            // Like any stage that can't start, but the shell goes on: it's in a subshell.
+            sh_last_status = 2;
+            sh_arena_release(&sh_exec_arena, mark);
+            return -1;
+        }
+    }
+    if (node->redirs != NULL) {
+        if (sh_redirect_prepare(node->redirs, &redirs) < 0) {
+            sh_arena_release(&sh_exec_arena, mark);
+            return -1;
+        }
+        stage.actions = redirs.actions;
+        stage.num_actions = redirs.num_actions;
+    }
+    if (num_assigns > 0) {
+        // The stage runs in a child, so the assignments never outlive it.
+        vars = sh_arena_alloc(&sh_exec_arena, num_assigns * sizeof(struct sh_var_saved));
+        if (sh_exec_assign(node, num_assigns, vars, &env_mark) < 0) {
+            sh_exec_unassign(vars, num_assigns, &env_mark);
+            sh_redirect_close(&redirs);
+            sh_last_status = 2;
+            sh_arena_release(&sh_exec_arena, mark);
+            return -1;
+        }
+    }
+
+    func = args != NULL && args[0] != NULL ? sh_func_find(args[0]) : NULL;
+    if (args != NULL && args[0] != NULL && func == NULL && sh_builtin_lookup(args[0]) == NULL) {
+        pid = sh_spawn(args, sh_spawn_backend, &stage);
+    } else {
+        pid = sh_fork(&stage);
+        if (pid == 0) {
+            // Child process
+            sh_job_control = 0;
+            if (func != NULL) {
+                sh_func_call(func, args);
+            } else if (args != NULL) {
+                sh_execute(args);
+            } else if (node->type == SH_NODE_SUBSHELL) {
+                sh_exec_node(node->list.first);
+            } else {
+                sh_exec_body(node);
+            }
+            fflush(stdout);
+            exit(sh_last_status);
+        }
+    }
+
+    if (vars != NULL) {
+        sh_exec_unassign(vars, num_assigns, &env_mark);
+    }
+    sh_redirect_close(&redirs);
+    sh_arena_release(&sh_exec_arena, mark);
+    return pid;
+}
+
+/**
+ * @brief Run a pipeline of several commands.
+ *
+ * Every stage is started right away, each one reading from the pipe the previous one
+ * writes to, so they all run at the same time. The pipes are created with O_CLOEXEC:
+ * a stage gets its own ends through dup2(), and no program inherits any other pipe
+ * (a stray write end would keep the next stage from ever seeing end of file). Once
+ * everything is running, the shell waits for all of the stages in one loop, or, for
+ * "cmd &", registers them as a background job and goes on.
+ *
+ * @param node The pipeline.
+ * @param async Whether to run it in the background.
+ * @return 1, to continue executing.
+ */
+int sh_exec_pipeline(struct sh_node *node, int async) {
+    struct sh_launch launch = {-1, -1, -1, sh_job_control ? 0 : -1, NULL, 0};
+    long long start = sh_trace_fd >= 0 ? sh_now() : 0, spawned = 0;
+    struct sh_node *stage;
+    struct sh_job *job;
+    char *text;
+    pid_t pid = 0;
+    int fds[2], n = 0, count = 0;
+
+    // Without job control, a background job must not compete with the shell for its input.
+    if (async && !sh_job_control) {
+        launch.fd_in = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+
+    for (stage = node->list.first; stage != NULL; stage = stage->next) {
+        count++;
+    }
+    // Each stage joins the job as soon as it starts: expanding the next one's words may
+    // wait for a "$(...)", and reap the stages that finish meanwhile.
+    job = sh_job_add(NULL, count, -1);
+
+    for (stage = node->list.first; stage != NULL; stage = stage->next) {
+        launch.fd_out = -1;
+        launch.fd_peer = -1;
+        if (stage->next != NULL) {
+            if (pipe2(fds, O_CLOEXEC) < 0) {
+                perror("sh");
+                break;
+            }
+            launch.fd_out = fds[1];
+            launch.fd_peer = fds[0];
+        }
+
+        pid = sh_launch_stage(stage, &launch);
+        sh_job_set_proc(job, n++, pid);
+        if (launch.pgid == 0 && pid > 0) {
+            launch.pgid = job->pgid = pid;
+        }
+
+        // The stages have their own copies of the pipe ends now.
+        if (launch.fd_in >= 0) {
+            close(launch.fd_in);
+        }
+        if (launch.fd_out >= 0) {
+            close(launch.fd_out);
+        }
+        launch.fd_in = stage->next != NULL ? fds[0] : -1;
+    }
+    if (launch.fd_in >= 0) {
+        close(launch.fd_in);
+    }
+
+    // Stages after a failed pipe() never started, and aren't part of the job.
+    job->num_procs = n;
+    if (n == 0) {
+        sh_job_remove(job);
+        return 1;
+    }
+    if (async) {
+        sh_start_background_job(job, sh_job_describe(node, NULL));
+        return 1;
+    }
+    if (sh_trace_fd >= 0) {
+        spawned = sh_now();
+    }
+    sh_last_status = sh_wait_foreground_job(job, node, NULL);
+    if (n < count) {
+        sh_last_status = 1;
+    }
+    if (sh_trace_fd >= 0) {
+        text = sh_job_describe(node, NULL);
+        sh_trace_command("pipeline", NULL, text, pid, spawned - start, sh_now() - spawned);
+        free(text);
+    }
+    return 1;
+}
+
+/**
+ * @brief Start a list item that ended with "&" in the background.
+ *
+ * A pipeline (or a single command) is started the usual way, without waiting for it.
+ * Anything else, like "a && b &", runs in a subshell.
+ *
+ * @param node The list item.
+ * @return 1, to continue executing.
+ */
+int sh_exec_async(struct sh_node *node) {
+    struct sh_launch launch = {-1, -1, -1, sh_job_control ? 0 : -1, NULL, 0};
+    pid_t pid;
+
+    if (node->type == SH_NODE_PIPELINE && !(node->flags & SH_NODE_TIME)) {
+        sh_exec_pipeline(node, 1);
+    } else {
+        if (!sh_job_control) {
+            launch.fd_in = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        }
+        pid = sh_fork(&launch);
+        if (pid == 0) {
+            // Child process
+            sh_job_control = 0;
+            sh_mark_tail(node);
+            sh_exec_node(node);
+            fflush(stdout);
+            exit(sh_last_status);
+        } else if (pid > 0) {
+            sh_start_background(&pid, 1, launch.pgid < 0 ? -1 : pid, sh_job_describe(node, NULL));
+        }
+        if (launch.fd_in >= 0) {
+            close(launch.fd_in);
+        }
+    }
+
+    // Collect jobs that are already done, so that thousands of them don't pile up.
+    sh_jobs_reap();
+    return 1;
+}
+
+/**
+ * @brief Run a pipeline that started with "time", and report how long it took.
+ * @param node The pipeline.
+ * @return 1 if the shell should continue running, 0 if it should terminate.
+ */
+int sh_exec_timed(struct sh_node *node) {
+    struct rusage usage = {0}, self_before, self_after, *outer = sh_time_usage;
+    long long start, real;
+    int status;
+
+    getrusage(RUSAGE_SELF, &self_before);
+    start = sh_now();
+    sh_time_usage = &usage;
+
+    node->flags &= ~SH_NODE_TIME;
+    status = sh_exec_node(node);
+    node->flags |= SH_NODE_TIME;
+
+    real = sh_now() - start;
+    sh_time_usage = outer;
+    getrusage(RUSAGE_SELF, &self_after);
+
+    // Builtins ran in the shell: count what the shell itself used in the meantime.
+    timersub(&self_after.ru_utime, &self_before.ru_utime, &self_after.ru_utime);
+    timersub(&self_after.ru_stime, &self_before.ru_stime, &self_after.ru_stime);
+    self_after.ru_nvcsw -= self_before.ru_nvcsw;
+    self_after.ru_nivcsw -= self_before.ru_nivcsw;
+    if (usage.ru_maxrss != 0) {
+        self_after.ru_maxrss = 0;
+    }
+    sh_rusage_add(&usage, &self_after);
+    if (outer != NULL) {
+        sh_rusage_add(outer, &usage);
+    }
+
+    if (node->flags & SH_NODE_TIME_POSIX) {
+        fprintf(stderr, "real %.2f\nuser %.2f\nsys %.2f\n", real / 1e9,
+                usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6,
+                usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6);
+    } else {
+        fprintf(stderr, "\nreal\t%lldm%.3fs\nuser\t%ldm%.3fs\nsys\t%ldm%.3fs\n"
+                        "maxrss\t%ld KiB\ncsw\t%ld voluntary, %ld involuntary\n",
+                real / 60000000000LL, (real % 60000000000LL) / 1e9,
+                (long) usage.ru_utime.tv_sec / 60, usage.ru_utime.tv_sec % 60 + usage.ru_utime.tv_usec / 1e6,
+                (long) usage.ru_stime.tv_sec / 60, usage.ru_stime.tv_sec % 60 + usage.ru_stime.tv_usec / 1e6,
+                usage.ru_maxrss, usage.ru_nvcsw, usage.ru_nivcsw);
+    }
+    return status;
+}
+
+/**
+ * @brief Find out whether a loop should stop, after its body (or condition) ran.
+ *
+ * Takes care of a pending "break" or "continue": each loop it passes through uses up
+ * one level, and the last one is where the jump lands.
+ *
+ * @return 1 if the loop should stop, 0 if it should go on.
+ */
+int sh_loop_stop(void) {
+    if (sh_jump == SH_JUMP_NONE) {
+        return 0;
+    }
+    if ((sh_jump != SH_JUMP_BREAK && sh_jump != SH_JUMP_CONTINUE) || --sh_jump_levels > 0) {
+        return 1;
+    }
+    if (sh_jump == SH_JUMP_BREAK) {
+        sh_jump = SH_JUMP_NONE;
+        return 1;
+    }
+    sh_jump = SH_JUMP_NONE;
+    return 0;
+}
+
+/**
+ * @brief Run a "while" or "until" loop.
+ * @param node The loop.
+ * @return 1 if the shell should continue running, 0 if it should terminate.
+ */
+int sh_exec_while(struct sh_node *node) {
+    int status = 1, last = 0;
+
+    sh_loop_depth++;
+    while (status) {
+        status = sh_exec_node(node->cond.cond);
+        if (sh_jump != SH_JUMP_NONE) {
+            if (sh_loop_stop()) {
+                break;
+            }
+            continue;
+        }
+        if (!status || (sh_last_status == 0) != (node->type == SH_NODE_WHILE)) {
+            break;
+        }
+        status = sh_exec_node(node->cond.body);
+        last = sh_last_status;
+        if (sh_loop_stop()) {
+            break;
+        }
+    }
+    sh_loop_depth--;
+    sh_last_status = last;
+    return status;
+}
+
+/**
+ * @brief Expand the words a "for" loop goes over.
+ *
+ * The words are expanded once, up front, and copied out of the shared field list,
+ * which the commands in the body reuse.
+ *
+ * @param node The loop.
+ * @param words Set to the words, in the execution arena.
+ * @return Number of words.
+ */
+size_t sh_exec_for_words(struct sh_node *node, char ***words) {
+    static const struct sh_word all_params = {"\"$@\"", 4, SH_WORD_QUOTED | SH_WORD_DOLLAR};
+    struct sh_fields *fields = &sh_expand_list;
+    size_t i;
+
+    fields->count = 0;
+    if (node->loop.argc < 0) {
+        sh_expand_fields(&sh_exec_arena, &all_params, &sh_expand_buf, fields);
+    }
+    for (i = 0; node->loop.argc > 0 && i < (size_t) node->loop.argc; i++) {
+        sh_expand_fields(&sh_exec_arena, &node->loop.words[i], &sh_expand_buf, fields);
+    }
+    *words = sh_arena_alloc(&sh_exec_arena, (fields->count + 1) * sizeof(char *));
+    if (fields->count > 0) {
+        memcpy(*words, fields->words, fields->count * sizeof(char *));
+    }
+    return fields->count;
+}
+
+/**
+ * @brief Run a "for" loop.
+ * @param node The loop.
+ * @return 1 if the shell should continue running, 0 if it should terminate.
+ */
+int sh_exec_for(struct sh_node *node) {
+    struct sh_arena_mark mark = sh_arena_get_mark(&sh_exec_arena);
+    size_t i, count;
+    char **words;
+    int status = 1;
+
+    count = sh_exec_for_words(node, &words);
+    sh_last_status = 0;
+    sh_loop_depth++;
+    for (i = 0; i < count && status; i++) {
+        sh_var_set(node->loop.name.text, node->loop.name.len, words[i], 0);
+        status = sh_exec_node(node->loop.body);
+        if (sh_loop_stop()) {
+            break;
+        }
+    }
+    sh_loop_depth--;
+    sh_arena_release(&sh_exec_arena, mark);
+    return status;
+}
+
+/**
+ * @brief Match the word of a "case" against one of its patterns.
+ * @param word The expanded word.
+ * @param pattern The pattern, as written.
+ * @return Whether it matches.
+ */
+int sh_case_match(const char *word, const struct sh_word *pattern) {
+    struct sh_arena_mark mark = sh_arena_get_mark(&sh_exec_arena);
+    int match = fnmatch(sh_expand_pattern(&sh_exec_arena, pattern, &sh_expand_buf), word, 0) == 0;
+
+    sh_arena_release(&sh_exec_arena, mark);
+    return match;
+}
+
+/**
+ * @brief Run a "case": the first item with a pattern that matches the word.
+ * @param node The case.
+ * @return 1 if the shell should continue running, 0 if it should terminate.
+ */
+int sh_exec_case(struct sh_node *node) {
+    struct sh_arena_mark mark = sh_arena_get_mark(&sh_exec_arena);
+    struct sh_case_item *item;
+    const char *word;
+    int i;
+
+    word = sh_expand_word(&sh_exec_arena, &node->cases.word, &sh_expand_buf);
+    if (word == NULL) {
+        word = "";
+    }
+    sh_last_status = 0;
+    for (item = node->cases.items; item != NULL; item = item->next) {
+        for (i = 0; i < item->num_patterns; i++) {
+            if (sh_case_match(word, &item->patterns[i])) {
+                sh_arena_release(&sh_exec_arena, mark);
+                return item->body != NULL ? sh_exec_node(item->body) : 1;
+            }
+        }
+    }
+    sh_arena_release(&sh_exec_arena, mark);
+    return 1;
+}
+
+/**
+ * @brief Run the body of a compound command, in the shell itself.
+ * @param node The compound command (not a subshell).
+ * @return 1 if the shell should continue running, 0 if it should terminate.
+ */
+int sh_exec_body(struct sh_node *node) {
+    int status;
+
+    switch (node->type) {
+        case SH_NODE_IF:
+            for (; node != NULL; node = node->cond.orelse) {
+                if (node->type != SH_NODE_IF) {
+                    // "else"
+                    return sh_exec_node(node);
+                }
+                status = sh_exec_node(node->cond.cond);
+                if (!status || sh_jump != SH_JUMP_NONE) {
+                    return status;
+                }
+                if (sh_last_status == 0) {
+                    return sh_exec_node(node->cond.body);
+                }
+            }
+            sh_last_status = 0;
+            return 1;
+
+        case SH_NODE_WHILE:
+        case SH_NODE_UNTIL:
+            return sh_exec_while(node);
+
+        case SH_NODE_FOR:
+            return sh_exec_for(node);
+
+        case SH_NODE_CASE:
+            return sh_exec_case(node);
+
+        case SH_NODE_GROUP:
+            return sh_exec_node(node->list.first);
+
+        default:
+            return sh_exec_node(node);
+    }
+}
+
+/**
+ * @brief Run a compound command like "if" or "while" in the shell, with its redirections.
+ * @param node The compound command.
+ * @return 1 if the shell should continue running, 0 if it should terminate.
+ */
+int sh_exec_compound(struct sh_node *node) {
+    struct sh_arena_mark mark;
+    struct sh_redirs redirs = {0};
+    struct sh_saved_fd *saved;
+    int status, num_saved;
+
+    if (node->redirs == NULL) {
+        return sh_exec_body(node);
+    }
+    mark = sh_arena_get_mark(&sh_exec_arena);
+    if (sh_redirect_prepare(node->redirs, &redirs) < 0) {
+        sh_arena_release(&sh_exec_arena, mark);
+        return 1;
+    }
+    saved = sh_arena_alloc(&sh_exec_arena, redirs.num_actions * sizeof(struct sh_saved_fd));
+    num_saved = sh_redirect_apply_saved(&redirs, saved);
+    status = sh_exec_body(node);
+    sh_redirect_restore(saved, num_saved);
+    sh_redirect_close(&redirs);
+    sh_arena_release(&sh_exec_arena, mark);
+    return status;
+}
+
+/**
+ * @brief Run a tree.
+ * @param node The tree.
+ * @return 1 if the shell should continue running, 0 if it should terminate.
+ */
+int sh_exec_node(struct sh_node *node) {
+    struct sh_node *item;
+    int status = 1;
+
+    switch (node->type) {
+        case SH_NODE_COMMAND:
+            return sh_exec_command(node);
+
+        case SH_NODE_SUBSHELL:
+            return sh_exec_subshell(node);
+
+        case SH_NODE_IF:
+        case SH_NODE_WHILE:
+        case SH_NODE_UNTIL:
+        case SH_NODE_FOR:
+        case SH_NODE_CASE:
+        case SH_NODE_GROUP:
+            return sh_exec_compound(node);
+
+        case SH_NODE_FUNCTION:
+            sh_func_define(node);
+            return 1;
+
+        case SH_NODE_PIPELINE:
+            if (node->flags & SH_NODE_TIME) {
+                return sh_exec_timed(node);
+            }
+            if (node->list.first->next != NULL) {
+                status = sh_exec_pipeline(node, 0);
+            } else {
+                status = sh_exec_node(node->list.first);
+            }
+            if (node->flags & SH_NODE_NEGATE) {
+                sh_last_status = !sh_last_status;
+            }
+            return status;
+
+        case SH_NODE_AND:
+        case SH_NODE_OR:
+            status = sh_exec_node(node->binary.left);
+            if (status && sh_jump == SH_JUMP_NONE && (sh_last_status == 0) == (node->type == SH_NODE_AND)) {
+                status = sh_exec_node(node->binary.right);
+            }
+            return status;
+
+        case SH_NODE_LIST:
+            for (item = node->list.first; item != NULL && status && sh_jump == SH_JUMP_NONE; item = item->next) {
+                if (item->flags & SH_NODE_ASYNC) {
+                    status = sh_exec_async(item);
+                } else {
+                    status = sh_exec_node(item);
+                }
+            }
+            return status;
+    }
+    return status;
+}
+
+
+/*
+ * Functions
+ *
+ * "name() { ...; }" defines a function, which is then run like a command, with its
+ * arguments as "$1", "$2", ... A function body runs every time the function is called,
+ * so the work of understanding it is done once, when it is defined: the tree is copied
+ * out of the line's arena (which is about to be reset) and compiled into bytecode, a
+ * flat array of small instructions in which "if", the loops, "case", "&&" and "||" have
+ * all become jumps. Running the function is then a tight loop over that array with one
+ * switch on the opcode, in the spirit of sh_execute(), instead of a recursive walk that
+ * rediscovers the shape of the tree on every call.
+ *
+ * Simple commands stay nodes: an instruction hands them to sh_exec_command(), which
+ * expands and runs them like anywhere else, except for plain assignments ("x=$1"), which
+ * the compiler spots so that they skip straight to setting the variables. The rarer things
+ * that aren't worth compiling (pipelines, subshells, compound commands with redirections)
+ * go to the tree walker as a whole. Loops keep their state (where they started, and the words a
+ * "for" goes over) on a small stack, so "break 2" or "continue" is a jump to the right
+ * end of the right loop. The variables a function declares with "local" are put aside
+ * in its frame, and come back when it returns.
+ *
+ * Like variable names, function names are interned in an open-addressing table and keep
+ * their slot for good; "unset -f" only drops the code. The code is reference counted, so
+ * a function can redefine itself (or be unset) while it is running.
+ */
+
+enum sh_opcode {
+    SH_OP_COMMAND,     // run a simple command (node)
+    SH_OP_ASSIGN,      // a command that only assigns variables (node)
+    SH_OP_RUN,         // run anything else with the tree walker (node)
+    SH_OP_ASYNC,       // start a list item that ended with "&" (node)
+    SH_OP_JUMP,        // go to target
+    SH_OP_JUMP_FAIL,   // go to target if the last command failed
+    SH_OP_JUMP_OK,     // go to target if the last command succeeded
+    SH_OP_NEGATE,      // negate the last status, for "!"
+    SH_OP_STATUS_0,    // set the last status to 0
+    SH_OP_LOOP,        // enter a "while" or "until" loop; target is its SH_OP_LEAVE
+    SH_OP_FOR,         // enter a "for" loop (node) and expand its words; target is its SH_OP_LEAVE
+    SH_OP_NEXT,        // set the variable of a "for" loop (node) to its next word, or go to target
+    SH_OP_REPEAT,      // end of a loop body: go back to target
+    SH_OP_LEAVE,       // leave the innermost loop
+    SH_OP_CASE,        // expand the word of a "case" (node)
+    SH_OP_MATCH,       // go to target if the word matches a pattern (word)
+    SH_OP_MISMATCH,    // go to target unless the word matches a pattern (word)
+    SH_OP_NO_MATCH,    // no pattern matched: status 0, go to target
+};
+
+struct sh_insn {
+    enum sh_opcode op;
+    int target;
+    union {
+        struct sh_node *node;
+        const struct sh_word *word;
+    };
+};
+
+struct sh_code {
+    int refs;
+    int num_insns;
+    struct sh_insn *insns;
+    struct sh_node *body;      // the copy of the tree the instructions point into
+    struct sh_arena arena;     // where the copy is
+};
+
+struct sh_func {
+    const char *name;
+    unsigned int hash;
+    unsigned int name_len;
+    struct sh_code *code;      // NULL after "unset -f"
+};
+
+struct sh_func_table {
+    struct sh_func *entries;
+    int size;
+    int count;
+    int defined;               // how many have code: lookups are skipped while there are none
+    unsigned int generation;   // changes whenever a function is defined or unset
+    struct sh_arena names;
+};
+
+struct sh_func_table sh_funcs;
+
+/*
+ * The state of a loop in a running function.
+ */
+struct sh_vm_loop {
+    int pc;                    // its SH_OP_LOOP or SH_OP_FOR
+    int last;                  // exit status of the last trip through the body
+    struct sh_arena_mark mark;
+    char **words;              // "for" only
+    size_t num_words;
+    size_t next;
+};
+
+/*
+ * The loops of all the running functions, innermost last.
+ */
+struct sh_vm_stack {
+    struct sh_vm_loop *loops;
+    size_t count;
+    size_t size;
+};
+
+struct sh_vm_stack sh_vm;
+
+/*
+ * The variables a running function made local, with the values they had before.
+ */
+struct sh_frame {
+    struct sh_var_saved *saved;
+    int count;
+    int size;
+};
+
+struct sh_frame *sh_frame = NULL;
+
+#define SH_FUNC_INITIAL_SIZE 64
+
+/**
+ * @brief Find the slot for a function name (open addressing with linear probing).
+ * @param name The name.
+ * @param len Length of the name.
+ * @param hash Hash of the name.
+ * @return The slot holding the name, or the empty slot where it belongs.
+ */
+struct sh_func *sh_func_slot(const char *name, size_t len, unsigned int hash) {
+    struct sh_func_table *t = &sh_funcs;
+    unsigned int i = hash & (t->size - 1);
+    struct sh_func *func;
+
+    for (func = &t->entries[i]; func->name != NULL; func = &t->entries[i]) {
+        if (func->hash == hash && func->name_len == len && memcmp(func->name, name, len) == 0) {
+            break;
+        }
+        i = (i + 1) & (t->size - 1);
+    }
+    return func;
+}
+
+/**
+ * @brief Find a function, adding its name to the table if it's new.
+ * @param name The name.
+ * @param len Length of the name.
+ * @return The function's entry.
+ */
+struct sh_func *sh_func_intern(const char *name, size_t len) {
+    struct sh_func_table *t = &sh_funcs;
+    unsigned int hash = sh_var_hash(name, len);
+    struct sh_func *func, *old;
+    int i, old_size;
+
+    if ((t->count + 1) * 4 > t->size * 3) {
+        old = t->entries;
+        old_size = t->size;
+        t->size = old_size > 0 ? old_size * 2 : SH_FUNC_INITIAL_SIZE;
+        t->entries = calloc(t->size, sizeof(struct sh_func));
+        if (!t->entries) {
+            fprintf(stderr, "sh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        for (i = 0; i < old_size; i++) {
+            if (old[i].name != NULL) {
+                *sh_func_slot(old[i].name, old[i].name_len, old[i].hash) = old[i];
+            }
+        }
+        free(old);
+    }
+
+    func = sh_func_slot(name, len, hash);
+    if (func->name == NULL) {
+        func->name = sh_arena_strndup(&t->names, name, len);
+        func->hash = hash;
+        func->name_len = len;
+        t->count++;
+    }
+    return func;
+}
+
+/**
+ * @brief Find the function a command names.
+ * @param name The command name.
+ * @return The function, or NULL if there is no such function.
+ */
+struct sh_func *sh_func_find(const char *name) {
+    struct sh_func *func;
+    size_t len;
+
+    if (sh_funcs.defined == 0) {
+        return NULL;
+    }
+    len = strlen(name);
+    func = sh_func_slot(name, len, sh_var_hash(name, len));
+    return func->code != NULL ? func : NULL;
+}
+
+/**
+ * @brief Drop a reference to compiled code, freeing it with the last one.
+ * @param code The code.
+ */
+void sh_code_release(struct sh_code *code) {
+    if (--code->refs == 0) {
+        free(code->insns);
+        sh_arena_free(&code->arena);
+        free(code);
+    }
+}
+
+/**
+ * @brief Copy a word into an arena.
+ */
+void sh_word_copy(struct sh_arena *arena, struct sh_word *to, const struct sh_word *from) {
+    to->text = sh_arena_strndup(arena, from->text, from->len);
+    to->len = from->len;
+    to->flags = from->flags;
+}
+
+/**
+ * @brief Copy some words into an arena.
+ */
+struct sh_word *sh_words_copy(struct sh_arena *arena, const struct sh_word *words, int n) {
+    struct sh_word *copy = sh_arena_alloc(arena, (n > 0 ? n : 1) * sizeof(struct sh_word));
+    int i;
+
+    for (i = 0; i < n; i++) {
+        sh_word_copy(arena, &copy[i], &words[i]);
+    }
+    return copy;
+}
+
+/**
+ * @brief Copy a tree into an arena, words and all.
+ * @param arena Where to put the copy.
+ * @param node The tree (or NULL).
+ * @return The copy.
+ */
+struct sh_node *sh_node_copy(struct sh_arena *arena, const struct sh_node *node) {
+    struct sh_case_item *item, **item_tail;
+    const struct sh_case_item *from;
+    struct sh_redir *redir, **redir_tail;
+    const struct sh_redir *r;
+    struct sh_node *copy, **tail;
+    const struct sh_node *child;
+
+    if (node == NULL) {
+        return NULL;
+    }
+    copy = sh_arena_alloc(arena, sizeof(struct sh_node));
+    *copy = *node;
+    copy->flags &= ~SH_NODE_TAIL;
+    copy->next = NULL;
+
+    redir_tail = &copy->redirs;
+    for (r = node->redirs; r != NULL; r = r->next) {
+        redir = sh_arena_alloc(arena, sizeof(struct sh_redir));
+        *redir = *r;
+        redir->next = NULL;
+        sh_word_copy(arena, &redir->target, &r->target);
+        if (r->op == SH_TOKEN_DLESS || r->op == SH_TOKEN_DLESSDASH) {
+            sh_word_copy(arena, &redir->body, &r->body);
+        }
+        *redir_tail = redir;
+        redir_tail = &redir->next;
+    }
+
+    switch (node->type) {
+        case SH_NODE_COMMAND:
+            copy->command.words = sh_words_copy(arena, node->command.words, node->command.argc);
+            break;
+        case SH_NODE_PIPELINE:
+        case SH_NODE_LIST:
+        case SH_NODE_SUBSHELL:
+        case SH_NODE_GROUP:
+            tail = &copy->list.first;
+            for (child = node->list.first; child != NULL; child = child->next) {
+                *tail = sh_node_copy(arena, child);
+                tail = &(*tail)->next;
+            }
+            break;
+        case SH_NODE_AND:
+        case SH_NODE_OR:
+            copy->binary.left = sh_node_copy(arena, node->binary.left);
+            copy->binary.right = sh_node_copy(arena, node->binary.right);
+            break;
+        case SH_NODE_IF:
+        case SH_NODE_WHILE:
+        case SH_NODE_UNTIL:
+            copy->cond.cond = sh_node_copy(arena, node->cond.cond);
+            copy->cond.body = sh_node_copy(arena, node->cond.body);
+            copy->cond.orelse = sh_node_copy(arena, node->cond.orelse);
+            break;
+        case SH_NODE_FOR:
+            sh_word_copy(arena, &copy->loop.name, &node->loop.name);
+            copy->loop.words = sh_words_copy(arena, node->loop.words, node->loop.argc);
+            copy->loop.body = sh_node_copy(arena, node->loop.body);
+            break;
+        case SH_NODE_CASE:
+            sh_word_copy(arena, &copy->cases.word, &node->cases.word);
+            item_tail = &copy->cases.items;
+            for (from = node->cases.items; from != NULL; from = from->next) {
+                item = sh_arena_alloc(arena, sizeof(struct sh_case_item));
+                item->next = NULL;
+                item->num_patterns = from->num_patterns;
+                item->patterns = sh_words_copy(arena, from->patterns, from->num_patterns);
+                item->body = sh_node_copy(arena, from->body);
+                *item_tail = item;
+                item_tail = &item->next;
+            }
+            break;
+        case SH_NODE_FUNCTION:
+            sh_word_copy(arena, &copy->func.name, &node->func.name);
+            copy->func.body = sh_node_copy(arena, node->func.body);
+            break;
+    }
+    return copy;
+}
+
+struct sh_compiler {
+    struct sh_insn *insns;
+    int count;
+    int size;
+};
+
+/**
+ * @brief Append an instruction.
+ * @param c The compiler.
+ * @param op The opcode.
+ * @param node Its node, if it has one.
+ * @return Index of the instruction, to fill in its target later.
+ */
+int sh_compile_emit(struct sh_compiler *c, enum sh_opcode op, struct sh_node *node) {
+    if (c->count == c->size) {
+        c->size = c->size > 0 ? c->size * 2 : 64;
+        c->insns = realloc(c->insns, c->size * sizeof(struct sh_insn));
+        if (!c->insns) {
+            fprintf(stderr, "sh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    c->insns[c->count].op = op;
+    c->insns[c->count].target = -1;
+    c->insns[c->count].node = node;
+    return c->count++;
+}
+
+/**
+ * @brief Point a chain of forward jumps at the next instruction.
+ *
+ * Until their destination is known, the jumps are linked through their targets.
+ *
+ * @param c The compiler.
+ * @param chain The last jump of the chain, or -1.
+ */
+void sh_compile_patch(struct sh_compiler *c, int chain) {
+    int next;
+
+    while (chain >= 0) {
+        next = c->insns[chain].target;
+        c->insns[chain].target = c->count;
+        chain = next;
+    }
+}
+
+/**
+ * @brief Compile a tree.
+ * @param c The compiler.
+ * @param node The tree.
+ */
+void sh_compile(struct sh_compiler *c, struct sh_node *node) {
+    struct sh_case_item *item;
+    struct sh_node *child;
+    int i, at, jump, chain = -1, matched;
+
+    if (node->redirs != NULL && node->type != SH_NODE_COMMAND) {
+        sh_compile_emit(c, SH_OP_RUN, node);
+        return;
+    }
+
+    switch (node->type) {
+        case SH_NODE_COMMAND:
+            if (node->redirs == NULL && sh_count_assignments(node) == node->command.argc) {
+                sh_compile_emit(c, SH_OP_ASSIGN, node);
+            } else {
+                sh_compile_emit(c, SH_OP_COMMAND, node);
+            }
+            break;
+
+        case SH_NODE_PIPELINE:
+            if (node->list.first->next != NULL || (node->flags & SH_NODE_TIME)) {
+                sh_compile_emit(c, SH_OP_RUN, node);
+                break;
+            }
+            sh_compile(c, node->list.first);
+            if (node->flags & SH_NODE_NEGATE) {
+                sh_compile_emit(c, SH_OP_NEGATE, NULL);
+            }
+            break;
+
+        case SH_NODE_AND:
+        case SH_NODE_OR:
+            sh_compile(c, node->binary.left);
+            jump = sh_compile_emit(c, node->type == SH_NODE_AND ? SH_OP_JUMP_FAIL : SH_OP_JUMP_OK, NULL);
+            sh_compile(c, node->binary.right);
+            c->insns[jump].target = c->count;
+            break;
+
+        case SH_NODE_LIST:
+            for (child = node->list.first; child != NULL; child = child->next) {
+                if (child->flags & SH_NODE_ASYNC) {
+                    sh_compile_emit(c, SH_OP_ASYNC, child);
+                } else {
+                    sh_compile(c, child);
+                }
+            }
+            break;
+
+        case SH_NODE_GROUP:
+            sh_compile(c, node->list.first);
+            break;
+
+        case SH_NODE_IF:
+            for (; node != NULL && node->type == SH_NODE_IF; node = node->cond.orelse) {
+                sh_compile(c, node->cond.cond);
+                jump = sh_compile_emit(c, SH_OP_JUMP_FAIL, NULL);
+                sh_compile(c, node->cond.body);
+                i = sh_compile_emit(c, SH_OP_JUMP, NULL);
+                c->insns[i].target = chain;
+                chain = i;
+                c->insns[jump].target = c->count;
+            }
+            if (node != NULL) {
+                sh_compile(c, node);
+            } else {
+                sh_compile_emit(c, SH_OP_STATUS_0, NULL);
+            }
+            sh_compile_patch(c, chain);
+            break;
+
+        case SH_NODE_WHILE:
+        case SH_NODE_UNTIL:
+            at = sh_compile_emit(c, SH_OP_LOOP, NULL);
+            sh_compile(c, node->cond.cond);
+            jump = sh_compile_emit(c, node->type == SH_NODE_WHILE ? SH_OP_JUMP_FAIL : SH_OP_JUMP_OK, NULL);
+            sh_compile(c, node->cond.body);
+            c->insns[sh_compile_emit(c, SH_OP_REPEAT, NULL)].target = at + 1;
+            c->insns[at].target = c->insns[jump].target = sh_compile_emit(c, SH_OP_LEAVE, NULL);
+            break;
+
+        case SH_NODE_FOR:
+            at = sh_compile_emit(c, SH_OP_FOR, node);
+            jump = sh_compile_emit(c, SH_OP_NEXT, node);
+            sh_compile(c, node->loop.body);
+            c->insns[sh_compile_emit(c, SH_OP_REPEAT, NULL)].target = jump;
+            c->insns[at].target = c->insns[jump].target = sh_compile_emit(c, SH_OP_LEAVE, NULL);
+            break;
+
+        case SH_NODE_CASE:
+            // Each item tries its patterns; the last one skips to the next item if it doesn't match.
+            sh_compile_emit(c, SH_OP_CASE, node);
+            for (item = node->cases.items; item != NULL; item = item->next) {
+                matched = -1;
+                for (i = 0; i < item->num_patterns - 1; i++) {
+                    at = sh_compile_emit(c, SH_OP_MATCH, NULL);
+                    c->insns[at].word = &item->patterns[i];
+                    c->insns[at].target = matched;
+                    matched = at;
+                }
+                jump = sh_compile_emit(c, SH_OP_MISMATCH, NULL);
+                c->insns[jump].word = &item->patterns[item->num_patterns - 1];
+                sh_compile_patch(c, matched);
+                if (item->body != NULL) {
+                    sh_compile(c, item->body);
+                } else {
+                    sh_compile_emit(c, SH_OP_STATUS_0, NULL);
+                }
+                i = sh_compile_emit(c, SH_OP_JUMP, NULL);
+                c->insns[i].target = chain;
+                chain = i;
+                c->insns[jump].target = c->count;
+            }
+            sh_compile_emit(c, SH_OP_NO_MATCH, NULL);
+            sh_compile_patch(c, chain);
+            break;
+
+        case SH_NODE_SUBSHELL:
+        case SH_NODE_FUNCTION:
+            sh_compile_emit(c, SH_OP_RUN, node);
+            break;
+    }
+}
+
+/**
+ * @brief Define a function.
+ * @param node The definition.
+ */
+void sh_func_define(struct sh_node *node) {
+    struct sh_compiler c = {0};
+    struct sh_code *code = calloc(1, sizeof(struct sh_code));
+    struct sh_func *func;
+
+    if (!code) {
+        fprintf(stderr, "sh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    code->body = sh_node_copy(&code->arena, node->func.body);
+    sh_compile(&c, code->body);
+    code->refs = 1;
+    code->insns = c.insns;
+    code->num_insns = c.count;
+
+    func = sh_func_intern(node->func.name.text, node->func.name.len);
+    if (func->code != NULL) {
+        sh_code_release(func->code);
+    } else {
+        sh_funcs.defined++;
+    }
+    func->code = code;
+    sh_funcs.generation++;
+    sh_last_status = 0;
+}
+
+/**
+ * @brief Forget a function, for "unset -f".
+ * @param name The name.
+ * @param len Length of the name.
+ */
+void sh_func_unset(const char *name, size_t len) {
+    struct sh_func *func;
+
+    if (sh_funcs.entries == NULL) {
+        return;
+    }
+    func = sh_func_slot(name, len, sh_var_hash(name, len));
+    if (func->code != NULL) {
+        sh_code_release(func->code);
+        func->code = NULL;
+        sh_funcs.defined--;
+        sh_funcs.generation++;
+    }
+}
+
+/**
+ * @brief Enter a loop in a running function.
+ * @param pc Where the loop starts.
+ * @return The loop's state.
+ */
+struct sh_vm_loop *sh_vm_push(int pc) {
+    struct sh_vm_loop *loop;
+
+    if (sh_vm.count == sh_vm.size) {
+        sh_vm.size = sh_vm.size > 0 ? sh_vm.size * 2 : 16;
+        sh_vm.loops = realloc(sh_vm.loops, sh_vm.size * sizeof(struct sh_vm_loop));
+        if (!sh_vm.loops) {
+            fprintf(stderr, "sh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    loop = &sh_vm.loops[sh_vm.count++];
+    loop->pc = pc;
+    loop->last = 0;
+    loop->mark = sh_arena_get_mark(&sh_exec_arena);
+    loop->words = NULL;
+    loop->num_words = loop->next = 0;
+    sh_loop_depth++;
+    return loop;
+}
+
+/**
+ * @brief Leave the innermost loop of a running function.
+ * @return Exit status of the loop.
+ */
+int sh_vm_pop(void) {
+    struct sh_vm_loop *loop = &sh_vm.loops[--sh_vm.count];
+
+    sh_arena_release(&sh_exec_arena, loop->mark);
+    sh_loop_depth--;
+    return loop->last;
+}
+
+/**
+ * @brief Run compiled code.
+ * @param code The code.
+ * @return 1 if the shell should continue running, 0 if it should terminate.
+ */
+int sh_vm_run(const struct sh_code *code) {
+    const struct sh_insn *insns = code->insns, *insn;
+    struct sh_arena_mark case_mark = {0};
+    struct sh_vm_loop *loop;
+    const char *subject = NULL;
+    size_t base = sh_vm.count;
+    int pc = 0, status = 1;
+
+    while (pc < code->num_insns) {
+        insn = &insns[pc++];
+        switch (insn->op) {
+            case SH_OP_COMMAND:
+                status = sh_exec_command(insn->node);
+                break;
+            case SH_OP_ASSIGN:
+                sh_subst_status = -1;
+                if (sh_exec_assign(insn->node, insn->node->command.argc, NULL, NULL) < 0) {
+                    status = sh_expand_abort();
+                    break;
+                }
+                sh_last_status = sh_subst_status >= 0 ? sh_subst_status : 0;
+                continue;
+            case SH_OP_RUN:
+                status = sh_exec_node(insn->node);
+                break;
+            case SH_OP_ASYNC:
+                status = sh_exec_async(insn->node);
+                break;
+
+            case SH_OP_JUMP:
+                pc = insn->target;
+                continue;
+            case SH_OP_JUMP_FAIL:
+                if (sh_last_status != 0) {
+                    pc = insn->target;
+                }
+                continue;
+            case SH_OP_JUMP_OK:
+                if (sh_last_status == 0) {
+                    pc = insn->target;
+                }
+                continue;
+            case SH_OP_NEGATE:
+                sh_last_status = !sh_last_status;
+                continue;
+            case SH_OP_STATUS_0:
+                sh_last_status = 0;
+                continue;
+
+            case SH_OP_LOOP:
+                sh_vm_push(pc - 1);
+                continue;
+            case SH_OP_FOR:
+                loop = sh_vm_push(pc - 1);
+                loop->num_words = sh_exec_for_words(insn->node, &loop->words);
+                continue;
+            case SH_OP_NEXT:
+                loop = &sh_vm.loops[sh_vm.count - 1];
+                if (loop->next == loop->num_words) {
+                    pc = insn->target;
+                } else {
+                    sh_var_set(insn->node->loop.name.text, insn->node->loop.name.len, loop->words[loop->next++], 0);
+                }
+                continue;
+            case SH_OP_REPEAT:
+                sh_vm.loops[sh_vm.count - 1].last = sh_last_status;
+                pc = insn->target;
+                continue;
+            case SH_OP_LEAVE:
+                sh_last_status = sh_vm_pop();
+                continue;
+
+            case SH_OP_CASE:
+                case_mark = sh_arena_get_mark(&sh_exec_arena);
+                subject = sh_expand_word(&sh_exec_arena, &insn->node->cases.word, &sh_expand_buf);
+                if (subject == NULL) {
+                    subject = "";
+                }
+                continue;
+            case SH_OP_MATCH:
+            case SH_OP_MISMATCH:
+                if (sh_case_match(subject, insn->word)) {
+                    sh_arena_release(&sh_exec_arena, case_mark);
+                    if (insn->op == SH_OP_MATCH) {
+                        pc = insn->target;
+                    }
+                } else if (insn->op == SH_OP_MISMATCH) {
+                    pc = insn->target;
+                }
+                continue;
+            case SH_OP_NO_MATCH:
+                sh_arena_release(&sh_exec_arena, case_mark);
+                sh_last_status = 0;
+                continue;
+        }
+
+        // Only commands get this far: see whether one of them wants to leave.
+        if (!status) {
+            break;
+        }
+        if (sh_jump != SH_JUMP_NONE) {
+            if ((sh_jump != SH_JUMP_BREAK && sh_jump != SH_JUMP_CONTINUE) || sh_vm.count == base) {
+                break;
+            }
+            while (sh_jump_levels > 1 && sh_vm.count > base + 1) {
+                sh_vm_pop();
+                sh_jump_levels--;
+            }
+            loop = &sh_vm.loops[sh_vm.count - 1];
+            loop->last = sh_last_status;
+            pc = sh_jump == SH_JUMP_BREAK ? insns[loop->pc].target : loop->pc + 1;
+            sh_jump = SH_JUMP_NONE;
+        }
+    }
+
+    while (sh_vm.count > base) {
+        sh_vm_pop();
+    }
+    return status;
+}
+
+/**
+ * @brief Call a function.
+ *
+ * The arguments become the positional parameters ("$0" stays what it was), and the
+ * function starts outside of any loop: a "break" in it doesn't leave the caller's loops.
+ *
+ * @param func The function.
+ * @param args The arguments. args[0] is the function's name.
+ * @return 1 if the shell should continue running, 0 if it should terminate.
+ */
+int sh_func_call(struct sh_func *func, char **args) {
+    struct sh_arena_mark mark = sh_arena_get_mark(&sh_exec_arena);
+    struct sh_frame frame = {NULL, 0, 0}, *outer = sh_frame;
+    struct sh_code *code = func->code;
+    char **outer_argv = sh_argv;
+    int outer_argc = sh_argc, outer_depth = sh_loop_depth, argc, status;
+    long long start = sh_trace_fd >= 0 ? sh_now() : 0;
+
+    for (argc = 0; args[argc] != NULL; argc++);
+    sh_argv = sh_arena_alloc(&sh_exec_arena, (argc + 1) * sizeof(char *));
+    memcpy(sh_argv, args, (argc + 1) * sizeof(char *));
+    sh_argv[0] = outer_argc > 0 ? outer_argv[0] : args[0];
+    sh_argc = argc;
+    sh_frame = &frame;
+    sh_loop_depth = 0;
+    code->refs++;
+
+    status = sh_vm_run(code);
+    if (sh_jump == SH_JUMP_RETURN) {
+        sh_jump = SH_JUMP_NONE;
+    }
+
+    sh_code_release(code);
+    while (frame.count > 0) {
+        sh_var_restore(&frame.saved[--frame.count]);
+    }
+    free(frame.saved);
+    sh_frame = outer;
+    sh_loop_depth = outer_depth;
+    sh_argc = outer_argc;
+    sh_argv = outer_argv;
+    sh_arena_release(&sh_exec_arena, mark);
+    if (sh_trace_fd >= 0) {
+        sh_trace_command("function", args, NULL, getpid(), 0, sh_now() - start);
+    }
+    return status;
+}
+
+/**
+ * @brief Builtin command: local.
+ *
+ * Each variable keeps its value (and export flag) unless it is given a new one, and
+ * gets back the one it had before when the function returns.
+ *
+ * @param args List of args. args[0] is "local". The rest are NAME or NAME=VALUE.
+ * @return Always returns 1, to continue executing.
+ */
+int sh_local(char **args) {
+    struct sh_var_saved *saved;
+    size_t len;
+    int i, j;
+
+    if (sh_frame == NULL) {
+        fprintf(stderr, "sh: local: not in a function\n");
+        sh_last_status = 1;
+        return 1;
+    }
+    for (i = 1; args[i] != NULL; i++) {
+        len = sh_var_name_len(args[i], strlen(args[i]));
+        if (len == 0 || (args[i][len] != '\0' && args[i][len] != '=')) {
+            fprintf(stderr, "sh: local: %s: not a valid identifier\n", args[i]);
+            sh_last_status = 1;
+            continue;
+        }
+
+        // Already local: only the value changes.
+        for (j = 0; j < sh_frame->count; j++) {
+            if (sh_frame->saved[j].len == len && memcmp(sh_frame->saved[j].name, args[i], len) == 0) {
+                break;
+            }
+        }
+        if (j == sh_frame->count) {
+            if (sh_frame->count == sh_frame->size) {
+                sh_frame->size = sh_frame->size > 0 ? sh_frame->size * 2 : 8;
+                sh_frame->saved = realloc(sh_frame->saved, sh_frame->size * sizeof(struct sh_var_saved));
+                if (!sh_frame->saved) {
+                    fprintf(stderr, "sh: allocation error\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            saved = &sh_frame->saved[sh_frame->count++];
+            sh_var_save(args[i], len, saved);
+            if (saved->entry != NULL && args[i][len] == '\0') {
+                sh_var_set(args[i], len, saved->entry + len + 1, saved->flags);
+            } else if (saved->flags & SH_VAR_EXPORT) {
+                sh_var_export(args[i], len);
+            }
+        }
+        if (args[i][len] == '=') {
+            sh_var_set(args[i], len, args[i] + len + 1, 0);
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Builtin command: return.
+ * @param args List of args. args[0] is "return". args[1], if given, is the exit status.
+ * @return Always returns 1, to continue executing.
+ */
+int sh_return(char **args) {
+    if (sh_frame == NULL) {
+        fprintf(stderr, "sh: return: can only return from a function\n");
+        sh_last_status = 1;
+        return 1;
+    }
+    if (args[1] != NULL) {
+        sh_last_status = atoi(args[1]) & 0xff;
+    }
+    sh_jump = SH_JUMP_RETURN;
+    return 1;
+}
+
+
+/*
+ * Command substitution
+ *
+ * "$(cmd)" (or "`cmd`") is replaced by whatever cmd writes to its standard output. The
+ * textbook way is to fork a subshell and read its output from a pipe, and the shell still
+ * does that when it has to, but a fork for every "x=$(f "$y")" is what makes a loop of
+ * them slow. So the shell first looks at what the command is:
+ *   - "echo ...": the arguments are expanded and formatted straight into the buffer the
+ *     output is collected in. No process, no file descriptor, not even a system call.
+ *   - A single program, like "basename "$f"": it is spawned with its standard output on
+ *     a pipe, without a copy of the shell in between. The shell reads it in large chunks,
+ *     and once the output turns out to be large (a read fills a whole default-sized pipe),
+ *     the pipe is made as large as the kernel allows (F_SETPIPE_SZ), so the program
+ *     rarely has to wait for the shell. Small outputs don't pay for a big pipe.
+ *   - Anything that can't change the state of the shell (builtins that only produce
+ *     output, functions, loops, pipelines and programs, in any combination) runs in the
+ *     shell itself, with its standard output pointed at an in-memory file (a memfd) that
+ *     is read back when it is done. A file and not a pipe, since nobody reads the output
+ *     while the command runs: a builtin writing more than a pipe holds would block the
+ *     shell forever.
+ *   - Anything else (an assignment, "cd", "exit", a function definition, ...) would change
+ *     the shell, so it runs in a forked subshell, and its output is read from a pipe.
+ * Which one it is depends on the tree only (and on which functions exist), so it is
+ * worked out once: the trees are kept in a small cache keyed by the text, and a
+ * substitution in a loop or a function is parsed and examined the first time only.
+ *
+ * A substitution happens in the middle of expanding a word, and the command in it expands
+ * words of its own, so the scratch space for that is swapped out while it runs. They nest
+ * ("$(dirname "$(pwd)")"), so each level of nesting has its own output buffer and memfd.
+ * Past SH_SUBST_MAX_LEVELS, everything forks, which also puts an end to a function that
+ * calls itself in a substitution forever (like other shells, it runs out of processes
+ * instead of stack).
+ */
+
+enum sh_subst_kind {
+    SH_SUBST_ECHO,      // format the arguments of "echo" into the output
+    SH_SUBST_SPAWN,     // spawn a program with its output on a pipe
+    SH_SUBST_SHELL,     // run in the shell, with its output on a memfd
+    SH_SUBST_FORK,      // run in a subshell, with its output on a pipe
+};
+
+#define SH_SUBST_CACHE_SIZE 16        // must be a power of 2
+#define SH_SUBST_MAX_LEVELS 16
+#define SH_SUBST_MAX_CALLS  8         // how deep the purity check follows function calls
+#define SH_SUBST_PIPE_SIZE  (1 << 20)
+#define SH_SUBST_CHUNK      65536         // also the size of a pipe, unless it is made larger
+
+struct sh_subst_entry {
+    char *text;                // NULL if the slot is empty
+    size_t len;
+    unsigned int hash;
+    struct sh_node *tree;
+    enum sh_subst_kind kind;
+    unsigned int generation;   // of sh_funcs, when kind was worked out
+    int busy;                  // the command is running, so the slot can't be reused
+    struct sh_arena arena;
+};
+
+struct sh_subst_level {
+    struct sh_strbuf out;
+    struct sh_strbuf buf;      // swapped with sh_expand_buf while the command runs
+    struct sh_fields list;     // swapped with sh_expand_list
+    int memfd;                 // 0 until it is needed
+};
+
+struct sh_subst_state {
+    struct sh_subst_entry cache[SH_SUBST_CACHE_SIZE];
+    struct sh_subst_level levels[SH_SUBST_MAX_LEVELS];
+    int depth;
+    struct sh_lexer lexer;
+    struct sh_parser parser;
+};
+
+struct sh_subst_state sh_subst;
+
+/**
+ * @brief Check that a word doesn't assign a variable when it is expanded, as
+ *        "${NAME=word}", "${NAME:=word}" and "$((NAME = n))" do.
+ * @param word The word.
+ * @return 1 if it doesn't, 0 if it might.
+ */
+int sh_subst_word_pure(const struct sh_word *word) {
+    const char *p = word->text, *end = word->text + word->len, *close;
+
+    if (!(word->flags & SH_WORD_DOLLAR)) {
+        return 1;
+    }
+    while ((p = memchr(p, '$', end - p)) != NULL && ++p < end) {
+        if (*p == '(' && p + 1 < end && p[1] == '(' && (close = sh_lex_arith_end(p, end)) != NULL) {
+            // Any "=" but the ones of "==", "!=", "<=" and ">=" may be an assignment.
+            for (p += 2; p < close; p++) {
+                if (*p != '=' || p[-1] == '!' || ((p[-1] == '<' || p[-1] == '>') && p[-2] != p[-1])) {
+                    continue;
+                }
+                if (p[1] != '=') {
+                    return 0;
+                }
+                p++;
+            }
+        } else if (*p == '{') {
+            p++;
+            p += sh_var_name_len(p, end - p);
+            p += p < end && *p == ':';
+            if (p < end && *p == '=') {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+int sh_subst_pure(struct sh_node *node, int calls);
+
+/**
+ * @brief Check that a simple command can't change the state of the shell.
+ * @param node The command.
+ * @param calls How many function calls deep the check already is.
+ * @return 1 if it can't, 0 if it might.
+ */
+int sh_subst_command_pure(struct sh_node *node, int calls) {
+    int num_assigns = sh_count_assignments(node), i;
+    const struct sh_builtin *builtin = NULL;
+    const struct sh_word *name;
+    struct sh_func *func = NULL;
+    char text[16];
+
+    for (i = 0; i < node->command.argc; i++) {
+        if (!sh_subst_word_pure(&node->command.words[i])) {
+            return 0;
+        }
+    }
+    if (num_assigns == node->command.argc) {
+        // Only assignments, which is the point of them.
+        return 0;
+    }
+    name = &node->command.words[num_assigns];
+    if (name->flags != 0) {
+        // Who knows what "$cmd" will turn out to be.
+        return 0;
+    }
+
+    if (name->len < sizeof(text)) {
+        memcpy(text, name->text, name->len);
+        text[name->len] = '\0';
+        builtin = sh_builtin_lookup(text);
+    }
+    if (sh_funcs.defined > 0 && (builtin == NULL || !(builtin->flags & SH_BUILTIN_SPECIAL))) {
+        func = sh_func_slot(name->text, name->len, sh_var_hash(name->text, name->len));
+    }
+    if (func != NULL && func->code != NULL) {
+        return calls < SH_SUBST_MAX_CALLS && sh_subst_pure(func->code->body, calls + 1);
+    }
+    if (builtin == NULL || (builtin->flags & SH_BUILTIN_SUBSHELL)) {
+        return 1;
+    }
+    if (num_assigns > 0 && (builtin->flags & SH_BUILTIN_SPECIAL)) {
+        // The assignments would outlive the command.
+        return 0;
+    }
+    // Loops and functions are left the same way either way. "local" is fine in a function
+    // the command calls, but not in the one the substitution is in.
+    return builtin->func == &sh_true || builtin->func == &sh_break || builtin->func == &sh_continue ||
+           builtin->func == &sh_return || (builtin->func == &sh_local && calls > 0);
+}
+
+/**
+ * @brief Check that a tree can't change the state of the shell, so that running it in
+ *        the shell is the same as running it in a subshell.
+ * @param node The tree.
+ * @param calls How many function calls deep the check already is.
+ * @return 1 if it can't, 0 if it might.
+ */
+int sh_subst_pure(struct sh_node *node, int calls) {
+    struct sh_case_item *item;
+    struct sh_redir *redir;
+    struct sh_node *child;
+    int i;
+
+    if (node == NULL) {
+        return 1;
+    }
+    if (node->flags & SH_NODE_ASYNC) {
+        return 0;
+    }
+    for (redir = node->redirs; redir != NULL; redir = redir->next) {
+        if (!sh_subst_word_pure(&redir->target)) {
+            return 0;
+        }
+    }
+
+    switch (node->type) {
+        case SH_NODE_COMMAND:
+            return sh_subst_command_pure(node, calls);
+        case SH_NODE_SUBSHELL:
+            // It forks anyway.
+            return 1;
+        case SH_NODE_PIPELINE:
+        case SH_NODE_LIST:
+        case SH_NODE_GROUP:
+            for (child = node->list.first; child != NULL; child = child->next) {
+                if (!sh_subst_pure(child, calls)) {
+                    return 0;
+                }
+            }
+            return 1;
+        case SH_NODE_AND:
+        case SH_NODE_OR:
+            return sh_subst_pure(node->binary.left, calls) && sh_subst_pure(node->binary.right, calls);
+        case SH_NODE_IF:
+        case SH_NODE_WHILE:
+        case SH_NODE_UNTIL:
+            return sh_subst_pure(node->cond.cond, calls) && sh_subst_pure(node->cond.body, calls) &&
+                   sh_subst_pure(node->cond.orelse, calls);
+        case SH_NODE_CASE:
+            if (!sh_subst_word_pure(&node->cases.word)) {
+                return 0;
+            }
+            for (item = node->cases.items; item != NULL; item = item->next) {
+                for (i = 0; i < item->num_patterns; i++) {
+                    if (!sh_subst_word_pure(&item->patterns[i])) {
+                        return 0;
+                    }
+                }
+                if (!sh_subst_pure(item->body, calls)) {
+                    return 0;
+                }
+            }
+            return 1;
+        case SH_NODE_FOR:
+            // It assigns its variable.
+        case SH_NODE_FUNCTION:
+            return 0;
+    }
+    return 0;
+}
+
+/**
+ * @brief Get to the command in a tree, if it is a single one: the tree of "$(cmd)" is a
+ *        list of one pipeline of one command.
+ * @param tree The tree.
+ * @return The command, or what the tree is if it is something else.
+ */
+struct sh_node *sh_subst_single(struct sh_node *tree) {
+    while ((tree->type == SH_NODE_LIST || (tree->type == SH_NODE_PIPELINE && !(tree->flags & (SH_NODE_NEGATE | SH_NODE_TIME))))
+           && tree->list.first->next == NULL && !(tree->list.first->flags & SH_NODE_ASYNC)) {
+        tree = tree->list.first;
+    }
+    return tree;
+}
+
+/**
+ * @brief Decide how to run the command of a substitution.
+ * @param tree The command.
+ * @return How to run it.
+ */
+enum sh_subst_kind sh_subst_classify(struct sh_node *tree) {
+    struct sh_node *node = sh_subst_single(tree);
+    const struct sh_word *name;
+    char text[16] = "";
+    int num_assigns;
+
+    if (node->type == SH_NODE_COMMAND && sh_subst_pure(node, 0)) {
+        num_assigns = sh_count_assignments(node);
+        name = &node->command.words[num_assigns];
+        if (name->len < sizeof(text)) {
+            memcpy(text, name->text, name->len);
+            text[name->len] = '\0';
+        }
+        if (num_assigns == 0 && node->redirs == NULL && strcmp(text, "echo") == 0 && sh_func_find(text) == NULL) {
+            return SH_SUBST_ECHO;
+        }
+        if ((name->len >= sizeof(text) || sh_builtin_lookup(text) == NULL) &&
+            (sh_funcs.defined == 0 || sh_func_slot(name->text, name->len, sh_var_hash(name->text, name->len))->code == NULL)) {
+            return SH_SUBST_SPAWN;
+        }
+    }
+#ifdef __linux__
+    if (sh_subst_pure(tree, 0)) {
+        return SH_SUBST_SHELL;
+    }
+#endif
+    return SH_SUBST_FORK;
+}
+
+/**
+ * @brief Find the parsed command of a substitution, parsing it if it isn't cached.
+ * @param text The command.
+ * @param len Length of the command.
+ * @param temp Where to parse it if its slot in the cache is in use.
+ * @return The entry, or NULL if the command is not valid.
+ */
+struct sh_subst_entry *sh_subst_parse(const char *text, size_t len, struct sh_subst_entry *temp) {
+    unsigned int hash = sh_var_hash(text, len);
+    struct sh_subst_entry *entry = &sh_subst.cache[hash & (SH_SUBST_CACHE_SIZE - 1)];
+    struct sh_node *tree;
+    int lexed, parsed;
+
+    if (entry->text != NULL && entry->hash == hash && entry->len == len && memcmp(entry->text, text, len) == 0) {
+        if (entry->tree != NULL && entry->generation != sh_funcs.generation) {
+            entry->kind = sh_subst_classify(entry->tree);
+            entry->generation = sh_funcs.generation;
+        }
+        return entry;
+    }
+    if (entry->busy) {
+        entry = temp;
+    }
+
+    sh_arena_reset(&entry->arena);
+    entry->text = NULL;
+    lexed = sh_lex(&sh_subst.lexer, text, len);
+    parsed = lexed == SH_LEX_OK ? sh_parse(&sh_subst.parser, &sh_subst.lexer, &entry->arena, &tree) : SH_PARSE_INCOMPLETE;
+    if (parsed != SH_PARSE_OK) {
+        if (parsed == SH_PARSE_INCOMPLETE) {
+            fprintf(stderr, "sh: syntax error: unexpected end of input\n");
+        }
+        return NULL;
+    }
+
+    entry->text = sh_arena_strndup(&entry->arena, text, len);
+    entry->len = len;
+    entry->hash = hash;
+    entry->tree = tree;
+    entry->kind = tree != NULL ? sh_subst_classify(tree) : SH_SUBST_ECHO;
+    entry->generation = sh_funcs.generation;
+    return entry;
+}
+
+/**
+ * @brief Read everything from a pipe to its end.
+ * @param fd The read end of the pipe.
+ * @param out Where to append what was read.
+ */
+void sh_subst_read(int fd, struct sh_strbuf *out) {
+    int grown = 0;
+    ssize_t n;
+
+    for (;;) {
+        sh_strbuf_reserve(out, SH_SUBST_CHUNK);
+        n = read(fd, out->data + out->len, out->size - out->len - 1);
+        if (n > 0) {
+            out->len += n;
+#ifdef F_SETPIPE_SZ
+            if (n >= SH_SUBST_CHUNK && !grown) {
+                // Only a hint: an unprivileged process can't go over /proc/sys/fs/pipe-max-size.
+                fcntl(fd, F_SETPIPE_SZ, SH_SUBST_PIPE_SIZE);
+                grown = 1;
+            }
+#endif
+        } else if (n == 0 || errno != EINTR) {
+            break;
+        }
+    }
+    out->data[out->len] = '\0';
+}
+
+/**
+ * @brief Run a command with its output on a pipe, and read it all.
+ * @param node The command: a single program (SH_SUBST_SPAWN), or the whole tree wrapped in
+ *        a subshell (SH_SUBST_FORK).
+ * @param out Where to put the output.
+ * @return Exit status of the command.
+ */
+int sh_subst_pipe(struct sh_node *node, struct sh_strbuf *out) {
+    struct sh_launch launch = {-1, -1, -1, -1, NULL, 0};
+    int fds[2];
+    pid_t pid;
+
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        perror("sh");
+        return 1;
+    }
+    launch.fd_out = fds[1];
+    pid = sh_launch_stage(node, &launch);
+    close(fds[1]);
+    sh_subst_read(fds[0], out);
+    close(fds[0]);
+    return pid > 0 ? sh_wait_foreground(&pid, 1, -1, NULL, NULL) : sh_last_status;
+}
+
+#ifdef __linux__
+/**
+ * @brief Run a command in the shell, with its output on the memfd of a level.
+ * @param tree The command.
+ * @param level The level, whose output buffer gets the output.
+ * @return Exit status of the command, or -1 if there is no memfd to be had.
+ */
+int sh_subst_shell(struct sh_node *tree, struct sh_subst_level *level) {
+    int outer_depth = sh_loop_depth, n;
+    struct sh_fd_action action = {STDOUT_FILENO, -1};
+    struct sh_redirs redirs = {&action, 1, NULL, 0};
+    struct sh_saved_fd saved;
+    struct stat st;
+    ssize_t got;
+
+    if (level->memfd == 0) {
+        n = memfd_create("sh-subst", MFD_CLOEXEC);
+        if (n < 0 || (n = sh_redirect_move_fd(n, 0)) < 0) {
+            return -1;
+        }
+        level->memfd = n;
+    }
+
+    // Like a subshell, the command starts outside of any loop. A ^C still stops it (and
+    // whatever it is in the middle of) the way it would anywhere else.
+    action.src = level->memfd;
+    n = sh_redirect_apply_saved(&redirs, &saved);
+    sh_loop_depth = 0;
+    sh_exec_node(tree);
+    sh_loop_depth = outer_depth;
+    if (sh_jump != SH_JUMP_INTERRUPT) {
+        sh_jump = SH_JUMP_NONE;
+    }
+    sh_redirect_restore(&saved, n);
+
+    if (fstat(level->memfd, &st) == 0 && st.st_size > 0) {
+        sh_strbuf_reserve(&level->out, st.st_size);
+        got = pread(level->memfd, level->out.data, st.st_size, 0);
+        level->out.len = got > 0 ? got : 0;
+        level->out.data[level->out.len] = '\0';
+        if (ftruncate(level->memfd, 0) < 0 || lseek(level->memfd, 0, SEEK_SET) < 0) {
+            perror("sh");
+        }
+    }
+    return sh_last_status;
+}
+#endif
+
+/**
+ * @brief Forget the memfds of the substitution levels, in a newly forked subshell.
+ *
+ * They are shared with the parent across fork(), and two processes collecting output in
+ * the same memfd would truncate each other's. The one the subshell is writing to right now
+ * is its standard output, which is a copy.
+ */
+void sh_subst_forget(void) {
+    int i;
+
+    for (i = 0; i < SH_SUBST_MAX_LEVELS; i++) {
+        if (sh_subst.levels[i].memfd > 0) {
+            close(sh_subst.levels[i].memfd);
+            sh_subst.levels[i].memfd = 0;
+        }
+    }
+}
+
+/**
+ * @brief Run the command of a command substitution, and collect its output.
+ *
+ * Like for any command, "$?" is its exit status afterwards, and sh_subst_status records
+ * it for a command that is nothing but assignments ("x=$(false)" fails).
+ *
+ * @param text The command.
+ * @param len Length of the command.
+ * @param out_len Set to the length of the output.
+ * @return The output, good until the next substitution.
+ */
+const char *sh_command_subst(const char *text, size_t len, size_t *out_len) {
+    struct sh_arena_mark mark = sh_arena_get_mark(&sh_exec_arena);
+    struct sh_subst_level *level, deep = {0};
+    struct sh_subst_entry *entry, temp = {0};
+    struct sh_node subshell = {0};
+    struct sh_strbuf buf;
+    struct sh_fields list;
+    enum sh_subst_kind kind;
+    const char *result;
+    char **args;
+    int status = 0, failed = sh_expand_failed;
+
+    level = sh_subst.depth < SH_SUBST_MAX_LEVELS ? &sh_subst.levels[sh_subst.depth] : &deep;
+    level->out.len = 0;
+    sh_strbuf_reserve(&level->out, 0);
+    level->out.data[0] = '\0';
+
+    entry = sh_subst_parse(text, len, &temp);
+    if (entry == NULL) {
+        status = 2;
+    } else if (entry->tree != NULL) {
+        sh_subst.depth++;
+        entry->busy++;
+        buf = sh_expand_buf;
+        sh_expand_buf = level->buf;
+        list = sh_expand_list;
+        sh_expand_list = level->list;
+
+        kind = entry->kind;
+        if (level == &deep && kind != SH_SUBST_SPAWN) {
+            kind = SH_SUBST_FORK;
+        }
+        switch (kind) {
+            case SH_SUBST_ECHO:
+                if ((args = sh_expand_args(sh_subst_single(entry->tree), 0)) != NULL) {
+                    sh_echo_append(&level->out, args);
+                } else {
+                    status = 2;
+                }
+                break;
+            case SH_SUBST_SPAWN:
+                status = sh_subst_pipe(sh_subst_single(entry->tree), &level->out);
+                break;
+            case SH_SUBST_SHELL:
+#ifdef __linux__
+                if ((status = sh_subst_shell(entry->tree, level)) >= 0) {
+                    break;
+                }
+#endif
+                // No memfd: fork after all.
+                // fall through
+            case SH_SUBST_FORK:
+                subshell.type = SH_NODE_SUBSHELL;
+                subshell.list.first = entry->tree;
+                status = sh_subst_pipe(&subshell, &level->out);
+                break;
+        }
+
+        level->buf = sh_expand_buf;
+        sh_expand_buf = buf;
+        level->list = sh_expand_list;
+        sh_expand_list = list;
+        entry->busy--;
+        sh_subst.depth--;
+    }
+    sh_arena_free(&temp.arena);
+    sh_arena_release(&sh_exec_arena, mark);
+    sh_last_status = sh_subst_status = status;
+    // The command ran in a subshell (or as if it did): its failures are its own.
+    sh_expand_failed = failed;
+
+    *out_len = level->out.len;
+    if (level != &deep) {
+        return level->out.data;
+    }
+    result = sh_arena_strndup(&sh_exec_arena, deep.out.data, deep.out.len);
+    free(deep.out.data);
+    free(deep.buf.data);
+    free(deep.list.words);
+    return result;
+}
+
+
+/*
+ * Reading a line
+ *
+ * Reading a line stdin sounds so simple, but in C it can be a hassle.
+ * The sad thing is that you don't know ahead of time how much text a user
+ * will enter into their shell. You can't simply allocate a block and hope
+ * they don't exceed it. Instead, you need to start with a block, and if they
+ * do exceed it, reallocate with more space. This is common strategy in C.
+ *
+ * Reading one character at a time with "getchar()" is simple, but slow when the shell is
+ * fed a multi-megabyte script: every byte costs a function call and a branch. Instead
+ * we "read()" big blocks into a buffer and look for the newline with "memchr()", which
+ * the C library implements with SIMD instructions. Lines are handed out as slices of
+ * that buffer (a pointer and a length), so nothing is copied. A slice stays valid until
+ * the next line is read. When a line doesn't fit, the unread part is moved to the front
+ * of the buffer, and the buffer doubles in size only if the line still doesn't fit.
+ *
+ * Script files don't even need the buffer: the whole file is mapped into memory with
+ * "mmap()", and the lines are slices of the mapping. The kernel pages the file in as we
+ * go, and those pages are shared with the page cache instead of being copied into ours.
+ * The command string of "sh -c" is read the same way, straight out of argv.
+ *
+ * If the file is truncated while we run it, touching the part of the mapping past the
+ * new end raises SIGBUS. The handler maps zeros over that part, so the access can go on,
+ * and the reader then reports the truncation and stops. A script that isn't a regular
+ * file (a pipe, say) can't be mapped, and is read in blocks.
+ */
+
+enum sh_reader_kind {
+    SH_READER_FD,
+    SH_READER_MAP,
+    SH_READER_STRING,
+};
+
+#define SH_READER_BLOCK_SIZE 65536
+
+struct sh_reader {
+    int fd;
+    char *buffer;
+    size_t size;
+    size_t start;
+    size_t scan;
+    size_t end;
+    int eof;
+    enum sh_reader_kind kind;
+};
+
+/**
+ * @brief Set up a reader on a file descriptor.
+ * @param reader The reader.
+ * @param fd The file descriptor to read from.
+ */
+void sh_reader_init(struct sh_reader *reader, int fd) {
+    reader->fd = fd;
+    reader->size = SH_READER_BLOCK_SIZE;
+    reader->buffer = malloc(reader->size);
+    reader->start = reader->scan = reader->end = 0;
+    reader->eof = 0;
+    reader->kind = SH_READER_FD;
+
+    if (!reader->buffer) {
+        fprintf(stderr, "sh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * The script mapping, for the SIGBUS handler.
+ */
+char *sh_map_start;
+size_t sh_map_size;
+volatile sig_atomic_t sh_map_truncated;
+
+/**
+ * @brief Signal handler for SIGBUS: the script was truncated under its mapping.
+ */
+void sh_sigbus_handler(int sig, siginfo_t *info, void *context) {
+    char *addr = info->si_addr, *end = sh_map_start + sh_map_size, *page;
+
+    (void) context;
+    if (info->si_code == BUS_ADRERR && addr >= sh_map_start && addr < end) {
+        page = sh_map_start + ((addr - sh_map_start) & ~((size_t) sysconf(_SC_PAGESIZE) - 1));
+        if (mmap(page, end - page, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED) {
+            sh_map_truncated = 1;
+            return;
+        }
+    }
+    // Not ours: die of it, as if there were no handler.
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+/**
+ * @brief Set up a reader on a memory mapping of a file.
+ *
+ * A file that can't be mapped, because it isn't a regular file, gets a block reader.
+ *
+ * @param reader The reader.
+ * @param path The file to map.
+ * @return 0 on success, -1 on error (with errno set).
+ */
+int sh_reader_map(struct sh_reader *reader, const char *path) {
+    struct sigaction sa;
+    struct stat st;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        sh_reader_init(reader, fd);
+        return 0;
+    }
+
+    reader->fd = -1;
+    reader->buffer = NULL;
+    reader->size = st.st_size;
+    reader->start = reader->scan = 0;
+    reader->end = st.st_size;
+    reader->eof = 1;
+    reader->kind = SH_READER_MAP;
+
+    // An empty file can't be mapped, and has no lines anyway.
+    if (st.st_size > 0) {
+        reader->buffer = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (reader->buffer == MAP_FAILED) {
+            close(fd);
+            return -1;
+        }
+        madvise(reader->buffer, st.st_size, MADV_SEQUENTIAL);
+
+        sh_map_start = reader->buffer;
+        sh_map_size = st.st_size;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_sigaction = sh_sigbus_handler;
+        sa.sa_flags = SA_SIGINFO;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGBUS, &sa, NULL);
+    }
+    close(fd);
+    return 0;
+}
+
+/**
+ * @brief Set up a reader on a string.
+ * @param reader The reader.
+ * @param string The string, which must outlive the reader.
+ */
+void sh_reader_string(struct sh_reader *reader, const char *string) {
+    reader->fd = -1;
+    reader->buffer = (char *) string;
+    reader->size = strlen(string);
+    reader->start = reader->scan = 0;
+    reader->end = reader->size;
+    reader->eof = 1;
+    reader->kind = SH_READER_STRING;
+}
+
+/**
+ * @brief Release a reader's buffer or mapping.
+ * @param reader The reader.
+ */
+void sh_reader_free(struct sh_reader *reader) {
+    switch (reader->kind) {
+        case SH_READER_FD:
+            free(reader->buffer);
+            // A script's own descriptor, as opposed to stdin.
+            if (reader->fd > STDERR_FILENO) {
+                close(reader->fd);
+            }
+            break;
+        case SH_READER_MAP:
+            if (reader->buffer != NULL) {
+                munmap(reader->buffer, reader->size);
+            }
+            break;
+        case SH_READER_STRING:
+            break;
+    }
+    reader->buffer = NULL;
+}
+
+/**
+ * @brief Check whether a reader has handed out all of its input.
+ * @param reader The reader.
+ * @return 1 if there is nothing left to read, 0 if there may be.
+ */
+int sh_reader_done(struct sh_reader *reader) {
+    return reader->eof && reader->start == reader->end;
+}
+
+/**
+ * @brief Read another block into the reader's buffer.
+ * @param reader The reader.
+ * @return The number of bytes read, 0 at end of file.
+ */
+ssize_t sh_reader_fill(struct sh_reader *reader) {
+    size_t pending = reader->end - reader->start;
+    ssize_t n;
+
+    // Make room: first by dropping the lines already handed out, then by growing.
+    if (reader->start > 0) {
+        memmove(reader->buffer, reader->buffer + reader->start, pending);
+        reader->scan -= reader->start;
+        reader->start = 0;
+        reader->end = pending;
+    }
+    if (reader->size - reader->end < SH_READER_BLOCK_SIZE / 2) {
+        reader->size *= 2;
+        reader->buffer = realloc(reader->buffer, reader->size);
+        if (!reader->buffer) {
+            fprintf(stderr, "sh: reallocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (reader->kind == SH_READER_FD) {
+        sh_wait_input(reader->fd);
+    }
+    do {
+        n = read(reader->fd, reader->buffer + reader->end, reader->size - reader->end);
+    } while (n < 0 && errno == EINTR);
+
+    if (n < 0) {
+        perror("sh");
+        n = 0;
+    }
+    if (n == 0) {
+        reader->eof = 1;
+    }
+    reader->end += n;
+    return n;
+}
+
+/**
+ * @brief Get the next line from a reader.
+ * @param reader The reader.
+ * @param len Set to the length of the line.
+ * @return The line, without its newline and not null terminated, or NULL at end of file.
+ *         The line is only valid until the next call.
+ */
+const char *sh_reader_next(struct sh_reader *reader, size_t *len) {
+    const char *line, *newline;
+    size_t next;
+
+    while (1) {
+        newline = memchr(reader->buffer + reader->scan, '\n', reader->end - reader->scan);
+        if (newline != NULL) {
+            next = newline - reader->buffer + 1;
+            break;
+        }
+        reader->scan = reader->end;
+        if (reader->start == reader->end && reader->eof) {
+            return NULL;
+        }
+        if (reader->eof || sh_reader_fill(reader) == 0) {
+            // End of file: hand out whatever is left as the last line.
+            if (reader->start == reader->end) {
+                return NULL;
+            }
+            newline = reader->buffer + reader->end;
+            next = reader->end;
+            break;
+        }
+    }
+
+    if (reader->kind == SH_READER_MAP && sh_map_truncated) {
+        // What we found may have been the zeros the SIGBUS handler put in.
+        fprintf(stderr, "sh: script truncated while being read\n");
+        sh_last_status = 2;
+        reader->start = reader->scan = reader->end;
+        return NULL;
+    }
+
+    line = reader->buffer + reader->start;
+    *len = newline - line;
+    reader->start = reader->scan = next;
+    return line;
+}
+
+/**
+ * @brief Read a line of input.
+ * @param reader The reader for stdin or the script.
+ * @param len Set to the length of the line.
+ * @return The line, or NULL at end of file.
+ */
+const char *sh_read_line(struct sh_reader *reader, size_t *len) {
+    return sh_reader_next(reader, len);
+}
+
+
+/*
+ * Running commands in parallel
+ *
+ * "parallel" runs the same command over many inputs, several at a time, like
+ * "xargs -P" or GNU parallel but without starting another program to do the fanning
+ * out. The inputs are the words after ":::", or else the lines of standard input, and
+ * they form a work queue: whenever one of the N slots is free, the next input is taken
+ * and the command is started with it, through sh_spawn() like any other command.
+ *
+ * Each command's standard output goes into a pipe of its own, an event source of the
+ * reactor (see "The event loop"), and so are SIGCHLD and, with "-t", a timer per
+ * command that kills it when it runs too long. A command's output is written out in
+ * one piece once the command is done, so the outputs of different commands never mix.
+ * By default they come out in the order the commands finish; with "-k" they come out
+ * in the order of the inputs, and the output of the oldest command still running is
+ * passed through as it arrives.
+ *
+ * The exit status is the number of commands that failed (at most 101), like GNU
+ * parallel's.
+ */
+
+#define SH_PARALLEL_MAX_FAILED 101
+
+struct sh_parallel;
+
+struct sh_parallel_slot {
+    struct sh_parallel *par;
+    struct sh_job *job;               // NULL once the command has been reaped
+    struct sh_event_source output;    // read end of its output pipe, -1 at end of file
+    struct sh_event_source timer;     // its timeout, -1 if none
+    size_t seq;                       // position of its input
+    int status;
+    int busy;
+    struct sh_strbuf out;
+};
+
+struct sh_parallel {
+    char **command;           // the command, with "{}" where the input goes
+    int num_command;
+    int has_placeholder;
+    char **inputs;            // inputs from ":::", or NULL to read lines from stdin
+    struct sh_reader reader;
+    size_t next_input;
+    int keep_order;
+    long timeout;             // in milliseconds, 0 for none
+    size_t next_seq;          // next input, in order
+    size_t next_flush;        // with -k, next output to write
+    int num_slots;
+    struct sh_parallel_slot *slots;
+    int failed;
+    int dev_null;
+};
+
+/**
+ * @brief Take the next input off the work queue.
+ * @param par The parallel run.
+ * @param len Set to the length of the input.
+ * @return The input (not null terminated), or NULL when the queue is empty.
+ */
+const char *sh_parallel_next_input(struct sh_parallel *par, size_t *len) {
+    const char *input;
+
+    if (par->inputs != NULL) {
+        input = par->inputs[par->next_input];
+        if (input == NULL) {
+            return NULL;
+        }
+        par->next_input++;
+        *len = strlen(input);
+        return input;
+    }
+    return sh_reader_next(&par->reader, len);
+}
+
+/**
+ * @brief Start the command for one input in a slot.
+ * @param par The parallel run.
+ * @param slot The slot.
+ * @param input The input.
+ * @param len Length of the input.
+ */
+void sh_parallel_start(struct sh_parallel *par, struct sh_parallel_slot *slot, const char *input, size_t len) {
+    struct sh_launch launch = {par->dev_null, -1, -1, -1, NULL, 0};
+    struct sh_strbuf word = {0};
+    char **args = malloc((par->num_command + 2) * sizeof(char *));
+    const char *p, *brace;
+    int i, fds[2];
+    pid_t pid = -1;
+
+    if (!args) {
+        fprintf(stderr, "sh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Put the input in place of every "{}", or after the command if there is none.
+    for (i = 0; i < par->num_command; i++) {
+        word.len = 0;
+        for (p = par->command[i]; (brace = strstr(p, "{}")) != NULL; p = brace + 2) {
+            sh_strbuf_append(&word, p, brace - p);
+            sh_strbuf_append(&word, input, len);
+        }
+        sh_strbuf_append(&word, p, strlen(p));
+        args[i] = strdup(word.data);
+    }
+    if (!par->has_placeholder) {
+        args[i++] = strndup(input, len);
+    }
+    args[i] = NULL;
+
+    slot->seq = par->next_seq++;
+    slot->busy = 1;
+    slot->status = 0;
+    slot->out.len = 0;
+    slot->job = NULL;
+
+    if (pipe2(fds, O_CLOEXEC) == 0) {
+        launch.fd_out = fds[1];
+        pid = sh_spawn(args, sh_spawn_backend, &launch);
+        close(fds[1]);
+        slot->output.fd = fds[0];
+        slot->status = sh_last_status;
+        if (sh_reactor_add(&slot->output) < 0) {
+            perror("sh");
+        }
+    } else {
+        perror("sh");
+        slot->status = 1;
+    }
+    if (pid > 0) {
+        slot->job = sh_job_add(&pid, 1, -1);
+        if (par->timeout > 0 && sh_reactor_add_timer(&slot->timer, par->timeout) < 0) {
+            perror("sh: parallel: -t");
+            par->timeout = 0;
+        }
+    }
+
+    for (i = 0; args[i] != NULL; i++) {
+        free(args[i]);
+    }
+    free(args);
+    free(word.data);
+}
+
+/**
+ * @brief Write out the output of finished commands and free their slots.
+ * @param par The parallel run.
+ */
+void sh_parallel_flush(struct sh_parallel *par) {
+    struct sh_parallel_slot *slot;
+    int i, flushed;
+
+    do {
+        flushed = 0;
+        for (i = 0; i < par->num_slots; i++) {
+            slot = &par->slots[i];
+            if (!slot->busy || slot->job != NULL || slot->output.fd >= 0) {
+                continue;
+            }
+            if (par->keep_order && slot->seq != par->next_flush) {
+                continue;
+            }
+            sh_write_all(STDOUT_FILENO, slot->out.data, slot->out.len);
+            if (slot->status != 0 && par->failed < SH_PARALLEL_MAX_FAILED) {
+                par->failed++;
+            }
+            slot->busy = 0;
+            par->next_flush++;
+            flushed = 1;
+        }
+    } while (flushed && par->keep_order);
+}
+
+/**
+ * @brief Event source function for a command's output: read what it wrote.
+ * @param source The slot's output source.
+ */
+void sh_parallel_output(struct sh_event_source *source) {
+    struct sh_parallel_slot *slot = source->data;
+    struct sh_parallel *par = slot->par;
+    ssize_t n;
+
+    sh_strbuf_reserve(&slot->out, SH_READER_BLOCK_SIZE);
+    n = read(source->fd, slot->out.data + slot->out.len, slot->out.size - slot->out.len - 1);
+    if (n < 0 && errno == EINTR) {
+        return;
+    }
+    if (n <= 0) {
+        sh_reactor_remove(source);
+        close(source->fd);
+        source->fd = -1;
+        return;
+    }
+
+    // The oldest command's output doesn't need to wait for anything.
+    slot->out.len += n;
+    if (par->keep_order && slot->seq == par->next_flush) {
+        sh_write_all(STDOUT_FILENO, slot->out.data, slot->out.len);
+        slot->out.len = 0;
+    }
+}
+
+/**
+ * @brief Event source function for a command's timeout: kill the command.
+ * @param source The slot's timer.
+ */
+void sh_parallel_timeout(struct sh_event_source *source) {
+    struct sh_parallel_slot *slot = source->data;
+
+    if (slot->job != NULL && sh_job_state(slot->job) != SH_JOB_DONE) {
+        kill(slot->job->procs[0].pid, SIGTERM);
+    }
+    sh_reactor_remove_timer(source);
+}
+
+/**
+ * @brief Builtin command: run a command over many inputs, several at a time.
+ * @param args List of args. "parallel [-j N] [-k] [-t SECONDS] COMMAND [ARG...] [::: INPUT...]"
+ *             runs COMMAND once per input (the lines of standard input if there is no
+ *             ":::"), at most N at a time, killing any that runs longer than SECONDS.
+ *             "{}" in the arguments is replaced with the input; without it, the input
+ *             is added as the last argument.
+ * @return Always returns 1, to continue executing.
+ */
+int sh_parallel(char **args) {
+    struct sh_parallel par = {0};
+    struct sh_parallel_slot *slot;
+    const char *input, *value;
+    size_t len;
+    int i, argi = 1, more = 1, busy, opt;
+
+    par.num_slots = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    for (; args[argi] != NULL && args[argi][0] == '-'; argi++) {
+        opt = args[argi][1];
+        if (opt == 'k' && args[argi][2] == '\0') {
+            par.keep_order = 1;
+            continue;
+        }
+        if (opt != 'j' && opt != 't') {
+            break;
+        }
+        value = args[argi][2] != '\0' ? args[argi] + 2 : args[++argi];
+        if (value == NULL || atof(value) <= 0) {
+            fprintf(stderr, "sh: parallel: -%c needs a positive number\n", opt);
+            sh_last_status = 2;
+            return 1;
+        }
+        if (opt == 'j') {
+            par.num_slots = atoi(value);
+        } else {
+            par.timeout = (long) (atof(value) * 1000);
+        }
+    }
+    par.command = args + argi;
+    for (; args[argi] != NULL && strcmp(args[argi], ":::") != 0; argi++) {
+        if (strstr(args[argi], "{}") != NULL) {
+            par.has_placeholder = 1;
+        }
+    }
+    par.num_command = (int) (args + argi - par.command);
+    if (par.num_command == 0) {
+        fprintf(stderr, "usage: parallel [-j N] [-k] [-t SECONDS] COMMAND [ARG...] [::: INPUT...]\n");
+        sh_last_status = 2;
+        return 1;
+    }
+    if (par.num_slots < 1) {
+        par.num_slots = 1;
+    }
+    if (args[argi] != NULL) {
+        par.inputs = args + argi + 1;
+    } else {
+        sh_reader_init(&par.reader, STDIN_FILENO);
+    }
+
+    par.dev_null = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    par.slots = calloc(par.num_slots, sizeof(struct sh_parallel_slot));
+    if (!par.slots) {
+        fprintf(stderr, "sh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < par.num_slots; i++) {
+        slot = &par.slots[i];
+        slot->par = &par;
+        slot->output = (struct sh_event_source) {-1, sh_parallel_output, slot};
+        slot->timer = (struct sh_event_source) {-1, sh_parallel_timeout, slot};
+    }
+    fflush(stdout);
+
+    while (1) {
+        // Fill the free slots from the work queue.
+        for (i = 0; i < par.num_slots && more; i++) {
+            if (!par.slots[i].busy) {
+                input = sh_parallel_next_input(&par, &len);
+                if (input == NULL) {
+                    more = 0;
+                    break;
+                }
+                sh_parallel_start(&par, &par.slots[i], input, len);
+            }
+        }
+
+        // Collect the commands that are done.
+        sh_jobs_reap();
+        busy = 0;
+        for (i = 0; i < par.num_slots; i++) {
+            slot = &par.slots[i];
+            if (slot->busy && slot->job != NULL && sh_job_state(slot->job) == SH_JOB_DONE) {
+                slot->status = sh_job_status(slot->job);
+                sh_job_remove(slot->job);
+                slot->job = NULL;
+                sh_reactor_remove_timer(&slot->timer);
+            }
+        }
+        sh_parallel_flush(&par);
+        for (i = 0; i < par.num_slots; i++) {
+            busy += par.slots[i].busy;
+        }
+        if (busy == 0 && !more) {
+            break;
+        }
+
+        // Wait for output, a command to finish, or a timeout.
+        if (busy == par.num_slots || !more) {
+            if (sh_reactor_wait(-1) < 0) {
+                perror("sh");
+                break;
+            }
+        }
+    }
+
+    for (i = 0; i < par.num_slots; i++) {
+        free(par.slots[i].out.data);
+    }
+    free(par.slots);
+    if (par.inputs == NULL) {
+        sh_reader_free(&par.reader);
+    }
+    if (par.dev_null >= 0) {
+        close(par.dev_null);
+    }
+    sh_last_status = par.failed;
+    return 1;
+}
+
+
+/*
+ * Basic loop of a shell
+ *
+ * Shell does the following during its loop:
+ *   1. Read: Read the command from standard input.
+ *   2. Parse: Separate the command string into a program and arguments.
+ *   3. Execute: Run the parsed command.
+ *
+ * Neither reading nor waiting for a command blocks the shell on that one thing: both
+ * wait in the reactor (see "The event loop"), so background jobs are reaped while the
+ * shell waits for input, and anything else the shell watches is served while a
+ * foreground job runs.
+ */
+
+/**
+ * @brief Loop getting input and executing it.
+ *
+ * A command that isn't finished at the end of a line (an open quote, an "if" without
+ * its "fi", ...) goes on on the next one: the lines are collected and parsed together.
+ * Parsing them all again for every line would take time quadratic in the length of the
+ * command, so that only happens for a line that may finish it: one that ends a
+ * here-document, may end an open quote, or closes the last compound command open (see
+ * sh_lex_count_depth(), which only needs the new line lexed).
+ *
+ * @param reader Where to read commands from.
+ * @param prompt Whether to print a prompt before each line.
+ * @param tail_exec Whether the last command may replace the shell (see sh_exec_tail()).
+ */
+void sh_loop(struct sh_reader *reader, int prompt, int tail_exec) {
+    struct sh_lexer lexer = {0};
+    struct sh_parser parser = {0};
+    struct sh_arena arena = {0};
+    struct sh_strbuf more = {0}, delim = {0};
+    struct sh_token delim_token = {SH_TOKEN_WORD, 0, NULL, 0};
+    struct sh_lex_depth depth = {0, 0, 0};
+    struct sh_node *tree;
+    const char *line, *text;
+    long long start;
+    size_t len;
+    int status = 1, result, lexed = SH_LEX_OK, pending = 0, heredoc = 0, strip = 0, continued = 0;
+
+    do {
+        sh_jobs_notify();
+        sh_jump = SH_JUMP_NONE;
+        if (prompt) {
+            printf("> ");
+            fflush(stdout);
+        }
+
+        // Read
+        line = sh_read_line(reader, &len);
+        if (line == NULL) {
+            if (pending) {
+                fprintf(stderr, heredoc ? "sh: syntax error: unterminated here-document\n"
+                                : lexed == SH_LEX_INCOMPLETE ? "sh: syntax error: unterminated quote\n"
+                                                             : "sh: syntax error: unexpected end of input\n");
+                sh_last_status = 2;
+            }
+            break;
+        }
+        if (pending) {
+            // The rest of a command that started on an earlier line ("if", a quote, ...).
+            sh_strbuf_putc(&more, '\n');
+            sh_strbuf_append(&more, line, len);
+            if (heredoc) {
+                // Inside a here-document, nothing changes until its delimiter shows up, so
+                // don't lex the whole command again for every line of the body.
+                for (text = line; strip && text < line + len && *text == '\t'; text++);
+                if (!sh_lex_heredoc_end(&delim_token, text, line + len - text)) {
+                    continue;
+                }
+                heredoc = 0;
+            } else if (lexed == SH_LEX_OK) {
+                // Everything is lexed, but some compound command is still open. A line that
+                // lexes on its own and leaves one open changes nothing.
+                depth.command = 1;
+                if (sh_lex(&lexer, line, len) == SH_LEX_OK) {
+                    sh_lex_count_depth(&depth, lexer.tokens, lexer.num_tokens);
+                    if (depth.open + depth.parens > 0) {
+                        continue;
+                    }
+                }
+            } else if (!continued && lexer.num_heredocs == 0) {
+                // Inside a quote (or "$(", "${"), only a character that can end it can. (A
+                // line after a "<<" may start the here-document's body: lex that again.)
+                for (text = line; text < line + len && strchr("'\"`)}", *text) == NULL; text++);
+                if (text == line + len) {
+                    continued = len > 0 && line[len - 1] == '\\';
+                    continue;
+                }
+            }
+            continued = len > 0 && line[len - 1] == '\\';
+            line = more.data;
+            len = more.len;
+        }
+
+        // Parse
+        start = sh_trace_fd >= 0 ? sh_now() : 0;
+        lexed = sh_lex(&lexer, line, len);
+        result = lexed == SH_LEX_OK ? sh_parse(&parser, &lexer, &arena, &tree) : SH_PARSE_INCOMPLETE;
+        if (result == SH_PARSE_INCOMPLETE) {
+            // Wait for more lines. The line is only good until the next read, so keep a copy.
+            if (lexer.unfinished != NULL) {
+                delim.len = 0;
+                sh_strbuf_append(&delim, lexer.tokens[lexer.unfinished->token].text,
+                                 lexer.tokens[lexer.unfinished->token].len);
+                delim_token.text = delim.data;
+                delim_token.len = delim.len;
+                strip = lexer.unfinished->strip;
+                heredoc = 1;
+            }
+            if (lexed == SH_LEX_OK) {
+                depth.open = depth.parens = 0;
+                depth.command = 1;
+                sh_lex_count_depth(&depth, lexer.tokens, lexer.num_tokens);
+            }
+            if (!pending) {
+                continued = len > 0 && line[len - 1] == '\\';
+                more.len = 0;
+                sh_strbuf_append(&more, line, len);
+            }
+            pending = 1;
+            sh_arena_reset(&arena);
+            continue;
+        }
+        pending = 0;
+        if (sh_trace_fd >= 0) {
+            sh_trace_parse(line, len, sh_now() - start);
+        }
+        if (result != SH_PARSE_OK) {
+            sh_last_status = 2;
+            sh_arena_reset(&arena);
+            continue;
+        }
+
+        // Execute
+        if (tree != NULL) {
+            if (tail_exec && sh_reader_done(reader)) {
+                sh_mark_tail(tree);
+            }
+            status = sh_exec_node(tree);
+        }
+
+        sh_arena_reset(&arena);
+    } while (status);
+
+    sh_arena_free(&arena);
+    free(lexer.tokens);
+    free(lexer.heredocs);
+    free(parser.words);
+    free(more.data);
+    free(delim.data);
+}
+
+
+/*
+ * A shell does three main things in its lifetime.
+ *   1. Initialize: In this step, a typical shell would read and execute its configuration files.
+ *      These change aspects of the shell's behavior.
+ *   2. Interpret: Next, the shell reads commands from stdin (which could be interactive, or a file)
+ *      and executes them.
+ *   3. Terminate: After its commands are executed, the shell executes any shutdown commands,
+ *      frees up any memory, and terminates.
+ */
+
+/**
+ * @brief Main entry point.
+ * @param argc Argument count.
+ * @param argv Argument vector.
+ * @return status code.
+ */
+// The benchmarks in bench/ include this file directly and bring their own main().
+#ifndef SH_NO_MAIN
+int main(int argc, char **argv) {
+    struct sh_reader reader;
+    int prompt;
+
+    sh_init_jobs();
+    sh_trace_init();
+
+    // "sh -c string [name [args...]]" runs one command string, with no prompt or config files.
+    if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+        if (argc < 3) {
+            fprintf(stderr, "sh: -c: option requires an argument\n");
+            return 2;
+        }
+        sh_reader_string(&reader, argv[2]);
+        sh_argc = argc > 3 ? argc - 3 : 1;
+        sh_argv = argc > 3 ? argv + 3 : argv;
+        sh_loop(&reader, 0, 1);
+        return sh_last_status;
+    }
+
+    // Load config files, if any.
+
+    // "sh script [args...]" runs a script, with $0 set to its name. Otherwise read stdin.
+    if (argc > 1) {
+        if (sh_reader_map(&reader, argv[1]) != 0) {
+            fprintf(stderr, "sh: %s: %s\n", argv[1], strerror(errno));
+            return 127;
+        }
+        sh_argc = argc - 1;
+        sh_argv = argv + 1;
+        prompt = 0;
+    } else {
+        sh_reader_init(&reader, STDIN_FILENO);
+        sh_argc = 1;
+        sh_argv = argv;
+        prompt = isatty(STDIN_FILENO);
+        sh_interactive = prompt;
+        sh_init_job_control();
+    }
+
+    // Run command loop.
+    sh_loop(&reader, prompt, 0);
 
     // Perform any shutdown/cleanup.
-    return EXIT_SUCCESS;
-}
\ No newline at end of file
+    sh_reader_free(&reader);
+    return sh_last_status;
+}
+#endif
@@ -0,0 +1,57 @@
+/*
+ * Builtin lookup test
+ *
+ * Looks up every name in "sh_builtins[]", which has to find its own entry, and names that
+ * are close to a builtin's (a letter short or long, a different case, a different middle)
+ * or that hash to the same slot as one, which must find nothing. A builtin added without
+ * new hash tables (see tools/builtin_hash.c) fails here instead of running the wrong
+ * command.
+ *
+ * Usage: ./builtins
+ */
+
+#define SH_NO_MAIN
+#include "../src/main.c"
+
+int main(void) {
+    static const char *near_misses[] = {
+            "", "c", "ca", "cats", "cd.", "Cd", "ech", "echoo", "ECHO", "exi", "exits", "ezit",
+            "expert", "tru", "ture", "fals", "falsee", "bgg", "fgg", "jobz", "hepl", "helpp",
+            "hahs", "lcoal", "paralel", "retrun", "unse", "wiat", "::", ":x", "contine",
+            "break ", "x", "ls", "wc", "sh",
+    };
+    const struct sh_builtin *builtin;
+    char name[32];
+    int i, failed = 0;
+
+    for (i = 0; i < SH_NUM_BUILTINS; i++) {
+        builtin = sh_builtin_lookup(sh_builtins[i].name);
+        if (builtin != &sh_builtins[i]) {
+            fprintf(stderr, "builtins: \"%s\" found %s\n", sh_builtins[i].name,
+                    builtin != NULL ? builtin->name : "nothing");
+            failed = 1;
+        }
+    }
+    for (i = 0; i < SH_NUM_BUILTINS; i++) {
+        // Same length, first, second and last characters: the same slot, another name.
+        snprintf(name, sizeof(name), "%s", sh_builtins[i].name);
+        if (strlen(name) >= 4) {
+            name[2] = name[2] == 'Q' ? 'R' : 'Q';
+            builtin = sh_builtin_lookup(name);
+            if (builtin != NULL) {
+                fprintf(stderr, "builtins: \"%s\" found \"%s\"\n", name, builtin->name);
+                failed = 1;
+            }
+        }
+    }
+    for (i = 0; i < (int) (sizeof(near_misses) / sizeof(near_misses[0])); i++) {
+        builtin = sh_builtin_lookup(near_misses[i]);
+        if (builtin != NULL) {
+            fprintf(stderr, "builtins: \"%s\" found \"%s\"\n", near_misses[i], builtin->name);
+            failed = 1;
+        }
+    }
+
+    printf("builtins: %s\n", failed ? "FAIL" : "ok");
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,42 @@
+# Operators, with C's precedence.
+echo $((1 + 2)) "$((2 * 3 + 4))" $(( (1 + 2) * 3 )) $((7 / 2)) $((7 % 3)) $((-7 / 2))
+echo $((2 << 3)) $((-16 >> 2)) $((1 < 2)) $((2 <= 1)) $((3 == 3)) $((3 != 3))
+echo $((5 & 3)) $((5 | 3)) $((5 ^ 3)) $((~0)) $((!0)) $((!5)) $((- -3)) $((2 * -3))
+echo $((0x1f)) $((017)) $((1 && 0)) $((0 || 2)) $((1 ? 10 : 20)) $((0 ? 10 : 0 ? 30 : 40))
+echo $((9223372036854775807 + 1))
+
+# Variables, by name or expanded first, and assignments.
+x=5
+echo $((x * 2)) $(($x * 2)) $((unset_variable + 1)) $(( $(echo 4) * x ))
+echo $((x += 3)) $x $((y = x - 1)) $y $((x <<= 1)) $x $((a = b = 7)) $a $b
+i=0
+while [ $i -lt 5 ]; do
+    i=$((i + 1))
+done
+echo "i=$i"
+
+# The side that isn't taken isn't evaluated.
+echo $((0 && (z = 1))) $((1 || (z = 1))) $((0 ? 1 / 0 : 2)) "z=$z"
+
+# An assignment in a command substitution stays in the subshell.
+n=1
+echo $(echo $((n = 5))) $n
+
+# "$((" that starts a command substitution of a subshell.
+echo $((echo subshell) | cat)
+
+# An error stops the command, with status 2, and would end the script: each one is in
+# a subshell here.
+(echo $((1 / 0)) not run)
+echo "status $?"
+(x=$((1 +)); echo not run)
+echo "status $?"
+(echo $((08)))
+echo "status $?"
+(v=abc; echo $((v + 1)))
+echo "status $?"
+(y=$((1 / 0)) true)
+echo "status $?"
+echo $(echo $((1 / 0))) "the substitution's error is its own"
+echo $((1 / 0))
+echo "not run"
@@ -0,0 +1,94 @@
+# Functions, their arguments, and "return".
+greet() {
+    echo "hello $1, $# arguments"
+}
+greet world
+greet "two words" more
+status() { return $1; }
+status 3
+echo "return 3: $?"
+last() { false; return; }
+last
+echo "return with no argument: $?"
+early() {
+    echo before
+    return 0
+    echo after
+}
+early
+fallthrough() { (exit 4); }
+fallthrough
+echo "status of the last command: $?"
+
+# The positional parameters are the function's while it runs, and come back after.
+outer() {
+    echo "outer: $1"
+    inner x y
+    echo "outer again: $1 ($#)"
+}
+inner() { echo "inner: $1 $2"; }
+outer a
+
+# "local" variables end with the function; others are global.
+x=global
+y=global
+scope() {
+    local x=local
+    y=changed
+    echo "in: x=$x y=$y"
+    nested
+}
+nested() { echo "nested sees x=$x"; }
+scope
+echo "out: x=$x y=$y"
+
+# Recursion.
+count() {
+    local n=$1
+    if [ "$n" -gt 0 ]; then
+        count $((n - 1))
+        echo "n=$n"
+    fi
+}
+count 3
+fib() {
+    if [ $1 -lt 2 ]; then
+        echo $1
+    else
+        echo $(($(fib $(($1 - 1))) + $(fib $(($1 - 2)))))
+    fi
+}
+fib 10
+
+# "break" and "continue" across loops, and "return" out of a loop.
+for i in 1 2 3; do
+    for j in a b c; do
+        if [ $j = b ]; then continue 2; fi
+        if [ $i = 3 ]; then break 2; fi
+        echo "$i$j"
+    done
+done
+echo "after the loops"
+i=0
+while true; do
+    i=$((i + 1))
+    [ $i -lt 3 ] && continue
+    echo "while stopped at $i"
+    break
+done
+loop_return() {
+    for i in 1 2 3; do
+        [ $i = 2 ] && return 7
+        echo "in loop $i"
+    done
+}
+loop_return
+echo "return from a loop: $?"
+
+# A function can be redefined, and "unset -f" removes it.
+f() { echo one; }
+f() { echo two; }
+f
+unset -f f
+f
+echo "unset: $?"
@@ -0,0 +1,28 @@
+# Pathname expansion, in a directory of its own. The C locale sorts by bytes.
+LC_ALL=C
+export LC_ALL
+dir=$(mktemp -d)
+cd "$dir" || exit 1
+touch b.txt a.txt B.txt 10.log 9.log a-b.txt .hidden .hidden.txt 'sp ace.txt' '[x].txt'
+mkdir sub other .hidden-dir
+touch sub/one.c sub/two.h other/three.c .hidden-dir/four.c
+
+echo *
+echo *.txt
+echo ?.txt ?.log
+echo [ab].txt [!ab].txt [a-z]*.txt [[]x].txt
+echo */*.c */ .hidden-dir/*
+echo a*b* *.c
+
+# Names that start with "." only match a pattern that does, and never "." or "..".
+echo .*
+echo .h*.txt
+
+# A pattern that matches nothing stays as it is; a quoted one is never a pattern.
+echo *.none no/such/*.c "*.txt" '?.txt' \*.txt
+# Unquoted expansions are patterns too, and a match with a space in it is one field.
+pattern="*.log"
+echo $pattern "$pattern"
+for name in sp*; do echo "[$name]"; done
+
+cd / && rm -rf "$dir"
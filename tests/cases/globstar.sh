@@ -0,0 +1,30 @@
+# "**" matches any number of directories, skipping hidden ones and not
+# following symbolic links. The result must not depend on the thread count.
+LC_ALL=C
+export LC_ALL
+dir=$(mktemp -d)
+cd "$dir" || exit 1
+mkdir -p d/a/b d/.hid/x d/c/e/f
+touch d/top.c d/a/y.c d/a/b/x.c d/a/b/.dot.c d/.hid/x/z.c d/c/e/f/w.c d/c/w.h
+ln -s ../a d/c/link
+
+# A wider tree, so that several threads have work to share.
+for i in 0 1 2 3 4 5 6 7 8 9; do
+	for j in 0 1 2 3 4 5 6 7 8 9; do
+		mkdir -p wide/$i/$j/deep
+		touch wide/$i/$j/f.c wide/$i/$j/deep/g.c
+	done
+done
+
+for n in 1 4; do
+	SH_GLOB_THREADS=$n
+	echo "threads $n"
+	echo d/**/*.c
+	echo d/**
+	echo d/**/*.none
+	echo wide/**/*.c > wide.$n
+done
+cmp wide.1 wide.4 && echo "same wide tree"
+wc -w < wide.1
+
+cd / && rm -rf "$dir"
@@ -0,0 +1,56 @@
+# A here-document is expanded like a word in double quotes, but its quotes are just
+# characters.
+name=world
+cat <<EOF
+hello $name, "quoted" and 'single'
+$(echo substituted) `echo backquoted` $((6 * 7)) \$name \\ \`
+a backslash-newline \
+joins lines
+EOF
+
+# With the delimiter quoted, nothing is expanded.
+cat <<'EOF'
+hello $name $(echo not run) \
+EOF
+cat <<"E O F"
+$name
+E O F
+cat <<\EOF
+$name
+EOF
+
+# "<<-" removes leading tabs, from the body and the delimiter line, but not spaces.
+cat <<-EOF
+	one tab
+		two tabs
+    four spaces
+	EOF
+
+# Several on one line, to builtins, programs, functions and loops.
+cat <<ONE; cat <<TWO
+first
+ONE
+second
+TWO
+wc -l <<EOF
+1
+2
+EOF
+f() { sed 's/^/in f: /'; }
+f <<EOF
+x
+y
+EOF
+for i in 1 2; do
+    cat <<EOF
+iteration $i
+EOF
+done
+
+# An empty body, and one larger than a pipe holds.
+cat <<EOF
+EOF
+big=$(i=0; while [ $i -lt 3000 ]; do echo "line $i of a large here-document"; i=$((i + 1)); done)
+wc -c <<EOF
+$big
+EOF
@@ -0,0 +1,40 @@
+# Background jobs: "$!", "jobs", and "wait" for one job, a PID, or all of them.
+sleep 0.3 &
+pid=$!
+jobs
+[ "$pid" -gt 0 ] && echo "\$! is set"
+wait $pid
+echo "wait \$!: $?"
+(exit 3) &
+wait $!
+echo "wait for a job that exits 3: $?"
+sleep 0.2 | (exit 5) &
+wait $!
+echo "wait for a pipeline: $?"
+sleep 0.1 &
+wait %1
+echo "wait %1: $?"
+
+# "wait" with no arguments waits for every job, and its status is 0.
+for i in 1 2 3 4 5; do
+    (sleep 0.1; exit $i) &
+done
+wait
+echo "wait for all: $?"
+jobs
+echo "no jobs left"
+
+# Many jobs at once are all reaped.
+i=0
+while [ $i -lt 200 ]; do
+    true &
+    i=$((i + 1))
+done
+wait
+jobs
+echo "200 jobs reaped"
+
+# Waiting for something that isn't a job.
+wait 99999 2> /dev/null
+echo "wait for an unknown PID: $?"
+wait %9
@@ -0,0 +1,49 @@
+# A command that goes on over several lines runs once, and only once, it is complete.
+if true; then
+    echo if
+    if false; then
+        echo no
+    else
+        echo nested
+    fi
+fi
+
+# Words that only look like they open or close a command.
+echo if while for case {
+echo fi done esac }
+for word in if fi; do
+    echo "$word"
+done
+case if in
+    if|while) echo pattern if ;;
+    (fi) echo pattern fi ;;
+esac
+case done in
+    done)
+        echo pattern done
+        ;;
+esac
+
+# Here-documents and quotes inside a block.
+while true; do
+    cat <<EOF
+body fi
+EOF
+    echo "quoted
+fi"
+    break
+done
+
+# Functions, subshells and groups.
+f() {
+    echo function
+}
+f
+(
+    echo subshell
+)
+{
+    echo group
+}
+echo "after" \
+    continued
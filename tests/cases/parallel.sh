@@ -0,0 +1,22 @@
+# "-k" keeps the outputs in the order of the inputs, however the commands finish.
+parallel -j 4 -k sh -c 'sleep 0.$((6 - 2 * {})); echo {}' ::: 0 1 2 3
+# Without it, they come out in the order the commands finish.
+parallel -j 4 sh -c 'sleep 0.$((6 - 2 * {})); echo {}' ::: 0 1 2 3
+# A command's output never mixes with another's.
+parallel -j 3 -k sh -c 'echo {} one; sleep 0.1; echo {} two' ::: a b c
+
+# "{}" is replaced with the input; without it, the input is the last argument. The
+# inputs are the lines of standard input when there is no ":::".
+parallel -k echo "<{}>" ::: x y
+printf 'line 1\nline 2\n' | parallel -k echo input:
+
+# The exit status is the number of commands that failed.
+parallel -j 2 sh -c 'exit {}' ::: 0 1 0 2 3
+echo "3 failed: $?"
+parallel -j 2 true ::: 1 2 3
+echo "none failed: $?"
+parallel -j 1 -k sh -c 'exit 1' ::: $(i=0; while [ $i -lt 150 ]; do echo $i; i=$((i + 1)); done)
+echo "150 failed: $?"
+# "-t" kills a command that runs too long, which counts as failed.
+parallel -t 0.2 -k sleep ::: 0.01 5
+echo "1 timed out: $?"
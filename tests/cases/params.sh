@@ -0,0 +1,53 @@
+# Variables, and "${...}" forms.
+name=world
+echo "hello $name" hello${name}s "${name}" '$name'
+unset name
+echo "[${name}] [${name:-default}] [${name-unset}] [${name+set}]"
+empty=
+echo "[${empty:-default}] [${empty-unset}] [${empty:+set}] [${empty+set}]"
+echo "[${assigned=first}] [${assigned=second}] $assigned"
+echo "[${empty:=now set}] $empty"
+word=abcdef
+echo "${#word} ${#unset_variable}"
+echo "${word:-$name}" "${unset_variable:-$word and more}"
+
+# Special parameters.
+set_status() { return $1; }
+set_status 7
+echo "\$? is $?"
+f() {
+    echo "$# arguments: [$1] [$2] [$3]"
+    for arg in "$@"; do echo "\"\$@\": [$arg]"; done
+    for arg in $@; do echo "\$@: [$arg]"; done
+    for arg in "$*"; do echo "\"\$*\": [$arg]"; done
+}
+f "one two" "" three
+f
+
+# Field splitting on IFS, only of unquoted expansions.
+list="a b  c"
+for item in $list; do echo "[$item]"; done
+for item in "$list"; do echo "[$item]"; done
+IFS=:
+path="/bin::/usr/bin:"
+for dir in $path; do echo "[$dir]"; done
+IFS=" :"
+for mixed in " x : y " "a : : b" " :x"; do
+    for item in $mixed; do echo "[$item]"; done
+done
+unset IFS
+for item in $list; do echo "[$item]"; done
+nothing=
+for item in $nothing "$nothing"; do echo "[$item]"; done
+
+# Exported variables reach programs; others don't.
+exported=yes
+plain=no
+export exported
+sh -c 'echo "exported=$exported plain=$plain"'
+temporary=only-here sh -c 'echo "temporary=$temporary"'
+echo "temporary=$temporary"
+
+# Bad substitutions are errors.
+(echo ${word x})
+echo "status $?"
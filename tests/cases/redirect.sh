@@ -0,0 +1,29 @@
+# Duplicating a descriptor that isn't open fails before the command runs, for builtins
+# and programs alike, and names the descriptor.
+echo builtin >&5
+echo "status $?"
+/bin/echo program >&5
+echo "status $?"
+/bin/echo stage >&6 | cat
+echo "status $?"
+
+# Open by an earlier redirection of the same command, or closed by one.
+echo "via 3" 3>&1 1>&3
+echo "closed" 3>&- 1>&3
+echo "status $?"
+
+# Open in a group or subshell that redirects it.
+{ echo "group"; echo "group 5" >&5; } 5>&1
+(echo "subshell 4" >&4) 4>&1
+
+# The shell's own descriptors aren't the script's.
+echo "internal" >&3
+echo "status $?"
+
+# Other redirections.
+echo "to file" > out.tmp
+cat < out.tmp
+echo "appended" >> out.tmp
+cat out.tmp
+echo "stderr" 2>&1 >&2 | cat
+rm -f out.tmp
@@ -0,0 +1,40 @@
+# Output of builtins, functions and programs, with the newlines at its end removed (but
+# not the ones inside it).
+echo "[$(echo builtin)] [$(printf 'program\n\n\n')] [$(printf 'a\n\nb\n')]"
+f() { echo "function $1"; }
+echo "[$(f one)]" "[`f two`]"
+echo "[$(true)] [$(:)]"
+x=$(printf '  spaced  out  ')
+echo "[$x]" [$(printf '  spaced  out  ')]
+
+# Nesting, in both forms.
+echo "$(echo "outer $(echo "inner $(echo innermost)")")"
+echo `echo outer \`echo inner\``
+echo "$(echo ')' "(" '$(not run)')"
+
+# The command runs in a subshell: what it assigns, defines, or changes stays there,
+# even where the shell runs it without a new process.
+v=before
+g() { v=changed; echo "in g: $v"; }
+echo "$(g)"
+echo "after: $v"
+echo "$(v=changed; cd /; echo "$v")" "$v"
+echo "$(h() { echo defined; }; h)"
+(h) 2> /dev/null || echo "h isn't defined out here"
+y=$(exit 4)
+echo "assignment status $?"
+
+# Output larger than a pipe holds.
+big=$(i=0; while [ $i -lt 2000 ]; do echo "line $i of output, padded out to forty bytes"; i=$((i + 1)); done)
+echo "${#big}"
+
+# A "$(...)" in a later stage of a pipeline, while an earlier stage finishes: the shell
+# must still see that stage's exit, and not wait for it forever.
+true | cat /dev/null $(sleep 0.2)
+echo "status $?"
+true | echo $(sleep 0.2)a
+(exit 3) | echo $(sleep 0.2)b | cat
+echo "status $?"
+echo c | cat - $(sleep 0.2; echo /dev/null) &
+wait $!
+echo "status $?"
@@ -0,0 +1,24 @@
+# "~" is $HOME at the start of a word, and in an assignment after "=" or ":"; "~NAME" is
+# NAME's home directory. Quoted, or anywhere else, it is just a "~".
+HOME=/home/test
+echo ~ ~/x ~root ~root/bin
+echo "~" '~' \~ ~"root" a~ x=~ a:~ ~no-such-user/x
+x=~
+y=~/a:~/b:~root
+z=a~
+echo "$x" "$y" "$z"
+case /home/test in
+    ~) echo "case pattern" ;;
+esac
+for dir in ~/x ~; do
+    echo "$dir"
+done
+cat <<EOF
+~ in a here-document
+EOF
+
+# The directory isn't split into fields, or a pattern.
+HOME="/a b/*"
+for field in ~; do
+    echo "[$field]"
+done
@@ -0,0 +1,28 @@
+#!/bin/sh
+#
+# Script tests
+#
+# Runs every tests/cases/NAME.sh with the shell given on the command line, from inside
+# tests/cases, and compares what it prints (standard output and standard error together)
+# with NAME.out. Prints a line per test, and a diff for each one that fails; the exit
+# status is the number of failures.
+#
+# Usage: ./run.sh shell
+
+shell=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+cd "$(dirname "$0")/cases" || exit 1
+
+failed=0
+for test in *.sh; do
+    name=${test%.sh}
+    "$shell" "$test" > "$name.actual" 2>&1
+    if cmp -s "$name.out" "$name.actual"; then
+        echo "$name: ok"
+    else
+        echo "$name: FAIL"
+        diff "$name.out" "$name.actual"
+        failed=$((failed + 1))
+    fi
+    rm -f "$name.actual"
+done
+exit $failed
@@ -0,0 +1,114 @@
+/*
+ * Builtin hash generator
+ *
+ * Finds values for "sh_builtin_asso[]" that give every name in "sh_builtins[]" a slot
+ * of its own under sh_builtin_lookup()'s hash (the name's length plus the values of its
+ * first, second and last characters), keeping the largest hash, and so the slot table,
+ * as small as it can. It prints "SH_BUILTIN_MAX_HASH" and both tables, ready to replace
+ * the ones in src/main.c. Run it ("make builtin-hash") whenever a builtin is added or
+ * renamed; tests/builtins.c fails until the tables are right.
+ *
+ * The search is random but seeded, so the same names always give the same tables.
+ *
+ * Usage: ./builtin_hash [-n attempts]
+ */
+
+#define SH_NO_MAIN
+#include "../src/main.c"
+
+static unsigned long long state = 0x9e3779b97f4a7c15ULL;
+
+/*
+ * xorshift64*: small and deterministic, unlike rand().
+ */
+static unsigned int next_random(unsigned int limit) {
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return (unsigned int) ((state * 0x2545f4914f6cdd1dULL) >> 33) % (limit + 1);
+}
+
+static unsigned int hash(const unsigned int *asso, const char *name) {
+    size_t len = strlen(name);
+
+    return len + asso[(unsigned char) name[0]] + asso[(unsigned char) name[1]]
+           + asso[(unsigned char) name[len - 1]];
+}
+
+int main(int argc, char **argv) {
+    unsigned int asso[256], best_asso[256], limit, max, best_max = UINT_MAX;
+    unsigned char used[256] = {0};
+    const struct sh_builtin *slots[1024];
+    long attempt, attempts = 1000000;
+    int i, c, opt;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        if (opt == 'n') {
+            attempts = atol(optarg);
+        } else {
+            fprintf(stderr, "usage: %s [-n attempts]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Only the characters the hash looks at get a value; "\0" is the second character of
+    // one-letter names, and stays 0.
+    for (i = 0; i < SH_NUM_BUILTINS; i++) {
+        const char *name = sh_builtins[i].name;
+        used[(unsigned char) name[0]] = used[(unsigned char) name[1]] = 1;
+        used[(unsigned char) name[strlen(name) - 1]] = 1;
+    }
+    used[0] = 0;
+
+    for (attempt = 0; attempt < attempts; attempt++) {
+        // Small values make a small table, but leave fewer ways to avoid collisions, so
+        // the limit on them goes round a range of sizes.
+        limit = SH_NUM_BUILTINS / 2 + attempt % SH_NUM_BUILTINS;
+        memset(asso, 0, sizeof(asso));
+        for (c = 1; c < 256; c++) {
+            if (used[c]) {
+                asso[c] = next_random(limit);
+            }
+        }
+
+        memset(slots, 0, sizeof(slots));
+        max = 0;
+        for (i = 0; i < SH_NUM_BUILTINS; i++) {
+            unsigned int h = hash(asso, sh_builtins[i].name);
+            if (h >= sizeof(slots) / sizeof(slots[0]) || slots[h] != NULL) {
+                break;
+            }
+            slots[h] = &sh_builtins[i];
+            max = h > max ? h : max;
+        }
+        if (i == SH_NUM_BUILTINS && max < best_max) {
+            best_max = max;
+            memcpy(best_asso, asso, sizeof(asso));
+        }
+    }
+    if (best_max == UINT_MAX) {
+        fprintf(stderr, "builtin_hash: no perfect hash found in %ld attempts\n", attempts);
+        return EXIT_FAILURE;
+    }
+
+    memset(slots, 0, sizeof(slots));
+    for (i = 0; i < SH_NUM_BUILTINS; i++) {
+        slots[hash(best_asso, sh_builtins[i].name)] = &sh_builtins[i];
+    }
+    printf("#define SH_BUILTIN_MAX_HASH %u\n\n", best_max);
+    printf("const unsigned char sh_builtin_asso[256] = {\n");
+    for (c = 1; c < 256; c++) {
+        if (used[c]) {
+            printf("        ['%c'] = %u,\n", c, best_asso[c]);
+        }
+    }
+    printf("};\n\n");
+    printf("const struct sh_builtin *sh_builtin_slots[SH_BUILTIN_MAX_HASH + 1] = {\n");
+    for (i = 0; i <= (int) best_max; i++) {
+        if (slots[i] != NULL) {
+            printf("        [%d] = &sh_builtins[%d], // %s\n", i, (int) (slots[i] - sh_builtins), slots[i]->name);
+        }
+    }
+    printf("};\n");
+    return EXIT_SUCCESS;
+}